@@ -29,10 +29,14 @@ import androidx.annotation.Nullable;
 
 import com.android.networkstack.tethering.BpfCoordinator.Dependencies;
 import com.android.networkstack.tethering.BpfCoordinator.Ipv6ForwardingRule;
+import com.android.networkstack.tethering.BpfCoordinator.QosMarking;
 import com.android.networkstack.tethering.Tether4Key;
 import com.android.networkstack.tethering.Tether4Value;
 import com.android.networkstack.tethering.TetherStatsValue;
 
+import java.net.Inet4Address;
+import java.util.Collection;
+
 /**
  * Bpf coordinator class for API shims.
  */
@@ -91,6 +95,12 @@ public class BpfCoordinatorShimImpl
         return true;
     }
 
+    @Override
+    public boolean reconcileIpv6Rules(@NonNull Collection<Ipv6ForwardingRule> rules) {
+        // The rules are owned by netd, which does not outlive its state.
+        return true;
+    }
+
     @Override
     @Nullable
     public SparseArray<TetherStatsValue> tetherOffloadGetStats() {
@@ -172,12 +182,34 @@ public class BpfCoordinatorShimImpl
         return true;
     }
 
+    @Override
+    public void setQosMarking(@NonNull QosMarking upstream, @NonNull QosMarking downstream) {
+        /* no op: netd does not support QoS marking */
+    }
+
+    @Override
+    public boolean startDnsSteering(@NonNull String iface, @NonNull Inet4Address proxy) {
+        /* no op */
+        return false;
+    }
+
+    @Override
+    public boolean stopDnsSteering(@NonNull String iface) {
+        /* no op */
+        return true;
+    }
+
     @Override
     public boolean isAnyIpv4RuleOnUpstream(int ifIndex) {
         /* no op */
         return false;
     }
 
+    @Override
+    public void updateIpv4RuleCount(int upstreamIfindex, boolean added) {
+        /* no op */
+    }
+
     @Override
     public String toString() {
         return "Netd used";
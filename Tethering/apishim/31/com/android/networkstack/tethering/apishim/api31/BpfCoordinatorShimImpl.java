@@ -29,8 +29,10 @@ import android.util.SparseArray;
 import androidx.annotation.NonNull;
 import androidx.annotation.Nullable;
 
+import com.android.net.module.util.NetworkStackConstants;
 import com.android.networkstack.tethering.BpfCoordinator.Dependencies;
 import com.android.networkstack.tethering.BpfCoordinator.Ipv6ForwardingRule;
+import com.android.networkstack.tethering.BpfCoordinator.QosMarking;
 import com.android.networkstack.tethering.BpfMap;
 import com.android.networkstack.tethering.BpfUtils;
 import com.android.networkstack.tethering.Tether4Key;
@@ -45,6 +47,9 @@ import com.android.networkstack.tethering.TetherUpstream6Key;
 
 import java.io.FileDescriptor;
 import java.io.IOException;
+import java.net.Inet4Address;
+import java.util.Collection;
+import java.util.HashMap;
 
 /**
  * Bpf coordinator class for API shims.
@@ -58,6 +63,12 @@ public class BpfCoordinatorShimImpl
     // PFKEYv2 constants. See include/uapi/linux/pfkeyv2.h.
     private static final int PF_KEY_V2 = 2;
 
+    // The local resolver of the downstreams listens on the standard DNS port.
+    private static final int DNS_PORT = 53;
+
+    private static final MacAddress NULL_MAC_ADDRESS = MacAddress.fromString(
+            "00:00:00:00:00:00");
+
     @NonNull
     private final SharedLog mLog;
 
@@ -99,6 +110,12 @@ public class BpfCoordinatorShimImpl
     // TODO: Add IPv6 rule count.
     private final SparseArray<Integer> mRule4CountOnUpstream = new SparseArray<>();
 
+    // QoS marking of the IPv6 rules. The IPv4 values are built with theirs by BpfCoordinator.
+    @NonNull
+    private QosMarking mUpstreamQos = QosMarking.NONE;
+    @NonNull
+    private QosMarking mDownstreamQos = QosMarking.NONE;
+
     public BpfCoordinatorShimImpl(@NonNull final Dependencies deps) {
         mLog = deps.getSharedLog().forSubComponent(TAG);
 
@@ -154,7 +171,7 @@ public class BpfCoordinatorShimImpl
         if (!isInitialized()) return false;
 
         final TetherDownstream6Key key = rule.makeTetherDownstream6Key();
-        final Tether6Value value = rule.makeTether6Value();
+        final Tether6Value value = rule.makeTether6Value(mDownstreamQos);
 
         try {
             mBpfDownstream6Map.updateEntry(key, value);
@@ -190,7 +207,8 @@ public class BpfCoordinatorShimImpl
 
         final TetherUpstream6Key key = new TetherUpstream6Key(downstreamIfindex, inDstMac);
         final Tether6Value value = new Tether6Value(upstreamIfindex, outSrcMac,
-                outDstMac, OsConstants.ETH_P_IPV6, mtu);
+                outDstMac, OsConstants.ETH_P_IPV6, mtu, mUpstreamQos.priority, mUpstreamQos.dscp,
+                mUpstreamQos.flags);
         try {
             mBpfUpstream6Map.insertEntry(key, value);
         } catch (ErrnoException | IllegalStateException e) {
@@ -215,6 +233,34 @@ public class BpfCoordinatorShimImpl
         return true;
     }
 
+    @Override
+    public boolean reconcileIpv6Rules(@NonNull Collection<Ipv6ForwardingRule> rules) {
+        if (!isInitialized()) return false;
+
+        final HashMap<TetherDownstream6Key, Tether6Value> downstream = new HashMap<>();
+        final HashMap<TetherUpstream6Key, Tether6Value> upstream = new HashMap<>();
+        for (Ipv6ForwardingRule rule : rules) {
+            downstream.put(rule.makeTetherDownstream6Key(),
+                    rule.makeTether6Value(mDownstreamQos));
+            // Sync from BpfCoordinator#tetherOffloadRuleAdd, which starts upstream forwarding
+            // for each pair of downstream and upstream that has a rule.
+            upstream.put(new TetherUpstream6Key(rule.downstreamIfindex, rule.srcMac),
+                    new Tether6Value(rule.upstreamIfindex, NULL_MAC_ADDRESS, NULL_MAC_ADDRESS,
+                    OsConstants.ETH_P_IPV6, NetworkStackConstants.ETHER_MTU,
+                    mUpstreamQos.priority, mUpstreamQos.dscp, mUpstreamQos.flags));
+        }
+
+        try {
+            final int changed = mBpfDownstream6Map.reconcile(downstream)
+                    + mBpfUpstream6Map.reconcile(upstream);
+            if (changed > 0) mLog.w("Reconciled " + changed + " IPv6 forwarding entries");
+        } catch (ErrnoException | IllegalArgumentException e) {
+            mLog.e("Could not reconcile IPv6 forwarding entries: " + e);
+            return false;
+        }
+        return true;
+    }
+
     @Override
     @Nullable
     public SparseArray<TetherStatsValue> tetherOffloadGetStats() {
@@ -343,11 +389,7 @@ public class BpfCoordinatorShimImpl
         try {
             if (downstream) {
                 mBpfDownstream4Map.insertEntry(key, value);
-
-                // Increase the rule count while a adding rule is using a given upstream interface.
-                final int upstreamIfindex = (int) key.iif;
-                int count = mRule4CountOnUpstream.get(upstreamIfindex, 0 /* default */);
-                mRule4CountOnUpstream.put(upstreamIfindex, ++count);
+                updateIpv4RuleCount((int) key.iif, true /* added */);
             } else {
                 mBpfUpstream4Map.insertEntry(key, value);
             }
@@ -372,21 +414,7 @@ public class BpfCoordinatorShimImpl
                     return false;
                 }
 
-                // Decrease the rule count while a deleting rule is not using a given upstream
-                // interface anymore.
-                final int upstreamIfindex = (int) key.iif;
-                Integer count = mRule4CountOnUpstream.get(upstreamIfindex);
-                if (count == null) {
-                    Log.wtf(TAG, "Could not delete count for interface " + upstreamIfindex);
-                    return false;
-                }
-
-                if (--count == 0) {
-                    // Remove the entry if the count decreases to zero.
-                    mRule4CountOnUpstream.remove(upstreamIfindex);
-                } else {
-                    mRule4CountOnUpstream.put(upstreamIfindex, count);
-                }
+                if (!decreaseIpv4RuleCount((int) key.iif)) return false;
             } else {
                 mBpfUpstream4Map.deleteEntry(key);
             }
@@ -426,12 +454,74 @@ public class BpfCoordinatorShimImpl
         return true;
     }
 
+    @Override
+    public void setQosMarking(@NonNull QosMarking upstream, @NonNull QosMarking downstream) {
+        mUpstreamQos = upstream;
+        mDownstreamQos = downstream;
+    }
+
+    @Override
+    public boolean startDnsSteering(@NonNull String iface, @NonNull Inet4Address proxy) {
+        if (!isInitialized()) return false;
+
+        try {
+            BpfUtils.startDnsSteering(iface, proxy, DNS_PORT);
+        } catch (IOException e) {
+            mLog.e("Could not start DNS steering: " + e);
+            return false;
+        }
+        return true;
+    }
+
+    @Override
+    public boolean stopDnsSteering(@NonNull String iface) {
+        if (!isInitialized()) return false;
+
+        try {
+            BpfUtils.stopDnsSteering(iface);
+        } catch (IOException e) {
+            mLog.e("Could not stop DNS steering: " + e);
+            return false;
+        }
+        return true;
+    }
+
     @Override
     public boolean isAnyIpv4RuleOnUpstream(int ifIndex) {
         // No entry means no rule for the given interface because 0 has never been stored.
         return mRule4CountOnUpstream.get(ifIndex) != null;
     }
 
+    @Override
+    public void updateIpv4RuleCount(int upstreamIfindex, boolean added) {
+        if (!added) {
+            decreaseIpv4RuleCount(upstreamIfindex);
+            return;
+        }
+
+        // Increase the rule count while a adding rule is using a given upstream interface.
+        int count = mRule4CountOnUpstream.get(upstreamIfindex, 0 /* default */);
+        mRule4CountOnUpstream.put(upstreamIfindex, ++count);
+    }
+
+    private boolean decreaseIpv4RuleCount(int upstreamIfindex) {
+        // Decrease the rule count while a deleting rule is not using a given upstream
+        // interface anymore.
+        Integer count = mRule4CountOnUpstream.get(upstreamIfindex);
+        if (count == null) {
+            Log.wtf(TAG, "Could not delete count for interface " + upstreamIfindex);
+            return false;
+        }
+
+        if (--count == 0) {
+            // Remove the entry if the count decreases to zero.
+            mRule4CountOnUpstream.remove(upstreamIfindex);
+        } else {
+            mRule4CountOnUpstream.put(upstreamIfindex, count);
+        }
+        return true;
+    }
+
     private String mapStatus(BpfMap m, String name) {
         return name + "{" + (m != null ? "OK" : "ERROR") + "}";
     }
@@ -24,10 +24,14 @@ import androidx.annotation.Nullable;
 
 import com.android.networkstack.tethering.BpfCoordinator.Dependencies;
 import com.android.networkstack.tethering.BpfCoordinator.Ipv6ForwardingRule;
+import com.android.networkstack.tethering.BpfCoordinator.QosMarking;
 import com.android.networkstack.tethering.Tether4Key;
 import com.android.networkstack.tethering.Tether4Value;
 import com.android.networkstack.tethering.TetherStatsValue;
 
+import java.net.Inet4Address;
+import java.util.Collection;
+
 /**
  * Bpf coordinator class for API shims.
  */
@@ -98,6 +102,15 @@ public abstract class BpfCoordinatorShim {
     public abstract boolean stopUpstreamIpv6Forwarding(int downstreamIfindex,
             int upstreamIfindex, @NonNull MacAddress inDstMac);
 
+    /**
+     * Make the IPv6 forwarding maps match the given downstream rules, and the upstream forwarding
+     * entries they imply. Only the entries that differ are deleted or written.
+     *
+     * @param rules all the IPv6 forwarding rules that should currently be in place.
+     * @return true if the maps were reconciled or there was nothing to do, false otherwise.
+     */
+    public abstract boolean reconcileIpv6Rules(@NonNull Collection<Ipv6ForwardingRule> rules);
+
     /**
      * Return BPF tethering offload statistics.
      *
@@ -153,6 +166,12 @@ public abstract class BpfCoordinatorShim {
      */
     public abstract boolean isAnyIpv4RuleOnUpstream(int ifIndex);
 
+    /**
+     * Account for a downstream IPv4 rule on the specified upstream that was added or removed
+     * without going through #tetherOffloadRuleAdd or #tetherOffloadRuleRemove, e.g. by MapWorker.
+     */
+    public abstract void updateIpv4RuleCount(int upstreamIfindex, boolean added);
+
     /**
      * Attach BPF program.
      *
@@ -166,5 +185,23 @@ public abstract class BpfCoordinatorShim {
      * TODO: consider using InterfaceParams to replace interface name.
      */
     public abstract boolean detachProgram(@NonNull String iface);
+
+    /**
+     * Set the QoS marking of the IPv6 rules added from now on, in the upstream and the downstream
+     * direction respectively.
+     */
+    public abstract void setQosMarking(@NonNull QosMarking upstream,
+            @NonNull QosMarking downstream);
+
+    /**
+     * Steer the DNS queries of the clients of a downstream to the local resolver at the given
+     * address, while the upstream BPF program is attached to that downstream.
+     */
+    public abstract boolean startDnsSteering(@NonNull String iface, @NonNull Inet4Address proxy);
+
+    /**
+     * Stop steering the DNS queries of the clients of a downstream.
+     */
+    public abstract boolean stopDnsSteering(@NonNull String iface);
 }
 
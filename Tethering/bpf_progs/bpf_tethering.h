@@ -51,6 +51,7 @@
     ERR(SHORT_UDP_HEADER)    \
     ERR(UDP_CSUM_ZERO)       \
     ERR(TRUNCATED_IPV4)      \
+    ERR(TENTATIVE_RULE)      \
     ERR(_MAX)
 
 #define ERR(x) BPF_TETHER_ERR_ ##x,
@@ -72,9 +73,16 @@ static const char *bpf_tether_errors[] = {
 // is the sum of the sizes of their fields.
 #define STRUCT_SIZE(name, size) _Static_assert(sizeof(name) == (size), "Incorrect struct size.")
 
+// Version of the layout of the map keys and values below. Offload state snapshots record it so
+// that they can be decoded offline. Bump it whenever one of these structs changes.
+#define BPF_TETHER_LAYOUT_VERSION 2
+
 
 #define BPF_PATH_TETHER BPF_PATH "tethering/"
 
+// Array of the BPF_TETHER_ERR_* counters, indexed by error code.
+#define TETHER_ERROR_MAP_PATH BPF_PATH_TETHER "map_offload_tether_error_map"
+
 #define TETHER_STATS_MAP_PATH BPF_PATH_TETHER "map_offload_tether_stats_map"
 
 typedef uint32_t TetherStatsKey;  // upstream ifindex
@@ -100,6 +108,12 @@ typedef uint64_t TetherLimitValue;  // in bytes
 #define TETHER_DOWNSTREAM6_TC_PROG_RAWIP_PATH BPF_PATH_TETHER TETHER_DOWNSTREAM6_TC_PROG_RAWIP_NAME
 #define TETHER_DOWNSTREAM6_TC_PROG_ETHER_PATH BPF_PATH_TETHER TETHER_DOWNSTREAM6_TC_PROG_ETHER_NAME
 
+// Optional variant of the ethernet downstream6 program that also answers neighbor solicitations.
+#define TETHER_DOWNSTREAM6_TC_PROG_NDP_ETHER_NAME \
+    "prog_offload_schedcls_tether_downstream6_ndp_ether"
+#define TETHER_DOWNSTREAM6_TC_PROG_NDP_ETHER_PATH \
+    BPF_PATH_TETHER TETHER_DOWNSTREAM6_TC_PROG_NDP_ETHER_NAME
+
 #define TETHER_DOWNSTREAM6_MAP_PATH BPF_PATH_TETHER "map_offload_tether_downstream6_map"
 
 // For now tethering offload only needs to support downstreams that use 6-byte MAC addresses,
@@ -114,12 +128,20 @@ typedef struct {
 } TetherDownstream6Key;
 STRUCT_SIZE(TetherDownstream6Key, 4 + 6 + 2 + 16);  // 28
 
+// QoS marking of the forwarded packets of a rule, replacing what the mangle table would have done
+// had the packets gone through the stack. The ECN bits are always preserved.
+#define TETHER_QOS_FLAG_DSCP 1  // Rewrite the DSCP to 'dscp'
+
 typedef struct {
     uint32_t oif;             // The output interface to redirect to
     struct ethhdr macHeader;  // includes dst/src mac and ethertype (zeroed iff rawip egress)
     uint16_t pmtu;            // The maximum L3 output path/route mtu
+    uint32_t priority;        // skb priority of the forwarded packets (0 == unchanged)
+    uint8_t dscp;             // DSCP of the forwarded packets, iff TETHER_QOS_FLAG_DSCP
+    uint8_t qosFlags;         // TETHER_QOS_FLAG_*
+    uint16_t pad;             // zero pad for 4 byte alignment
 } Tether6Value;
-STRUCT_SIZE(Tether6Value, 4 + 14 + 2);  // 20
+STRUCT_SIZE(Tether6Value, 4 + 14 + 2 + 4 + 1 + 1 + 2);  // 28
 
 #define TETHER_DOWNSTREAM64_MAP_PATH BPF_PATH_TETHER "map_offload_tether_downstream64_map"
 
@@ -162,6 +184,16 @@ typedef struct {
 } TetherUpstream6Key;
 STRUCT_SIZE(TetherUpstream6Key, 12);
 
+#define TETHER_NDP_PROXY_MAP_PATH BPF_PATH_TETHER "map_offload_tether_ndp_proxy_map"
+
+typedef uint32_t TetherNdpProxyKey;  // upstream ifindex
+
+typedef struct {
+    uint8_t mac[ETH_ALEN];  // upstream mac address to advertise for offloaded clients
+    uint8_t zero[2];        // zero pad for 8 byte alignment
+} TetherNdpProxyValue;
+STRUCT_SIZE(TetherNdpProxyValue, 6 + 2);  // 8
+
 #define TETHER_DOWNSTREAM4_TC_PROG_RAWIP_NAME "prog_offload_schedcls_tether_downstream4_rawip"
 #define TETHER_DOWNSTREAM4_TC_PROG_ETHER_NAME "prog_offload_schedcls_tether_downstream4_ether"
 
@@ -199,8 +231,18 @@ typedef struct {
     __be16 srcPort;           // source &
     __be16 dstPort;           // destination tcp/udp/... ports
     uint64_t last_used;       // Kernel updates on each use with bpf_ktime_get_boot_ns()
+    uint32_t priority;        // skb priority of the forwarded packets (0 == unchanged)
+    uint8_t dscp;             // DSCP of the forwarded packets, iff TETHER_QOS_FLAG_DSCP
+    uint8_t qosFlags;         // TETHER_QOS_FLAG_*
+    uint16_t pad;             // zero pad for 8 byte alignment
 } Tether4Value;
-STRUCT_SIZE(Tether4Value, 4 + 14 + 2 + 16 + 16 + 2 + 2 + 8);  // 64
+STRUCT_SIZE(Tether4Value, 4 + 14 + 2 + 16 + 16 + 2 + 2 + 8 + 4 + 1 + 1 + 2);  // 72
+
+// 'last_used' value of a rule pair installed before the connection saw any reply. The programs
+// leave the packets of such a rule to the stack until the first reply direction packet confirms
+// the pair by updating 'last_used'. No packet is forwarded 1ns after boot, so this value cannot
+// be a real timestamp.
+#define TETHER_LAST_USED_TENTATIVE 1
 
 #define TETHER_DOWNSTREAM_XDP_PROG_RAWIP_NAME "prog_offload_xdp_tether_downstream_rawip"
 #define TETHER_DOWNSTREAM_XDP_PROG_ETHER_NAME "prog_offload_xdp_tether_downstream_ether"
@@ -214,4 +256,108 @@ STRUCT_SIZE(Tether4Value, 4 + 14 + 2 + 16 + 16 + 2 + 2 + 8);  // 64
 #define TETHER_UPSTREAM_XDP_PROG_RAWIP_PATH BPF_PATH_TETHER TETHER_UPSTREAM_XDP_PROG_RAWIP_NAME
 #define TETHER_UPSTREAM_XDP_PROG_ETHER_PATH BPF_PATH_TETHER TETHER_UPSTREAM_XDP_PROG_ETHER_NAME
 
+// Restores the source of the DNS replies of the local resolver steered by the upstream4 programs.
+#define TETHER_DNS_STEER_EGRESS_PROG_NAME "prog_offload_schedcls_tether_dns_steer_egress_ether"
+#define TETHER_DNS_STEER_EGRESS_PROG_PATH BPF_PATH_TETHER TETHER_DNS_STEER_EGRESS_PROG_NAME
+
+#define TETHER_DNS_STEER_CONFIG_MAP_PATH BPF_PATH_TETHER "map_offload_tether_dns_steer_config_map"
+
+typedef uint32_t TetherDnsSteerConfigKey;  // The downstream interface index
+
+typedef struct {
+    struct in_addr proxy4;  // Address of the local DNS resolver on that downstream
+    __be16 proxyPort;       // UDP port of the local DNS resolver
+    uint16_t pad;           // zero pad for 4 byte alignment
+} TetherDnsSteerConfigValue;
+STRUCT_SIZE(TetherDnsSteerConfigValue, 4 + 2 + 2);  // 8
+
+#define TETHER_DNS_STEER_STATE_MAP_PATH BPF_PATH_TETHER "map_offload_tether_dns_steer_state_map"
+
+typedef struct {
+    uint32_t iif;             // The downstream interface index
+    struct in_addr client4;   // Address &
+    __be16 clientPort;        // UDP port of the client, or 0 for the fragments of a reply
+    __be16 fragId;            // IP id of the fragmented reply if clientPort is 0, else 0
+} TetherDnsSteerStateKey;
+STRUCT_SIZE(TetherDnsSteerStateKey, 4 + 4 + 2 + 2);  // 12
+
+typedef struct {
+    struct in_addr resolver4;  // Address &
+    __be16 resolverPort;       // UDP port the client originally sent its query to
+    uint16_t pad;              // zero pad for 4 byte alignment
+} TetherDnsSteerStateValue;
+STRUCT_SIZE(TetherDnsSteerStateValue, 4 + 2 + 2);  // 8
+
+// Redirects the control packets of a downstream interface to its AF_XDP socket, see xsk_receiver.h.
+#define TETHER_XSK_CONTROL_XDP_PROG_NAME "prog_offload_xdp_tether_xsk_control"
+#define TETHER_XSK_CONTROL_XDP_PROG_PATH BPF_PATH_TETHER TETHER_XSK_CONTROL_XDP_PROG_NAME
+
+#define TETHER_XSK_MAP_PATH BPF_PATH_TETHER "map_offload_tether_xsk_map"
+#define TETHER_XSK_CONFIG_MAP_PATH BPF_PATH_TETHER "map_offload_tether_xsk_config_map"
+
+// Number of entries of tether_xsk_map, i.e. of downstreams with an AF_XDP socket at once.
+#define TETHER_XSK_MAX_SLOTS 16
+
+typedef uint32_t TetherXskConfigKey;  // The downstream interface index
+
+typedef struct {
+    uint32_t slot;   // Index of the socket in tether_xsk_map
+    uint32_t queue;  // Receive queue the socket is bound to
+} TetherXskConfigValue;
+STRUCT_SIZE(TetherXskConfigValue, 4 + 4);  // 8
+
+// Socket filter attached to the neighbor solicitation sockets opened through TetheringUtils.
+#define TETHER_NS_FILTER_PROG_NAME "prog_offload_skfilter_tether_ns_filter"
+#define TETHER_NS_FILTER_PROG_PATH BPF_PATH_TETHER TETHER_NS_FILTER_PROG_NAME
+
+#define TETHER_ND_CONFIG_MAP_PATH BPF_PATH_TETHER "map_offload_tether_nd_config_map"
+
+// Only accept solicitations whose target is present in tether_nd_target_map.
+#define TETHER_ND_FLAG_CHECK_TARGET 1
+
+typedef uint32_t TetherNdConfigKey;  // ifindex the socket is bound to
+
+typedef struct {
+    uint32_t flags;       // TETHER_ND_FLAG_*
+    uint32_t burst;       // Solicitations accepted per target per interval (0 == no rate limit)
+    uint64_t intervalNs;  // Length of the rate limiting interval
+} TetherNdConfigValue;
+STRUCT_SIZE(TetherNdConfigValue, 4 + 4 + 8);  // 16
+
+#define TETHER_ND_TARGET_MAP_PATH BPF_PATH_TETHER "map_offload_tether_nd_target_map"
+
+typedef struct {
+    uint32_t iif;              // The input interface index
+    struct in6_addr target6;   // A target address we own or proxy on that interface
+} TetherNdTargetKey;
+STRUCT_SIZE(TetherNdTargetKey, 4 + 16);  // 20
+
+typedef uint32_t TetherNdTargetValue;  // unused, always zero
+
+#define TETHER_ND_RATELIMIT_MAP_PATH BPF_PATH_TETHER "map_offload_tether_nd_ratelimit_map"
+
+typedef struct {
+    uint32_t iif;              // The input interface index
+    struct in6_addr target6;   // The solicitation target address
+} TetherNdRateLimitKey;
+STRUCT_SIZE(TetherNdRateLimitKey, 4 + 16);  // 20
+
+typedef struct {
+    uint64_t windowStart;  // bpf_ktime_get_ns() at the start of the current interval
+    uint32_t count;        // Solicitations accepted during the current interval
+    uint32_t pad;          // zero pad for 8 byte alignment
+} TetherNdRateLimitValue;
+STRUCT_SIZE(TetherNdRateLimitValue, 8 + 4 + 4);  // 16
+
+// Rate limiting state of all the solicitations of an interface, created with its configuration.
+// It bounds the solicitations accepted however many targets they are spread over.
+#define TETHER_ND_IFACE_RATELIMIT_MAP_PATH \
+    BPF_PATH_TETHER "map_offload_tether_nd_iface_ratelimit_map"
+
+// Solicitations accepted per interface per interval, as a multiple of the per target burst.
+#define TETHER_ND_IFACE_BURST_MULTIPLIER 4
+
+typedef uint32_t TetherNdIfaceRateLimitKey;  // ifindex the socket is bound to
+typedef TetherNdRateLimitValue TetherNdIfaceRateLimitValue;
+
 #undef STRUCT_SIZE
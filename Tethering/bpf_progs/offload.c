@@ -29,7 +29,21 @@
 #include "bpf_tethering.h"
 
 // From kernel:include/net/ip.h
-#define IP_DF 0x4000  // Flag: "Don't Fragment"
+#define IP_DF 0x4000      // Flag: "Don't Fragment"
+#define IP_MF 0x2000      // Flag: "More Fragments"
+#define IP_OFFSET 0x1FFF  // "Fragment Offset" part
+
+// From kernel:include/net/inet_ecn.h
+#define INET_ECN_MASK 3
+
+#define DNS_PORT 53
+
+// From kernel:include/net/ndisc.h
+#define NDISC_ROUTER_SOLICITATION 133
+#define NDISC_NEIGHBOUR_SOLICITATION 135
+#define NDISC_NEIGHBOUR_ADVERTISEMENT 136
+#define ND_OPT_SOURCE_LL_ADDR 1
+#define ND_OPT_TARGET_LL_ADDR 2
 
 // ----- Helper functions for offsets to fields -----
 
@@ -261,6 +275,18 @@ static inline __always_inline int do_forward6(struct __sk_buff* skb, const bool
     // (-ENOTSUPP) if it isn't.
     bpf_csum_update(skb, 0xFFFF - ntohs(old_hl) + ntohs(new_hl));
 
+    // The traffic class straddles the version and the flow label in the first 16-bit word,
+    // which is not covered by any checksum besides CHECKSUM_COMPLETE.
+    if (v->qosFlags & TETHER_QOS_FLAG_DSCP) {
+        const __u16 old_word = *(__u16*)ip6;
+        const uint8_t ecn = (ip6->flow_lbl[0] >> 4) & INET_ECN_MASK;
+        ip6->priority = v->dscp >> 2;
+        ip6->flow_lbl[0] = ((v->dscp & 3) << 6) | (ecn << 4) | (ip6->flow_lbl[0] & 0xF);
+        const __u16 new_word = *(__u16*)ip6;
+        bpf_csum_update(skb, 0xFFFF - old_word + new_word);
+    }
+    if (v->priority) skb->priority = v->priority;
+
     __sync_fetch_and_add(downstream ? &stat_v->rxPackets : &stat_v->txPackets, packets);
     __sync_fetch_and_add(downstream ? &stat_v->rxBytes : &stat_v->txBytes, bytes);
 
@@ -346,12 +372,296 @@ DEFINE_BPF_PROG_KVER_RANGE("schedcls/tether_upstream6_rawip$stub", AID_ROOT, AID
     return TC_ACT_OK;
 }
 
+// ----- IPv6 Neighbor Discovery Proxy -----
+
+// Upstreams on which solicitations for offloaded clients are answered directly, indexed by
+// upstream ifindex.
+DEFINE_BPF_MAP_GRW(tether_ndp_proxy_map, HASH, TetherNdpProxyKey, TetherNdpProxyValue, 16,
+                   AID_NETWORK_STACK)
+
+// A neighbor solicitation or advertisement carrying a single link-layer address option,
+// ie. everything following the ethernet header.
+struct nd_packet {
+    struct ipv6hdr ip6;
+    uint8_t type;
+    uint8_t code;
+    __be16 checksum;
+    __be32 flags;  // reserved in a solicitation
+    struct in6_addr target;
+    uint8_t opt_type;
+    uint8_t opt_len;  // in units of 8 bytes
+    uint8_t opt_mac[ETH_ALEN];
+};
+_Static_assert(sizeof(struct nd_packet) == IP6_HLEN + 32, "Incorrect nd_packet size.");
+
+// From kernel:include/net/ndisc.h: Solicited flag, the only one set for a proxied host.
+#define ND_NA_FLAG_SOLICITED htonl(0x40000000)
+
+// Answers a solicitation arriving on the upstream for the address of a client that has a
+// downstream offload rule, by rewriting it in place into a neighbor advertisement carrying the
+// upstream mac and sending it back out of the upstream.
+//
+// Only solicitations with a source link-layer address option are handled, since these are exactly
+// as long as the advertisement. Anything else, including duplicate address detection probes from
+// the unspecified address, returns TC_ACT_UNSPEC and is left to do_forward6() and the kernel.
+static inline __always_inline int do_ndp_proxy(struct __sk_buff* skb) {
+    if (skb->protocol != htons(ETH_P_IPV6)) return TC_ACT_UNSPEC;
+    if (skb->len != ETH_HLEN + sizeof(struct nd_packet)) return TC_ACT_UNSPEC;
+
+    try_make_readable(skb, ETH_HLEN + sizeof(struct nd_packet));
+
+    void* data = (void*)(long)skb->data;
+    const void* data_end = (void*)(long)skb->data_end;
+    struct ethhdr* eth = data;
+    struct nd_packet* ns = (void*)(eth + 1);
+
+    if ((void*)(ns + 1) > data_end) return TC_ACT_UNSPEC;
+    if (eth->h_proto != htons(ETH_P_IPV6)) return TC_ACT_UNSPEC;
+
+    // As per https://tools.ietf.org/html/rfc4861#section-7.1.1 .
+    if (ns->ip6.version != 6 || ns->ip6.nexthdr != IPPROTO_ICMPV6) return TC_ACT_UNSPEC;
+    if (ns->ip6.hop_limit != 255) return TC_ACT_UNSPEC;
+    if (ns->ip6.payload_len != htons(sizeof(*ns) - IP6_HLEN)) return TC_ACT_UNSPEC;
+    if (ns->type != NDISC_NEIGHBOUR_SOLICITATION || ns->code != 0) return TC_ACT_UNSPEC;
+    if (ns->opt_type != ND_OPT_SOURCE_LL_ADDR || ns->opt_len != 1) return TC_ACT_UNSPEC;
+    if (!(ns->ip6.saddr.s6_addr32[0] | ns->ip6.saddr.s6_addr32[1] |
+          ns->ip6.saddr.s6_addr32[2] | ns->ip6.saddr.s6_addr32[3])) return TC_ACT_UNSPEC;
+
+    uint32_t ifindex = skb->ifindex;
+    TetherNdpProxyValue* proxy = bpf_tether_ndp_proxy_map_lookup_elem(&ifindex);
+    if (!proxy) return TC_ACT_UNSPEC;
+
+    // Downstream rules are currently always added with a null dstMac, see
+    // BpfCoordinator.Ipv6ForwardingRule#makeTetherDownstream6Key.
+    TetherDownstream6Key kd = {
+            .iif = ifindex,
+            .neigh6 = ns->target,
+    };
+    if (!bpf_tether_downstream6_map_lookup_elem(&kd)) return TC_ACT_UNSPEC;
+
+    struct ethhdr na_eth = {
+            .h_proto = htons(ETH_P_IPV6),
+    };
+    __builtin_memcpy(na_eth.h_dest, ns->opt_mac, ETH_ALEN);
+    __builtin_memcpy(na_eth.h_source, proxy->mac, ETH_ALEN);
+
+    // Like the kernel's own proxy ndp, answer from the target address.
+    struct nd_packet na = {
+            .ip6 = {
+                    .version = 6,
+                    .payload_len = htons(sizeof(na) - IP6_HLEN),
+                    .nexthdr = IPPROTO_ICMPV6,
+                    .hop_limit = 255,
+                    .saddr = ns->target,
+                    .daddr = ns->ip6.saddr,
+            },
+            .type = NDISC_NEIGHBOUR_ADVERTISEMENT,
+            .code = 0,
+            .flags = ND_NA_FLAG_SOLICITED,
+            .target = ns->target,
+            .opt_type = ND_OPT_TARGET_LL_ADDR,
+            .opt_len = 1,
+    };
+    __builtin_memcpy(na.opt_mac, proxy->mac, ETH_ALEN);
+
+    // ICMPv6 checksum over the pseudo header (addresses, length and next header) and the message,
+    // which directly follows the addresses.
+    uint32_t sum = htons(sizeof(na) - IP6_HLEN) + htons(IPPROTO_ICMPV6);
+    const __u16* words = (const __u16*)&na.ip6.saddr;
+    for (int i = 0; i < (sizeof(na) - IP6_OFFSET(saddr)) / sizeof(__u16); ++i) {
+        sum += words[i];
+    }
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    na.checksum = ~sum;
+
+    // The packet was just checked to be exactly this long, so neither of these should fail,
+    // but if the second one does the packet is already half rewritten.
+    if (bpf_skb_store_bytes(skb, 0, &na_eth, ETH_HLEN, 0)) return TC_ACT_UNSPEC;
+    if (bpf_skb_store_bytes(skb, ETH_HLEN, &na, sizeof(na), 0)) return TC_ACT_SHOT;
+
+    return bpf_redirect(ifindex, 0 /* this is effectively BPF_F_EGRESS */);
+}
+
+// Replaces sched_cls_tether_downstream6_ether on ethernet upstreams where it loads.
+DEFINE_OPTIONAL_BPF_PROG_KVER("schedcls/tether_downstream6_ndp_ether", AID_ROOT, AID_NETWORK_STACK,
+                              sched_cls_tether_downstream6_ndp_ether, KVER(4, 14, 0))
+(struct __sk_buff* skb) {
+    const int ret = do_ndp_proxy(skb);
+    if (ret != TC_ACT_UNSPEC) return ret;
+    return do_forward6(skb, /* is_ethernet */ true, /* downstream */ true);
+}
+
+// ----- DNS Steering -----
+
+// Downstreams whose clients' DNS queries are steered to the local resolver, indexed by ifindex.
+DEFINE_BPF_MAP_GRW(tether_dns_steer_config_map, HASH, TetherDnsSteerConfigKey,
+                   TetherDnsSteerConfigValue, 16, AID_NETWORK_STACK)
+
+// The resolver each client sent its steered queries to, so that replies can be restored.
+DEFINE_BPF_MAP_GRW(tether_dns_steer_state_map, LRU_HASH, TetherDnsSteerStateKey,
+                   TetherDnsSteerStateValue, 1024, AID_NETWORK_STACK)
+
+// Rewrites a UDP DNS query that a client on an ethernet downstream sends to any resolver into a
+// query to the local resolver of that downstream, and hands it to the stack. The resolver the
+// client asked is remembered, and tether_dns_steer_egress_ether restores it as the source of the
+// reply. Returns TC_ACT_UNSPEC, leaving the packet untouched, if it is not steered.
+//
+// Must be called with valid ethernet, IPv4 and UDP headers, ie. after the checks of do_forward4().
+static inline __always_inline int maybe_steer_dns4(struct __sk_buff* skb, struct iphdr* ip,
+                                                   struct udphdr* udph) {
+    if (udph->dest != htons(DNS_PORT)) return TC_ACT_UNSPEC;
+
+    const uint32_t ifindex = skb->ifindex;
+    TetherDnsSteerConfigValue* config = bpf_tether_dns_steer_config_map_lookup_elem(&ifindex);
+    if (!config) return TC_ACT_UNSPEC;
+
+    TetherDnsSteerStateKey k = {
+            .iif = ifindex,
+            .client4.s_addr = ip->saddr,
+            .clientPort = udph->source,
+    };
+
+    // Queries already addressed to the local resolver need no rewriting, and their replies must
+    // not be rewritten either, so forget any steered query the client sent from the same port.
+    if (ip->daddr == config->proxy4.s_addr) {
+        bpf_tether_dns_steer_state_map_delete_elem(&k);
+        return TC_ACT_UNSPEC;
+    }
+
+    const __be32 old_daddr = ip->daddr;
+    const __be32 new_daddr = config->proxy4.s_addr;
+    const __be16 old_dport = udph->dest;
+    const __be16 new_dport = config->proxyPort;
+    const TetherDnsSteerStateValue v = {
+            .resolver4.s_addr = old_daddr,
+            .resolverPort = old_dport,
+    };
+    // Without state the reply could not be restored, so leave the query alone.
+    if (bpf_tether_dns_steer_state_map_update_elem(&k, &v, BPF_ANY)) return TC_ACT_UNSPEC;
+
+    const int l4_offs_csum = ETH_IP4_UDP_OFFSET(check);
+    const int sz4 = sizeof(__be32);
+    const int sz2 = sizeof(__be16);
+
+    bpf_l4_csum_replace(skb, l4_offs_csum, old_daddr, new_daddr,
+                        sz4 | BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0);
+    bpf_l3_csum_replace(skb, ETH_IP4_OFFSET(check), old_daddr, new_daddr, sz4);
+    bpf_skb_store_bytes(skb, ETH_IP4_OFFSET(daddr), &new_daddr, sz4, 0);
+
+    bpf_l4_csum_replace(skb, l4_offs_csum, old_dport, new_dport, sz2 | BPF_F_MARK_MANGLED_0);
+    bpf_skb_store_bytes(skb, ETH_IP4_UDP_OFFSET(dest), &new_dport, sz2, 0);
+
+    // The destination is now local, let the stack deliver the query to the resolver.
+    return TC_ACT_OK;
+}
+
+// Attached to egress of ethernet downstreams with DNS steering enabled. Rewrites the replies of
+// the local resolver to steered queries so they appear to come from the resolver the client
+// originally asked.
+DEFINE_OPTIONAL_BPF_PROG_KVER("schedcls/tether_dns_steer_egress_ether", AID_ROOT,
+                              AID_NETWORK_STACK, sched_cls_tether_dns_steer_egress_ether,
+                              KVER(4, 14, 0))
+(struct __sk_buff* skb) {
+    if (skb->protocol != htons(ETH_P_IP)) return TC_ACT_OK;
+
+    const uint32_t ifindex = skb->ifindex;
+    TetherDnsSteerConfigValue* config = bpf_tether_dns_steer_config_map_lookup_elem(&ifindex);
+    if (!config) return TC_ACT_OK;
+    const __be32 proxy4 = config->proxy4.s_addr;
+    const __be16 proxyPort = config->proxyPort;
+
+    try_make_readable(skb, ETH_HLEN + IP4_HLEN + UDP_HLEN);
+
+    void* data = (void*)(long)skb->data;
+    const void* data_end = (void*)(long)skb->data_end;
+    struct ethhdr* eth = data;
+    struct iphdr* ip = (void*)(eth + 1);
+
+    if (data + sizeof(*eth) + sizeof(*ip) > data_end) return TC_ACT_OK;
+    if (eth->h_proto != htons(ETH_P_IP)) return TC_ACT_OK;
+    if (ip->version != 4 || ip->ihl != 5) return TC_ACT_OK;
+    if (ip->protocol != IPPROTO_UDP || ip->saddr != proxy4) return TC_ACT_OK;
+
+    TetherDnsSteerStateKey k = {
+            .iif = ifindex,
+            .client4.s_addr = ip->daddr,
+    };
+
+    // Only the first fragment (or an unfragmented packet) carries the UDP header. The other
+    // fragments of a reply are matched to it by IP id, through an entry that the first fragment
+    // adds and the last one removes. The fragments leave the local stack in order.
+    const bool has_l4 = !(ip->frag_off & htons(IP_OFFSET));
+    const bool more_frags = ip->frag_off & htons(IP_MF);
+    struct udphdr* udph = (void*)(ip + 1);
+    if (has_l4) {
+        if (data + sizeof(*eth) + sizeof(*ip) + sizeof(*udph) > data_end) return TC_ACT_OK;
+        if (udph->source != proxyPort) return TC_ACT_OK;
+        k.clientPort = udph->dest;
+    } else {
+        k.fragId = ip->id;
+    }
+
+    TetherDnsSteerStateValue* v = bpf_tether_dns_steer_state_map_lookup_elem(&k);
+    if (!v) return TC_ACT_OK;
+    const TetherDnsSteerStateValue resolver = *v;
+    const __be32 new_saddr = resolver.resolver4.s_addr;
+    const __be16 new_sport = resolver.resolverPort;
+
+    if (has_l4 && more_frags) {
+        TetherDnsSteerStateKey frag_k = {
+                .iif = ifindex,
+                .client4.s_addr = ip->daddr,
+                .fragId = ip->id,
+        };
+        bpf_tether_dns_steer_state_map_update_elem(&frag_k, &resolver, BPF_ANY);
+    } else if (!has_l4 && !more_frags) {
+        bpf_tether_dns_steer_state_map_delete_elem(&k);
+    }
+
+    const int sz4 = sizeof(__be32);
+    const int sz2 = sizeof(__be16);
+
+    if (has_l4) {
+        const int l4_offs_csum = ETH_IP4_UDP_OFFSET(check);
+        bpf_l4_csum_replace(skb, l4_offs_csum, proxy4, new_saddr,
+                            sz4 | BPF_F_PSEUDO_HDR | BPF_F_MARK_MANGLED_0);
+        bpf_l4_csum_replace(skb, l4_offs_csum, proxyPort, new_sport, sz2 | BPF_F_MARK_MANGLED_0);
+        bpf_skb_store_bytes(skb, ETH_IP4_UDP_OFFSET(source), &new_sport, sz2, 0);
+    }
+    bpf_l3_csum_replace(skb, ETH_IP4_OFFSET(check), proxy4, new_saddr, sz4);
+    bpf_skb_store_bytes(skb, ETH_IP4_OFFSET(saddr), &new_saddr, sz4, 0);
+
+    return TC_ACT_OK;
+}
+
 // ----- IPv4 Support -----
 
 DEFINE_BPF_MAP_GRW(tether_downstream4_map, HASH, Tether4Key, Tether4Value, 1024, AID_NETWORK_STACK)
 
 DEFINE_BPF_MAP_GRW(tether_upstream4_map, HASH, Tether4Key, Tether4Value, 1024, AID_NETWORK_STACK)
 
+// Confirms a tentative rule pair when its downstream rule 'v' sees its first reply packet. The
+// upstream rule key is rebuilt from the downstream rule value, which holds the original tuple.
+static inline __always_inline void confirm_tentative4(Tether4Value* v, const uint16_t l4Proto,
+                                                      const bool updatetime) {
+    const uint64_t now = updatetime ? bpf_ktime_get_boot_ns() : 0;
+
+    Tether4Key uk = {
+            .iif = v->oif,
+            .l4Proto = l4Proto,
+            .src4.s_addr = v->dst46.s6_addr32[3],
+            .dst4.s_addr = v->src46.s6_addr32[3],
+            .srcPort = v->dstPort,
+            .dstPort = v->srcPort,
+    };
+    __builtin_memcpy(uk.dstMac, v->macHeader.h_source, ETH_ALEN);
+
+    Tether4Value* uv = bpf_tether_upstream4_map_lookup_elem(&uk);
+    if (uv && uv->last_used == TETHER_LAST_USED_TENTATIVE) uv->last_used = now;
+    v->last_used = now;
+}
+
 static inline __always_inline int do_forward4(struct __sk_buff* skb, const bool is_ethernet,
         const bool downstream, const bool updatetime) {
     // Require ethernet dst mac address to be our unicast address.
@@ -481,6 +791,12 @@ static inline __always_inline int do_forward4(struct __sk_buff* skb, const bool
         if (!udph->check && (bpf_csum_update(skb, 0) >= 0)) TC_PUNT(UDP_CSUM_ZERO);
     }
 
+    // DNS queries from clients are steered to the local resolver if enabled on this downstream.
+    if (is_ethernet && !downstream && !is_tcp) {
+        const int ret = maybe_steer_dns4(skb, ip, udph);
+        if (ret != TC_ACT_UNSPEC) return ret;
+    }
+
     Tether4Key k = {
             .iif = skb->ifindex,
             .l4Proto = ip->protocol,
@@ -497,6 +813,14 @@ static inline __always_inline int do_forward4(struct __sk_buff* skb, const bool
     // If we don't find any offload information then simply let the core stack handle it...
     if (!v) return TC_ACT_OK;
 
+    // The rule pair was installed before the connection saw any reply. Conntrack must see the
+    // connection setup in both directions, so leave these packets to the stack, and confirm the
+    // pair on the first non-control reply packet, which conntrack sees as well.
+    if (v->last_used == TETHER_LAST_USED_TENTATIVE) {
+        if (downstream) confirm_tentative4(v, k.l4Proto, updatetime);
+        TC_PUNT(TENTATIVE_RULE);
+    }
+
     uint32_t stat_and_limit_k = downstream ? skb->ifindex : v->oif;
 
     TetherStatsValue* stat_v = bpf_tether_stats_map_lookup_elem(&stat_and_limit_k);
@@ -569,6 +893,16 @@ static inline __always_inline int do_forward4(struct __sk_buff* skb, const bool
     // For a rawip tx interface it will simply be a bunch of zeroes and later stripped.
     *eth = v->macHeader;
 
+    // Rewrite the DSCP before any helper invalidates the 'ip' pointer. The TOS byte shares its
+    // 16-bit checksum word with the version and header length.
+    if (v->qosFlags & TETHER_QOS_FLAG_DSCP) {
+        const __be16 old_word = *(__be16*)ip;
+        ip->tos = (v->dscp << 2) | (ip->tos & INET_ECN_MASK);
+        const __be16 new_word = *(__be16*)ip;
+        bpf_l3_csum_replace(skb, ETH_IP4_OFFSET(check), old_word, new_word, sizeof(__be16));
+    }
+    if (v->priority) skb->priority = v->priority;
+
     const int l4_offs_csum = is_tcp ? ETH_IP4_TCP_OFFSET(check) : ETH_IP4_UDP_OFFSET(check);
     const int sz4 = sizeof(__be32);
     // UDP 0 is special and stored as FFFF (this flag also causes a csum of 0 to be unmodified)
@@ -835,5 +1169,137 @@ DEFINE_XDP_PROG("xdp/tether_upstream_rawip",
     return do_xdp_forward_rawip(ctx, /* downstream */ false);
 }
 
+// ----- AF_XDP Control Path -----
+
+DEFINE_BPF_MAP_GRW(tether_xsk_map, XSKMAP, uint32_t, uint32_t, TETHER_XSK_MAX_SLOTS,
+                   AID_NETWORK_STACK)
+
+DEFINE_BPF_MAP_GRW(tether_xsk_config_map, HASH, TetherXskConfigKey, TetherXskConfigValue,
+                   TETHER_XSK_MAX_SLOTS, AID_NETWORK_STACK)
+
+// Redirects the Router Solicitations received on a downstream interface to the AF_XDP socket of
+// the native RA responder, and passes everything else to the stack. Only packets received on the
+// queue the socket is bound to can be redirected, the others are left to the responder's regular
+// ICMPv6 socket. If the socket is gone, bpf_redirect_map() falls back to XDP_PASS.
+DEFINE_XDP_PROG("xdp/tether_xsk_control", xdp_tether_xsk_control) {
+    const void* data = (void*)(long)ctx->data;
+    const void* data_end = (void*)(long)ctx->data_end;
+    const struct ethhdr* eth = data;
+    const struct ipv6hdr* ip6 = (void*)(eth + 1);
+    const uint8_t* icmp6_type = (void*)(ip6 + 1);
+
+    if ((void*)(icmp6_type + 1) > data_end) return XDP_PASS;
+    if (eth->h_proto != htons(ETH_P_IPV6)) return XDP_PASS;
+    if (ip6->version != 6 || ip6->nexthdr != IPPROTO_ICMPV6) return XDP_PASS;
+    if (*icmp6_type != NDISC_ROUTER_SOLICITATION) return XDP_PASS;
+
+    const TetherXskConfigKey key = ctx->ingress_ifindex;
+    const TetherXskConfigValue* config = bpf_tether_xsk_config_map_lookup_elem(&key);
+    if (!config || ctx->rx_queue_index != config->queue) return XDP_PASS;
+
+    return bpf_redirect_map(&tether_xsk_map, config->slot, XDP_PASS);
+}
+
+// ----- Neighbor Solicitation Flood Filtering -----
+
+// Per interface filter configuration, written by TetheringUtils#setupNsFloodFilter.
+DEFINE_BPF_MAP_GRW(tether_nd_config_map, HASH, TetherNdConfigKey, TetherNdConfigValue, 16,
+                   AID_NETWORK_STACK)
+
+// Addresses owned or proxied per interface, consulted iff TETHER_ND_FLAG_CHECK_TARGET is set.
+DEFINE_BPF_MAP_GRW(tether_nd_target_map, HASH, TetherNdTargetKey, TetherNdTargetValue, 256,
+                   AID_NETWORK_STACK)
+
+// Per target rate limiting state. Least recently used targets are evicted, so a flood of
+// solicitations for spoofed targets cannot fill the map.
+DEFINE_BPF_MAP_GRW(tether_nd_ratelimit_map, LRU_HASH, TetherNdRateLimitKey, TetherNdRateLimitValue,
+                   1024, AID_NETWORK_STACK)
+
+// Per interface rate limiting state, created by TetheringUtils#setupNsFloodFilter.
+DEFINE_BPF_MAP_GRW(tether_nd_iface_ratelimit_map, HASH, TetherNdIfaceRateLimitKey,
+                   TetherNdIfaceRateLimitValue, 16, AID_NETWORK_STACK)
+
+static inline __always_inline bool nd_ratelimit_allow(TetherNdRateLimitValue* v,
+        const TetherNdConfigValue* cfg, const uint32_t burst, const uint64_t now) {
+    // Races with other cpus may let a few extra packets through, which is fine: the goal is to
+    // bound userspace wakeups, not to enforce an exact rate.
+    if (now - v->windowStart >= cfg->intervalNs) {
+        v->windowStart = now;
+        v->count = 1;
+        return true;
+    }
+    if (v->count >= burst) return false;
+    __sync_fetch_and_add(&v->count, 1);
+    return true;
+}
+
+// Runs on the AF_PACKET/SOCK_DGRAM sockets, so the packet starts at the IPv6 header.
+// Returning 0 drops the packet before it is queued to the socket (and thus before the process
+// is woken up), returning skb->len accepts it in full.
+DEFINE_OPTIONAL_BPF_PROG_KVER("skfilter/tether_ns_filter", AID_ROOT, AID_NETWORK_STACK,
+                              sk_filter_tether_ns_filter, KVER(4, 14, 0))
+(struct __sk_buff* skb) {
+    struct {
+        struct ipv6hdr ip6;
+        uint8_t type;
+        uint8_t code;
+        __sum16 checksum;
+        __be32 reserved;
+        struct in6_addr target6;
+    } ns;
+
+    if (bpf_skb_load_bytes(skb, 0, &ns, sizeof(ns))) return 0;
+
+    if (ns.ip6.nexthdr != IPPROTO_ICMPV6) return 0;
+
+    // RFC 4861 section 7.1.1: hop limit must be 255, ie. the packet cannot have been forwarded.
+    if (ns.ip6.hop_limit != 255) return 0;
+
+    if (ns.type != NDISC_NEIGHBOUR_SOLICITATION || ns.code != 0) return 0;
+
+    const uint32_t iif = skb->ifindex;
+    const TetherNdConfigValue* cfg = bpf_tether_nd_config_map_lookup_elem(&iif);
+
+    // Not configured: behave like the classic filter installed by setupNsSocket.
+    if (!cfg) return skb->len;
+
+    if (cfg->flags & TETHER_ND_FLAG_CHECK_TARGET) {
+        TetherNdTargetKey tk = {
+                .iif = iif,
+                .target6 = ns.target6,
+        };
+        if (!bpf_tether_nd_target_map_lookup_elem(&tk)) return 0;
+    }
+
+    if (!cfg->burst) return skb->len;
+
+    const uint64_t now = bpf_ktime_get_ns();
+    TetherNdRateLimitKey rk = {
+            .iif = iif,
+            .target6 = ns.target6,
+    };
+    TetherNdRateLimitValue* rv = bpf_tether_nd_ratelimit_map_lookup_elem(&rk);
+    if (rv) {
+        if (!nd_ratelimit_allow(rv, cfg, cfg->burst, now)) return 0;
+    } else {
+        TetherNdRateLimitValue fresh = {
+                .windowStart = now,
+                .count = 1,
+        };
+        // Only fails if another cpu just created the entry: count this packet against it.
+        if (bpf_tether_nd_ratelimit_map_update_elem(&rk, &fresh, BPF_NOEXIST)) {
+            rv = bpf_tether_nd_ratelimit_map_lookup_elem(&rk);
+            if (!rv || !nd_ratelimit_allow(rv, cfg, cfg->burst, now)) return 0;
+        }
+    }
+
+    // Solicitations for many different targets, e.g. with random spoofed addresses, are still
+    // bounded by the interface bucket. Drop if it is missing rather than failing open.
+    TetherNdRateLimitValue* iv = bpf_tether_nd_iface_ratelimit_map_lookup_elem(&iif);
+    if (!iv) return 0;
+    return nd_ratelimit_allow(iv, cfg, cfg->burst * TETHER_ND_IFACE_BURST_MULTIPLIER, now)
+            ? skb->len : 0;
+}
+
 LICENSE("Apache 2.0");
 CRITICAL("tethering");
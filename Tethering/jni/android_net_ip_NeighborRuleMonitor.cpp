@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <jni.h>
+#include <linux/filter.h>
+#include <linux/neighbour.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <nativehelper/JNIHelp.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+
+#define LOG_TAG "NeighborRuleMonitorJni"
+#include <android/log.h>
+
+#include "nativehelper/scoped_primitive_array.h"
+
+#define BPF_FD_JUST_USE_INT
+#include "BpfSyscallWrappers.h"
+#include "bpf_map_batch.h"
+#include "bpf_tethering.h"
+
+namespace android {
+
+// Sync from BpfCoordinator#Ipv6ForwardingRule#makeTether6Value.
+static const uint16_t kEtherMtu = 1500;
+
+// Same as NeighborEvent#isValid.
+static const uint16_t kNudValid = NUD_PERMANENT | NUD_NOARP | NUD_REACHABLE | NUD_PROBE |
+        NUD_STALE | NUD_DELAY;
+
+static const size_t kRecvBufferSize = 64 * 1024;
+static const int kSocketRecvBufSize = 256 * 1024;
+
+struct in6_addr_less {
+    bool operator()(const in6_addr& a, const in6_addr& b) const {
+        return memcmp(&a, &b, sizeof(a)) < 0;
+    }
+};
+
+// Programs the IPv6 downstream rules of one downstream interface directly from its RTM_NEWNEIGH
+// and RTM_DELNEIGH notifications, without waiting for IpServer to process the same events.
+// IpServer still adds and removes the same rules afterwards, which keeps BpfCoordinator the owner
+// of the rules: the writes here are idempotent and the later ones from Java overwrite them. The
+// rules carry the same QoS marking as those of BpfCoordinator, which passes it in at start.
+class NeighborRuleMonitor {
+  public:
+    NeighborRuleMonitor(int sock, int mapFd, int wakeFd, int ifIndex, const uint8_t* mac,
+                        uint32_t priority, uint8_t dscp, uint8_t qosFlags)
+        : mSocket(sock), mMapFd(mapFd), mWakeFd(wakeFd), mIfIndex(ifIndex),
+          mPriority(priority), mDscp(dscp), mQosFlags(qosFlags) {
+        memcpy(mMac, mac, ETH_ALEN);
+    }
+
+    ~NeighborRuleMonitor() {
+        close(mSocket);
+        close(mMapFd);
+        close(mWakeFd);
+    }
+
+    void start() { mThread = std::thread(&NeighborRuleMonitor::run, this); }
+
+    void stop() {
+        const uint64_t one = 1;
+        if (write(mWakeFd, &one, sizeof(one)) != sizeof(one)) {
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Failed to wake monitor: %s",
+                    strerror(errno));
+        }
+        mThread.join();
+    }
+
+    void setUpstream(int ifIndex) { mUpstreamIfIndex.store(ifIndex); }
+
+  private:
+    void run();
+    void readEvents();
+    void onNeighbor(const nlmsghdr* nlh);
+    void flush();
+
+    const int mSocket;
+    const int mMapFd;
+    const int mWakeFd;
+    const int mIfIndex;
+    const uint32_t mPriority;
+    const uint8_t mDscp;
+    const uint8_t mQosFlags;
+    uint8_t mMac[ETH_ALEN];
+    std::thread mThread;
+    std::atomic<int> mUpstreamIfIndex{0};
+
+    // Only accessed from mThread. Maps each neighbor to its MAC address, or to an empty vector if
+    // its rule must be removed. Only the last event for each neighbor in a burst is applied.
+    std::map<in6_addr, std::vector<uint8_t>, in6_addr_less> mPending;
+    std::vector<uint8_t> mRecvBuffer = std::vector<uint8_t>(kRecvBufferSize);
+};
+
+void NeighborRuleMonitor::run() {
+    pollfd fds[] = {
+        { .fd = mSocket, .events = POLLIN },
+        { .fd = mWakeFd, .events = POLLIN },
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "poll: %s", strerror(errno));
+            return;
+        }
+        if (fds[1].revents) return;
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Netlink socket error");
+            return;
+        }
+
+        // Drain the whole burst first so that its rule updates can be written in one batch.
+        readEvents();
+        flush();
+    }
+}
+
+void NeighborRuleMonitor::readEvents() {
+    while (true) {
+        const ssize_t len = recv(mSocket, mRecvBuffer.data(), mRecvBuffer.size(), MSG_DONTWAIT);
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            // ENOBUFS means events were lost. IpServer gets them from its own monitor, so the
+            // rules are only programmed later.
+            if (errno != EAGAIN) {
+                __android_log_print(ANDROID_LOG_WARN, LOG_TAG, "recv: %s", strerror(errno));
+            }
+            return;
+        }
+
+        int remaining = len;
+        for (const nlmsghdr* nlh = reinterpret_cast<const nlmsghdr*>(mRecvBuffer.data());
+                NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining)) {
+            if (nlh->nlmsg_type == RTM_NEWNEIGH || nlh->nlmsg_type == RTM_DELNEIGH) {
+                onNeighbor(nlh);
+            }
+        }
+    }
+}
+
+void NeighborRuleMonitor::onNeighbor(const nlmsghdr* nlh) {
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(ndmsg))) return;
+    const ndmsg* ndm = static_cast<const ndmsg*>(NLMSG_DATA(nlh));
+    if (ndm->ndm_family != AF_INET6 || ndm->ndm_ifindex != mIfIndex) return;
+
+    const in6_addr* dst = nullptr;
+    const uint8_t* lladdr = nullptr;
+    int len = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*ndm));
+    for (const rtattr* rta = reinterpret_cast<const rtattr*>(
+                 reinterpret_cast<const uint8_t*>(ndm) + NLMSG_ALIGN(sizeof(*ndm)));
+            RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == NDA_DST && RTA_PAYLOAD(rta) == sizeof(in6_addr)) {
+            dst = static_cast<const in6_addr*>(RTA_DATA(rta));
+        } else if (rta->rta_type == NDA_LLADDR && RTA_PAYLOAD(rta) == ETH_ALEN) {
+            lladdr = static_cast<const uint8_t*>(RTA_DATA(rta));
+        }
+    }
+
+    // Same filtering as IpServer#updateIpv6ForwardingRules.
+    if (dst == nullptr || IN6_IS_ADDR_MULTICAST(dst) || IN6_IS_ADDR_LOOPBACK(dst) ||
+            IN6_IS_ADDR_LINKLOCAL(dst)) {
+        return;
+    }
+
+    const bool valid = nlh->nlmsg_type == RTM_NEWNEIGH && (ndm->ndm_state & kNudValid);
+    if (valid && lladdr == nullptr) return;
+    mPending[*dst] = valid ? std::vector<uint8_t>(lladdr, lladdr + ETH_ALEN)
+                           : std::vector<uint8_t>();
+}
+
+void NeighborRuleMonitor::flush() {
+    const uint32_t upstream = mUpstreamIfIndex.load();
+    if (upstream == 0) {
+        // No rules without an upstream. IpServer adds them when the upstream comes up.
+        mPending.clear();
+        return;
+    }
+
+    std::vector<uint8_t> writeKeys, writeValues, deleteKeys;
+    for (const auto& [addr, mac] : mPending) {
+        TetherDownstream6Key key = {
+            .iif = upstream,
+            .neigh6 = addr,
+        };
+        const uint8_t* k = reinterpret_cast<const uint8_t*>(&key);
+        if (mac.empty()) {
+            deleteKeys.insert(deleteKeys.end(), k, k + sizeof(key));
+            continue;
+        }
+
+        Tether6Value value = {
+            .oif = static_cast<uint32_t>(mIfIndex),
+            .pmtu = kEtherMtu,
+            .priority = mPriority,
+            .dscp = mDscp,
+            .qosFlags = mQosFlags,
+        };
+        memcpy(value.macHeader.h_dest, mac.data(), ETH_ALEN);
+        memcpy(value.macHeader.h_source, mMac, ETH_ALEN);
+        value.macHeader.h_proto = htons(ETH_P_IPV6);
+        const uint8_t* v = reinterpret_cast<const uint8_t*>(&value);
+        writeKeys.insert(writeKeys.end(), k, k + sizeof(key));
+        writeValues.insert(writeValues.end(), v, v + sizeof(value));
+    }
+    mPending.clear();
+
+    if (deleteMapEntries(mMapFd, sizeof(TetherDownstream6Key), deleteKeys)) {
+        __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Failed to delete rules: %s",
+                strerror(errno));
+    }
+    if (writeMapEntries(mMapFd, sizeof(TetherDownstream6Key), sizeof(Tether6Value), writeKeys,
+            writeValues)) {
+        __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Failed to write rules: %s",
+                strerror(errno));
+    }
+}
+
+// Opens a NETLINK_ROUTE socket subscribed to neighbor notifications, with a socket filter that
+// drops the notifications for other families and interfaces before they are queued.
+static int createNeighborSocket(int ifIndex) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (fd == -1) return -1;
+
+    // Absolute loads are big endian, so compare against the ifindex as read that way.
+    sock_filter code[] = {
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS,  NLMSG_HDRLEN + offsetof(ndmsg, ndm_family)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    AF_INET6, 0, 3),
+        BPF_STMT(BPF_LD  | BPF_W   | BPF_ABS,  NLMSG_HDRLEN + offsetof(ndmsg, ndm_ifindex)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    htonl(ifIndex), 0, 1),
+        BPF_STMT(BPF_RET | BPF_K,              0xFFFFFFFF),
+        BPF_STMT(BPF_RET | BPF_K,              0),
+    };
+    const sock_fprog filter = {
+        sizeof(code) / sizeof(code[0]),
+        code,
+    };
+    const sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = RTMGRP_NEIGH,
+    };
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &kSocketRecvBufSize, sizeof(kSocketRecvBufSize)) ||
+            setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) ||
+            bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))) {
+        const int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static jlong android_net_ip_NeighborRuleMonitor_start(JNIEnv* env, jclass clazz, jint ifIndex,
+        jbyteArray mac, jlong priority, jshort dscp, jshort qosFlags) {
+    ScopedByteArrayRO macBytes(env, mac);
+    if (macBytes.size() != ETH_ALEN) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                "Invalid MAC address length %zu", macBytes.size());
+        return 0;
+    }
+
+    const int mapFd = bpf::mapRetrieveRW(TETHER_DOWNSTREAM6_MAP_PATH);
+    if (mapFd == -1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Failed to open downstream6 map: %s",
+                strerror(errno));
+        return 0;
+    }
+
+    const int sock = createNeighborSocket(ifIndex);
+    if (sock == -1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Failed to open neighbor socket: %s",
+                strerror(errno));
+        close(mapFd);
+        return 0;
+    }
+
+    const int wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeFd == -1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "eventfd: %s", strerror(errno));
+        close(sock);
+        close(mapFd);
+        return 0;
+    }
+
+    NeighborRuleMonitor* monitor = new NeighborRuleMonitor(sock, mapFd, wakeFd, ifIndex,
+            reinterpret_cast<const uint8_t*>(macBytes.get()), static_cast<uint32_t>(priority),
+            static_cast<uint8_t>(dscp), static_cast<uint8_t>(qosFlags));
+    monitor->start();
+    return reinterpret_cast<jlong>(monitor);
+}
+
+static void android_net_ip_NeighborRuleMonitor_setUpstream(JNIEnv* env, jclass clazz,
+        jlong handle, jint upstreamIfIndex) {
+    reinterpret_cast<NeighborRuleMonitor*>(handle)->setUpstream(upstreamIfIndex);
+}
+
+static void android_net_ip_NeighborRuleMonitor_stop(JNIEnv* env, jclass clazz, jlong handle) {
+    NeighborRuleMonitor* monitor = reinterpret_cast<NeighborRuleMonitor*>(handle);
+    monitor->stop();
+    delete monitor;
+}
+
+/*
+ * JNI registration.
+ */
+static const JNINativeMethod gMethods[] = {
+    /* name, signature, funcPtr */
+    { "nativeStart", "(I[BJSS)J", (void*) android_net_ip_NeighborRuleMonitor_start },
+    { "nativeSetUpstream", "(JI)V", (void*) android_net_ip_NeighborRuleMonitor_setUpstream },
+    { "nativeStop", "(J)V", (void*) android_net_ip_NeighborRuleMonitor_stop },
+};
+
+int register_android_net_ip_NeighborRuleMonitor(JNIEnv* env) {
+    return jniRegisterNativeMethods(env,
+            "android/net/ip/NeighborRuleMonitor",
+            gMethods, NELEM(gMethods));
+}
+
+}; // namespace android
@@ -0,0 +1,429 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <jni.h>
+#include <linux/if_ether.h>
+#include <netinet/icmp6.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <nativehelper/JNIHelp.h>
+#include <netjniutils/netjniutils.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define LOG_TAG "RaResponderJni"
+#include <android/log.h>
+
+#include "nativehelper/scoped_primitive_array.h"
+#include "xsk_receiver.h"
+
+namespace android {
+
+// From https://tools.ietf.org/html/rfc4861#section-10 .
+static const int64_t kMaxRaDelayTimeNs = 500 * 1000000LL;
+static const int64_t kMinDelayBetweenRasNs = 3 * 1000000000LL;
+static const int kLinkLocalHopLimit = 255;
+
+// Distinct solicitors answered with unicast RAs in one response window. A burst from more clients
+// than this is answered with a single multicast RA instead.
+static const size_t kMaxPendingSolicitors = 8;
+
+// The largest RA that RouterAdvertisementDaemon builds is IPV6_MIN_MTU bytes.
+static const size_t kMaxRaLength = 1280;
+
+// Receive queue the AF_XDP socket is bound to. Single queue devices such as veth only have this
+// one; on multi-queue devices, solicitations on the other queues still reach mSocket.
+static const uint32_t kXskQueue = 0;
+
+static int64_t nowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Answers Router Solicitations on a socket configured by setupRaSocket(), from a thread that only
+// attaches to the VM to report that it stopped on a socket error. The RA itself is built in Java
+// and only pushed down when it changes; solicitations are answered from that template with the
+// random delay and rate limiting of RFC 4861 section 6.2.6. The periodic multicast RAs are still
+// sent from Java, which claims them through claimMulticast() so that multicast RAs from both
+// stay at least MIN_DELAY_BETWEEN_RAS apart.
+class RaResponder {
+  public:
+    RaResponder(int sock, int ifIndex, int wakeFd, JavaVM* vm, jobject daemon, jmethodID onStopped)
+        : mSocket(sock), mIfIndex(ifIndex), mWakeFd(wakeFd), mVm(vm), mDaemon(daemon),
+          mOnStopped(onStopped) {}
+
+    ~RaResponder() { close(mWakeFd); }
+
+    // The global reference to the RouterAdvertisementDaemon, deleted by the caller.
+    jobject daemon() const { return mDaemon; }
+
+    // Also receive solicitations through an AF_XDP socket, so that they bypass the stack. This is
+    // optional: on failure, e.g. if the driver has no native XDP support or the kernel is too old
+    // to load the XDP program, all the solicitations are received on mSocket.
+    void startXsk() {
+        const int ret = mXsk.open(mIfIndex, kXskQueue);
+        if (ret != 0) {
+            __android_log_print(ANDROID_LOG_INFO, LOG_TAG,
+                    "Not using AF_XDP on ifindex %d: %s", mIfIndex, strerror(-ret));
+        }
+    }
+
+    void start() { mThread = std::thread(&RaResponder::run, this); }
+
+    void stop() {
+        const uint64_t one = 1;
+        if (write(mWakeFd, &one, sizeof(one)) != sizeof(one)) {
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Failed to wake responder: %s",
+                    strerror(errno));
+        }
+        mThread.join();
+    }
+
+    void setTemplate(const uint8_t* ra, size_t len) {
+        std::lock_guard<std::mutex> guard(mLock);
+        mTemplate.assign(ra, ra + len);
+    }
+
+    // Records that a multicast RA is sent now, unless the last one was sent less than
+    // MIN_DELAY_BETWEEN_RAS ago. Returns 0, or how long to wait before trying again.
+    int64_t claimMulticast(int64_t now) {
+        int64_t last = mLastMulticastNs.load();
+        do {
+            const int64_t next = last + kMinDelayBetweenRasNs;
+            if (now < next) return next - now;
+        } while (!mLastMulticastNs.compare_exchange_weak(last, now));
+        return 0;
+    }
+
+  private:
+    void run();
+    void readSolicitations(int64_t now);
+    void readXskSolicitations(int64_t now);
+    void onSolicitation(const sockaddr_in6& src, int64_t now, bool mayUnicast);
+    void sendPending(int64_t now);
+    void sendRa(const sockaddr_in6& dst);
+    void notifyStopped();
+
+    const int mSocket;
+    const int mIfIndex;
+    const int mWakeFd;
+    JavaVM* const mVm;
+    const jobject mDaemon;
+    const jmethodID mOnStopped;
+    std::thread mThread;
+    XskReceiver mXsk;
+
+    std::mutex mLock;
+    std::vector<uint8_t> mTemplate;  // Guarded by mLock.
+
+    // Only accessed from mThread.
+    std::vector<sockaddr_in6> mSolicitors;
+    int64_t mUnicastDeadlineNs = 0;
+    int64_t mMulticastDeadlineNs = 0;  // 0 if no multicast RA is scheduled
+
+    // Time of the last multicast RA, sent by this thread or by Java.
+    std::atomic<int64_t> mLastMulticastNs = -kMinDelayBetweenRasNs;
+};
+
+void RaResponder::run() {
+    // poll() ignores negative fds, so fds[2] is unused if there is no AF_XDP socket.
+    pollfd fds[] = {
+        { .fd = mSocket, .events = POLLIN },
+        { .fd = mWakeFd, .events = POLLIN },
+        { .fd = mXsk.fd(), .events = POLLIN },
+    };
+
+    while (true) {
+        int64_t now = nowNs();
+        int timeoutMs = -1;
+        for (int64_t deadline : { mSolicitors.empty() ? 0 : mUnicastDeadlineNs,
+                                  mMulticastDeadlineNs }) {
+            if (deadline == 0) continue;
+            const int64_t waitNs = std::max<int64_t>(0, deadline - now);
+            const int ms = static_cast<int>((waitNs + 999999) / 1000000);
+            timeoutMs = (timeoutMs < 0) ? ms : std::min(timeoutMs, ms);
+        }
+
+        if (poll(fds, 3, timeoutMs) < 0 && errno != EINTR) {
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "poll: %s", strerror(errno));
+            notifyStopped();
+            return;
+        }
+        if (fds[1].revents) return;
+        if (fds[0].revents & (POLLHUP | POLLNVAL)) {
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Socket of ifindex %d unusable: %#x",
+                    mIfIndex, fds[0].revents);
+            notifyStopped();
+            return;
+        }
+
+        now = nowNs();
+        // Also on POLLERR, so that receiving clears the pending error.
+        if (fds[0].revents & (POLLIN | POLLERR)) readSolicitations(now);
+        if (fds[2].revents & POLLIN) readXskSolicitations(now);
+        sendPending(now);
+    }
+}
+
+void RaResponder::readSolicitations(int64_t now) {
+    uint8_t pkt[kMaxRaLength];
+    uint8_t control[CMSG_SPACE(sizeof(int))];
+    while (true) {
+        sockaddr_in6 src = {};
+        iovec iov = { .iov_base = pkt, .iov_len = sizeof(pkt) };
+        msghdr msg = {
+            .msg_name = &src,
+            .msg_namelen = sizeof(src),
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        const ssize_t len = recvmsg(mSocket, &msg, MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) {
+                __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "recvmsg: %s", strerror(errno));
+            }
+            return;
+        }
+
+        // Validate as per https://tools.ietf.org/html/rfc4861#section-6.1.1 . The socket only
+        // delivers Router Solicitations, so the ICMPv6 type need not be checked again.
+        int hopLimit = -1;
+        for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT) {
+                memcpy(&hopLimit, CMSG_DATA(cmsg), sizeof(hopLimit));
+            }
+        }
+        if (hopLimit != kLinkLocalHopLimit) continue;
+        if (len < static_cast<ssize_t>(sizeof(nd_router_solicit))) continue;
+        const nd_router_solicit* rs = reinterpret_cast<const nd_router_solicit*>(pkt);
+        if (rs->nd_rs_type != ND_ROUTER_SOLICIT || rs->nd_rs_code != 0) continue;
+
+        onSolicitation(src, now, true /* mayUnicast */);
+    }
+}
+
+// Same validation as readSolicitations(), on whole ethernet frames. The ICMPv6 checksum is not
+// verified: a corrupted solicitation can at worst cause a rate-limited RA to be sent.
+//
+// These solicitations never reach the stack, which therefore does not learn the link-layer address
+// of the solicitor and could not send it a unicast RA without resolving it first. They are
+// answered with the multicast RA, which is the usual case as per RFC 4861 section 6.2.6.
+void RaResponder::readXskSolicitations(int64_t now) {
+    struct SolicitationFrame {
+        ethhdr eth;
+        ip6_hdr ip6;
+        nd_router_solicit rs;
+    } __attribute__((packed));
+
+    mXsk.receive([&](const uint8_t* frame, uint32_t len) {
+        if (len < sizeof(SolicitationFrame)) return;
+        SolicitationFrame f;
+        memcpy(&f, frame, sizeof(f));
+        if (f.eth.h_proto != htons(ETH_P_IPV6) || f.ip6.ip6_nxt != IPPROTO_ICMPV6) return;
+        if (f.ip6.ip6_hlim != kLinkLocalHopLimit) return;
+        const size_t payloadLen = ntohs(f.ip6.ip6_plen);
+        if (payloadLen < sizeof(f.rs) || payloadLen > len - sizeof(f.eth) - sizeof(f.ip6)) return;
+        if (f.rs.nd_rs_type != ND_ROUTER_SOLICIT || f.rs.nd_rs_code != 0) return;
+
+        const sockaddr_in6 src = {
+            .sin6_family = AF_INET6,
+            .sin6_addr = f.ip6.ip6_src,
+            .sin6_scope_id = static_cast<uint32_t>(mIfIndex),
+        };
+        onSolicitation(src, now, false /* mayUnicast */);
+    });
+}
+
+void RaResponder::onSolicitation(const sockaddr_in6& src, int64_t now, bool mayUnicast) {
+    const int64_t delay = arc4random_uniform(kMaxRaDelayTimeNs / 1000) * 1000LL;
+
+    // Solicitations from an unspecified or non link-local source, received through AF_XDP, or
+    // from more clients than can reasonably be answered one by one, get a multicast RA.
+    // Consecutive multicast RAs must be at least MIN_DELAY_BETWEEN_RAS apart.
+    const bool unicast = mayUnicast && IN6_IS_ADDR_LINKLOCAL(&src.sin6_addr) &&
+            src.sin6_scope_id == static_cast<uint32_t>(mIfIndex);
+    if (!unicast || mSolicitors.size() >= kMaxPendingSolicitors) {
+        const int64_t deadline =
+                std::max(now + delay, mLastMulticastNs.load() + kMinDelayBetweenRasNs);
+        if (mMulticastDeadlineNs == 0 || deadline < mMulticastDeadlineNs) {
+            mMulticastDeadlineNs = deadline;
+        }
+        return;
+    }
+
+    // A multicast RA is already on its way, and will reach this client too.
+    if (mMulticastDeadlineNs != 0) return;
+
+    for (const sockaddr_in6& s : mSolicitors) {
+        if (IN6_ARE_ADDR_EQUAL(&s.sin6_addr, &src.sin6_addr)) return;
+    }
+    if (mSolicitors.empty()) mUnicastDeadlineNs = now + delay;
+    mSolicitors.push_back(src);
+}
+
+void RaResponder::sendPending(int64_t now) {
+    if (mMulticastDeadlineNs != 0 && now >= mMulticastDeadlineNs) {
+        const int64_t waitNs = claimMulticast(now);
+        if (waitNs > 0) {
+            // Java sent a periodic multicast RA in the meantime.
+            mMulticastDeadlineNs = now + waitNs;
+        } else {
+            sockaddr_in6 allNodes = {
+                .sin6_family = AF_INET6,
+                .sin6_addr = {{{0xff,2,0,0,0,0,0,0,0,0,0,0,0,0,0,1}}},
+                .sin6_scope_id = static_cast<uint32_t>(mIfIndex),
+            };
+            sendRa(allNodes);
+            mMulticastDeadlineNs = 0;
+            // The multicast RA answers every pending solicitor as well.
+            mSolicitors.clear();
+        }
+    }
+
+    if (!mSolicitors.empty() && now >= mUnicastDeadlineNs) {
+        for (const sockaddr_in6& dst : mSolicitors) sendRa(dst);
+        mSolicitors.clear();
+    }
+}
+
+void RaResponder::sendRa(const sockaddr_in6& dst) {
+    std::lock_guard<std::mutex> guard(mLock);
+    // No RA has been built yet.
+    if (mTemplate.empty()) return;
+
+    if (sendto(mSocket, mTemplate.data(), mTemplate.size(), 0,
+            reinterpret_cast<const sockaddr*>(&dst), sizeof(dst)) < 0) {
+        __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "sendto: %s", strerror(errno));
+    }
+}
+
+// Lets Java start its own responder. Only called when the thread exits on its own.
+void RaResponder::notifyStopped() {
+    JNIEnv* env;
+    JavaVMAttachArgs args = { .version = JNI_VERSION_1_6, .name = "RaResponder" };
+    if (mVm->AttachCurrentThread(&env, &args) != JNI_OK) {
+        __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Cannot attach to report failure");
+        return;
+    }
+    env->CallVoidMethod(mDaemon, mOnStopped);
+    if (env->ExceptionCheck()) env->ExceptionClear();
+    mVm->DetachCurrentThread();
+}
+
+static jlong android_net_ip_RouterAdvertisementDaemon_startResponder(JNIEnv* env, jclass clazz,
+        jobject daemon, jobject javaFd, jint ifIndex, jboolean useXsk) {
+    int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
+    if (fd == -1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid file descriptor");
+        return 0;
+    }
+
+    // The hop limit is needed to reject solicitations that were forwarded by a router.
+    const int on = 1;
+    if (setsockopt(fd, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on)) != 0) {
+        jniThrowExceptionFmt(env, "java/io/IOException",
+                "setsockopt(IPV6_RECVHOPLIMIT): %s", strerror(errno));
+        return 0;
+    }
+
+    JavaVM* vm;
+    const jmethodID onStopped = env->GetMethodID(env->GetObjectClass(daemon),
+            "onNativeResponderStopped", "()V");
+    if (onStopped == nullptr || env->GetJavaVM(&vm) != JNI_OK) {
+        // GetMethodID has thrown NoSuchMethodError.
+        if (!env->ExceptionCheck()) jniThrowException(env, "java/io/IOException", "GetJavaVM");
+        return 0;
+    }
+
+    int wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wakeFd == -1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "eventfd: %s", strerror(errno));
+        return 0;
+    }
+
+    RaResponder* responder = new RaResponder(fd, ifIndex, wakeFd, vm, env->NewGlobalRef(daemon),
+            onStopped);
+    if (useXsk) responder->startXsk();
+    responder->start();
+    return reinterpret_cast<jlong>(responder);
+}
+
+static void android_net_ip_RouterAdvertisementDaemon_updateResponder(JNIEnv* env, jclass clazz,
+        jlong handle, jbyteArray ra, jint length) {
+    RaResponder* responder = reinterpret_cast<RaResponder*>(handle);
+    ScopedByteArrayRO bytes(env, ra);
+    if (length < 0 || static_cast<size_t>(length) > std::min(bytes.size(), kMaxRaLength)) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                "Invalid RA length %d", length);
+        return;
+    }
+    responder->setTemplate(reinterpret_cast<const uint8_t*>(bytes.get()), length);
+}
+
+static jlong android_net_ip_RouterAdvertisementDaemon_claimMulticast(JNIEnv* env, jclass clazz,
+        jlong handle) {
+    RaResponder* responder = reinterpret_cast<RaResponder*>(handle);
+    const int64_t waitNs = responder->claimMulticast(nowNs());
+    return (waitNs + 999999) / 1000000;
+}
+
+static void android_net_ip_RouterAdvertisementDaemon_stopResponder(JNIEnv* env, jclass clazz,
+        jlong handle) {
+    RaResponder* responder = reinterpret_cast<RaResponder*>(handle);
+    responder->stop();
+    env->DeleteGlobalRef(responder->daemon());
+    delete responder;
+}
+
+/*
+ * JNI registration.
+ */
+static const JNINativeMethod gMethods[] = {
+    /* name, signature, funcPtr */
+    { "nativeStartResponder",
+        "(Landroid/net/ip/RouterAdvertisementDaemon;Ljava/io/FileDescriptor;IZ)J",
+        (void*) android_net_ip_RouterAdvertisementDaemon_startResponder },
+    { "nativeUpdateResponder", "(J[BI)V",
+        (void*) android_net_ip_RouterAdvertisementDaemon_updateResponder },
+    { "nativeClaimMulticast", "(J)J",
+        (void*) android_net_ip_RouterAdvertisementDaemon_claimMulticast },
+    { "nativeStopResponder", "(J)V",
+        (void*) android_net_ip_RouterAdvertisementDaemon_stopResponder },
+};
+
+int register_android_net_ip_RouterAdvertisementDaemon(JNIEnv* env) {
+    return jniRegisterNativeMethods(env,
+            "android/net/ip/RouterAdvertisementDaemon",
+            gMethods, NELEM(gMethods));
+}
+
+}; // namespace android
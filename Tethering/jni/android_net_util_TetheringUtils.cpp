@@ -14,10 +14,12 @@
  * limitations under the License.
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <error.h>
 #include <jni.h>
 #include <linux/filter.h>
+#include <linux/if_packet.h>
 #include <nativehelper/JNIHelp.h>
 #include <nativehelper/ScopedUtfChars.h>
 #include <netjniutils/netjniutils.h>
@@ -28,30 +30,85 @@
 #include <sys/socket.h>
 #include <stdio.h>
 
+#include <algorithm>
+#include <vector>
+
+#define LOG_TAG "TetheringUtilsJni"
+#include <android/log.h>
+
+#define BPF_FD_JUST_USE_INT
+#include "BpfSyscallWrappers.h"
+#include "bpf_tethering.h"
+#include "nativehelper/scoped_primitive_array.h"
+
 namespace android {
 
 static const uint32_t kIPv6NextHeaderOffset = offsetof(ip6_hdr, ip6_nxt);
+static const uint32_t kIPv6HopLimitOffset = offsetof(ip6_hdr, ip6_hlim);
 static const uint32_t kIPv6PayloadStart = sizeof(ip6_hdr);
 static const uint32_t kICMPv6TypeOffset = kIPv6PayloadStart + offsetof(icmp6_hdr, icmp6_type);
+static const uint32_t kNsTargetOffset =
+        kIPv6PayloadStart + offsetof(nd_neighbor_solicit, nd_ns_target);
+
+static const int kLinkLocalHopLimit = 255;
+
+// Classic BPF jump offsets are only 8 bits wide, so a generated filter can only match a limited
+// number of target addresses. Above this, the target check is left to userspace.
+static const size_t kMaxClassicNsTargets = 16;
 
-static void android_net_util_setupIcmpFilter(JNIEnv *env, jobject javaFd, uint32_t type) {
-    sock_filter filter_code[] = {
+// Builds a filter that accepts ICMPv6 packets of the given type with a hop limit of 255 (as
+// required for all neighbor discovery messages by RFC 4861) and, if any targets are given, whose
+// neighbor solicitation target address is one of them.
+static std::vector<sock_filter> makeIcmpFilter(uint32_t type,
+        const std::vector<in6_addr>& targets) {
+    static const size_t kNumHeaderChecks = 6;
+    static const size_t kInsnsPerTarget = 8;
+    const size_t reject = kNumHeaderChecks + kInsnsPerTarget * targets.size();
+    const size_t accept = reject + 1;
+
+    // Returns the jump offset from the instruction at index |from| to the one at index |to|.
+    const auto jumpTo = [](size_t from, size_t to) { return static_cast<uint8_t>(to - from - 1); };
+
+    std::vector<sock_filter> code = {
         // Check header is ICMPv6.
         BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS,  kIPv6NextHeaderOffset),
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    IPPROTO_ICMPV6, 0, 3),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    IPPROTO_ICMPV6, 0, jumpTo(1, reject)),
+
+        // Check hop limit, ie. that the packet was not forwarded.
+        BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS,  kIPv6HopLimitOffset),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    kLinkLocalHopLimit, 0, jumpTo(3, reject)),
 
         // Check ICMPv6 type.
         BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS,  kICMPv6TypeOffset),
-        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    type, 0, 1),
-
-        // Accept or reject.
-        BPF_STMT(BPF_RET | BPF_K,              0xffff),
-        BPF_STMT(BPF_RET | BPF_K,              0)
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    type,
+                targets.empty() ? jumpTo(5, accept) : 0, jumpTo(5, reject)),
     };
 
+    // Check target address, one 32-bit word at a time. A mismatch moves on to the next target.
+    for (size_t i = 0; i < targets.size(); i++) {
+        const size_t nextTarget = kNumHeaderChecks + kInsnsPerTarget * (i + 1);
+        for (size_t w = 0; w < 4; w++) {
+            const size_t jeq = code.size() + 1;
+            code.push_back(BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+                    static_cast<uint32_t>(kNsTargetOffset + w * sizeof(uint32_t))));
+            code.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ntohl(targets[i].s6_addr32[w]),
+                    w == 3 ? jumpTo(jeq, accept) : 0, jumpTo(jeq, nextTarget)));
+        }
+    }
+
+    // Reject or accept.
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+    code.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffff));
+    return code;
+}
+
+static void android_net_util_setupIcmpFilter(JNIEnv *env, jobject javaFd, uint32_t type,
+        const std::vector<in6_addr>& targets = {}) {
+    std::vector<sock_filter> filter_code = makeIcmpFilter(type, targets);
+
     const sock_fprog filter = {
-        sizeof(filter_code) / sizeof(filter_code[0]),
-        filter_code,
+        static_cast<unsigned short>(filter_code.size()),
+        filter_code.data(),
     };
 
     int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
@@ -71,11 +128,161 @@ static void android_net_util_setupNsSocket(JNIEnv *env, jobject clazz, jobject j
     android_net_util_setupIcmpFilter(env, javaFd, ND_NEIGHBOR_SOLICIT);
 }
 
+// Replaces the targets of the given interface in the pinned target map with |targets|.
+static int syncNsTargets(int mapFd, uint32_t ifIndex, const std::vector<in6_addr>& targets) {
+    // Deleting the current key would restart iteration, so collect the stale keys first.
+    std::vector<TetherNdTargetKey> stale;
+    TetherNdTargetKey key;
+    int ret = bpf::getFirstMapKey(mapFd, &key);
+    while (ret == 0) {
+        if (key.iif == ifIndex) stale.push_back(key);
+        ret = bpf::getNextMapKey(mapFd, &key, &key);
+    }
+    if (errno != ENOENT) return -errno;
+
+    for (const TetherNdTargetKey& k : stale) {
+        if (bpf::deleteMapEntry(mapFd, &k) && errno != ENOENT) return -errno;
+    }
+
+    const TetherNdTargetValue value = 0;
+    for (const in6_addr& target : targets) {
+        const TetherNdTargetKey k = { .iif = ifIndex, .target6 = target };
+        if (bpf::writeToMapEntry(mapFd, &k, &value, BPF_ANY)) return -errno;
+    }
+    return 0;
+}
+
+// Deletes the targets of the given interface from the pinned target map.
+static int clearNsTargets(int mapFd, uint32_t ifIndex) {
+    return syncNsTargets(mapFd, ifIndex, {});
+}
+
+// Forgets the rate limiting state of all targets on the given interface.
+static int clearNsRateLimits(int mapFd, uint32_t ifIndex) {
+    std::vector<TetherNdRateLimitKey> keys;
+    TetherNdRateLimitKey key;
+    int ret = bpf::getFirstMapKey(mapFd, &key);
+    while (ret == 0) {
+        if (key.iif == ifIndex) keys.push_back(key);
+        ret = bpf::getNextMapKey(mapFd, &key, &key);
+    }
+    if (errno != ENOENT) return -errno;
+
+    for (const TetherNdRateLimitKey& k : keys) {
+        if (bpf::deleteMapEntry(mapFd, &k) && errno != ENOENT) return -errno;
+    }
+    return 0;
+}
+
+// Configures the maps of the NS filter program for the given interface and attaches it to the
+// socket. Returns 0 on success, or a negative errno if the program or maps are not available.
+static int attachNsFilterProgram(int fd, uint32_t ifIndex, const std::vector<in6_addr>& targets,
+        uint32_t burst, uint64_t intervalNs) {
+    const int progFd = bpf::retrieveProgram(TETHER_NS_FILTER_PROG_PATH);
+    if (progFd == -1) return -errno;
+
+    const int configFd = bpf::mapRetrieveRW(TETHER_ND_CONFIG_MAP_PATH);
+    const int targetFd = bpf::mapRetrieveRW(TETHER_ND_TARGET_MAP_PATH);
+    const int rateLimitFd = bpf::mapRetrieveRW(TETHER_ND_RATELIMIT_MAP_PATH);
+    const int ifaceRateLimitFd = bpf::mapRetrieveRW(TETHER_ND_IFACE_RATELIMIT_MAP_PATH);
+
+    int ret = 0;
+    if (configFd == -1 || targetFd == -1 || rateLimitFd == -1 || ifaceRateLimitFd == -1) {
+        ret = -errno;
+    } else if ((ret = syncNsTargets(targetFd, ifIndex, targets)) == 0 &&
+               (ret = clearNsRateLimits(rateLimitFd, ifIndex)) == 0) {
+        const TetherNdConfigValue config = {
+            .flags = targets.empty() ? 0u : TETHER_ND_FLAG_CHECK_TARGET,
+            .burst = burst,
+            .intervalNs = intervalNs,
+        };
+        // The program drops everything on an interface without a bucket, so it must exist
+        // before the configuration does.
+        const TetherNdIfaceRateLimitValue bucket = {};
+        if (bpf::writeToMapEntry(ifaceRateLimitFd, &ifIndex, &bucket, BPF_ANY) ||
+            bpf::writeToMapEntry(configFd, &ifIndex, &config, BPF_ANY)) {
+            ret = -errno;
+        } else if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_BPF, &progFd, sizeof(progFd))) {
+            // This atomically replaces the classic filter installed by setupNsSocket.
+            ret = -errno;
+        }
+    }
+
+    if (ifaceRateLimitFd != -1) close(ifaceRateLimitFd);
+    if (rateLimitFd != -1) close(rateLimitFd);
+    if (targetFd != -1) close(targetFd);
+    if (configFd != -1) close(configFd);
+    close(progFd);
+    return ret;
+}
+
+static jboolean android_net_util_setupNsFloodFilter(JNIEnv *env, jobject clazz, jobject javaFd,
+        jint ifIndex, jbyteArray javaTargets, jint burst, jint intervalMs)
+{
+    std::vector<in6_addr> targets;
+    if (javaTargets != nullptr) {
+        ScopedByteArrayRO bytes(env, javaTargets);
+        if (bytes.size() % sizeof(in6_addr) != 0) {
+            jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                    "Invalid targets length %zu", bytes.size());
+            return false;
+        }
+        targets.resize(bytes.size() / sizeof(in6_addr));
+        memcpy(targets.data(), bytes.get(), bytes.size());
+    }
+
+    int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
+    const int ret = attachNsFilterProgram(fd, static_cast<uint32_t>(ifIndex), targets,
+            static_cast<uint32_t>(burst), static_cast<uint64_t>(intervalMs) * 1000000);
+    if (ret == 0) return true;
+
+    // No eBPF support (or the program could not be attached): fall back to a generated classic
+    // filter, which checks everything except the per-source rate limit.
+    __android_log_print(ANDROID_LOG_WARN, LOG_TAG,
+            "Cannot attach NS filter program on ifindex %d, solicitations are not rate limited: %s",
+            ifIndex, strerror(-ret));
+    if (targets.size() > kMaxClassicNsTargets) targets.clear();
+    android_net_util_setupIcmpFilter(env, javaFd, ND_NEIGHBOR_SOLICIT, targets);
+    return false;
+}
+
+// Removes everything setupNsFloodFilter wrote to the maps for the given interface. The maps only
+// have room for a few interfaces, and every tethering session gets a new interface index.
+static void android_net_util_clearNsFloodFilter(JNIEnv *env, jobject clazz, jint ifIndex)
+{
+    const uint32_t iif = static_cast<uint32_t>(ifIndex);
+    const int configFd = bpf::mapRetrieveRW(TETHER_ND_CONFIG_MAP_PATH);
+    // No maps, so setupNsFloodFilter fell back to the classic filter and wrote nothing.
+    if (configFd == -1) return;
+    const int targetFd = bpf::mapRetrieveRW(TETHER_ND_TARGET_MAP_PATH);
+    const int rateLimitFd = bpf::mapRetrieveRW(TETHER_ND_RATELIMIT_MAP_PATH);
+    const int ifaceRateLimitFd = bpf::mapRetrieveRW(TETHER_ND_IFACE_RATELIMIT_MAP_PATH);
+
+    // The configuration goes first: the program drops everything on a configured interface
+    // without a bucket.
+    int ret = 0;
+    if (bpf::deleteMapEntry(configFd, &iif) && errno != ENOENT) ret = -errno;
+    if (ifaceRateLimitFd == -1 || targetFd == -1 || rateLimitFd == -1) {
+        ret = -errno;
+    } else {
+        if (bpf::deleteMapEntry(ifaceRateLimitFd, &iif) && errno != ENOENT) ret = -errno;
+        if (const int err = clearNsTargets(targetFd, iif)) ret = err;
+        if (const int err = clearNsRateLimits(rateLimitFd, iif)) ret = err;
+    }
+    if (ret) {
+        __android_log_print(ANDROID_LOG_ERROR, LOG_TAG,
+                "Cannot clear NS filter state of ifindex %d: %s", ifIndex, strerror(-ret));
+    }
+
+    if (ifaceRateLimitFd != -1) close(ifaceRateLimitFd);
+    if (rateLimitFd != -1) close(rateLimitFd);
+    if (targetFd != -1) close(targetFd);
+    close(configFd);
+}
+
 static void android_net_util_setupRaSocket(JNIEnv *env, jobject clazz, jobject javaFd,
         jint ifIndex)
 {
-    static const int kLinkLocalHopLimit = 255;
-
     int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
 
     // Set an ICMPv6 filter that only passes Router Solicitations.
@@ -162,6 +369,93 @@ static void android_net_util_setupRaSocket(JNIEnv *env, jobject clazz, jobject j
     }
 }
 
+// Metadata stored at the start of each slot of a message batch buffer, followed by the payload.
+// Must be kept in sync with android.net.util.MessageBatch.
+struct BatchMessageHeader {
+    uint32_t length;   // Payload bytes stored after the header
+    uint32_t flags;    // MSG_TRUNC if the datagram did not fit in the slot
+    uint32_t ifindex;  // Receiving interface index, or 0 if unknown
+    uint16_t family;   // Family of the source address: AF_INET6 or AF_PACKET
+    uint16_t addrLen;  // Bytes of addr that are valid
+    uint8_t addr[16];  // Source IPv6 address, or source link-layer address
+};
+static_assert(sizeof(BatchMessageHeader) == 32, "BatchMessageHeader must match MessageBatch.java");
+
+static const int kMaxBatchMessages = 64;
+
+static void fillBatchMessageHeader(BatchMessageHeader* hdr, const mmsghdr& msg) {
+    *hdr = {};
+    hdr->length = msg.msg_len;
+    hdr->flags = msg.msg_hdr.msg_flags & MSG_TRUNC;
+    // With MSG_TRUNC the kernel reports the real datagram length, not the stored length.
+    if (hdr->length > msg.msg_hdr.msg_iov->iov_len) hdr->length = msg.msg_hdr.msg_iov->iov_len;
+
+    const sockaddr* sa = static_cast<const sockaddr*>(msg.msg_hdr.msg_name);
+    if (sa->sa_family == AF_INET6 && msg.msg_hdr.msg_namelen >= sizeof(sockaddr_in6)) {
+        const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(sa);
+        hdr->family = AF_INET6;
+        hdr->ifindex = sin6->sin6_scope_id;
+        hdr->addrLen = sizeof(sin6->sin6_addr);
+        memcpy(hdr->addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr));
+    } else if (sa->sa_family == AF_PACKET && msg.msg_hdr.msg_namelen >= sizeof(sockaddr_ll)) {
+        const sockaddr_ll* sll = reinterpret_cast<const sockaddr_ll*>(sa);
+        hdr->family = AF_PACKET;
+        hdr->ifindex = sll->sll_ifindex;
+        hdr->addrLen = std::min<size_t>(sll->sll_halen, sizeof(hdr->addr));
+        memcpy(hdr->addr, sll->sll_addr, std::min(hdr->addrLen, (uint16_t) sizeof(sll->sll_addr)));
+    }
+}
+
+// Receives up to maxMessages datagrams with a single recvmmsg() into the direct buffer, which is
+// split into maxMessages slots of slotSize bytes each. Blocks until at least one datagram is
+// available, unless the socket is non-blocking or flags contain MSG_DONTWAIT, in which case
+// EAGAIN is thrown.
+static jint android_net_util_recvMessageBatch(JNIEnv *env, jobject clazz, jobject javaFd,
+        jobject buffer, jint slotSize, jint maxMessages, jint flags)
+{
+    uint8_t* base = static_cast<uint8_t*>(env->GetDirectBufferAddress(buffer));
+    const jlong capacity = env->GetDirectBufferCapacity(buffer);
+    if (base == nullptr || maxMessages <= 0 || maxMessages > kMaxBatchMessages ||
+            slotSize <= static_cast<jint>(sizeof(BatchMessageHeader)) ||
+            static_cast<jlong>(slotSize) * maxMessages > capacity) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                "Invalid batch: %d slots of %d bytes in a %lld byte buffer", maxMessages,
+                slotSize, static_cast<long long>(capacity));
+        return -1;
+    }
+
+    mmsghdr msgs[kMaxBatchMessages] = {};
+    iovec iovs[kMaxBatchMessages];
+    sockaddr_storage addrs[kMaxBatchMessages];
+    for (int i = 0; i < maxMessages; i++) {
+        uint8_t* slot = base + static_cast<size_t>(i) * slotSize;
+        iovs[i].iov_base = slot + sizeof(BatchMessageHeader);
+        iovs[i].iov_len = slotSize - sizeof(BatchMessageHeader);
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
+    int n;
+    do {
+        // MSG_WAITFORONE: only the first datagram may block, then drain what is already queued.
+        n = recvmmsg(fd, msgs, maxMessages, MSG_WAITFORONE | flags, nullptr);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+        jniThrowErrnoException(env, "recvmmsg", errno);
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        auto hdr = reinterpret_cast<BatchMessageHeader*>(base + static_cast<size_t>(i) * slotSize);
+        fillBatchMessageHeader(hdr, msgs[i]);
+    }
+    return n;
+}
+
 /*
  * JNI registration.
  */
@@ -171,8 +465,14 @@ static const JNINativeMethod gMethods[] = {
         (void*) android_net_util_setupNaSocket },
     { "setupNsSocket", "(Ljava/io/FileDescriptor;)V",
         (void*) android_net_util_setupNsSocket },
+    { "setupNsFloodFilter", "(Ljava/io/FileDescriptor;I[BII)Z",
+        (void*) android_net_util_setupNsFloodFilter },
+    { "clearNsFloodFilter", "(I)V",
+        (void*) android_net_util_clearNsFloodFilter },
     { "setupRaSocket", "(Ljava/io/FileDescriptor;I)V",
         (void*) android_net_util_setupRaSocket },
+    { "recvMessageBatch", "(Ljava/io/FileDescriptor;Ljava/nio/ByteBuffer;III)I",
+        (void*) android_net_util_recvMessageBatch },
 };
 
 int register_android_net_util_TetheringUtils(JNIEnv* env) {
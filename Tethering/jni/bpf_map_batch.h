@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <linux/bpf.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#ifndef BPF_FD_JUST_USE_INT
+#define BPF_FD_JUST_USE_INT
+#endif
+#include "BpfSyscallWrappers.h"
+
+namespace android {
+
+// Number of entries read, written or deleted per batch system call.
+constexpr uint32_t kBpfBatchSize = 256;
+
+// Unlike bpf::bpf(), lets the kernel write back into attr, e.g. the number of elements processed.
+inline int bpfBatch(int cmd, bpf_attr* attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+// Reads all the entries of the map into keys and values. Uses BPF_MAP_LOOKUP_BATCH, which is
+// available from kernel 5.6, and falls back to iterating the keys one by one.
+inline int readAllMapEntries(int fd, size_t keySize, size_t valueSize,
+                             std::vector<uint8_t>* keys, std::vector<uint8_t>* values) {
+    // The batch token is opaque. Hash maps use a bucket index, other maps use a key.
+    std::vector<uint8_t> inBatch(std::max<size_t>(keySize, sizeof(uint64_t)));
+    std::vector<uint8_t> outBatch(inBatch.size());
+    bool first = true;
+    while (true) {
+        const size_t n = keys->size() / keySize;
+        keys->resize((n + kBpfBatchSize) * keySize);
+        values->resize((n + kBpfBatchSize) * valueSize);
+        bpf_attr attr = {};
+        attr.batch.in_batch = first ? 0 : ptr_to_u64(inBatch.data());
+        attr.batch.out_batch = ptr_to_u64(outBatch.data());
+        attr.batch.keys = ptr_to_u64(keys->data() + n * keySize);
+        attr.batch.values = ptr_to_u64(values->data() + n * valueSize);
+        attr.batch.count = kBpfBatchSize;
+        attr.batch.map_fd = static_cast<uint32_t>(fd);
+        const int ret = bpfBatch(BPF_MAP_LOOKUP_BATCH, &attr);
+        const int err = errno;
+        if (ret && err != ENOENT) {
+            // Unsupported by the kernel or the map type, or a hash bucket larger than the batch.
+            keys->clear();
+            values->clear();
+            break;
+        }
+        keys->resize((n + attr.batch.count) * keySize);
+        values->resize((n + attr.batch.count) * valueSize);
+        if (ret) return 0;  // ENOENT: no more entries.
+        inBatch.swap(outBatch);
+        first = false;
+    }
+
+    std::vector<uint8_t> key(keySize), nextKey(keySize), value(valueSize);
+    int ret = bpf::getFirstMapKey(fd, nextKey.data());
+    int err = errno;
+    while (ret == 0) {
+        key.swap(nextKey);
+        ret = bpf::getNextMapKey(fd, key.data(), nextKey.data());
+        err = errno;
+        // The key may have been deleted by the data path since it was returned.
+        if (bpf::findMapEntry(fd, key.data(), value.data())) continue;
+        keys->insert(keys->end(), key.begin(), key.end());
+        values->insert(values->end(), value.begin(), value.end());
+    }
+    errno = err;
+    return err == ENOENT ? 0 : -1;
+}
+
+// Deletes the given keys with BPF_MAP_DELETE_BATCH, or one by one if the kernel does not support
+// it. Keys that no longer exist are ignored.
+inline int deleteMapEntries(int fd, size_t keySize, const std::vector<uint8_t>& keys) {
+    const size_t count = keys.size() / keySize;
+    size_t done = 0;
+    bool batch = true;
+    while (done < count) {
+        if (batch) {
+            bpf_attr attr = {};
+            attr.batch.keys = ptr_to_u64(keys.data() + done * keySize);
+            attr.batch.count = std::min<size_t>(count - done, kBpfBatchSize);
+            attr.batch.map_fd = static_cast<uint32_t>(fd);
+            const uint32_t requested = attr.batch.count;
+            if (bpfBatch(BPF_MAP_DELETE_BATCH, &attr) == 0) {
+                done += requested;
+                continue;
+            }
+            // On ENOENT, count is the number of keys deleted before the missing one. Any other
+            // error may come before anything is processed, and the operations are idempotent, so
+            // just continue one by one from where the batch started.
+            if (errno == ENOENT) {
+                done += std::min(attr.batch.count, requested) + 1;
+                continue;
+            }
+            batch = false;
+        }
+        if (bpf::deleteMapEntry(fd, keys.data() + done * keySize) && errno != ENOENT) return -1;
+        done++;
+    }
+    return 0;
+}
+
+// Writes the given entries with BPF_MAP_UPDATE_BATCH, or one by one if the kernel does not
+// support it.
+inline int writeMapEntries(int fd, size_t keySize, size_t valueSize,
+                           const std::vector<uint8_t>& keys, const std::vector<uint8_t>& values) {
+    const size_t count = keys.size() / keySize;
+    size_t done = 0;
+    bool batch = true;
+    while (done < count) {
+        if (batch) {
+            bpf_attr attr = {};
+            attr.batch.keys = ptr_to_u64(keys.data() + done * keySize);
+            attr.batch.values = ptr_to_u64(values.data() + done * valueSize);
+            attr.batch.count = std::min<size_t>(count - done, kBpfBatchSize);
+            attr.batch.map_fd = static_cast<uint32_t>(fd);
+            attr.batch.elem_flags = BPF_ANY;
+            const uint32_t requested = attr.batch.count;
+            if (bpfBatch(BPF_MAP_UPDATE_BATCH, &attr) == 0) {
+                done += requested;
+                continue;
+            }
+            // Retry one by one, which also reports which entry failed.
+            batch = false;
+        }
+        if (bpf::writeToMapEntry(fd, keys.data() + done * keySize,
+                                 values.data() + done * valueSize, BPF_ANY)) {
+            return -1;
+        }
+        done++;
+    }
+    return 0;
+}
+
+}  // namespace android
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "bpf_map_batch.h"
+
+// Streams the entries of a map through a BPF map element iterator (kernel 5.9+): the kernel runs
+// a small program on every entry, which writes the key then the value to a seq_file, and the
+// result is read with plain read() calls. A whole map is dumped with a handful of reads of up to
+// 8 pages each, instead of one bpf() call per entry or per batch.
+//
+// The program is the equivalent of:
+//
+//   SEC("iter/bpf_map_elem")
+//   int dump(struct bpf_iter__bpf_map_elem* ctx) {
+//       if (!ctx->key || !ctx->value) return 0;
+//       bpf_seq_write(ctx->meta->seq, ctx->key, KEY_SIZE);
+//       bpf_seq_write(ctx->meta->seq, ctx->value, VALUE_SIZE);
+//       return 0;
+//   }
+//
+// It is built here rather than in bpf_progs/ because the BPF loader cannot load tracing programs:
+// they must be attached to the BTF id of bpf_iter_bpf_map_elem, which is looked up in the kernel
+// BTF at run time. The key and value sizes are immediates, so one program is loaded per layout.
+// Loading it needs CAP_BPF and CAP_PERFMON, i.e. root, and is denied by SELinux to the tethering
+// process: only root tools such as tetheroffloadinfo should use it. Other callers must use
+// readAllMapEntries() instead.
+
+namespace android {
+
+namespace bpf_map_iter_internal {
+
+// Kinds of BTF types added after the kernel headers of some branches.
+constexpr uint32_t kBtfKindFloat = 16;
+constexpr uint32_t kBtfKindDeclTag = 17;
+constexpr uint32_t kBtfKindTypeTag = 18;
+constexpr uint32_t kBtfKindEnum64 = 19;
+
+// Returns the size of the data that follows a btf_type of the given kind, or -1 if the kind is
+// unknown.
+inline int btfTypeExtraSize(uint32_t kind, uint32_t vlen) {
+    switch (kind) {
+        case BTF_KIND_INT:
+        case BTF_KIND_VAR:
+        case kBtfKindDeclTag:
+            return 4;
+        case BTF_KIND_ARRAY:
+            return sizeof(btf_array);
+        case BTF_KIND_STRUCT:
+        case BTF_KIND_UNION:
+        case BTF_KIND_DATASEC:
+        case kBtfKindEnum64:
+            return 12 * vlen;
+        case BTF_KIND_ENUM:
+        case BTF_KIND_FUNC_PROTO:
+            return 8 * vlen;
+        case BTF_KIND_PTR:
+        case BTF_KIND_FWD:
+        case BTF_KIND_TYPEDEF:
+        case BTF_KIND_VOLATILE:
+        case BTF_KIND_CONST:
+        case BTF_KIND_RESTRICT:
+        case BTF_KIND_FUNC:
+        case kBtfKindFloat:
+        case kBtfKindTypeTag:
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Returns the id of the function with the given name in the kernel BTF, or -1 with errno set.
+inline int findKernelBtfFunc(const char* name) {
+    const int fd = open("/sys/kernel/btf/vmlinux", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    std::vector<uint8_t> btf;
+    uint8_t buf[65536];
+    ssize_t n;
+    while ((n = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)))) > 0) {
+        btf.insert(btf.end(), buf, buf + n);
+    }
+    const int err = errno;
+    close(fd);
+    if (n == -1) {
+        errno = err;
+        return -1;
+    }
+
+    btf_header hdr;
+    if (btf.size() < sizeof(hdr)) return errno = EBADMSG, -1;
+    memcpy(&hdr, btf.data(), sizeof(hdr));
+    const uint64_t typeStart = uint64_t{hdr.hdr_len} + hdr.type_off;
+    const uint64_t strStart = uint64_t{hdr.hdr_len} + hdr.str_off;
+    if (hdr.magic != BTF_MAGIC || typeStart + hdr.type_len > btf.size() ||
+        strStart + hdr.str_len > btf.size()) {
+        return errno = EBADMSG, -1;
+    }
+    const size_t nameLen = strlen(name) + 1;
+    uint64_t off = typeStart;
+    for (int id = 1; off + sizeof(btf_type) <= typeStart + hdr.type_len; id++) {
+        btf_type t;
+        memcpy(&t, btf.data() + off, sizeof(t));
+        const uint32_t kind = BTF_INFO_KIND(t.info);
+        if (kind == BTF_KIND_FUNC && t.name_off + nameLen <= hdr.str_len &&
+            !memcmp(btf.data() + strStart + t.name_off, name, nameLen)) {
+            return id;
+        }
+        const int extra = btfTypeExtraSize(kind, BTF_INFO_VLEN(t.info));
+        if (extra < 0) return errno = EBADMSG, -1;
+        off += sizeof(t) + extra;
+    }
+    return errno = ENOENT, -1;
+}
+
+constexpr bpf_insn insn(uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm) {
+    return bpf_insn{.code = code, .dst_reg = dst, .src_reg = src, .off = off, .imm = imm};
+}
+
+// Offsets in struct bpf_iter__bpf_map_elem, whose fields are all 8 bytes.
+constexpr int16_t kCtxMeta = 0;
+constexpr int16_t kCtxKey = 16;
+constexpr int16_t kCtxValue = 24;
+// Offset of seq in struct bpf_iter_meta.
+constexpr int16_t kMetaSeq = 0;
+
+inline int loadMapDumpProgram(int btfId, uint32_t keySize, uint32_t valueSize) {
+    constexpr uint8_t kLoad64 = BPF_LDX | BPF_MEM | BPF_DW;
+    constexpr uint8_t kMovImm = BPF_ALU64 | BPF_MOV | BPF_K;
+    constexpr uint8_t kMovReg = BPF_ALU64 | BPF_MOV | BPF_X;
+    constexpr uint8_t kJeqImm = BPF_JMP | BPF_JEQ | BPF_K;
+    const bpf_insn prog[] = {
+            insn(kLoad64, BPF_REG_6, BPF_REG_1, kCtxMeta, 0),
+            insn(kLoad64, BPF_REG_7, BPF_REG_1, kCtxKey, 0),
+            insn(kLoad64, BPF_REG_8, BPF_REG_1, kCtxValue, 0),
+            insn(kJeqImm, BPF_REG_7, 0, 9, 0),  // goto out
+            insn(kJeqImm, BPF_REG_8, 0, 8, 0),  // goto out
+            insn(kLoad64, BPF_REG_1, BPF_REG_6, kMetaSeq, 0),
+            insn(kMovReg, BPF_REG_2, BPF_REG_7, 0, 0),
+            insn(kMovImm, BPF_REG_3, 0, 0, static_cast<int32_t>(keySize)),
+            insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_seq_write),
+            insn(kLoad64, BPF_REG_1, BPF_REG_6, kMetaSeq, 0),
+            insn(kMovReg, BPF_REG_2, BPF_REG_8, 0, 0),
+            insn(kMovImm, BPF_REG_3, 0, 0, static_cast<int32_t>(valueSize)),
+            insn(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_seq_write),
+            // out:
+            insn(kMovImm, BPF_REG_0, 0, 0, 0),
+            insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    // bpf_seq_write() is only available to programs with a GPL compatible license.
+    static const char kLicense[] = "GPL";
+    bpf_attr attr = {};
+    attr.prog_type = BPF_PROG_TYPE_TRACING;
+    attr.insns = ptr_to_u64(prog);
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = ptr_to_u64(kLicense);
+    attr.expected_attach_type = BPF_TRACE_ITER;
+    attr.attach_btf_id = static_cast<uint32_t>(btfId);
+    return bpfBatch(BPF_PROG_LOAD, &attr);
+}
+
+}  // namespace bpf_map_iter_internal
+
+// Returns a file descriptor from which all the entries of the map can be read, each as keySize
+// bytes of key followed by valueSize bytes of value. A read() never splits an entry, and returns
+// 0 at the end of the map. Returns -1 with errno set if the kernel does not support map element
+// iterators or the caller is not allowed to load tracing programs.
+inline int openMapDump(int mapFd, uint32_t keySize, uint32_t valueSize) {
+    using namespace bpf_map_iter_internal;
+    static std::atomic<int> btfId = 0;
+    if (btfId == 0) {
+        const int id = findKernelBtfFunc("bpf_iter_bpf_map_elem");
+        btfId = (id == -1) ? -errno : id;
+    }
+    if (btfId < 0) return errno = -btfId, -1;
+
+    // Verifying the program costs more than reading a few thousand entries, so each program is
+    // loaded once and kept for the lifetime of the process.
+    static std::mutex lock;
+    static std::map<std::pair<uint32_t, uint32_t>, int> programs;
+    int progFd;
+    {
+        std::lock_guard guard(lock);
+        const auto it = programs.find({keySize, valueSize});
+        if (it != programs.end()) {
+            progFd = it->second;
+        } else {
+            progFd = loadMapDumpProgram(btfId, keySize, valueSize);
+            if (progFd == -1) return -1;
+            programs[{keySize, valueSize}] = progFd;
+        }
+    }
+    bpf_iter_link_info linkInfo = {};
+    linkInfo.map.map_fd = static_cast<uint32_t>(mapFd);
+    bpf_attr attr = {};
+    attr.link_create.prog_fd = static_cast<uint32_t>(progFd);
+    attr.link_create.attach_type = BPF_TRACE_ITER;
+    attr.link_create.iter_info = ptr_to_u64(&linkInfo);
+    attr.link_create.iter_info_len = sizeof(linkInfo);
+    const int linkFd = bpfBatch(BPF_LINK_CREATE, &attr);
+    if (linkFd == -1) return -1;
+
+    attr = {};
+    attr.iter_create.link_fd = static_cast<uint32_t>(linkFd);
+    const int iterFd = bpfBatch(BPF_ITER_CREATE, &attr);
+    const int err = errno;
+    // The iterator holds its own references to the link, the program and the map.
+    close(linkFd);
+    errno = err;
+    return iterFd;
+}
+
+// Like readAllMapEntries(), but reads the entries from a map element iterator.
+inline int streamAllMapEntries(int fd, size_t keySize, size_t valueSize,
+                               std::vector<uint8_t>* keys, std::vector<uint8_t>* values) {
+    const int iterFd = openMapDump(fd, keySize, valueSize);
+    if (iterFd == -1) return -1;
+    const size_t entrySize = keySize + valueSize;
+    // The kernel fills a seq_file buffer of 8 pages and copies out as much of it as fits. A buffer
+    // at least as large always receives whole entries.
+    std::vector<uint8_t> buf(static_cast<size_t>(getpagesize()) * 8);
+    ssize_t n;
+    while ((n = TEMP_FAILURE_RETRY(read(iterFd, buf.data(), buf.size()))) > 0) {
+        if (n % entrySize) {
+            n = -1;
+            errno = EBADMSG;
+            break;
+        }
+        for (const uint8_t* p = buf.data(); p < buf.data() + n; p += entrySize) {
+            keys->insert(keys->end(), p, p + keySize);
+            values->insert(values->end(), p + keySize, p + entrySize);
+        }
+    }
+    const int err = errno;
+    close(iterFd);
+    if (n == -1) {
+        keys->clear();
+        values->clear();
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// Reads all the entries of the map with a map element iterator if possible, or with
+// readAllMapEntries() otherwise. Once the iterator has failed because of the kernel or the
+// privileges of the process, later calls go straight to readAllMapEntries().
+inline int dumpAllMapEntries(int fd, size_t keySize, size_t valueSize,
+                             std::vector<uint8_t>* keys, std::vector<uint8_t>* values) {
+    static std::atomic<bool> iteratorUnavailable = false;
+    if (!iteratorUnavailable) {
+        if (streamAllMapEntries(fd, keySize, valueSize, keys, values) == 0) return 0;
+        if (errno == EPERM || errno == EACCES || errno == EINVAL || errno == ENOENT ||
+            errno == ENOSYS) {
+            iteratorUnavailable = true;
+        }
+    }
+    return readAllMapEntries(fd, keySize, valueSize, keys, values);
+}
+
+}  // namespace android
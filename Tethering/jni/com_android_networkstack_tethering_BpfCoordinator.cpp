@@ -14,10 +14,16 @@
  * limitations under the License.
  */
 
+#include <arpa/inet.h>
+#include <errno.h>
 #include <jni.h>
 #include <nativehelper/JNIHelp.h>
 
+#define BPF_FD_JUST_USE_INT
+#include "BpfSyscallWrappers.h"
 #include "bpf_tethering.h"
+#include "conntrack_timeout.h"
+#include "offload_snapshot.h"
 
 namespace android {
 
@@ -30,12 +36,39 @@ static jobjectArray getBpfCounterNames(JNIEnv *env) {
     return ret;
 }
 
+// Returns the number of flows refreshed. See refreshActiveConntrackTimeouts.
+static jint refreshConntrackTimeouts(JNIEnv* env, jclass clazz, jlong maxIdleNs,
+                                     jint tcpTimeoutSec, jint udpTimeoutSec) {
+    const char* failedCall = nullptr;
+    const int ret = refreshActiveConntrackTimeouts(maxIdleNs, tcpTimeoutSec, udpTimeoutSec,
+                                                   &failedCall);
+    if (ret == -1) {
+        jniThrowErrnoException(env, failedCall, errno);
+        return 0;
+    }
+    return ret;
+}
+
+// Writes a binary snapshot of all the tethering maps. See offload_snapshot_format.h.
+static void writeSnapshot(JNIEnv* env, jclass clazz, jobject javaFd) {
+    const int fd = jniGetFDFromFileDescriptor(env, javaFd);
+    if (fd == -1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid file descriptor");
+        return;
+    }
+    if (writeOffloadSnapshot(fd, false /* useMapIterators */)) {
+        jniThrowErrnoException(env, "writeOffloadSnapshot", errno);
+    }
+}
+
 /*
  * JNI registration.
  */
 static const JNINativeMethod gMethods[] = {
     /* name, signature, funcPtr */
     { "getBpfCounterNames", "()[Ljava/lang/String;", (void*) getBpfCounterNames },
+    { "refreshConntrackTimeouts", "(JII)I", (void*) refreshConntrackTimeouts },
+    { "writeOffloadSnapshot", "(Ljava/io/FileDescriptor;)V", (void*) writeSnapshot },
 };
 
 int register_com_android_networkstack_tethering_BpfCoordinator(JNIEnv* env) {
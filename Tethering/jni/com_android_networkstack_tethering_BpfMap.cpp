@@ -14,16 +14,21 @@
  * limitations under the License.
  */
 
+#include <android/trace.h>
 #include <errno.h>
 #include <jni.h>
 #include <nativehelper/JNIHelp.h>
 #include <nativehelper/ScopedLocalRef.h>
 
+#include <string_view>
+#include <unordered_map>
+
 #include "nativehelper/scoped_primitive_array.h"
 #include "nativehelper/scoped_utf_chars.h"
 
 #define BPF_FD_JUST_USE_INT
 #include "BpfSyscallWrappers.h"
+#include "bpf_map_batch.h"
 
 namespace android {
 
@@ -69,7 +74,9 @@ static jint com_android_networkstack_tethering_BpfMap_bpfFdGet(JNIEnv *env, jobj
         jstring path, jint mode) {
     ScopedUtfChars pathname(env, path);
 
+    ATrace_beginSection("bpfFdGet");
     jint fd = bpf::bpfFdGet(pathname.c_str(), static_cast<unsigned>(mode));
+    ATrace_endSection();
 
     return fd;
 }
@@ -79,10 +86,13 @@ static void com_android_networkstack_tethering_BpfMap_writeToMapEntry(JNIEnv *en
     ScopedByteArrayRO keyRO(env, key);
     ScopedByteArrayRO valueRO(env, value);
 
+    ATrace_beginSection("writeToMapEntry");
     int ret = bpf::writeToMapEntry(static_cast<int>(fd), keyRO.get(), valueRO.get(),
             static_cast<int>(flags));
+    const int err = errno;
+    ATrace_endSection();
 
-    if (ret) throwErrnoException(env, "writeToMapEntry", errno);
+    if (ret) throwErrnoException(env, "writeToMapEntry", err);
 }
 
 static jboolean throwIfNotEnoent(JNIEnv *env, const char* functionName, int ret, int err) {
@@ -134,6 +144,71 @@ static jboolean com_android_networkstack_tethering_BpfMap_findMapEntry(JNIEnv *e
     return throwIfNotEnoent(env, "findMapEntry", ret, errno);
 }
 
+// Makes the content of the map equal to the given entries, which are passed as the concatenation
+// of their keys and of their values. Only the entries that differ are deleted or written. Returns
+// the number of entries that were deleted or written.
+static jint com_android_networkstack_tethering_BpfMap_reconcile(JNIEnv *env, jobject clazz,
+        jint fd, jint keySize, jint valueSize, jbyteArray wantedKeys, jbyteArray wantedValues) {
+    ScopedByteArrayRO keysRO(env, wantedKeys);
+    ScopedByteArrayRO valuesRO(env, wantedValues);
+    if (keySize <= 0 || valueSize <= 0 || keysRO.size() % keySize ||
+        keysRO.size() / keySize != valuesRO.size() / valueSize) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                "Invalid entries: %zu bytes of keys, %zu bytes of values", keysRO.size(),
+                valuesRO.size());
+        return 0;
+    }
+    const char* keysBase = reinterpret_cast<const char*>(keysRO.get());
+    const char* valuesBase = reinterpret_cast<const char*>(valuesRO.get());
+
+    std::vector<uint8_t> liveKeys, liveValues;
+    if (readAllMapEntries(fd, keySize, valueSize, &liveKeys, &liveValues)) {
+        throwErrnoException(env, "reconcile", errno);
+        return 0;
+    }
+
+    std::unordered_map<std::string_view, std::string_view> wanted;
+    const size_t wantedCount = keysRO.size() / keySize;
+    wanted.reserve(wantedCount);
+    for (size_t i = 0; i < wantedCount; i++) {
+        wanted.emplace(std::string_view(keysBase + i * keySize, keySize),
+                       std::string_view(valuesBase + i * valueSize, valueSize));
+    }
+
+    std::vector<uint8_t> toDelete;
+    const char* liveKeysBase = reinterpret_cast<const char*>(liveKeys.data());
+    const char* liveValuesBase = reinterpret_cast<const char*>(liveValues.data());
+    for (size_t i = 0; i < liveKeys.size() / keySize; i++) {
+        const std::string_view key(liveKeysBase + i * keySize, keySize);
+        const auto it = wanted.find(key);
+        if (it == wanted.end()) {
+            toDelete.insert(toDelete.end(), key.begin(), key.end());
+        } else if (it->second == std::string_view(liveValuesBase + i * valueSize, valueSize)) {
+            // Already up to date.
+            wanted.erase(it);
+        }
+    }
+
+    // What is left in wanted is either missing or stale in the map.
+    std::vector<uint8_t> toWriteKeys, toWriteValues;
+    toWriteKeys.reserve(wanted.size() * keySize);
+    toWriteValues.reserve(wanted.size() * valueSize);
+    for (const auto& [key, value] : wanted) {
+        toWriteKeys.insert(toWriteKeys.end(), key.begin(), key.end());
+        toWriteValues.insert(toWriteValues.end(), value.begin(), value.end());
+    }
+
+    if (deleteMapEntries(fd, keySize, toDelete)) {
+        throwErrnoException(env, "reconcile delete", errno);
+        return 0;
+    }
+    if (writeMapEntries(fd, keySize, valueSize, toWriteKeys, toWriteValues)) {
+        throwErrnoException(env, "reconcile write", errno);
+        return 0;
+    }
+    return (toDelete.size() / keySize) + wanted.size();
+}
+
 /*
  * JNI registration.
  */
@@ -151,6 +226,8 @@ static const JNINativeMethod gMethods[] = {
         (void*) com_android_networkstack_tethering_BpfMap_getNextMapKey },
     { "findMapEntry", "(I[B[B)Z",
         (void*) com_android_networkstack_tethering_BpfMap_findMapEntry },
+    { "reconcile", "(III[B[B)I",
+        (void*) com_android_networkstack_tethering_BpfMap_reconcile },
 
 };
 
@@ -14,126 +14,27 @@
  * limitations under the License.
  */
 
+#include <android/trace.h>
 #include <arpa/inet.h>
 #include <jni.h>
 #include <linux/if_arp.h>
 #include <linux/if_ether.h>
-#include <linux/netlink.h>
-#include <linux/pkt_cls.h>
-#include <linux/pkt_sched.h>
-#include <linux/rtnetlink.h>
 #include <nativehelper/JNIHelp.h>
 #include <net/if.h>
 #include <stdio.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 
 // TODO: use unique_fd.
 #define BPF_FD_JUST_USE_INT
 #include "BpfSyscallWrappers.h"
 #include "bpf_tethering.h"
+#include "dns_steer_state.h"
+#include "nativehelper/scoped_primitive_array.h"
 #include "nativehelper/scoped_utf_chars.h"
-
-// The maximum length of TCA_BPF_NAME. Sync from net/sched/cls_bpf.c.
-#define CLS_BPF_NAME_LEN 256
+#include "tc_filter.h"
 
 namespace android {
-// Sync from system/netd/server/NetlinkCommands.h
-const uint16_t NETLINK_REQUEST_FLAGS = NLM_F_REQUEST | NLM_F_ACK;
-const sockaddr_nl KERNEL_NLADDR = {AF_NETLINK, 0, 0, 0};
-
-// TODO: move to frameworks/libs/net/common/native for sharing with
-// system/netd/server/OffloadUtils.{c, h}.
-static void sendAndProcessNetlinkResponse(JNIEnv* env, const void* req, int len) {
-    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);  // TODO: use unique_fd
-    if (fd == -1) {
-        jniThrowExceptionFmt(env, "java/io/IOException",
-                             "socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE): %s",
-                             strerror(errno));
-        return;
-    }
-
-    static constexpr int on = 1;
-    if (setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &on, sizeof(on))) {
-        jniThrowExceptionFmt(env, "java/io/IOException",
-                             "setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, %d)", on);
-        close(fd);
-        return;
-    }
-
-    // this is needed to get valid strace netlink parsing, it allocates the pid
-    if (bind(fd, (const struct sockaddr*)&KERNEL_NLADDR, sizeof(KERNEL_NLADDR))) {
-        jniThrowExceptionFmt(env, "java/io/IOException", "bind(fd, {AF_NETLINK, 0, 0}): %s",
-                             strerror(errno));
-        close(fd);
-        return;
-    }
-
-    // we do not want to receive messages from anyone besides the kernel
-    if (connect(fd, (const struct sockaddr*)&KERNEL_NLADDR, sizeof(KERNEL_NLADDR))) {
-        jniThrowExceptionFmt(env, "java/io/IOException", "connect(fd, {AF_NETLINK, 0, 0}): %s",
-                             strerror(errno));
-        close(fd);
-        return;
-    }
-
-    int rv = send(fd, req, len, 0);
-
-    if (rv == -1) {
-        jniThrowExceptionFmt(env, "java/io/IOException", "send(fd, req, len, 0): %s",
-                             strerror(errno));
-        close(fd);
-        return;
-    }
-
-    if (rv != len) {
-        jniThrowExceptionFmt(env, "java/io/IOException", "send(fd, req, len, 0): %s",
-                             strerror(EMSGSIZE));
-        close(fd);
-        return;
-    }
-
-    struct {
-        nlmsghdr h;
-        nlmsgerr e;
-        char buf[256];
-    } resp = {};
-
-    rv = recv(fd, &resp, sizeof(resp), MSG_TRUNC);
-
-    if (rv == -1) {
-        jniThrowExceptionFmt(env, "java/io/IOException", "recv() failed: %s", strerror(errno));
-        close(fd);
-        return;
-    }
-
-    if (rv < (int)NLMSG_SPACE(sizeof(struct nlmsgerr))) {
-        jniThrowExceptionFmt(env, "java/io/IOException", "recv() returned short packet: %d", rv);
-        close(fd);
-        return;
-    }
-
-    if (resp.h.nlmsg_len != (unsigned)rv) {
-        jniThrowExceptionFmt(env, "java/io/IOException",
-                             "recv() returned invalid header length: %d != %d", resp.h.nlmsg_len,
-                             rv);
-        close(fd);
-        return;
-    }
-
-    if (resp.h.nlmsg_type != NLMSG_ERROR) {
-        jniThrowExceptionFmt(env, "java/io/IOException",
-                             "recv() did not return NLMSG_ERROR message: %d", resp.h.nlmsg_type);
-        close(fd);
-        return;
-    }
-
-    if (resp.e.error) {  // returns 0 on success
-        jniThrowExceptionFmt(env, "java/io/IOException", "NLMSG_ERROR message return error: %s",
-                             strerror(-resp.e.error));
-    }
-    close(fd);
-    return;
-}
 
 static int hardwareAddressType(const char* interface) {
     int fd = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
@@ -186,6 +87,40 @@ static jboolean com_android_networkstack_tethering_BpfUtils_isEthernet(JNIEnv* e
     }
 }
 
+// The placeholder programs of offload.c only return TC_ACT_OK: r0 = 0; exit.
+static constexpr uint32_t kStubProgramInsns = 2;
+
+// Returns whether the pinned program is one of the placeholders that forward nothing. Kernels too
+// old to report program information (4.9) only ever load the placeholders. Without CAP_SYS_ADMIN
+// the kernel hides the instruction count, so fall back to the maps used: the placeholders use
+// none. If neither is available the program is assumed to be real.
+static jboolean com_android_networkstack_tethering_BpfUtils_isStubProgram(JNIEnv* env,
+                                                                          jobject clazz,
+                                                                          jstring bpfProgPath) {
+    ScopedUtfChars pathname(env, bpfProgPath);
+
+    const int bpfFd = bpf::retrieveProgram(pathname.c_str());
+    if (bpfFd == -1) return true;  // Cannot be attached, so there is no offload either.
+
+    bpf_prog_info info = {};
+    bpf_attr attr = {};
+    attr.info.bpf_fd = static_cast<uint32_t>(bpfFd);
+    attr.info.info_len = sizeof(info);
+    attr.info.info = ptr_to_u64(&info);
+    const int ret = syscall(__NR_bpf, BPF_OBJ_GET_INFO_BY_FD, &attr, sizeof(attr));
+    close(bpfFd);
+    if (ret) return true;
+
+    if (info.xlated_prog_len) {
+        return info.xlated_prog_len <= kStubProgramInsns * sizeof(bpf_insn);
+    }
+    // The kernel writes back how much of the struct it knows about.
+    if (attr.info.info_len >= offsetof(bpf_prog_info, map_ids) + sizeof(info.map_ids)) {
+        return info.nr_map_ids == 0;
+    }
+    return false;
+}
+
 // tc filter add dev .. in/egress prio 1 protocol ipv6/ip bpf object-pinned /sys/fs/bpf/...
 // direct-action
 static void com_android_networkstack_tethering_BpfUtils_tcFilterAddDevBpf(
@@ -193,110 +128,28 @@ static void com_android_networkstack_tethering_BpfUtils_tcFilterAddDevBpf(
         jstring bpfProgPath) {
     ScopedUtfChars pathname(env, bpfProgPath);
 
+    ATrace_beginSection("retrieveProgram");
     const int bpfFd = bpf::retrieveProgram(pathname.c_str());
+    const int err = errno;
+    ATrace_endSection();
     if (bpfFd == -1) {
         jniThrowExceptionFmt(env, "java/io/IOException", "retrieveProgram failed %s",
-                             strerror(errno));
+                             strerror(err));
         return;
     }
 
-    struct {
-        nlmsghdr n;
-        tcmsg t;
-        struct {
-            nlattr attr;
-            // The maximum classifier name length is defined as IFNAMSIZ.
-            // See tcf_proto_ops in include/net/sch_generic.h.
-            char str[NLMSG_ALIGN(IFNAMSIZ)];
-        } kind;
-        struct {
-            nlattr attr;
-            struct {
-                nlattr attr;
-                __u32 u32;
-            } fd;
-            struct {
-                nlattr attr;
-                char str[NLMSG_ALIGN(CLS_BPF_NAME_LEN)];
-            } name;
-            struct {
-                nlattr attr;
-                __u32 u32;
-            } flags;
-        } options;
-    } req = {
-            .n =
-                    {
-                            .nlmsg_len = sizeof(req),
-                            .nlmsg_type = RTM_NEWTFILTER,
-                            .nlmsg_flags = NETLINK_REQUEST_FLAGS | NLM_F_EXCL | NLM_F_CREATE,
-                    },
-            .t =
-                    {
-                            .tcm_family = AF_UNSPEC,
-                            .tcm_ifindex = ifIndex,
-                            .tcm_handle = TC_H_UNSPEC,
-                            .tcm_parent = TC_H_MAKE(TC_H_CLSACT,
-                                                    ingress ? TC_H_MIN_INGRESS : TC_H_MIN_EGRESS),
-                            .tcm_info = static_cast<__u32>((static_cast<uint16_t>(prio) << 16) |
-                                                           htons(static_cast<uint16_t>(proto))),
-                    },
-            .kind =
-                    {
-                            .attr =
-                                    {
-                                            .nla_len = sizeof(req.kind),
-                                            .nla_type = TCA_KIND,
-                                    },
-                            // Classifier name. See cls_bpf_ops in net/sched/cls_bpf.c.
-                            .str = "bpf",
-                    },
-            .options =
-                    {
-                            .attr =
-                                    {
-                                            .nla_len = sizeof(req.options),
-                                            .nla_type = NLA_F_NESTED | TCA_OPTIONS,
-                                    },
-                            .fd =
-                                    {
-                                            .attr =
-                                                    {
-                                                            .nla_len = sizeof(req.options.fd),
-                                                            .nla_type = TCA_BPF_FD,
-                                                    },
-                                            .u32 = static_cast<__u32>(bpfFd),
-                                    },
-                            .name =
-                                    {
-                                            .attr =
-                                                    {
-                                                            .nla_len = sizeof(req.options.name),
-                                                            .nla_type = TCA_BPF_NAME,
-                                                    },
-                                            // Visible via 'tc filter show', but
-                                            // is overwritten by strncpy below
-                                            .str = "placeholder",
-                                    },
-                            .flags =
-                                    {
-                                            .attr =
-                                                    {
-                                                            .nla_len = sizeof(req.options.flags),
-                                                            .nla_type = TCA_BPF_FLAGS,
-                                                    },
-                                            .u32 = TCA_BPF_FLAG_ACT_DIRECT,
-                                    },
-                    },
-    };
-
-    snprintf(req.options.name.str, sizeof(req.options.name.str), "%s:[*fsobj]",
-            basename(pathname.c_str()));
-
-    // The exception may be thrown from sendAndProcessNetlinkResponse. Close the file descriptor of
-    // BPF program before returning the function in any case.
-    sendAndProcessNetlinkResponse(env, &req, sizeof(req));
+    char name[CLS_BPF_NAME_LEN];
+    snprintf(name, sizeof(name), "%s:[*fsobj]", basename(pathname.c_str()));
+
+    ATrace_beginSection("RTM_NEWTFILTER");
+    const int ret = tcFilterAddDevBpf(ifIndex, ingress, static_cast<uint16_t>(prio),
+                                      static_cast<uint16_t>(proto), bpfFd, name);
+    ATrace_endSection();
     close(bpfFd);
+    if (ret) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "RTM_NEWTFILTER failed: %s",
+                             strerror(-ret));
+    }
 }
 
 // tc filter del dev .. in/egress prio .. protocol ..
@@ -304,29 +157,98 @@ static void com_android_networkstack_tethering_BpfUtils_tcFilterDelDev(JNIEnv* e
                                                                        jint ifIndex,
                                                                        jboolean ingress,
                                                                        jshort prio, jshort proto) {
-    const struct {
-        nlmsghdr n;
-        tcmsg t;
-    } req = {
-            .n =
-                    {
-                            .nlmsg_len = sizeof(req),
-                            .nlmsg_type = RTM_DELTFILTER,
-                            .nlmsg_flags = NETLINK_REQUEST_FLAGS,
-                    },
-            .t =
-                    {
-                            .tcm_family = AF_UNSPEC,
-                            .tcm_ifindex = ifIndex,
-                            .tcm_handle = TC_H_UNSPEC,
-                            .tcm_parent = TC_H_MAKE(TC_H_CLSACT,
-                                                    ingress ? TC_H_MIN_INGRESS : TC_H_MIN_EGRESS),
-                            .tcm_info = static_cast<__u32>((static_cast<uint16_t>(prio) << 16) |
-                                                           htons(static_cast<uint16_t>(proto))),
-                    },
-    };
-
-    sendAndProcessNetlinkResponse(env, &req, sizeof(req));
+    const int ret = tcFilterDelDev(ifIndex, ingress, static_cast<uint16_t>(prio),
+                                   static_cast<uint16_t>(proto));
+    if (ret) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "RTM_DELTFILTER failed: %s",
+                             strerror(-ret));
+    }
+}
+
+// Answer neighbor solicitations for offloaded clients on the given upstream, advertising mac.
+static void com_android_networkstack_tethering_BpfUtils_ndpProxyAdd(JNIEnv* env, jobject clazz,
+                                                                    jint ifIndex,
+                                                                    jbyteArray mac) {
+    ScopedByteArrayRO macBytes(env, mac);
+    if (macBytes.size() != ETH_ALEN) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid mac address length %zu",
+                             macBytes.size());
+        return;
+    }
+
+    const int mapFd = bpf::mapRetrieveRW(TETHER_NDP_PROXY_MAP_PATH);
+    if (mapFd == -1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "mapRetrieveRW failed %s",
+                             strerror(errno));
+        return;
+    }
+
+    const TetherNdpProxyKey key = static_cast<uint32_t>(ifIndex);
+    TetherNdpProxyValue value = {};
+    memcpy(value.mac, macBytes.get(), ETH_ALEN);
+    if (bpf::writeToMapEntry(mapFd, &key, &value, BPF_ANY)) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "writeToMapEntry failed %s",
+                             strerror(errno));
+    }
+    close(mapFd);
+}
+
+static void com_android_networkstack_tethering_BpfUtils_ndpProxyRemove(JNIEnv* env, jobject clazz,
+                                                                       jint ifIndex) {
+    // The map does not exist if the ndp proxy program could not be loaded.
+    const int mapFd = bpf::mapRetrieveRW(TETHER_NDP_PROXY_MAP_PATH);
+    if (mapFd == -1) return;
+
+    const TetherNdpProxyKey key = static_cast<uint32_t>(ifIndex);
+    bpf::deleteMapEntry(mapFd, &key);
+    close(mapFd);
+}
+
+// Steer the DNS queries of the clients of the given downstream to the resolver at proxy:port.
+static void com_android_networkstack_tethering_BpfUtils_dnsSteerAdd(JNIEnv* env, jobject clazz,
+                                                                    jint ifIndex,
+                                                                    jbyteArray proxy,
+                                                                    jshort port) {
+    ScopedByteArrayRO proxyBytes(env, proxy);
+    if (proxyBytes.size() != sizeof(struct in_addr)) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Invalid IPv4 address length %zu",
+                             proxyBytes.size());
+        return;
+    }
+
+    const int mapFd = bpf::mapRetrieveRW(TETHER_DNS_STEER_CONFIG_MAP_PATH);
+    if (mapFd == -1) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "mapRetrieveRW failed %s",
+                             strerror(errno));
+        return;
+    }
+
+    const TetherDnsSteerConfigKey key = static_cast<uint32_t>(ifIndex);
+    TetherDnsSteerConfigValue value = {};
+    memcpy(&value.proxy4, proxyBytes.get(), sizeof(value.proxy4));
+    value.proxyPort = htons(static_cast<uint16_t>(port));
+    if (bpf::writeToMapEntry(mapFd, &key, &value, BPF_ANY)) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "writeToMapEntry failed %s",
+                             strerror(errno));
+    }
+    close(mapFd);
+}
+
+static void com_android_networkstack_tethering_BpfUtils_dnsSteerRemove(JNIEnv* env, jobject clazz,
+                                                                       jint ifIndex) {
+    // The maps do not exist if the steering program could not be loaded.
+    const int mapFd = bpf::mapRetrieveRW(TETHER_DNS_STEER_CONFIG_MAP_PATH);
+    if (mapFd == -1) return;
+
+    const TetherDnsSteerConfigKey key = static_cast<uint32_t>(ifIndex);
+    bpf::deleteMapEntry(mapFd, &key);
+    close(mapFd);
+
+    const int stateMapFd = bpf::mapRetrieveRW(TETHER_DNS_STEER_STATE_MAP_PATH);
+    if (stateMapFd == -1) return;
+    // Entries that cannot be deleted are left to expire from the LRU map.
+    clearDnsSteerState(stateMapFd, static_cast<uint32_t>(ifIndex));
+    close(stateMapFd);
 }
 
 /*
@@ -336,10 +258,20 @@ static const JNINativeMethod gMethods[] = {
         /* name, signature, funcPtr */
         {"isEthernet", "(Ljava/lang/String;)Z",
          (void*)com_android_networkstack_tethering_BpfUtils_isEthernet},
+        {"isStubProgram", "(Ljava/lang/String;)Z",
+         (void*)com_android_networkstack_tethering_BpfUtils_isStubProgram},
         {"tcFilterAddDevBpf", "(IZSSLjava/lang/String;)V",
          (void*)com_android_networkstack_tethering_BpfUtils_tcFilterAddDevBpf},
         {"tcFilterDelDev", "(IZSS)V",
          (void*)com_android_networkstack_tethering_BpfUtils_tcFilterDelDev},
+        {"ndpProxyAdd", "(I[B)V",
+         (void*)com_android_networkstack_tethering_BpfUtils_ndpProxyAdd},
+        {"ndpProxyRemove", "(I)V",
+         (void*)com_android_networkstack_tethering_BpfUtils_ndpProxyRemove},
+        {"dnsSteerAdd", "(I[BS)V",
+         (void*)com_android_networkstack_tethering_BpfUtils_dnsSteerAdd},
+        {"dnsSteerRemove", "(I)V",
+         (void*)com_android_networkstack_tethering_BpfUtils_dnsSteerRemove},
 };
 
 int register_com_android_networkstack_tethering_BpfUtils(JNIEnv* env) {
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <jni.h>
+#include <linux/filter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netlink.h>
+#include <nativehelper/JNIHelp.h>
+#include <nativehelper/scoped_primitive_array.h>
+#include <netinet/in.h>
+#include <netjniutils/netjniutils.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "conntrack_event_parser.h"
+
+namespace android {
+
+static const int kMaxBatchMessages = 64;
+
+// Opens a non-blocking NETLINK_NETFILTER socket subscribed to the given conntrack groups. If
+// ipv4Only is set, a socket filter drops events for other families before they are queued, so
+// they neither wake up the reader nor use up receive buffer space.
+static jobject com_android_networkstack_tethering_ConntrackEventReader_createSocket(
+        JNIEnv* env, jclass clazz, jint groups, jint rcvbufBytes, jboolean ipv4Only) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (fd == -1) {
+        jniThrowErrnoException(env, "socket(NETLINK_NETFILTER)", errno);
+        return nullptr;
+    }
+
+    // SO_RCVBUFFORCE ignores rmem_max, but needs CAP_NET_ADMIN.
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbufBytes, sizeof(rcvbufBytes)) &&
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbufBytes, sizeof(rcvbufBytes))) {
+        jniThrowErrnoException(env, "setsockopt(SO_RCVBUF)", errno);
+        close(fd);
+        return nullptr;
+    }
+
+    if (ipv4Only) {
+        sock_filter code[] = {
+            BPF_STMT(BPF_LD  | BPF_B   | BPF_ABS,
+                     NLMSG_HDRLEN + offsetof(nfgenmsg, nfgen_family)),
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,    AF_INET, 0, 1),
+            BPF_STMT(BPF_RET | BPF_K,              0xFFFFFFFF),
+            BPF_STMT(BPF_RET | BPF_K,              0),
+        };
+        const sock_fprog filter = {
+            sizeof(code) / sizeof(code[0]),
+            code,
+        };
+        if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter))) {
+            jniThrowErrnoException(env, "setsockopt(SO_ATTACH_FILTER)", errno);
+            close(fd);
+            return nullptr;
+        }
+    }
+
+    const sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_groups = static_cast<uint32_t>(groups),
+    };
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))) {
+        jniThrowErrnoException(env, "bind(NETLINK_NETFILTER)", errno);
+        close(fd);
+        return nullptr;
+    }
+
+    return jniCreateFileDescriptor(env, fd);
+}
+
+// Drains queued conntrack messages with recvmmsg() into recvBuffer, which is split into slots of
+// slotSize bytes, and decodes the ones that pass shouldReportConntrackEvent() into records. Loops
+// until at least one record was decoded, and throws EAGAIN when the socket is drained, or ENOBUFS
+// when events were lost to an overrun.
+static jint com_android_networkstack_tethering_ConntrackEventReader_readEvents(
+        JNIEnv* env, jclass clazz, jobject javaFd, jobject recvBuffer, jint slotSize,
+        jobject recordBuffer, jint maxRecords, jint newStatusMask) {
+    uint8_t* recvBase = static_cast<uint8_t*>(env->GetDirectBufferAddress(recvBuffer));
+    const jlong recvCapacity = env->GetDirectBufferCapacity(recvBuffer);
+    auto records = static_cast<ConntrackEventRecord*>(env->GetDirectBufferAddress(recordBuffer));
+    const jlong recordCapacity = env->GetDirectBufferCapacity(recordBuffer);
+    if (recvBase == nullptr || records == nullptr || slotSize < NLMSG_HDRLEN || maxRecords <= 0 ||
+        static_cast<jlong>(maxRecords) * sizeof(ConntrackEventRecord) > recordCapacity ||
+        recvCapacity < slotSize) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                             "Invalid buffers for %d records of %d bytes", maxRecords, slotSize);
+        return -1;
+    }
+
+    // Conntrack events are sent one per datagram, so receiving at most maxRecords datagrams leaves
+    // room for every event.
+    const int slots = std::min<jlong>({kMaxBatchMessages, maxRecords, recvCapacity / slotSize});
+    mmsghdr msgs[kMaxBatchMessages] = {};
+    iovec iovs[kMaxBatchMessages];
+    for (int i = 0; i < slots; i++) {
+        iovs[i].iov_base = recvBase + static_cast<size_t>(i) * slotSize;
+        iovs[i].iov_len = slotSize;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    const int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
+    int count = 0;
+    while (count == 0) {
+        const int n = recvmmsg(fd, msgs, slots, MSG_DONTWAIT, nullptr);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            jniThrowErrnoException(env, "recvmmsg", errno);
+            return -1;
+        }
+
+        for (int i = 0; i < n && count < maxRecords; i++) {
+            // A truncated message cannot be parsed safely, and is counted as lost.
+            if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+
+            const nlmsghdr* nlh = static_cast<const nlmsghdr*>(iovs[i].iov_base);
+            int remaining = msgs[i].msg_len;
+            for (; NLMSG_OK(nlh, remaining) && count < maxRecords;
+                 nlh = NLMSG_NEXT(nlh, remaining)) {
+                if (parseConntrackMessage(nlh, &records[count]) &&
+                    shouldReportConntrackEvent(records[count], newStatusMask)) {
+                    count++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+// Opens a non-blocking NETLINK_NETFILTER socket and requests a dump of the IPv4 conntrack table.
+// The replies are read with readDump() whenever the socket becomes readable.
+static jobject com_android_networkstack_tethering_ConntrackEventReader_startDump(JNIEnv* env,
+                                                                                 jclass clazz) {
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (fd == -1) {
+        jniThrowErrnoException(env, "socket(NETLINK_NETFILTER)", errno);
+        return nullptr;
+    }
+
+    struct {
+        nlmsghdr nlh;
+        nfgenmsg nfg;
+    } req = {
+        .nlh = {
+            .nlmsg_len = sizeof(req),
+            .nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET,
+            .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP,
+            .nlmsg_seq = 1,
+        },
+        .nfg = {
+            .nfgen_family = AF_INET,
+            .version = NFNETLINK_V0,
+        },
+    };
+    const sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    if (sendto(fd, &req, sizeof(req), 0, reinterpret_cast<const sockaddr*>(&kernel),
+               sizeof(kernel)) != sizeof(req)) {
+        jniThrowErrnoException(env, "sendto(IPCTNL_MSG_CT_GET)", errno);
+        close(fd);
+        return nullptr;
+    }
+
+    return jniCreateFileDescriptor(env, fd);
+}
+
+// Reads one datagram of the dump requested by startDump() and decodes the connections that
+// originate from one of clientAddrs, a concatenation of IPv4 addresses, and pass
+// shouldReportConntrackEvent(), into records. Returns the number of records, which may be 0 if no
+// connection in the datagram matched, or -1 once the dump is complete. Throws EAGAIN if the next
+// datagram has not arrived yet.
+static jint com_android_networkstack_tethering_ConntrackEventReader_readDump(
+        JNIEnv* env, jclass clazz, jobject javaFd, jobject recvBuffer, jobject recordBuffer,
+        jint maxRecords, jbyteArray clientAddrs, jint newStatusMask) {
+    uint8_t* recvBase = static_cast<uint8_t*>(env->GetDirectBufferAddress(recvBuffer));
+    const jlong recvCapacity = env->GetDirectBufferCapacity(recvBuffer);
+    auto records = static_cast<ConntrackEventRecord*>(env->GetDirectBufferAddress(recordBuffer));
+    const jlong recordCapacity = env->GetDirectBufferCapacity(recordBuffer);
+    if (recvBase == nullptr || records == nullptr || recvCapacity < NLMSG_HDRLEN ||
+        maxRecords <= 0 ||
+        static_cast<jlong>(maxRecords) * sizeof(ConntrackEventRecord) > recordCapacity) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                             "Invalid buffers for %d records", maxRecords);
+        return -1;
+    }
+
+    ScopedByteArrayRO clients(env, clientAddrs);
+    if (clients.get() == nullptr) return -1;
+    const size_t numClients = clients.size() / 4;
+    const uint8_t* clientBase = reinterpret_cast<const uint8_t*>(clients.get());
+
+    const int fd = netjniutils::GetNativeFileDescriptor(env, javaFd);
+    ssize_t len;
+    do {
+        len = recv(fd, recvBase, recvCapacity, MSG_TRUNC);
+    } while (len == -1 && errno == EINTR);
+    if (len == -1) {
+        jniThrowErrnoException(env, "recv", errno);
+        return -1;
+    }
+    if (len > recvCapacity) {
+        jniThrowErrnoException(env, "recv", EMSGSIZE);
+        return -1;
+    }
+
+    int count = 0;
+    int remaining = len;
+    for (const nlmsghdr* nlh = reinterpret_cast<const nlmsghdr*>(recvBase);
+         NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining)) {
+        if (nlh->nlmsg_type == NLMSG_DONE) return -1;
+        if (nlh->nlmsg_type == NLMSG_ERROR) {
+            const nlmsgerr* err = static_cast<const nlmsgerr*>(NLMSG_DATA(nlh));
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*err)) || err->error == 0) return -1;
+            jniThrowErrnoException(env, "IPCTNL_MSG_CT_GET", -err->error);
+            return -1;
+        }
+        if (count >= maxRecords) {
+            jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                                 "More than %d conntrack entries in one datagram", maxRecords);
+            return -1;
+        }
+        if (!parseConntrackMessage(nlh, &records[count], true /* allowDump */) ||
+            !shouldReportConntrackEvent(records[count], newStatusMask)) {
+            continue;
+        }
+        for (size_t i = 0; i < numClients; i++) {
+            if (!memcmp(records[count].origSrc, clientBase + i * 4, 4)) {
+                count++;
+                break;
+            }
+        }
+    }
+    return count;
+}
+
+/*
+ * JNI registration.
+ */
+static const JNINativeMethod gMethods[] = {
+        /* name, signature, funcPtr */
+        {"nativeCreateSocket", "(IIZ)Ljava/io/FileDescriptor;",
+         (void*)com_android_networkstack_tethering_ConntrackEventReader_createSocket},
+        {"nativeReadEvents",
+         "(Ljava/io/FileDescriptor;Ljava/nio/ByteBuffer;ILjava/nio/ByteBuffer;II)I",
+         (void*)com_android_networkstack_tethering_ConntrackEventReader_readEvents},
+        {"nativeStartDump", "()Ljava/io/FileDescriptor;",
+         (void*)com_android_networkstack_tethering_ConntrackEventReader_startDump},
+        {"nativeReadDump",
+         "(Ljava/io/FileDescriptor;Ljava/nio/ByteBuffer;Ljava/nio/ByteBuffer;I[BI)I",
+         (void*)com_android_networkstack_tethering_ConntrackEventReader_readDump},
+};
+
+int register_com_android_networkstack_tethering_ConntrackEventReader(JNIEnv* env) {
+    return jniRegisterNativeMethods(env, "com/android/networkstack/tethering/ConntrackEventReader",
+                                    gMethods, NELEM(gMethods));
+}
+
+};  // namespace android
@@ -0,0 +1,482 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <jni.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netlink.h>
+#include <nativehelper/JNIHelp.h>
+#include <nativehelper/ScopedLocalRef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "nativehelper/scoped_primitive_array.h"
+#include "nativehelper/scoped_utf_chars.h"
+#include "netlink_writer.h"
+
+namespace android {
+
+// The forwarding state lives in one inet table, which holds the flowtable and a forward chain that
+// adds the flows of the offloaded (downstream, upstream) pairs to it. The table is replaced as a
+// whole whenever the pairs change, because kernels before 5.8 cannot change the devices of an
+// existing flowtable.
+static const char* kTableName = "tether_offload";
+static const char* kFlowtableName = "ft";
+static const char* kForwardChainName = "forward";
+
+// The offloaded traffic is counted in one netdev table per device, so the counters survive the
+// changes of the inet table. Its "pre" chain counts all the packets received by the device, before
+// the flowtable; its "post" chain counts those the flowtable did not take. The difference is the
+// traffic forwarded by the flowtable.
+static const char* kCounterTablePrefix = "tether_offload_";
+static const char* kPreName = "pre";
+static const char* kPostName = "post";
+
+static const int32_t kFlowtablePriority = 0;
+// After the iptables filter table, so that only the flows it accepts are offloaded.
+static const int32_t kForwardChainPriority = 1;
+
+static const uint16_t kNftMsgFlags = NLM_F_REQUEST | NLM_F_ACK;
+
+static void putU32(NetlinkWriter* w, uint16_t type, uint32_t value) {
+    value = htonl(value);
+    w->putAttr(type, &value, sizeof(value));
+}
+
+static void putString(NetlinkWriter* w, uint16_t type, const char* str) {
+    w->putAttr(type, str, strlen(str) + 1);
+}
+
+static size_t beginNftMessage(NetlinkWriter* w, uint16_t msgType, uint8_t family,
+                              uint16_t flags) {
+    const size_t msg = w->begin((NFNL_SUBSYS_NFTABLES << 8) | msgType, flags);
+    const nfgenmsg nfg = {.nfgen_family = family, .version = NFNETLINK_V0};
+    w->append(&nfg, sizeof(nfg));
+    return msg;
+}
+
+static void appendBatchMarker(NetlinkWriter* w, uint16_t type) {
+    const size_t msg = w->begin(type, NLM_F_REQUEST);
+    const nfgenmsg nfg = {.nfgen_family = AF_UNSPEC,
+                          .version = NFNETLINK_V0,
+                          .res_id = htons(NFNL_SUBSYS_NFTABLES)};
+    w->append(&nfg, sizeof(nfg));
+    w->endMessage(msg);
+}
+
+static void appendTable(NetlinkWriter* w, uint16_t msgType, uint8_t family, const char* name) {
+    const size_t msg = beginNftMessage(w, msgType, family,
+                                       kNftMsgFlags | (msgType == NFT_MSG_NEWTABLE ? NLM_F_CREATE
+                                                                                   : 0));
+    putString(w, NFTA_TABLE_NAME, name);
+    w->endMessage(msg);
+}
+
+// Deletes the table if it exists: adding an existing table without NLM_F_EXCL succeeds, so the
+// deletion that follows cannot fail with ENOENT.
+static void appendResetTable(NetlinkWriter* w, uint8_t family, const char* name) {
+    appendTable(w, NFT_MSG_NEWTABLE, family, name);
+    appendTable(w, NFT_MSG_DELTABLE, family, name);
+}
+
+static void appendBaseChain(NetlinkWriter* w, uint8_t family, const char* table, const char* name,
+                            uint32_t hook, int32_t priority, const char* dev) {
+    const size_t msg = beginNftMessage(w, NFT_MSG_NEWCHAIN, family, kNftMsgFlags | NLM_F_CREATE);
+    putString(w, NFTA_CHAIN_TABLE, table);
+    putString(w, NFTA_CHAIN_NAME, name);
+    const size_t hookAttr = w->beginNest(NFTA_CHAIN_HOOK);
+    putU32(w, NFTA_HOOK_HOOKNUM, hook);
+    putU32(w, NFTA_HOOK_PRIORITY, static_cast<uint32_t>(priority));
+    if (dev != nullptr) putString(w, NFTA_HOOK_DEV, dev);
+    w->endNest(hookAttr);
+    putString(w, NFTA_CHAIN_TYPE, "filter");
+    w->endMessage(msg);
+}
+
+static size_t beginRule(NetlinkWriter* w, uint8_t family, const char* table, const char* chain,
+                        size_t* exprs) {
+    const size_t msg = beginNftMessage(w, NFT_MSG_NEWRULE, family,
+                                       kNftMsgFlags | NLM_F_CREATE | NLM_F_APPEND);
+    putString(w, NFTA_RULE_TABLE, table);
+    putString(w, NFTA_RULE_CHAIN, chain);
+    *exprs = w->beginNest(NFTA_RULE_EXPRESSIONS);
+    return msg;
+}
+
+static void endRule(NetlinkWriter* w, size_t msg, size_t exprs) {
+    w->endNest(exprs);
+    w->endMessage(msg);
+}
+
+struct ExprNest {
+    size_t elem;
+    size_t data;
+};
+
+static ExprNest beginExpr(NetlinkWriter* w, const char* name) {
+    const size_t elem = w->beginNest(NFTA_LIST_ELEM);
+    putString(w, NFTA_EXPR_NAME, name);
+    return {elem, w->beginNest(NFTA_EXPR_DATA)};
+}
+
+static void endExpr(NetlinkWriter* w, const ExprNest& expr) {
+    w->endNest(expr.data);
+    w->endNest(expr.elem);
+}
+
+// meta iif|oif == ifindex
+static void appendMetaIfindexMatch(NetlinkWriter* w, uint32_t key, uint32_t ifindex) {
+    ExprNest expr = beginExpr(w, "meta");
+    putU32(w, NFTA_META_DREG, NFT_REG_1);
+    putU32(w, NFTA_META_KEY, key);
+    endExpr(w, expr);
+
+    expr = beginExpr(w, "cmp");
+    putU32(w, NFTA_CMP_SREG, NFT_REG_1);
+    putU32(w, NFTA_CMP_OP, NFT_CMP_EQ);
+    const size_t data = w->beginNest(NFTA_CMP_DATA);
+    w->putAttr(NFTA_DATA_VALUE, &ifindex, sizeof(ifindex));  // Host byte order, as the meta key.
+    w->endNest(data);
+    endExpr(w, expr);
+}
+
+// meta iif in ifindex meta oif out flow add @ft
+static void appendOffloadRule(NetlinkWriter* w, uint32_t in, uint32_t out) {
+    size_t exprs;
+    const size_t msg = beginRule(w, NFPROTO_INET, kTableName, kForwardChainName, &exprs);
+    appendMetaIfindexMatch(w, NFT_META_IIF, in);
+    appendMetaIfindexMatch(w, NFT_META_OIF, out);
+    const ExprNest expr = beginExpr(w, "flow_offload");
+    putString(w, NFTA_FLOW_TABLE_NAME, kFlowtableName);
+    endExpr(w, expr);
+    endRule(w, msg, exprs);
+}
+
+static void appendCounter(NetlinkWriter* w, const char* table, const char* name) {
+    const size_t msg = beginNftMessage(w, NFT_MSG_NEWOBJ, NFPROTO_NETDEV,
+                                       kNftMsgFlags | NLM_F_CREATE);
+    putString(w, NFTA_OBJ_TABLE, table);
+    putString(w, NFTA_OBJ_NAME, name);
+    putU32(w, NFTA_OBJ_TYPE, NFT_OBJECT_COUNTER);
+    w->endNest(w->beginNest(NFTA_OBJ_DATA));
+    w->endMessage(msg);
+}
+
+// A netdev ingress chain that only feeds the counter of the same name.
+static void appendCountingChain(NetlinkWriter* w, const char* table, const char* name,
+                                int32_t priority, const char* dev) {
+    appendBaseChain(w, NFPROTO_NETDEV, table, name, NF_NETDEV_INGRESS, priority, dev);
+    size_t exprs;
+    const size_t msg = beginRule(w, NFPROTO_NETDEV, table, name, &exprs);
+    const ExprNest expr = beginExpr(w, "objref");
+    putU32(w, NFTA_OBJREF_IMM_TYPE, NFT_OBJECT_COUNTER);
+    putString(w, NFTA_OBJREF_IMM_NAME, name);
+    endExpr(w, expr);
+    endRule(w, msg, exprs);
+}
+
+static std::string counterTableName(int ifindex) {
+    return kCounterTablePrefix + std::to_string(ifindex);
+}
+
+static int openNetfilterSocket() {
+    const int sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (sock == -1) return -1;
+    const sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    if (connect(sock, reinterpret_cast<const sockaddr*>(&kernel), sizeof(kernel))) {
+        const int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+    return sock;
+}
+
+// Commits the messages of the writer as one nf_tables transaction: either all of them are applied
+// or none is. Returns 0, or -1 with errno set to the first error reported by the kernel.
+static int commitBatch(const NetlinkWriter& messages) {
+    NetlinkWriter batch;
+    appendBatchMarker(&batch, NFNL_MSG_BATCH_BEGIN);
+    batch.append(messages.data(), messages.size());
+    appendBatchMarker(&batch, NFNL_MSG_BATCH_END);
+
+    const int sock = openNetfilterSocket();
+    if (sock == -1) return -1;
+    if (send(sock, batch.data(), batch.size(), 0) == -1) {
+        const int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    // The batch is processed within send(), so all the acks are already queued.
+    int firstError = 0;
+    std::vector<uint8_t> buf(8192);
+    ssize_t len;
+    while ((len = recv(sock, buf.data(), buf.size(), MSG_DONTWAIT)) > 0) {
+        for (const nlmsghdr* nlh = reinterpret_cast<const nlmsghdr*>(buf.data());
+             NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type != NLMSG_ERROR) continue;
+            const nlmsgerr* err = reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(nlh));
+            if (err->error != 0 && firstError == 0) firstError = -err->error;
+        }
+    }
+    close(sock);
+    if (firstError) {
+        errno = firstError;
+        return -1;
+    }
+    return 0;
+}
+
+// Fills attrs, indexed by type, with the attributes in [data, data + len).
+static void parseAttrs(const uint8_t* data, size_t len, const nlattr** attrs, size_t maxType) {
+    memset(attrs, 0, (maxType + 1) * sizeof(*attrs));
+    while (len >= NLA_HDRLEN) {
+        const nlattr* nla = reinterpret_cast<const nlattr*>(data);
+        if (nla->nla_len < NLA_HDRLEN || nla->nla_len > len) break;
+        const uint16_t type = nla->nla_type & NLA_TYPE_MASK;
+        if (type <= maxType) attrs[type] = nla;
+        const size_t aligned = std::min<size_t>(NLA_ALIGN(nla->nla_len), len);
+        data += aligned;
+        len -= aligned;
+    }
+}
+
+static const uint8_t* attrData(const nlattr* nla) {
+    return reinterpret_cast<const uint8_t*>(nla) + NLA_HDRLEN;
+}
+
+static size_t attrLen(const nlattr* nla) {
+    return nla->nla_len - NLA_HDRLEN;
+}
+
+static uint64_t attrU64(const nlattr* nla) {
+    uint64_t value = 0;
+    if (attrLen(nla) >= sizeof(value)) memcpy(&value, attrData(nla), sizeof(value));
+    return be64toh(value);
+}
+
+struct DeviceCounters {
+    uint64_t preBytes;
+    uint64_t prePackets;
+    uint64_t postBytes;
+    uint64_t postPackets;
+};
+
+// Reads the counters of all the counter tables, including those of a previous process.
+static int readCounters(std::map<int, DeviceCounters>* counters) {
+    const int sock = openNetfilterSocket();
+    if (sock == -1) return -1;
+
+    NetlinkWriter req;
+    const size_t msg = beginNftMessage(&req, NFT_MSG_GETOBJ, NFPROTO_NETDEV,
+                                       NLM_F_REQUEST | NLM_F_DUMP);
+    req.endMessage(msg);
+    if (send(sock, req.data(), req.size(), 0) == -1) {
+        const int err = errno;
+        close(sock);
+        errno = err;
+        return -1;
+    }
+
+    const size_t prefixLen = strlen(kCounterTablePrefix);
+    std::vector<uint8_t> buf(32768);
+    while (true) {
+        ssize_t len = recv(sock, buf.data(), buf.size(), 0);
+        if (len == -1) {
+            if (errno == EINTR) continue;
+            const int err = errno;
+            close(sock);
+            errno = err;
+            return -1;
+        }
+        for (const nlmsghdr* nlh = reinterpret_cast<const nlmsghdr*>(buf.data());
+             NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                close(sock);
+                return 0;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                const nlmsgerr* err = reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(nlh));
+                close(sock);
+                errno = -err->error;
+                return -1;
+            }
+            if (nlh->nlmsg_type != ((NFNL_SUBSYS_NFTABLES << 8) | NFT_MSG_NEWOBJ)) continue;
+
+            const nlattr* obj[NFTA_OBJ_MAX + 1];
+            const size_t hdrLen = NLMSG_LENGTH(sizeof(nfgenmsg));
+            parseAttrs(reinterpret_cast<const uint8_t*>(nlh) + NLMSG_ALIGN(hdrLen),
+                       nlh->nlmsg_len - NLMSG_ALIGN(hdrLen), obj, NFTA_OBJ_MAX);
+            if (!obj[NFTA_OBJ_TABLE] || !obj[NFTA_OBJ_NAME] || !obj[NFTA_OBJ_DATA]) continue;
+
+            const std::string table(reinterpret_cast<const char*>(attrData(obj[NFTA_OBJ_TABLE])),
+                                    strnlen(reinterpret_cast<const char*>(
+                                                    attrData(obj[NFTA_OBJ_TABLE])),
+                                            attrLen(obj[NFTA_OBJ_TABLE])));
+            if (table.compare(0, prefixLen, kCounterTablePrefix) != 0) continue;
+            const int ifindex = atoi(table.c_str() + prefixLen);
+            if (ifindex <= 0) continue;
+
+            const nlattr* counter[NFTA_COUNTER_MAX + 1];
+            parseAttrs(attrData(obj[NFTA_OBJ_DATA]), attrLen(obj[NFTA_OBJ_DATA]), counter,
+                       NFTA_COUNTER_MAX);
+            if (!counter[NFTA_COUNTER_BYTES] || !counter[NFTA_COUNTER_PACKETS]) continue;
+            const uint64_t bytes = attrU64(counter[NFTA_COUNTER_BYTES]);
+            const uint64_t packets = attrU64(counter[NFTA_COUNTER_PACKETS]);
+
+            DeviceCounters& c = (*counters)[ifindex];
+            const char* name = reinterpret_cast<const char*>(attrData(obj[NFTA_OBJ_NAME]));
+            if (!strncmp(name, kPreName, attrLen(obj[NFTA_OBJ_NAME]))) {
+                c.preBytes = bytes;
+                c.prePackets = packets;
+            } else if (!strncmp(name, kPostName, attrLen(obj[NFTA_OBJ_NAME]))) {
+                c.postBytes = bytes;
+                c.postPackets = packets;
+            }
+        }
+    }
+}
+
+static void com_android_networkstack_tethering_FlowtableOffload_nativeSetFlowtable(
+        JNIEnv* env, jclass clazz, jobjectArray devices, jintArray pairs) {
+    ScopedIntArrayRO pairIfindexes(env, pairs);
+    if (pairIfindexes.get() == nullptr) return;
+    if (pairIfindexes.size() % 2) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                             "Odd number of pair interface indexes: %zu", pairIfindexes.size());
+        return;
+    }
+
+    NetlinkWriter w;
+    appendResetTable(&w, NFPROTO_INET, kTableName);
+    const jsize deviceCount = env->GetArrayLength(devices);
+    if (deviceCount > 0) {
+        appendTable(&w, NFT_MSG_NEWTABLE, NFPROTO_INET, kTableName);
+
+        const size_t msg = beginNftMessage(&w, NFT_MSG_NEWFLOWTABLE, NFPROTO_INET,
+                                           kNftMsgFlags | NLM_F_CREATE);
+        putString(&w, NFTA_FLOWTABLE_TABLE, kTableName);
+        putString(&w, NFTA_FLOWTABLE_NAME, kFlowtableName);
+        const size_t hook = w.beginNest(NFTA_FLOWTABLE_HOOK);
+        putU32(&w, NFTA_FLOWTABLE_HOOK_NUM, NF_NETDEV_INGRESS);
+        putU32(&w, NFTA_FLOWTABLE_HOOK_PRIORITY, static_cast<uint32_t>(kFlowtablePriority));
+        const size_t devs = w.beginNest(NFTA_FLOWTABLE_HOOK_DEVS);
+        for (jsize i = 0; i < deviceCount; i++) {
+            ScopedLocalRef<jstring> device(env,
+                    static_cast<jstring>(env->GetObjectArrayElement(devices, i)));
+            ScopedUtfChars name(env, device.get());
+            if (name.c_str() == nullptr) return;
+            putString(&w, NFTA_DEVICE_NAME, name.c_str());
+        }
+        w.endNest(devs);
+        w.endNest(hook);
+        w.endMessage(msg);
+
+        appendBaseChain(&w, NFPROTO_INET, kTableName, kForwardChainName, NF_INET_FORWARD,
+                        kForwardChainPriority, nullptr);
+        for (size_t i = 0; i < pairIfindexes.size(); i += 2) {
+            const uint32_t downstream = static_cast<uint32_t>(pairIfindexes[i]);
+            const uint32_t upstream = static_cast<uint32_t>(pairIfindexes[i + 1]);
+            appendOffloadRule(&w, downstream, upstream);
+            appendOffloadRule(&w, upstream, downstream);
+        }
+    }
+
+    if (commitBatch(w)) jniThrowErrnoException(env, "setFlowtable", errno);
+}
+
+static void com_android_networkstack_tethering_FlowtableOffload_nativeAddCounters(
+        JNIEnv* env, jclass clazz, jint ifindex, jstring ifname) {
+    ScopedUtfChars dev(env, ifname);
+    if (dev.c_str() == nullptr) return;
+
+    // Starts from zero even if the table was left behind.
+    const std::string table = counterTableName(ifindex);
+    NetlinkWriter w;
+    appendResetTable(&w, NFPROTO_NETDEV, table.c_str());
+    appendTable(&w, NFT_MSG_NEWTABLE, NFPROTO_NETDEV, table.c_str());
+    appendCounter(&w, table.c_str(), kPreName);
+    appendCounter(&w, table.c_str(), kPostName);
+    appendCountingChain(&w, table.c_str(), kPreName, kFlowtablePriority - 1, dev.c_str());
+    appendCountingChain(&w, table.c_str(), kPostName, kFlowtablePriority + 1, dev.c_str());
+
+    if (commitBatch(w)) jniThrowErrnoException(env, "addCounters", errno);
+}
+
+static void com_android_networkstack_tethering_FlowtableOffload_nativeRemoveCounters(
+        JNIEnv* env, jclass clazz, jint ifindex) {
+    NetlinkWriter w;
+    appendResetTable(&w, NFPROTO_NETDEV, counterTableName(ifindex).c_str());
+    if (commitBatch(w)) jniThrowErrnoException(env, "removeCounters", errno);
+}
+
+// Returns {ifindex, pre bytes, pre packets, post bytes, post packets} for each counter table.
+static jlongArray com_android_networkstack_tethering_FlowtableOffload_nativeGetCounters(
+        JNIEnv* env, jclass clazz) {
+    std::map<int, DeviceCounters> counters;
+    if (readCounters(&counters)) {
+        jniThrowErrnoException(env, "getCounters", errno);
+        return nullptr;
+    }
+
+    std::vector<jlong> values;
+    for (const auto& [ifindex, c] : counters) {
+        values.insert(values.end(), {ifindex, static_cast<jlong>(c.preBytes),
+                                     static_cast<jlong>(c.prePackets),
+                                     static_cast<jlong>(c.postBytes),
+                                     static_cast<jlong>(c.postPackets)});
+    }
+    jlongArray result = env->NewLongArray(values.size());
+    if (result == nullptr) return nullptr;
+    env->SetLongArrayRegion(result, 0, values.size(), values.data());
+    return result;
+}
+
+/*
+ * JNI registration.
+ */
+static const JNINativeMethod gMethods[] = {
+        /* name, signature, funcPtr */
+        {"nativeSetFlowtable", "([Ljava/lang/String;[I)V",
+         (void*)com_android_networkstack_tethering_FlowtableOffload_nativeSetFlowtable},
+        {"nativeAddCounters", "(ILjava/lang/String;)V",
+         (void*)com_android_networkstack_tethering_FlowtableOffload_nativeAddCounters},
+        {"nativeRemoveCounters", "(I)V",
+         (void*)com_android_networkstack_tethering_FlowtableOffload_nativeRemoveCounters},
+        {"nativeGetCounters", "()[J",
+         (void*)com_android_networkstack_tethering_FlowtableOffload_nativeGetCounters},
+};
+
+int register_com_android_networkstack_tethering_FlowtableOffload(JNIEnv* env) {
+    return jniRegisterNativeMethods(env, "com/android/networkstack/tethering/FlowtableOffload",
+                                    gMethods, NELEM(gMethods));
+}
+
+};  // namespace android
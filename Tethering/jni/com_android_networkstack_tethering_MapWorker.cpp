@@ -0,0 +1,401 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <jni.h>
+#include <nativehelper/JNIHelp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <thread>
+
+#define LOG_TAG "MapWorkerJni"
+#include <android/log.h>
+
+#include "nativehelper/scoped_primitive_array.h"
+#include "nativehelper/scoped_utf_chars.h"
+
+#define BPF_FD_JUST_USE_INT
+#include "BpfSyscallWrappers.h"
+#include "bpf_tethering.h"
+#include "conntrack_timeout.h"
+
+namespace android {
+
+// Sync from MapWorker.java.
+static const int kOpAddUpstream4 = 1;
+static const int kOpAddDownstream4 = 2;
+static const int kOpRemoveUpstream4 = 3;
+static const int kOpRemoveDownstream4 = 4;
+static const int kOpRefreshConntrack = 5;
+static const size_t kMaxInFlight = 1024;
+
+// Single-producer single-consumer ring. push() must only be called from one thread and pop() from
+// one other thread; neither blocks.
+template <typename T, size_t N>
+class SpscRing {
+  public:
+    bool push(const T& item) {
+        const size_t tail = mTail.load(std::memory_order_relaxed);
+        if (tail - mHead.load(std::memory_order_acquire) == N) return false;
+        mItems[tail % N] = item;
+        mTail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T* item) {
+        const size_t head = mHead.load(std::memory_order_relaxed);
+        if (head == mTail.load(std::memory_order_acquire)) return false;
+        *item = mItems[head % N];
+        mHead.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+  private:
+    std::array<T, N> mItems;
+    // On separate cache lines, since each index is written by a different thread.
+    alignas(64) std::atomic<size_t> mHead{0};
+    alignas(64) std::atomic<size_t> mTail{0};
+};
+
+struct RuleOp {
+    int op;
+    Tether4Key key;
+    Tether4Value value;  // Unused by removals.
+};
+
+// Sync from MapWorker#drain.
+struct Completion {
+    int32_t op;
+    int32_t upstreamIfindex;  // Only set for downstream rules, whose key starts with it.
+    int32_t result;           // 0 or an errno for rules, the number of flows or -errno otherwise.
+};
+
+// Runs IPv4 rule writes and conntrack timeout refreshes on its own thread, so that slow map
+// operations do not hold up the BpfCoordinator handler thread. Rule operations are executed in
+// submission order. Completions are queued back and signalled on an eventfd that the handler's
+// MessageQueue watches.
+//
+// submit(), setConntrackRefresh() and drain() must be called from the same Java thread. The number
+// of rule operations that were submitted but whose completions were not drained yet is bounded by
+// kMaxInFlight, so that the worker never has to wait for room in the completion ring. The
+// conntrack refresh result does not go through that ring: it has its own slot.
+class MapWorker {
+  public:
+    MapWorker(int upstream4Fd, int downstream4Fd, int epollFd, int wakeFd, int timerFd,
+              int completionFd)
+        : mUpstream4Fd(upstream4Fd), mDownstream4Fd(downstream4Fd), mEpollFd(epollFd),
+          mWakeFd(wakeFd), mTimerFd(timerFd), mCompletionFd(completionFd) {}
+
+    ~MapWorker() {
+        close(mUpstream4Fd);
+        close(mDownstream4Fd);
+        close(mEpollFd);
+        close(mWakeFd);
+        close(mTimerFd);
+        close(mCompletionFd);
+    }
+
+    void start() { mThread = std::thread(&MapWorker::run, this); }
+
+    // Returns once all the submitted operations were executed.
+    void stop() {
+        mStopping.store(true);
+        wake();
+        mThread.join();
+    }
+
+    int completionFd() const { return mCompletionFd; }
+
+    bool submit(const RuleOp& op) {
+        if (mInFlight == kMaxInFlight || !mSubmissions.push(op)) return false;
+        mInFlight++;
+        wake();
+        return true;
+    }
+
+    int setConntrackRefresh(uint64_t intervalMs, uint64_t maxIdleNs, uint32_t tcpTimeoutSec,
+                            uint32_t udpTimeoutSec) {
+        mMaxIdleNs.store(maxIdleNs);
+        mTcpTimeoutSec.store(tcpTimeoutSec);
+        mUdpTimeoutSec.store(udpTimeoutSec);
+        const timespec interval = {
+            .tv_sec = static_cast<time_t>(intervalMs / 1000),
+            .tv_nsec = static_cast<long>((intervalMs % 1000) * 1000000),
+        };
+        const itimerspec spec = {.it_interval = interval, .it_value = interval};
+        return timerfd_settime(mTimerFd, 0, &spec, nullptr);
+    }
+
+    size_t drain(Completion* out, size_t max) {
+        uint64_t count;
+        // Reset the eventfd before popping, so that completions pushed afterwards signal again.
+        if (read(mCompletionFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "read(eventfd): %s",
+                    strerror(errno));
+        }
+        size_t n = 0;
+        while (n < max && mCompletions.pop(&out[n])) {
+            mInFlight--;
+            n++;
+        }
+        if (n < max && mRefreshPending.exchange(false, std::memory_order_acquire)) {
+            out[n++] = {.op = kOpRefreshConntrack, .result = mRefreshResult.load()};
+        }
+        // More completions than fit in out are signalled again for the next drain.
+        if (n == max) signalCompletions();
+        return n;
+    }
+
+  private:
+    void run();
+    void runRuleOps();
+    void refreshConntrack();
+    void wake();
+    void signalCompletions();
+
+    const int mUpstream4Fd;
+    const int mDownstream4Fd;
+    const int mEpollFd;
+    const int mWakeFd;
+    const int mTimerFd;
+    const int mCompletionFd;
+    std::thread mThread;
+    std::atomic<bool> mStopping{false};
+    std::atomic<uint64_t> mMaxIdleNs{0};
+    std::atomic<uint32_t> mTcpTimeoutSec{0};
+    std::atomic<uint32_t> mUdpTimeoutSec{0};
+
+    SpscRing<RuleOp, kMaxInFlight> mSubmissions;
+    SpscRing<Completion, kMaxInFlight> mCompletions;
+    // The result of the last conntrack refresh, if it was not drained yet.
+    std::atomic<bool> mRefreshPending{false};
+    std::atomic<int32_t> mRefreshResult{0};
+    // Only accessed from the Java thread.
+    size_t mInFlight = 0;
+};
+
+void MapWorker::wake() {
+    const uint64_t one = 1;
+    if (write(mWakeFd, &one, sizeof(one)) != sizeof(one)) {
+        __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Failed to wake worker: %s",
+                strerror(errno));
+    }
+}
+
+void MapWorker::signalCompletions() {
+    const uint64_t one = 1;
+    if (write(mCompletionFd, &one, sizeof(one)) != sizeof(one)) {
+        __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Failed to signal completions: %s",
+                strerror(errno));
+    }
+}
+
+void MapWorker::run() {
+    epoll_event events[2];
+    while (true) {
+        const int n = epoll_wait(mEpollFd, events, 2, -1);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "epoll_wait: %s", strerror(errno));
+            return;
+        }
+
+        uint64_t count;
+        for (int i = 0; i < n; i++) {
+            // Both are eventfd-like counters. Reading resets them.
+            if (read(events[i].data.fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "read: %s", strerror(errno));
+            }
+        }
+
+        // Read before running the rule operations, so that all the submissions made before
+        // stop() are executed before returning.
+        const bool stopping = mStopping.load();
+
+        // Rule operations go first: they delay offload of new flows, while the conntrack
+        // timeouts only need to be refreshed within a minute.
+        runRuleOps();
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == mTimerFd) refreshConntrack();
+        }
+
+        if (stopping) return;
+    }
+}
+
+void MapWorker::runRuleOps() {
+    RuleOp op;
+    bool completed = false;
+    while (mSubmissions.pop(&op)) {
+        const bool downstream = op.op == kOpAddDownstream4 || op.op == kOpRemoveDownstream4;
+        const int fd = downstream ? mDownstream4Fd : mUpstream4Fd;
+        int ret;
+        if (op.op == kOpAddUpstream4 || op.op == kOpAddDownstream4) {
+            // Same as BpfMap#insertEntry.
+            ret = bpf::writeToMapEntry(fd, &op.key, &op.value, BPF_NOEXIST);
+        } else {
+            ret = bpf::deleteMapEntry(fd, &op.key);
+        }
+        const Completion c = {
+            .op = op.op,
+            .upstreamIfindex = downstream ? static_cast<int32_t>(op.key.iif) : 0,
+            .result = ret ? errno : 0,
+        };
+        // The Java thread never has more than kMaxInFlight rule operations in flight, and nothing
+        // else goes through this ring, so this cannot fail unless that accounting is broken.
+        if (!mCompletions.push(c)) {
+            __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "Dropped completion of op %d", c.op);
+        }
+        completed = true;
+    }
+    if (completed) signalCompletions();
+}
+
+void MapWorker::refreshConntrack() {
+    const char* failedCall = nullptr;
+    int ret = refreshActiveConntrackTimeouts(mMaxIdleNs.load(), mTcpTimeoutSec.load(),
+                                             mUdpTimeoutSec.load(), &failedCall);
+    if (ret == -1) {
+        __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, "%s: %s", failedCall, strerror(errno));
+        ret = -errno;
+    }
+    // Replaces the previous result if it was not drained yet. It is only informational.
+    mRefreshResult.store(ret);
+    mRefreshPending.store(true, std::memory_order_release);
+    signalCompletions();
+}
+
+static int addToEpoll(int epollFd, int fd) {
+    epoll_event event = {.events = EPOLLIN, .data = {.fd = fd}};
+    return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+static jlong com_android_networkstack_tethering_MapWorker_start(JNIEnv* env, jclass clazz,
+        jstring upstream4MapPath, jstring downstream4MapPath) {
+    ScopedUtfChars upstream4Path(env, upstream4MapPath);
+    ScopedUtfChars downstream4Path(env, downstream4MapPath);
+    const int upstream4Fd = bpf::mapRetrieveRW(upstream4Path.c_str());
+    const int downstream4Fd = bpf::mapRetrieveRW(downstream4Path.c_str());
+    const int epollFd = epoll_create1(EPOLL_CLOEXEC);
+    const int wakeFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    const int timerFd = timerfd_create(CLOCK_BOOTTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    const int completionFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    const int fds[] = {upstream4Fd, downstream4Fd, epollFd, wakeFd, timerFd, completionFd};
+    const bool failed = std::any_of(std::begin(fds), std::end(fds), [](int fd) { return fd == -1; })
+            || addToEpoll(epollFd, wakeFd) || addToEpoll(epollFd, timerFd);
+    if (failed) {
+        jniThrowExceptionFmt(env, "java/io/IOException", "Failed to start map worker: %s",
+                strerror(errno));
+        for (const int fd : fds) {
+            if (fd != -1) close(fd);
+        }
+        return 0;
+    }
+
+    MapWorker* worker = new MapWorker(upstream4Fd, downstream4Fd, epollFd, wakeFd, timerFd,
+            completionFd);
+    worker->start();
+    return reinterpret_cast<jlong>(worker);
+}
+
+static jobject com_android_networkstack_tethering_MapWorker_getCompletionFd(JNIEnv* env,
+        jclass clazz, jlong handle) {
+    return jniCreateFileDescriptor(env, reinterpret_cast<MapWorker*>(handle)->completionFd());
+}
+
+static jboolean com_android_networkstack_tethering_MapWorker_submit(JNIEnv* env, jclass clazz,
+        jlong handle, jint op, jbyteArray key, jbyteArray value) {
+    RuleOp ruleOp = {.op = op};
+    ScopedByteArrayRO keyBytes(env, key);
+    if (keyBytes.size() != sizeof(ruleOp.key)) {
+        jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                "Invalid key length %zu", keyBytes.size());
+        return false;
+    }
+    memcpy(&ruleOp.key, keyBytes.get(), sizeof(ruleOp.key));
+    if (value != nullptr) {
+        ScopedByteArrayRO valueBytes(env, value);
+        if (valueBytes.size() != sizeof(ruleOp.value)) {
+            jniThrowExceptionFmt(env, "java/lang/IllegalArgumentException",
+                    "Invalid value length %zu", valueBytes.size());
+            return false;
+        }
+        memcpy(&ruleOp.value, valueBytes.get(), sizeof(ruleOp.value));
+    }
+    return reinterpret_cast<MapWorker*>(handle)->submit(ruleOp);
+}
+
+static void com_android_networkstack_tethering_MapWorker_setConntrackRefresh(JNIEnv* env,
+        jclass clazz, jlong handle, jlong intervalMs, jlong maxIdleNs, jint tcpTimeoutSec,
+        jint udpTimeoutSec) {
+    if (reinterpret_cast<MapWorker*>(handle)->setConntrackRefresh(intervalMs, maxIdleNs,
+            tcpTimeoutSec, udpTimeoutSec)) {
+        jniThrowErrnoException(env, "timerfd_settime", errno);
+    }
+}
+
+static jint com_android_networkstack_tethering_MapWorker_drain(JNIEnv* env, jclass clazz,
+        jlong handle, jintArray out) {
+    static const size_t kInts = sizeof(Completion) / sizeof(int32_t);
+    ScopedIntArrayRW outInts(env, out);
+    const size_t n = reinterpret_cast<MapWorker*>(handle)->drain(
+            reinterpret_cast<Completion*>(outInts.get()), outInts.size() / kInts);
+    return n;
+}
+
+static void com_android_networkstack_tethering_MapWorker_stop(JNIEnv* env, jclass clazz,
+        jlong handle) {
+    reinterpret_cast<MapWorker*>(handle)->stop();
+}
+
+static void com_android_networkstack_tethering_MapWorker_destroy(JNIEnv* env, jclass clazz,
+        jlong handle) {
+    delete reinterpret_cast<MapWorker*>(handle);
+}
+
+/*
+ * JNI registration.
+ */
+static const JNINativeMethod gMethods[] = {
+    /* name, signature, funcPtr */
+    { "nativeStart", "(Ljava/lang/String;Ljava/lang/String;)J",
+            (void*) com_android_networkstack_tethering_MapWorker_start },
+    { "nativeGetCompletionFd", "(J)Ljava/io/FileDescriptor;",
+            (void*) com_android_networkstack_tethering_MapWorker_getCompletionFd },
+    { "nativeSubmit", "(JI[B[B)Z", (void*) com_android_networkstack_tethering_MapWorker_submit },
+    { "nativeSetConntrackRefresh", "(JJJII)V",
+            (void*) com_android_networkstack_tethering_MapWorker_setConntrackRefresh },
+    { "nativeDrain", "(J[I)I", (void*) com_android_networkstack_tethering_MapWorker_drain },
+    { "nativeStop", "(J)V", (void*) com_android_networkstack_tethering_MapWorker_stop },
+    { "nativeDestroy", "(J)V", (void*) com_android_networkstack_tethering_MapWorker_destroy },
+};
+
+int register_com_android_networkstack_tethering_MapWorker(JNIEnv* env) {
+    return jniRegisterNativeMethods(env,
+            "com/android/networkstack/tethering/MapWorker",
+            gMethods, NELEM(gMethods));
+}
+
+}; // namespace android
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netlink.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+
+namespace android {
+
+// A conntrack event decoded from its netlink message, as handed to Java.
+// Must be kept in sync with com.android.networkstack.tethering.ConntrackEventReader.
+struct ConntrackEventRecord {
+    uint16_t msgType;         // (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_*
+    uint8_t proto;            // IPPROTO_TCP or IPPROTO_UDP
+    uint8_t pad;
+    uint32_t status;          // CTA_STATUS bits
+    uint32_t timeoutSec;      // CTA_TIMEOUT, or 0 if absent
+    uint8_t origSrc[4];       // Original direction tuple, addresses in network byte order
+    uint8_t origDst[4];
+    uint16_t origSrcPort;     // Ports in host byte order
+    uint16_t origDstPort;
+    uint8_t replySrc[4];      // Reply direction tuple
+    uint8_t replyDst[4];
+    uint16_t replySrcPort;
+    uint16_t replyDstPort;
+};
+static_assert(sizeof(ConntrackEventRecord) == 36,
+              "ConntrackEventRecord must match ConntrackEventReader.java");
+
+// Calls f(type, payload, payloadLen) for each well-formed attribute in [data, data + len).
+template <typename F>
+inline void forEachAttr(const uint8_t* data, size_t len, F f) {
+    while (len >= NLA_HDRLEN) {
+        const nlattr* nla = reinterpret_cast<const nlattr*>(data);
+        if (nla->nla_len < NLA_HDRLEN || nla->nla_len > len) return;
+        f(nla->nla_type & NLA_TYPE_MASK, data + NLA_HDRLEN, nla->nla_len - NLA_HDRLEN);
+        const size_t aligned = NLA_ALIGN(nla->nla_len);
+        if (aligned >= len) return;
+        data += aligned;
+        len -= aligned;
+    }
+}
+
+inline uint32_t getBe32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+inline uint16_t getBe16(const uint8_t* p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohs(v);
+}
+
+// Parses a CTA_TUPLE_ORIG or CTA_TUPLE_REPLY nest. Returns the number of fields found, which is 5
+// for a complete IPv4 tuple.
+inline int parseTuple(const uint8_t* data, size_t len, uint8_t* proto, uint8_t* src, uint8_t* dst,
+                      uint16_t* srcPort, uint16_t* dstPort) {
+    int found = 0;
+    forEachAttr(data, len, [&](uint16_t type, const uint8_t* p, size_t plen) {
+        if (type == CTA_TUPLE_IP) {
+            forEachAttr(p, plen, [&](uint16_t t, const uint8_t* q, size_t qlen) {
+                if (qlen < 4 || (t != CTA_IP_V4_SRC && t != CTA_IP_V4_DST)) return;
+                memcpy(t == CTA_IP_V4_SRC ? src : dst, q, 4);
+                found++;
+            });
+        } else if (type == CTA_TUPLE_PROTO) {
+            forEachAttr(p, plen, [&](uint16_t t, const uint8_t* q, size_t qlen) {
+                if (t == CTA_PROTO_NUM && qlen >= 1) {
+                    *proto = q[0];
+                    found++;
+                } else if ((t == CTA_PROTO_SRC_PORT || t == CTA_PROTO_DST_PORT) && qlen >= 2) {
+                    *(t == CTA_PROTO_SRC_PORT ? srcPort : dstPort) = getBe16(q);
+                    found++;
+                }
+            });
+        }
+    });
+    return found;
+}
+
+// Decodes an IPv4 TCP or UDP conntrack message without allocating. Returns false for anything
+// the offload cannot use. If allowDump is set, the IPCTNL_MSG_CT_GET replies to a dump request are
+// accepted too, and reported as IPCTNL_MSG_CT_NEW since they describe existing connections.
+inline bool parseConntrackMessage(const nlmsghdr* nlh, ConntrackEventRecord* rec,
+                                  bool allowDump = false) {
+    if ((nlh->nlmsg_type >> 8) != NFNL_SUBSYS_CTNETLINK) return false;
+    const uint8_t msg = nlh->nlmsg_type & 0xff;
+    const bool isDump = allowDump && msg == IPCTNL_MSG_CT_GET;
+    if (msg != IPCTNL_MSG_CT_NEW && msg != IPCTNL_MSG_CT_DELETE && !isDump) return false;
+    if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(nfgenmsg))) return false;
+
+    const nfgenmsg* nfg = static_cast<const nfgenmsg*>(NLMSG_DATA(nlh));
+    if (nfg->nfgen_family != AF_INET) return false;
+
+    *rec = {};
+    rec->msgType = isDump ? (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_NEW : nlh->nlmsg_type;
+    int origFields = 0, replyFields = 0;
+    uint8_t replyProto = 0;
+    const uint8_t* attrs = reinterpret_cast<const uint8_t*>(nfg) + NLMSG_ALIGN(sizeof(*nfg));
+    const size_t attrsLen = nlh->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(sizeof(*nfg)));
+    forEachAttr(attrs, attrsLen, [&](uint16_t type, const uint8_t* p, size_t plen) {
+        switch (type) {
+            case CTA_TUPLE_ORIG:
+                origFields = parseTuple(p, plen, &rec->proto, rec->origSrc, rec->origDst,
+                                        &rec->origSrcPort, &rec->origDstPort);
+                break;
+            case CTA_TUPLE_REPLY:
+                replyFields = parseTuple(p, plen, &replyProto, rec->replySrc, rec->replyDst,
+                                         &rec->replySrcPort, &rec->replyDstPort);
+                break;
+            case CTA_STATUS:
+                if (plen >= 4) rec->status = getBe32(p);
+                break;
+            case CTA_TIMEOUT:
+                if (plen >= 4) rec->timeoutSec = getBe32(p);
+                break;
+        }
+    });
+
+    if (origFields != 5 || replyFields != 5 || rec->proto != replyProto) return false;
+    return rec->proto == IPPROTO_TCP || rec->proto == IPPROTO_UDP;
+}
+
+// A connection that has seen a reply and has at most this many seconds left is closing: the TCP
+// states after ESTABLISHED all use shorter timeouts than this (see nf_conntrack_proto_tcp.c),
+// while an established connection is refreshed to 5 days.
+constexpr uint32_t kTcpMaxClosingTimeoutSec = 120;
+
+// Returns whether a decoded event is worth handing to Java. Deletions are always reported. A new
+// or updated connection is only reported if its status has all the bits of newStatusMask, and, for
+// TCP, if it is not closing, since the offload could only install rules that are about to expire.
+inline bool shouldReportConntrackEvent(const ConntrackEventRecord& rec, uint32_t newStatusMask) {
+    if ((rec.msgType & 0xff) == IPCTNL_MSG_CT_DELETE) return true;
+    if ((rec.status & newStatusMask) != newStatusMask) return false;
+    if (rec.proto == IPPROTO_TCP && (rec.status & IPS_SEEN_REPLY) && rec.timeoutSec != 0 &&
+        rec.timeoutSec <= kTcpMaxClosingTimeoutSec) {
+        return false;
+    }
+    return true;
+}
+
+}  // namespace android
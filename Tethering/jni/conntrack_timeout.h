@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netlink.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#ifndef BPF_FD_JUST_USE_INT
+#define BPF_FD_JUST_USE_INT
+#endif
+#include "BpfSyscallWrappers.h"
+#include "bpf_map_batch.h"
+#include "bpf_tethering.h"
+#include "netlink_writer.h"
+
+namespace android {
+
+// Original direction conntrack tuple of an offloaded IPv4 flow. Addresses and ports are in network
+// byte order.
+struct ConntrackTuple {
+    uint32_t src;
+    uint32_t dst;
+    uint16_t srcPort;
+    uint16_t dstPort;
+    uint8_t proto;
+};
+
+// Appends an IPCTNL_MSG_CT_NEW message that sets the timeout of the existing conntrack entry with
+// the given original tuple.
+inline void appendTimeoutUpdate(NetlinkWriter* w, const ConntrackTuple& t, uint32_t timeoutSec) {
+    const size_t msg = w->begin((NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_NEW,
+                                NLM_F_REQUEST | NLM_F_REPLACE);
+    const nfgenmsg nfg = {.nfgen_family = AF_INET, .version = NFNETLINK_V0};
+    w->append(&nfg, sizeof(nfg));
+
+    const size_t tuple = w->beginNest(CTA_TUPLE_ORIG);
+    const size_t ip = w->beginNest(CTA_TUPLE_IP);
+    w->putAttr(CTA_IP_V4_SRC, &t.src, sizeof(t.src));
+    w->putAttr(CTA_IP_V4_DST, &t.dst, sizeof(t.dst));
+    w->endNest(ip);
+    const size_t proto = w->beginNest(CTA_TUPLE_PROTO);
+    w->putAttr(CTA_PROTO_NUM, &t.proto, sizeof(t.proto));
+    w->putAttr(CTA_PROTO_SRC_PORT, &t.srcPort, sizeof(t.srcPort));
+    w->putAttr(CTA_PROTO_DST_PORT, &t.dstPort, sizeof(t.dstPort));
+    w->endNest(proto);
+    w->endNest(tuple);
+
+    const uint32_t timeout = htonl(timeoutSec);
+    w->putAttr(CTA_TIMEOUT, &timeout, sizeof(timeout));
+    w->endMessage(msg);
+}
+
+// Appends to flows the original tuples of the given IPv4 rules that were forwarded after cutoffNs.
+// Upstream rules are keyed by the original tuple, downstream rules carry it reversed in their
+// value. A flow that is active in both directions is only appended once.
+inline void appendActiveFlows(const Tether4Key* k, const Tether4Value* v, size_t count,
+                              bool downstream, uint64_t cutoffNs,
+                              std::unordered_set<std::string>* seen,
+                              std::vector<ConntrackTuple>* flows) {
+    for (size_t i = 0; i < count; i++) {
+        if (v[i].last_used <= cutoffNs) continue;
+        ConntrackTuple t = {.proto = static_cast<uint8_t>(k[i].l4Proto)};
+        if (downstream) {
+            memcpy(&t.src, &v[i].dst46.s6_addr[12], sizeof(t.src));
+            memcpy(&t.dst, &v[i].src46.s6_addr[12], sizeof(t.dst));
+            t.srcPort = v[i].dstPort;
+            t.dstPort = v[i].srcPort;
+        } else {
+            t.src = k[i].src4.s_addr;
+            t.dst = k[i].dst4.s_addr;
+            t.srcPort = k[i].srcPort;
+            t.dstPort = k[i].dstPort;
+        }
+        std::string id(reinterpret_cast<const char*>(&t), offsetof(ConntrackTuple, proto) + 1);
+        if (seen->insert(std::move(id)).second) flows->push_back(t);
+    }
+}
+
+// Collects the original tuples of the flows in the given IPv4 rule map that were forwarded after
+// cutoffNs. See appendActiveFlows().
+inline int collectActiveFlows(const char* path, bool downstream, uint64_t cutoffNs,
+                              std::unordered_set<std::string>* seen,
+                              std::vector<ConntrackTuple>* flows) {
+    const int fd = bpf::mapRetrieveRO(path);
+    if (fd == -1) return -1;
+
+    std::vector<uint8_t> keys, values;
+    const int ret = readAllMapEntries(fd, sizeof(Tether4Key), sizeof(Tether4Value), &keys,
+                                      &values);
+    const int err = errno;
+    close(fd);
+    if (ret) {
+        errno = err;
+        return -1;
+    }
+
+    appendActiveFlows(reinterpret_cast<const Tether4Key*>(keys.data()),
+                      reinterpret_cast<const Tether4Value*>(values.data()),
+                      keys.size() / sizeof(Tether4Key), downstream, cutoffNs, seen, flows);
+    return 0;
+}
+
+// Refreshes the conntrack timeouts of the offloaded IPv4 flows that were forwarded in the last
+// maxIdleNs nanoseconds. Offloaded packets bypass the stack, so without this the conntrack entries
+// of busy flows expire and their NAT mappings are lost. The timeout updates are sent in a few
+// large netlink datagrams rather than one per flow. Returns the number of flows refreshed, or -1
+// with errno set and *failedCall naming the call that failed.
+inline int refreshActiveConntrackTimeouts(uint64_t maxIdleNs, uint32_t tcpTimeoutSec,
+                                          uint32_t udpTimeoutSec, const char** failedCall) {
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);  // Same clock as bpf_ktime_get_boot_ns().
+    const uint64_t nowNs = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    const uint64_t cutoffNs = nowNs > maxIdleNs ? nowNs - maxIdleNs : 0;
+
+    std::unordered_set<std::string> seen;
+    std::vector<ConntrackTuple> flows;
+    if (collectActiveFlows(TETHER_UPSTREAM4_MAP_PATH, false, cutoffNs, &seen, &flows) ||
+        collectActiveFlows(TETHER_DOWNSTREAM4_MAP_PATH, true, cutoffNs, &seen, &flows)) {
+        *failedCall = "refreshConntrackTimeouts";
+        return -1;
+    }
+    if (flows.empty()) return 0;
+
+    const int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (sock == -1) {
+        *failedCall = "socket(NETLINK_NETFILTER)";
+        return -1;
+    }
+
+    // Errors, e.g. for entries that were deleted in the meantime, are not acked individually and
+    // are discarded with the socket. Each datagram is processed synchronously by sendto().
+    static const size_t kMaxDatagramSize = 8192;
+    const sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    NetlinkWriter w;
+    for (size_t i = 0; i < flows.size(); i++) {
+        const uint32_t timeout = flows[i].proto == IPPROTO_TCP ? tcpTimeoutSec : udpTimeoutSec;
+        appendTimeoutUpdate(&w, flows[i], timeout);
+        if (w.size() < kMaxDatagramSize && i + 1 < flows.size()) continue;
+
+        if (sendto(sock, w.data(), w.size(), 0, reinterpret_cast<const sockaddr*>(&kernel),
+                   sizeof(kernel)) == -1) {
+            const int err = errno;
+            close(sock);
+            *failedCall = "sendto(IPCTNL_MSG_CT_NEW)";
+            errno = err;
+            return -1;
+        }
+        w.clear();
+    }
+    close(sock);
+    return flows.size();
+}
+
+}  // namespace android
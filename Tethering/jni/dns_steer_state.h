@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errno.h>
+
+#include <vector>
+
+#ifndef BPF_FD_JUST_USE_INT
+#define BPF_FD_JUST_USE_INT
+#endif
+#include "BpfSyscallWrappers.h"
+#include "bpf_tethering.h"
+
+namespace android {
+
+// Deletes the entries of tether_dns_steer_state_map that belong to the given downstream, so that
+// none of them can rewrite a reply once steering is enabled again on the same ifindex. Returns the
+// number of entries deleted, or a negative errno if the map could not be walked.
+inline int clearDnsSteerState(int mapFd, uint32_t ifIndex) {
+    // The keys are collected first: a deleted key cannot be used to find the next one.
+    std::vector<TetherDnsSteerStateKey> keys;
+    TetherDnsSteerStateKey key;
+    int rv = bpf::getFirstMapKey(mapFd, &key);
+    while (rv == 0) {
+        if (key.iif == ifIndex) keys.push_back(key);
+        rv = bpf::getNextMapKey(mapFd, &key, &key);
+    }
+    if (errno != ENOENT) return -errno;
+
+    int deleted = 0;
+    for (const TetherDnsSteerStateKey& k : keys) {
+        if (bpf::deleteMapEntry(mapFd, &k) == 0) deleted++;
+    }
+    return deleted;
+}
+
+}  // namespace android
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/netlink.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace android {
+
+// Appends netlink messages and attributes to a buffer.
+class NetlinkWriter {
+  public:
+    size_t size() const { return mBuf.size(); }
+    const uint8_t* data() const { return mBuf.data(); }
+    void clear() { mBuf.clear(); }
+
+    size_t begin(uint16_t type, uint16_t flags) {
+        const size_t start = mBuf.size();
+        const nlmsghdr nlh = {.nlmsg_type = type, .nlmsg_flags = flags};
+        append(&nlh, sizeof(nlh));
+        return start;
+    }
+
+    size_t beginNest(uint16_t type) { return putAttr(type | NLA_F_NESTED, nullptr, 0); }
+
+    size_t putAttr(uint16_t type, const void* data, size_t len) {
+        const size_t start = mBuf.size();
+        const nlattr nla = {.nla_len = static_cast<uint16_t>(NLA_HDRLEN + len), .nla_type = type};
+        append(&nla, sizeof(nla));
+        append(data, len);
+        return start;
+    }
+
+    // Sets the length of the message or nested attribute that starts at the given offset.
+    void endMessage(size_t start) {
+        reinterpret_cast<nlmsghdr*>(&mBuf[start])->nlmsg_len = mBuf.size() - start;
+    }
+    void endNest(size_t start) {
+        reinterpret_cast<nlattr*>(&mBuf[start])->nla_len = mBuf.size() - start;
+    }
+
+    void append(const void* data, size_t len) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        mBuf.insert(mBuf.end(), p, p + len);
+        mBuf.resize(NLMSG_ALIGN(mBuf.size()));
+    }
+
+  private:
+    std::vector<uint8_t> mBuf;
+};
+
+}  // namespace android
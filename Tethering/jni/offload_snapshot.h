@@ -0,0 +1,197 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <vector>
+
+#ifndef BPF_FD_JUST_USE_INT
+#define BPF_FD_JUST_USE_INT
+#endif
+#include "BpfSyscallWrappers.h"
+#include "bpf_map_batch.h"
+#include "bpf_map_iter.h"
+#include "bpf_tethering.h"
+#include "offload_snapshot_format.h"
+
+namespace android {
+
+struct TetherSnapshotSource {
+    const char* name;
+    const char* path;
+    uint32_t keySize;
+    uint32_t valueSize;
+};
+
+// The maps of bpf_tethering.h whose entries can be read from userspace. The devmap and the xskmap
+// only hold interface indexes and sockets and are left out.
+static const TetherSnapshotSource kTetherSnapshotMaps[] = {
+    { "tether_error_map", TETHER_ERROR_MAP_PATH, sizeof(uint32_t), sizeof(uint32_t) },
+    { "tether_stats_map", TETHER_STATS_MAP_PATH, sizeof(TetherStatsKey),
+            sizeof(TetherStatsValue) },
+    { "tether_limit_map", TETHER_LIMIT_MAP_PATH, sizeof(TetherLimitKey),
+            sizeof(TetherLimitValue) },
+    { "tether_upstream4_map", TETHER_UPSTREAM4_MAP_PATH, sizeof(Tether4Key),
+            sizeof(Tether4Value) },
+    { "tether_downstream4_map", TETHER_DOWNSTREAM4_MAP_PATH, sizeof(Tether4Key),
+            sizeof(Tether4Value) },
+    { "tether_upstream6_map", TETHER_UPSTREAM6_MAP_PATH, sizeof(TetherUpstream6Key),
+            sizeof(Tether6Value) },
+    { "tether_downstream6_map", TETHER_DOWNSTREAM6_MAP_PATH, sizeof(TetherDownstream6Key),
+            sizeof(Tether6Value) },
+    { "tether_downstream64_map", TETHER_DOWNSTREAM64_MAP_PATH, sizeof(TetherDownstream64Key),
+            sizeof(TetherDownstream64Value) },
+    { "tether_ndp_proxy_map", TETHER_NDP_PROXY_MAP_PATH, sizeof(TetherNdpProxyKey),
+            sizeof(TetherNdpProxyValue) },
+    { "tether_dns_steer_config_map", TETHER_DNS_STEER_CONFIG_MAP_PATH,
+            sizeof(TetherDnsSteerConfigKey), sizeof(TetherDnsSteerConfigValue) },
+    { "tether_dns_steer_state_map", TETHER_DNS_STEER_STATE_MAP_PATH,
+            sizeof(TetherDnsSteerStateKey), sizeof(TetherDnsSteerStateValue) },
+    { "tether_xsk_config_map", TETHER_XSK_CONFIG_MAP_PATH, sizeof(TetherXskConfigKey),
+            sizeof(TetherXskConfigValue) },
+    { "tether_nd_config_map", TETHER_ND_CONFIG_MAP_PATH, sizeof(TetherNdConfigKey),
+            sizeof(TetherNdConfigValue) },
+    { "tether_nd_target_map", TETHER_ND_TARGET_MAP_PATH, sizeof(TetherNdTargetKey),
+            sizeof(TetherNdTargetValue) },
+    { "tether_nd_ratelimit_map", TETHER_ND_RATELIMIT_MAP_PATH, sizeof(TetherNdRateLimitKey),
+            sizeof(TetherNdRateLimitValue) },
+    { "tether_nd_iface_ratelimit_map", TETHER_ND_IFACE_RATELIMIT_MAP_PATH,
+            sizeof(TetherNdIfaceRateLimitKey), sizeof(TetherNdIfaceRateLimitValue) },
+};
+
+inline uint64_t alignSnapshotOffset(uint64_t offset) {
+    return (offset + 7) & ~7ULL;
+}
+
+// Writes len bytes to fd, which may be a pipe. Returns 0, or -1 with errno set.
+inline int writeFully(int fd, const void* data, size_t len) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    while (len > 0) {
+        const ssize_t ret = write(fd, p, len);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+// The entries of one map, as read from the kernel: count * keySize bytes of keys and count *
+// valueSize bytes of values.
+struct TetherSnapshotMapData {
+    const char* name;
+    uint32_t keySize;
+    uint32_t valueSize;
+    std::vector<uint8_t> keys;
+    std::vector<uint8_t> values;
+};
+
+// Writes the given maps to fd in the format of offload_snapshot_format.h, with the given capture
+// time. Returns 0, or -1 with errno set.
+inline int writeOffloadSnapshotMaps(int fd, const std::vector<TetherSnapshotMapData>& maps,
+                                    uint64_t bootTimeNs) {
+    TetherSnapshotHeader header = {
+        .formatVersion = TETHER_SNAPSHOT_FORMAT_VERSION,
+        .layoutVersion = BPF_TETHER_LAYOUT_VERSION,
+        .bootTimeNs = bootTimeNs,
+        .mapCount = static_cast<uint32_t>(maps.size()),
+    };
+    memcpy(header.magic, TETHER_SNAPSHOT_MAGIC, sizeof(header.magic));
+
+    std::vector<TetherSnapshotMap> table(maps.size());
+    uint64_t offset = alignSnapshotOffset(sizeof(header) + table.size() * sizeof(table[0]));
+    for (size_t i = 0; i < maps.size(); i++) {
+        TetherSnapshotMap& m = table[i];
+        strncpy(m.name, maps[i].name, sizeof(m.name) - 1);
+        m.keySize = maps[i].keySize;
+        m.valueSize = maps[i].valueSize;
+        m.count = maps[i].keys.size() / m.keySize;
+        m.keysOffset = offset;
+        offset = alignSnapshotOffset(offset + maps[i].keys.size());
+        m.valuesOffset = offset;
+        offset = alignSnapshotOffset(offset + maps[i].values.size());
+    }
+
+    static const uint8_t kPadding[8] = {};
+    uint64_t written = 0;
+    auto append = [&](const void* data, size_t len) {
+        if (writeFully(fd, data, len)) return false;
+        written += len;
+        return true;
+    };
+    auto padTo = [&](uint64_t target) { return append(kPadding, target - written); };
+
+    if (!append(&header, sizeof(header)) ||
+        !append(table.data(), table.size() * sizeof(table[0]))) {
+        return -1;
+    }
+    for (size_t i = 0; i < maps.size(); i++) {
+        if (!padTo(table[i].keysOffset) ||
+            !append(maps[i].keys.data(), maps[i].keys.size()) ||
+            !padTo(table[i].valuesOffset) ||
+            !append(maps[i].values.data(), maps[i].values.size())) {
+            return -1;
+        }
+    }
+    return padTo(offset) ? 0 : -1;
+}
+
+// Writes a snapshot of all the tethering maps to fd in the format of offload_snapshot_format.h.
+// The maps are all read before anything is written, so fd can be a pipe and the snapshot is as
+// consistent as the map iterators or batched reads allow. Map iterators are only used if
+// useMapIterators is true, which only root tools may set: see bpf_map_iter.h. If reading fails,
+// nothing is written. Maps that do not exist on this device are left out. Returns 0, or -1 with
+// errno set.
+inline int writeOffloadSnapshot(int fd, bool useMapIterators) {
+    std::vector<TetherSnapshotMapData> maps;
+    for (const TetherSnapshotSource& source : kTetherSnapshotMaps) {
+        const int mapFd = bpf::mapRetrieveRO(source.path);
+        if (mapFd == -1) {
+            if (errno == ENOENT) continue;  // e.g. the map of an optional program.
+            return -1;
+        }
+        TetherSnapshotMapData data = {
+            .name = source.name,
+            .keySize = source.keySize,
+            .valueSize = source.valueSize,
+        };
+        const int ret = useMapIterators
+                ? dumpAllMapEntries(mapFd, source.keySize, source.valueSize, &data.keys,
+                                    &data.values)
+                : readAllMapEntries(mapFd, source.keySize, source.valueSize, &data.keys,
+                                    &data.values);
+        const int err = errno;
+        close(mapFd);
+        if (ret) {
+            errno = err;
+            return -1;
+        }
+        maps.push_back(std::move(data));
+    }
+
+    timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    return writeOffloadSnapshotMaps(fd, maps, now.tv_sec * 1000000000ULL + now.tv_nsec);
+}
+
+}  // namespace android
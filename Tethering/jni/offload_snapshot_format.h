@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Binary snapshot of the tethering offload maps, written by writeOffloadSnapshot() and decoded
+// offline by libtetheroffloadsnapshot.
+//
+// The file starts with a TetherSnapshotHeader, followed by mapCount TetherSnapshotMap entries.
+// The keys and the values of each map are stored as the raw bytes read from the kernel, in two
+// arrays at 8-byte aligned offsets from the start of the file, so that a reader can mmap() the
+// file and use the arrays in place. All fields are in the byte order of the device, which is
+// little endian on all Android devices.
+
+namespace android {
+
+#define TETHER_SNAPSHOT_MAGIC "TETHSNAP"
+#define TETHER_SNAPSHOT_FORMAT_VERSION 1
+
+struct TetherSnapshotHeader {
+    char magic[8];           // TETHER_SNAPSHOT_MAGIC, not NUL-terminated
+    uint32_t formatVersion;  // TETHER_SNAPSHOT_FORMAT_VERSION
+    uint32_t layoutVersion;  // BPF_TETHER_LAYOUT_VERSION of the writer
+    uint64_t bootTimeNs;     // CLOCK_BOOTTIME at capture time, the clock of Tether4Value.last_used
+    uint32_t mapCount;       // Number of TetherSnapshotMap entries that follow
+    uint32_t reserved;       // Zero
+};
+static_assert(sizeof(TetherSnapshotHeader) == 32, "Incorrect struct size.");
+
+struct TetherSnapshotMap {
+    char name[40];          // NUL-terminated, e.g. "tether_upstream4_map"
+    uint32_t keySize;
+    uint32_t valueSize;
+    uint64_t count;         // Number of entries
+    uint64_t keysOffset;    // count * keySize bytes
+    uint64_t valuesOffset;  // count * valueSize bytes
+};
+static_assert(sizeof(TetherSnapshotMap) == 72, "Incorrect struct size.");
+
+}  // namespace android
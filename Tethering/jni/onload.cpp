@@ -23,9 +23,14 @@
 namespace android {
 
 int register_android_net_util_TetheringUtils(JNIEnv* env);
+int register_android_net_ip_RouterAdvertisementDaemon(JNIEnv* env);
+int register_android_net_ip_NeighborRuleMonitor(JNIEnv* env);
 int register_com_android_networkstack_tethering_BpfMap(JNIEnv* env);
 int register_com_android_networkstack_tethering_BpfCoordinator(JNIEnv* env);
 int register_com_android_networkstack_tethering_BpfUtils(JNIEnv* env);
+int register_com_android_networkstack_tethering_ConntrackEventReader(JNIEnv* env);
+int register_com_android_networkstack_tethering_MapWorker(JNIEnv* env);
+int register_com_android_networkstack_tethering_FlowtableOffload(JNIEnv* env);
 
 extern "C" jint JNI_OnLoad(JavaVM* vm, void*) {
     JNIEnv *env;
@@ -36,12 +41,22 @@ extern "C" jint JNI_OnLoad(JavaVM* vm, void*) {
 
     if (register_android_net_util_TetheringUtils(env) < 0) return JNI_ERR;
 
+    if (register_android_net_ip_RouterAdvertisementDaemon(env) < 0) return JNI_ERR;
+
+    if (register_android_net_ip_NeighborRuleMonitor(env) < 0) return JNI_ERR;
+
     if (register_com_android_networkstack_tethering_BpfMap(env) < 0) return JNI_ERR;
 
     if (register_com_android_networkstack_tethering_BpfCoordinator(env) < 0) return JNI_ERR;
 
     if (register_com_android_networkstack_tethering_BpfUtils(env) < 0) return JNI_ERR;
 
+    if (register_com_android_networkstack_tethering_ConntrackEventReader(env) < 0) return JNI_ERR;
+
+    if (register_com_android_networkstack_tethering_MapWorker(env) < 0) return JNI_ERR;
+
+    if (register_com_android_networkstack_tethering_FlowtableOffload(env) < 0) return JNI_ERR;
+
     return JNI_VERSION_1_6;
 }
 
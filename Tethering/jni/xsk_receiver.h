@@ -0,0 +1,349 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <mutex>
+
+#ifndef BPF_FD_JUST_USE_INT
+#define BPF_FD_JUST_USE_INT
+#endif
+#include "BpfSyscallWrappers.h"
+#include "bpf_tethering.h"
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+namespace android {
+
+// Attaches progFd as the XDP program of ifIndex with the given XDP_FLAGS_*, or detaches the
+// program if progFd is -1. Returns 0 on success or a negative errno.
+inline int setXdpProgram(int ifIndex, int progFd, uint32_t flags) {
+    struct {
+        nlmsghdr n;
+        ifinfomsg i;
+        nlattr xdp;
+        nlattr fd;
+        int32_t fdValue;
+        nlattr flags;
+        uint32_t flagsValue;
+    } req = {
+        .n = {
+            .nlmsg_len = sizeof(req),
+            .nlmsg_type = RTM_SETLINK,
+            .nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK,
+        },
+        .i = {
+            .ifi_family = AF_UNSPEC,
+            .ifi_index = ifIndex,
+        },
+        .xdp = {
+            .nla_len = sizeof(req) - offsetof(decltype(req), xdp),
+            .nla_type = NLA_F_NESTED | IFLA_XDP,
+        },
+        .fd = {
+            .nla_len = sizeof(nlattr) + sizeof(int32_t),
+            .nla_type = IFLA_XDP_FD,
+        },
+        .fdValue = progFd,
+        .flags = {
+            .nla_len = sizeof(nlattr) + sizeof(uint32_t),
+            .nla_type = IFLA_XDP_FLAGS,
+        },
+        .flagsValue = flags,
+    };
+
+    const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd == -1) return -errno;
+
+    const sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    struct {
+        nlmsghdr h;
+        nlmsgerr e;
+        char buf[256];
+    } resp = {};
+    int ret = 0;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&kernel), sizeof(kernel)) ||
+        send(fd, &req, sizeof(req), 0) != static_cast<ssize_t>(sizeof(req))) {
+        ret = -errno;
+    } else if (recv(fd, &resp, sizeof(resp), 0) <
+                       static_cast<ssize_t>(NLMSG_SPACE(sizeof(nlmsgerr))) ||
+               resp.h.nlmsg_type != NLMSG_ERROR) {
+        ret = -EPROTO;
+    } else {
+        ret = resp.e.error;
+    }
+    close(fd);
+    return ret;
+}
+
+// Attaches progFd as the XDP program of ifIndex in the given XDP_FLAGS_*_MODE, unless a program
+// is already attached. Returns 0 on success or a negative errno, e.g. -EOPNOTSUPP if the driver
+// has no XDP support and mode is XDP_FLAGS_DRV_MODE.
+inline int attachXdpProgram(int ifIndex, int progFd, uint32_t mode) {
+    return setXdpProgram(ifIndex, progFd, XDP_FLAGS_UPDATE_IF_NOEXIST | mode);
+}
+
+// Attaches progFd in native (driver) mode. Generic mode is not used outside of tests: it would
+// make every packet received on the interface go through XDP on the slow path, just to pick out
+// the solicitations.
+inline int attachNativeXdpProgram(int ifIndex, int progFd) {
+    return attachXdpProgram(ifIndex, progFd, XDP_FLAGS_DRV_MODE);
+}
+
+// Receives, through an AF_XDP socket, the packets that the xdp/tether_xsk_control program
+// redirects from one queue of a downstream interface. Only router solicitations are redirected:
+// DNS, DHCP and the other neighbor discovery messages still go through the stack to their
+// existing sockets.
+//
+// The program is only attached in native mode, so open() fails on interfaces whose driver has no
+// XDP support; their solicitations keep going through the stack. Tests can ask for generic mode
+// instead, to run on veth interfaces regardless of their native XDP support. The socket is bound
+// in copy mode, which does not depend on zero-copy support. Frames are received in batches from
+// the RX ring and handed back to the kernel through the fill ring as soon as they are processed,
+// so the receiver never allocates after open().
+//
+// Not thread-safe: open() and close() may not race with receive().
+class XskReceiver {
+  public:
+    static constexpr uint32_t kNumFrames = 64;  // Also the size of the RX and fill rings
+    static constexpr uint32_t kFrameSize = 2048;
+
+    XskReceiver() = default;
+    ~XskReceiver() { close(); }
+    XskReceiver(const XskReceiver&) = delete;
+    XskReceiver& operator=(const XskReceiver&) = delete;
+
+    // Creates the socket on the given queue, registers it in the XSK maps and attaches the
+    // control program to the interface in native mode, or in generic mode if
+    // genericModeForTesting is true. Returns 0 on success or a negative errno, in which case
+    // nothing is left behind.
+    int open(int ifIndex, uint32_t queue, bool genericModeForTesting = false) {
+        mIfIndex = ifIndex;
+        const int ret = openSocket(queue);
+        if (ret == 0) {
+            return registerAndAttach(queue,
+                    genericModeForTesting ? XDP_FLAGS_SKB_MODE : XDP_FLAGS_DRV_MODE);
+        }
+        close();
+        return ret;
+    }
+
+    // Detaches the control program and releases the socket. Safe to call more than once.
+    void close() {
+        if (mXdpFlags != 0) {
+            setXdpProgram(mIfIndex, -1, mXdpFlags);
+            mXdpFlags = 0;
+        }
+        if (mSlot != kNoSlot) {
+            std::lock_guard<std::mutex> guard(slotLock());
+            const int configMap = bpf::mapRetrieveRW(TETHER_XSK_CONFIG_MAP_PATH);
+            if (configMap >= 0) {
+                const TetherXskConfigKey key = static_cast<uint32_t>(mIfIndex);
+                bpf::deleteMapEntry(configMap, &key);
+                ::close(configMap);
+            }
+            const int xskMap = bpf::mapRetrieveRW(TETHER_XSK_MAP_PATH);
+            if (xskMap >= 0) {
+                bpf::deleteMapEntry(xskMap, &mSlot);
+                ::close(xskMap);
+            }
+            mSlot = kNoSlot;
+        }
+        if (mRxMap != MAP_FAILED) munmap(mRxMap, mRxMapLen);
+        if (mFillMap != MAP_FAILED) munmap(mFillMap, mFillMapLen);
+        if (mUmem != MAP_FAILED) munmap(mUmem, kNumFrames * kFrameSize);
+        mRxMap = mFillMap = mUmem = MAP_FAILED;
+        if (mFd != -1) ::close(mFd);
+        mFd = -1;
+    }
+
+    int fd() const { return mFd; }
+
+    // Calls f(frame, length) for every frame waiting in the RX ring, up to kNumFrames, then
+    // returns the frames to the kernel. Returns the number of frames processed.
+    template <typename F>
+    uint32_t receive(F f) {
+        const uint32_t rxCons = *mRxConsumer;
+        const uint32_t n = __atomic_load_n(mRxProducer, __ATOMIC_ACQUIRE) - rxCons;
+        const uint32_t fillProd = *mFillProducer;
+        for (uint32_t i = 0; i < n; i++) {
+            const xdp_desc& desc = mRxDescs[(rxCons + i) & (kNumFrames - 1)];
+            if (desc.addr + desc.len <= kNumFrames * kFrameSize) {
+                f(static_cast<const uint8_t*>(mUmem) + desc.addr, desc.len);
+            }
+            // There are only kNumFrames buffers, so the fill ring always has room for this one.
+            mFillAddrs[(fillProd + i) & (kNumFrames - 1)] = desc.addr & ~uint64_t(kFrameSize - 1);
+        }
+        __atomic_store_n(mFillProducer, fillProd + n, __ATOMIC_RELEASE);
+        __atomic_store_n(mRxConsumer, rxCons + n, __ATOMIC_RELEASE);
+        return n;
+    }
+
+  private:
+    static constexpr uint32_t kNoSlot = ~0U;
+
+    // Serializes the slot allocation of the receivers of all interfaces.
+    static std::mutex& slotLock() {
+        static std::mutex lock;
+        return lock;
+    }
+
+    int openSocket(uint32_t queue) {
+        mFd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+        if (mFd == -1) return -errno;
+
+        mUmem = mmap(nullptr, kNumFrames * kFrameSize, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mUmem == MAP_FAILED) return -errno;
+
+        const xdp_umem_reg reg = {
+            .addr = reinterpret_cast<uintptr_t>(mUmem),
+            .len = kNumFrames * kFrameSize,
+            .chunk_size = kFrameSize,
+        };
+        // Nothing is transmitted, but a UMEM cannot be bound without a completion ring.
+        const uint32_t ringSize = kNumFrames;
+        if (setsockopt(mFd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) ||
+            setsockopt(mFd, SOL_XDP, XDP_UMEM_FILL_RING, &ringSize, sizeof(ringSize)) ||
+            setsockopt(mFd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ringSize, sizeof(ringSize)) ||
+            setsockopt(mFd, SOL_XDP, XDP_RX_RING, &ringSize, sizeof(ringSize))) {
+            return -errno;
+        }
+
+        xdp_mmap_offsets off = {};
+        socklen_t optlen = sizeof(off);
+        if (getsockopt(mFd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen)) return -errno;
+
+        mRxMapLen = off.rx.desc + kNumFrames * sizeof(xdp_desc);
+        mRxMap = mmap(nullptr, mRxMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mFd,
+                      XDP_PGOFF_RX_RING);
+        if (mRxMap == MAP_FAILED) return -errno;
+        mFillMapLen = off.fr.desc + kNumFrames * sizeof(uint64_t);
+        mFillMap = mmap(nullptr, mFillMapLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        mFd, XDP_UMEM_PGOFF_FILL_RING);
+        if (mFillMap == MAP_FAILED) return -errno;
+
+        uint8_t* rx = static_cast<uint8_t*>(mRxMap);
+        mRxProducer = reinterpret_cast<uint32_t*>(rx + off.rx.producer);
+        mRxConsumer = reinterpret_cast<uint32_t*>(rx + off.rx.consumer);
+        mRxDescs = reinterpret_cast<const xdp_desc*>(rx + off.rx.desc);
+        uint8_t* fill = static_cast<uint8_t*>(mFillMap);
+        mFillProducer = reinterpret_cast<uint32_t*>(fill + off.fr.producer);
+        mFillAddrs = reinterpret_cast<uint64_t*>(fill + off.fr.desc);
+
+        // Hand every frame to the kernel before binding, so that no packet is dropped for lack
+        // of a buffer.
+        for (uint32_t i = 0; i < kNumFrames; i++) mFillAddrs[i] = i * kFrameSize;
+        __atomic_store_n(mFillProducer, kNumFrames, __ATOMIC_RELEASE);
+
+        const sockaddr_xdp addr = {
+            .sxdp_family = AF_XDP,
+            .sxdp_flags = XDP_COPY,
+            .sxdp_ifindex = static_cast<uint32_t>(mIfIndex),
+            .sxdp_queue_id = queue,
+        };
+        if (bind(mFd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))) return -errno;
+        return 0;
+    }
+
+    int registerAndAttach(uint32_t queue, uint32_t mode) {
+        int ret = 0;
+        const int prog = bpf::retrieveProgram(TETHER_XSK_CONTROL_XDP_PROG_PATH);
+        const int xskMap = bpf::mapRetrieveRW(TETHER_XSK_MAP_PATH);
+        const int configMap = bpf::mapRetrieveRW(TETHER_XSK_CONFIG_MAP_PATH);
+        if (prog < 0 || xskMap < 0 || configMap < 0) {
+            ret = -errno;
+        } else {
+            ret = registerSocket(xskMap, configMap, queue);
+        }
+
+        if (ret == 0) {
+            ret = attachXdpProgram(mIfIndex, prog, mode);
+            if (ret == 0) mXdpFlags = mode;
+        }
+
+        if (prog >= 0) ::close(prog);
+        if (xskMap >= 0) ::close(xskMap);
+        if (configMap >= 0) ::close(configMap);
+        if (ret != 0) close();
+        return ret;
+    }
+
+    int registerSocket(int xskMap, int configMap, uint32_t queue) {
+        std::lock_guard<std::mutex> guard(slotLock());
+
+        bool used[TETHER_XSK_MAX_SLOTS] = {};
+        TetherXskConfigKey key;
+        TetherXskConfigValue value;
+        int rv = bpf::getFirstMapKey(configMap, &key);
+        while (rv == 0) {
+            if (bpf::findMapEntry(configMap, &key, &value) == 0 &&
+                value.slot < TETHER_XSK_MAX_SLOTS) {
+                used[value.slot] = true;
+            }
+            rv = bpf::getNextMapKey(configMap, &key, &key);
+        }
+
+        uint32_t slot = 0;
+        while (slot < TETHER_XSK_MAX_SLOTS && used[slot]) slot++;
+        if (slot == TETHER_XSK_MAX_SLOTS) return -ENOSPC;
+
+        if (bpf::writeToMapEntry(xskMap, &slot, &mFd, BPF_ANY)) return -errno;
+        key = static_cast<uint32_t>(mIfIndex);
+        value = { .slot = slot, .queue = queue };
+        if (bpf::writeToMapEntry(configMap, &key, &value, BPF_ANY)) {
+            const int ret = -errno;
+            bpf::deleteMapEntry(xskMap, &slot);
+            return ret;
+        }
+        mSlot = slot;
+        return 0;
+    }
+
+    int mIfIndex = 0;
+    int mFd = -1;
+    uint32_t mSlot = kNoSlot;
+    uint32_t mXdpFlags = 0;  // XDP_FLAGS_*_MODE the program was attached with, or 0
+
+    void* mUmem = MAP_FAILED;
+    void* mRxMap = MAP_FAILED;
+    size_t mRxMapLen = 0;
+    void* mFillMap = MAP_FAILED;
+    size_t mFillMapLen = 0;
+
+    uint32_t* mRxProducer = nullptr;
+    uint32_t* mRxConsumer = nullptr;
+    const xdp_desc* mRxDescs = nullptr;
+    uint32_t* mFillProducer = nullptr;
+    uint64_t* mFillAddrs = nullptr;
+};
+
+}  // namespace android
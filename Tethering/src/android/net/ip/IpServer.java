@@ -69,6 +69,7 @@ import com.android.internal.util.StateMachine;
 import com.android.networkstack.tethering.BpfCoordinator;
 import com.android.networkstack.tethering.BpfCoordinator.ClientInfo;
 import com.android.networkstack.tethering.BpfCoordinator.Ipv6ForwardingRule;
+import com.android.networkstack.tethering.BpfCoordinator.QosMarking;
 import com.android.networkstack.tethering.PrivateAddressCoordinator;
 
 import java.net.Inet4Address;
@@ -175,9 +176,16 @@ public class IpServer extends StateMachine {
             return new IpNeighborMonitor(handler, log, consumer);
         }
 
+        /** Create a NeighborRuleMonitor to be used by this IpServer. */
+        public NeighborRuleMonitor getNeighborRuleMonitor(InterfaceParams ifParams,
+                QosMarking qos, SharedLog log) {
+            return new NeighborRuleMonitor(ifParams, qos, log);
+        }
+
         /** Create a RouterAdvertisementDaemon instance to be used by IpServer.*/
-        public RouterAdvertisementDaemon getRouterAdvertisementDaemon(InterfaceParams ifParams) {
-            return new RouterAdvertisementDaemon(ifParams);
+        public RouterAdvertisementDaemon getRouterAdvertisementDaemon(InterfaceParams ifParams,
+                boolean useXsk) {
+            return new RouterAdvertisementDaemon(ifParams, useXsk);
         }
 
         /** Get |ifName|'s interface information.*/
@@ -240,6 +248,7 @@ public class IpServer extends StateMachine {
     private final LinkProperties mLinkProperties;
     private final boolean mUsingLegacyDhcp;
     private final boolean mUsingBpfOffload;
+    private final boolean mUsingXskControl;
 
     private final Dependencies mDeps;
 
@@ -256,6 +265,9 @@ public class IpServer extends StateMachine {
     private LinkProperties mLastIPv6LinkProperties;
     private RouterAdvertisementDaemon mRaDaemon;
     private DadProxy mDadProxy;
+    // Null if BPF offload is disabled or IPv6 rules are not written to BPF maps directly.
+    @Nullable
+    private NeighborRuleMonitor mNeighborRuleMonitor;
 
     // To be accessed only on the handler thread
     private int mDhcpServerStartIndex = 0;
@@ -285,7 +297,7 @@ public class IpServer extends StateMachine {
     public IpServer(
             String ifaceName, Looper looper, int interfaceType, SharedLog log,
             INetd netd, @NonNull BpfCoordinator coordinator, Callback callback,
-            boolean usingLegacyDhcp, boolean usingBpfOffload,
+            boolean usingLegacyDhcp, boolean usingBpfOffload, boolean usingXskControl,
             PrivateAddressCoordinator addressCoordinator, Dependencies deps) {
         super(ifaceName, looper);
         mLog = log.forSubComponent(ifaceName);
@@ -298,6 +310,8 @@ public class IpServer extends StateMachine {
         mLinkProperties = new LinkProperties();
         mUsingLegacyDhcp = usingLegacyDhcp;
         mUsingBpfOffload = usingBpfOffload;
+        // Receiving solicitations through AF_XDP uses the same XDP support as BPF offload.
+        mUsingXskControl = usingBpfOffload && usingXskControl;
         mPrivateAddressCoordinator = addressCoordinator;
         mDeps = deps;
         resetLinkProperties();
@@ -668,7 +682,7 @@ public class IpServer extends StateMachine {
             return false;
         }
 
-        mRaDaemon = mDeps.getRouterAdvertisementDaemon(mInterfaceParams);
+        mRaDaemon = mDeps.getRouterAdvertisementDaemon(mInterfaceParams, mUsingXskControl);
         if (!mRaDaemon.start()) {
             stopIPv6();
             return false;
@@ -679,6 +693,16 @@ public class IpServer extends StateMachine {
                     || "T".equals(Build.VERSION.CODENAME)) {
             // DAD Proxy starts forwarding packets after IPv6 upstream is present.
             mDadProxy = mDeps.getDadProxy(getHandler(), mInterfaceParams);
+
+            // Before S, the IPv6 rules are written by netd. The monitor only writes the rules
+            // ahead of handleNeighborEvent, which still writes them as well.
+            if (mUsingBpfOffload) {
+                mNeighborRuleMonitor = mDeps.getNeighborRuleMonitor(mInterfaceParams,
+                        mBpfCoordinator.getDownstreamQos(), mLog);
+                if (mNeighborRuleMonitor != null && !mNeighborRuleMonitor.start()) {
+                    mNeighborRuleMonitor = null;
+                }
+            }
         }
 
         return true;
@@ -697,6 +721,11 @@ public class IpServer extends StateMachine {
             mDadProxy.stop();
             mDadProxy = null;
         }
+
+        if (mNeighborRuleMonitor != null) {
+            mNeighborRuleMonitor.stop();
+            mNeighborRuleMonitor = null;
+        }
     }
 
     // IPv6TetheringCoordinator sends updates with carefully curated IPv6-only
@@ -756,6 +785,11 @@ public class IpServer extends StateMachine {
         setRaParams(params);
         mLastIPv6LinkProperties = v6only;
 
+        // Switch the native monitor first, so that any rule it writes while the existing rules
+        // are moved uses the new upstream. It writes nothing while offload is not started.
+        if (mNeighborRuleMonitor != null) {
+            mNeighborRuleMonitor.setUpstream(mBpfCoordinator.isStarted() ? upstreamIfIndex : 0);
+        }
         updateIpv6ForwardingRules(mLastIPv6UpstreamIfindex, upstreamIfIndex, null);
         mLastIPv6UpstreamIfindex = upstreamIfIndex;
         if (mDadProxy != null) {
@@ -25,6 +25,7 @@ import static android.system.OsConstants.SOCK_NONBLOCK;
 import static android.system.OsConstants.SOCK_RAW;
 
 import android.net.util.InterfaceParams;
+import android.net.util.MessageBatch;
 import android.net.util.SocketUtils;
 import android.net.util.TetheringUtils;
 import android.os.Handler;
@@ -68,6 +69,18 @@ public class NeighborPacketForwarder extends PacketReader {
     public static final int ICMPV6_NEIGHBOR_ADVERTISEMENT  = 136;
     public static final int ICMPV6_NEIGHBOR_SOLICITATION = 135;
 
+    // Solicitations accepted per target address per interval before the kernel drops them. The
+    // solicitations forwarded are duplicate address detection probes, whose source is always ::,
+    // and a client only sends a handful per address (RFC 4862 DupAddrDetectTransmits).
+    private static final int NS_RATE_LIMIT_BURST = 8;
+    private static final int NS_RATE_LIMIT_INTERVAL_MS = 1000;
+
+    // Packets are drained from the socket in batches to save a system call per packet when
+    // a burst of neighbor discovery traffic arrives.
+    private static final int RECV_BATCH_SIZE = 16;
+    private final MessageBatch mBatch = new MessageBatch(RECV_BATCH_SIZE, DEFAULT_RECV_BUF_SIZE);
+    private int mBatchIndex;
+
     public NeighborPacketForwarder(Handler h, InterfaceParams tetheredInterface, int type) {
         super(h);
         mTag = NeighborPacketForwarder.class.getSimpleName() + "-"
@@ -115,6 +128,8 @@ public class NeighborPacketForwarder extends PacketReader {
 
     @Override
     protected FileDescriptor createFd() {
+        mBatch.clear();
+        mBatchIndex = 0;
         try {
             // ICMPv6 packets from modem do not have eth header, so RAW socket cannot be used.
             // To keep uniformity in both directions PACKET socket can be used.
@@ -125,6 +140,10 @@ public class NeighborPacketForwarder extends PacketReader {
                 TetheringUtils.setupNaSocket(mFd);
             } else if (mType == ICMPV6_NEIGHBOR_SOLICITATION) {
                 TetheringUtils.setupNsSocket(mFd);
+                // The targets are not restricted because the solicitations forwarded here are
+                // the clients' duplicate address detection probes for their own addresses.
+                TetheringUtils.setupNsFloodFilter(mFd, mListenIfaceParams.index,
+                        null /* targets */, NS_RATE_LIMIT_BURST, NS_RATE_LIMIT_INTERVAL_MS);
             }
 
             SocketAddress bindAddress = SocketUtils.makePacketSocketAddress(
@@ -139,6 +158,23 @@ public class NeighborPacketForwarder extends PacketReader {
         return mFd;
     }
 
+    @Override
+    protected void onStop() {
+        if (mType == ICMPV6_NEIGHBOR_SOLICITATION) {
+            TetheringUtils.clearNsFloodFilter(mListenIfaceParams.index);
+        }
+    }
+
+    @Override
+    protected int readPacket(FileDescriptor fd, byte[] packetBuffer) throws Exception {
+        if (mBatchIndex >= mBatch.size()) {
+            mBatchIndex = 0;
+            // Throws EAGAIN once the socket is drained, which ends this round of reads.
+            mBatch.receive(fd);
+        }
+        return mBatch.copyPayload(mBatchIndex++, packetBuffer);
+    }
+
     private Inet6Address getIpv6DestinationAddress(byte[] recvbuf) {
         Inet6Address dstAddr;
         try {
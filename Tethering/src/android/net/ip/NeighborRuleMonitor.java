@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package android.net.ip;
+
+import android.net.util.InterfaceParams;
+import android.net.util.SharedLog;
+
+import androidx.annotation.NonNull;
+
+import com.android.networkstack.tethering.BpfCoordinator.QosMarking;
+
+import java.io.IOException;
+
+/**
+ * Programs the IPv6 downstream forwarding rules of a tethered interface as soon as its neighbors
+ * become reachable.
+ *
+ * IpServer learns about new neighbors through {@link IpNeighborMonitor}, whose events are queued
+ * on the IpServer handler and then on the BpfCoordinator handler before the rule is written. This
+ * monitor listens to the same netlink notifications from a native thread and writes or removes
+ * the rules immediately, so that offload starts without that queueing delay.
+ *
+ * The rules written here are only a latency hint. The monitor reports nothing back to Java:
+ * IpServer and BpfCoordinator stay authoritative, process every neighbor event as before and
+ * write the same rule again, so each event is written to the map twice. Whatever the normal path
+ * writes or removes last is the final state of the rule, and the rules are only tracked, counted
+ * and cleaned up by BpfCoordinator. The monitor writes the rules with the same downstream QoS
+ * marking as BpfCoordinator, so that packets forwarded in between are marked the same way.
+ *
+ * This class is not thread-safe and must be used from the IpServer handler thread.
+ *
+ * @hide
+ */
+public class NeighborRuleMonitor {
+    static {
+        System.loadLibrary("tetherutilsjni");
+    }
+
+    private static final String TAG = NeighborRuleMonitor.class.getSimpleName();
+
+    @NonNull
+    private final InterfaceParams mDownstream;
+    @NonNull
+    private final QosMarking mQos;
+    @NonNull
+    private final SharedLog mLog;
+    private long mNativeMonitor;
+
+    /**
+     * @param qos the QoS marking of the written rules, see BpfCoordinator#getDownstreamQos.
+     */
+    public NeighborRuleMonitor(@NonNull InterfaceParams downstream, @NonNull QosMarking qos,
+            @NonNull SharedLog log) {
+        mDownstream = downstream;
+        mQos = qos;
+        mLog = log.forSubComponent(TAG);
+    }
+
+    /** Start monitoring. Returns false if the monitor could not be started. */
+    public boolean start() {
+        if (mNativeMonitor != 0) return true;
+        if (!mDownstream.hasMacAddress) return false;
+
+        try {
+            mNativeMonitor = nativeStart(mDownstream.index, mDownstream.macAddr.toByteArray(),
+                    mQos.priority, mQos.dscp, mQos.flags);
+        } catch (IOException | IllegalArgumentException e) {
+            mLog.e("Could not start neighbor rule monitor: " + e);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Set the upstream interface that new rules forward from, or 0 if there is no IPv6 upstream.
+     * Existing rules are not modified.
+     */
+    public void setUpstream(int upstreamIfindex) {
+        if (mNativeMonitor == 0) return;
+        nativeSetUpstream(mNativeMonitor, upstreamIfindex);
+    }
+
+    /** Stop monitoring. Rules that were already written are left to IpServer. */
+    public void stop() {
+        if (mNativeMonitor == 0) return;
+        nativeStop(mNativeMonitor);
+        mNativeMonitor = 0;
+    }
+
+    private static native long nativeStart(int ifIndex, byte[] mac, long priority, short dscp,
+            short qosFlags) throws IOException;
+    private static native void nativeSetUpstream(long monitor, int upstreamIfindex);
+    private static native void nativeStop(long monitor);
+}
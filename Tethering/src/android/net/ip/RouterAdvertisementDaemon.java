@@ -19,7 +19,11 @@ package android.net.ip;
 import static android.net.util.NetworkConstants.RFC7421_PREFIX_LENGTH;
 import static android.net.util.TetheringUtils.getAllNodesForScopeId;
 import static android.system.OsConstants.AF_INET6;
+import static android.system.OsConstants.EAGAIN;
 import static android.system.OsConstants.IPPROTO_ICMPV6;
+import static android.system.OsConstants.MSG_DONTWAIT;
+import static android.system.OsConstants.POLLIN;
+import static android.system.OsConstants.POLLNVAL;
 import static android.system.OsConstants.SOCK_RAW;
 import static android.system.OsConstants.SOL_SOCKET;
 import static android.system.OsConstants.SO_SNDTIMEO;
@@ -38,10 +42,13 @@ import android.net.LinkAddress;
 import android.net.MacAddress;
 import android.net.TrafficStats;
 import android.net.util.InterfaceParams;
+import android.net.util.MessageBatch;
 import android.net.util.SocketUtils;
 import android.net.util.TetheringUtils;
+import android.os.SystemClock;
 import android.system.ErrnoException;
 import android.system.Os;
+import android.system.StructPollfd;
 import android.system.StructTimeval;
 import android.util.Log;
 
@@ -55,6 +62,7 @@ import com.android.net.module.util.structs.RdnssOption;
 
 import java.io.FileDescriptor;
 import java.io.IOException;
+import java.io.InterruptedIOException;
 import java.net.Inet6Address;
 import java.net.InetAddress;
 import java.net.InetSocketAddress;
@@ -82,6 +90,10 @@ import java.util.concurrent.atomic.AtomicInteger;
  * @hide
  */
 public class RouterAdvertisementDaemon {
+    static {
+        System.loadLibrary("tetherutilsjni");
+    }
+
     private static final String TAG = RouterAdvertisementDaemon.class.getSimpleName();
 
     // Summary of various timers and lifetimes.
@@ -123,6 +135,13 @@ public class RouterAdvertisementDaemon {
     private volatile FileDescriptor mSocket;
     private volatile MulticastTransmitter mMulticastTransmitter;
     private volatile UnicastResponder mUnicastResponder;
+    // The time of the last multicast RA, in SystemClock.elapsedRealtime() milliseconds.
+    private volatile long mLastMulticastRaMs;
+    // Handle of the native responder answering Router Solicitations, or 0 if solicitations are
+    // answered by mUnicastResponder instead.
+    @GuardedBy("mLock")
+    private long mNativeResponder;
+    private final boolean mUseXsk;
 
     /** Encapsulate the RA parameters for RouterAdvertisementDaemon.*/
     public static class RaParams {
@@ -248,7 +267,19 @@ public class RouterAdvertisementDaemon {
     }
 
     public RouterAdvertisementDaemon(InterfaceParams ifParams) {
+        this(ifParams, false /* useXsk */);
+    }
+
+    /**
+     * @param useXsk whether the native responder should also receive solicitations through an
+     *               AF_XDP socket fed by an XDP program on the interface, which bypasses the stack.
+     *               This falls back to the regular socket if the kernel or the driver does not
+     *               support it. Only router solicitations are received this way; DNS, DHCP and
+     *               other neighbor discovery traffic is unaffected.
+     */
+    public RouterAdvertisementDaemon(InterfaceParams ifParams, boolean useXsk) {
         mInterface = ifParams;
+        mUseXsk = useXsk;
         mAllNodes = new InetSocketAddress(getAllNodesForScopeId(mInterface.index), 0);
         mDeprecatedInfoTracker = new DeprecatedInfoTracker();
     }
@@ -269,6 +300,7 @@ public class RouterAdvertisementDaemon {
 
             mRaParams = newParams;
             assembleRaLocked();
+            updateNativeResponderLocked();
         }
 
         maybeNotifyMulticastTransmitter();
@@ -283,14 +315,26 @@ public class RouterAdvertisementDaemon {
         mMulticastTransmitter = new MulticastTransmitter();
         mMulticastTransmitter.start();
 
-        mUnicastResponder = new UnicastResponder();
-        mUnicastResponder.start();
+        if (!startNativeResponder()) {
+            try {
+                mUnicastResponder = new UnicastResponder(mSocket);
+            } catch (ErrnoException e) {
+                Log.e(TAG, "Failed to create RS responder: " + e);
+                stop();
+                return false;
+            }
+            mUnicastResponder.start();
+        }
 
         return true;
     }
 
     /** Stop router advertisement daemon. */
     public void stop() {
+        stopNativeResponder();
+        // The responder must be gone before the socket is closed, so that it cannot receive from
+        // a file descriptor number that was reused in the meantime.
+        if (mUnicastResponder != null) mUnicastResponder.quit();
         closeSocket();
         // Wake up mMulticastTransmitter thread to interrupt a potential 1 day sleep before
         // the thread's termination.
@@ -531,6 +575,73 @@ public class RouterAdvertisementDaemon {
         mSocket = null;
     }
 
+    // Answering solicitations natively avoids waking up a Java thread for every client that joins,
+    // so the RA is only copied down when its content changes.
+    private boolean startNativeResponder() {
+        synchronized (mLock) {
+            try {
+                mNativeResponder = nativeStartResponder(this, mSocket, mInterface.index, mUseXsk);
+            } catch (IOException e) {
+                Log.e(TAG, "Failed to start native RA responder, falling back to Java: " + e);
+                return false;
+            }
+            updateNativeResponderLocked();
+        }
+        return true;
+    }
+
+    @GuardedBy("mLock")
+    private void updateNativeResponderLocked() {
+        if (mNativeResponder == 0) return;
+        // Like maybeSendRA, do not answer solicitations until there is an actual RA to send.
+        final int length = (mRaLength < ICMPV6_RA_HEADER_LEN) ? 0 : mRaLength;
+        nativeUpdateResponder(mNativeResponder, mRA, length);
+    }
+
+    // Called from the native responder thread when it exits because the socket is unusable, so
+    // that solicitations are still answered. Must not stop the native responder, which would
+    // join the calling thread.
+    private void onNativeResponderStopped() {
+        Log.e(TAG, "Native RA responder stopped, falling back to Java");
+        if (!isSocketValid()) return;
+        try {
+            mUnicastResponder = new UnicastResponder(mSocket);
+        } catch (ErrnoException e) {
+            Log.e(TAG, "Failed to create RS responder: " + e);
+            return;
+        }
+        mUnicastResponder.start();
+    }
+
+    // Waits until a multicast RA would not follow one sent by the native responder less than
+    // MIN_DELAY_BETWEEN_RAS_SEC earlier, and records it as sent as far as the native responder
+    // is concerned.
+    private void claimMulticast() {
+        while (true) {
+            final long waitMs;
+            synchronized (mLock) {
+                if (mNativeResponder == 0) return;
+                waitMs = nativeClaimMulticast(mNativeResponder);
+            }
+            if (waitMs <= 0) return;
+            try {
+                Thread.sleep(waitMs);
+            } catch (InterruptedException ignored) {
+                // An urgent RA still has to respect the delay.
+            }
+        }
+    }
+
+    private void stopNativeResponder() {
+        final long responder;
+        synchronized (mLock) {
+            responder = mNativeResponder;
+            mNativeResponder = 0;
+        }
+        // Joins the responder thread, so must be called before the socket is closed.
+        if (responder != 0) nativeStopResponder(responder);
+    }
+
     private boolean isSocketValid() {
         final FileDescriptor s = mSocket;
         return (s != null) && s.valid();
@@ -560,6 +671,7 @@ public class RouterAdvertisementDaemon {
                 }
                 Os.sendto(mSocket, mRA, 0, mRaLength, 0, dest);
             }
+            if (dest == mAllNodes) mLastMulticastRaMs = SystemClock.elapsedRealtime();
             Log.d(TAG, "RA sendto " + dest.getAddress().getHostAddress());
         } catch (ErrnoException | SocketException e) {
             if (isSocketValid()) {
@@ -569,33 +681,109 @@ public class RouterAdvertisementDaemon {
     }
 
     private final class UnicastResponder extends Thread {
-        private final InetSocketAddress mSolicitor = new InetSocketAddress(0);
-        // The recycled buffer for receiving Router Solicitations from clients.
+        // The number of Router Solicitations drained from the socket with one system call.
+        private static final int RECV_BATCH_SIZE = 16;
+        // How long stop() waits for the thread to exit.
+        private static final int QUIT_TIMEOUT_MS = 1000;
+        // The recycled batch for receiving Router Solicitations from clients.
         // If the RS is larger than IPV6_MIN_MTU the packets are truncated.
         // This is fine since currently only byte 0 is examined anyway.
-        private final byte[] mSolicitation = new byte[IPV6_MIN_MTU];
+        private final MessageBatch mSolicitations = new MessageBatch(RECV_BATCH_SIZE,
+                IPV6_MIN_MTU);
+        private final Set<Inet6Address> mSolicitors = new HashSet<>();
+        private final FileDescriptor mRecvSocket;
+        // A pipe whose read end becomes readable when the thread must exit. recvmmsg is not
+        // interrupted by closing the socket from another thread, so the thread only blocks in
+        // poll(), on both the socket and the pipe.
+        private final FileDescriptor mQuitReader;
+        private final FileDescriptor mQuitWriter;
+
+        UnicastResponder(FileDescriptor socket) throws ErrnoException {
+            mRecvSocket = socket;
+            final FileDescriptor[] pipe = Os.pipe();
+            mQuitReader = pipe[0];
+            mQuitWriter = pipe[1];
+        }
 
         @Override
         public void run() {
-            while (isSocketValid()) {
-                try {
-                    // Blocking receive.
-                    final int rval = Os.recvfrom(
-                            mSocket, mSolicitation, 0, mSolicitation.length, 0, mSolicitor);
-                    // Do the least possible amount of validation.
-                    if (rval < 1 || mSolicitation[0] != asByte(ICMPV6_ROUTER_SOLICITATION)) {
-                        continue;
+            final StructPollfd[] fds = { pollFd(mRecvSocket), pollFd(mQuitReader) };
+            try {
+                while (true) {
+                    try {
+                        Os.poll(fds, -1 /* timeoutMs */);
+                    } catch (ErrnoException e) {
+                        Log.e(TAG, "poll error: " + e);
+                        return;
                     }
-                } catch (ErrnoException | SocketException e) {
-                    if (isSocketValid()) {
-                        Log.e(TAG, "recvfrom error: " + e);
+                    if (fds[1].revents != 0 || (fds[0].revents & POLLNVAL) != 0) return;
+                    if (fds[0].revents == 0) continue;
+
+                    // Also reached on POLLERR, so that receiving clears the pending error.
+                    try {
+                        mSolicitations.receive(mRecvSocket, MSG_DONTWAIT);
+                    } catch (ErrnoException e) {
+                        if (e.errno != EAGAIN) Log.e(TAG, "recvmmsg error: " + e);
+                        continue;
                     }
-                    continue;
+                    answerSolicitations();
                 }
+            } finally {
+                closeQuietly(mQuitReader);
+            }
+        }
 
-                maybeSendRA(mSolicitor);
+        /** Stop the thread and wait for it to exit. Must not be called from the thread. */
+        void quit() {
+            try {
+                Os.write(mQuitWriter, new byte[1], 0, 1);
+                join(QUIT_TIMEOUT_MS);
+            } catch (ErrnoException | InterruptedIOException | InterruptedException e) {
+                Log.e(TAG, "Failed to stop RS responder: " + e);
+            } finally {
+                closeQuietly(mQuitWriter);
             }
         }
+
+        private void answerSolicitations() {
+            // Do the least possible amount of validation.
+            mSolicitors.clear();
+            for (int i = 0; i < mSolicitations.size(); i++) {
+                if (mSolicitations.getLength(i) < 1
+                        || mSolicitations.getByte(i, 0) != asByte(ICMPV6_ROUTER_SOLICITATION)) {
+                    continue;
+                }
+                final Inet6Address src = mSolicitations.getSourceAddress(i);
+                if (src != null) mSolicitors.add(src);
+            }
+            if (mSolicitors.isEmpty()) return;
+
+            // A burst of solicitations from several clients is answered with a single multicast
+            // RA, as permitted by RFC 4861 section 6.2.6, as long as multicast RAs stay at least
+            // MIN_DELAY_BETWEEN_RAS_SEC apart. Otherwise each client gets a unicast RA.
+            final long sinceLastMulticastMs = SystemClock.elapsedRealtime() - mLastMulticastRaMs;
+            if (mSolicitors.size() > 1
+                    && sinceLastMulticastMs >= MIN_DELAY_BETWEEN_RAS_SEC * 1000L) {
+                maybeSendRA(mAllNodes);
+                return;
+            }
+            for (Inet6Address solicitor : mSolicitors) {
+                maybeSendRA(new InetSocketAddress(solicitor, 0));
+            }
+        }
+    }
+
+    private static StructPollfd pollFd(FileDescriptor fd) {
+        final StructPollfd pollFd = new StructPollfd();
+        pollFd.fd = fd;
+        pollFd.events = (short) POLLIN;
+        return pollFd;
+    }
+
+    private static void closeQuietly(FileDescriptor fd) {
+        try {
+            Os.close(fd);
+        } catch (ErrnoException ignored) { }
     }
 
     // TODO: Consider moving this to run on a provided Looper as a Handler,
@@ -613,6 +801,7 @@ public class RouterAdvertisementDaemon {
                     // Stop sleeping, immediately send an RA, and continue.
                 }
 
+                claimMulticast();
                 maybeSendRA(mAllNodes);
                 synchronized (mLock) {
                     if (mDeprecatedInfoTracker.decrementCounters()) {
@@ -656,4 +845,11 @@ public class RouterAdvertisementDaemon {
             return 1000 * (long) getNextMulticastTransmitDelaySec();
         }
     }
+
+    private static native long nativeStartResponder(RouterAdvertisementDaemon daemon,
+            FileDescriptor fd, int ifIndex, boolean useXsk) throws IOException;
+    private static native void nativeUpdateResponder(long responder, byte[] ra, int length);
+    // Returns 0 if a multicast RA may be sent now, or how many milliseconds to wait.
+    private static native long nativeClaimMulticast(long responder);
+    private static native void nativeStopResponder(long responder);
 }
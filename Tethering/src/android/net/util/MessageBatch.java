@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+package android.net.util;
+
+import static android.system.OsConstants.AF_INET6;
+
+import android.system.ErrnoException;
+
+import androidx.annotation.NonNull;
+import androidx.annotation.Nullable;
+
+import com.android.internal.annotations.VisibleForTesting;
+
+import java.io.FileDescriptor;
+import java.net.Inet6Address;
+import java.net.UnknownHostException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * A batch of datagrams received from a socket with a single system call.
+ *
+ * The datagrams are stored in one direct buffer that is split into fixed size slots. Each slot
+ * starts with a header describing the datagram (see BatchMessageHeader in
+ * android_net_util_TetheringUtils.cpp), followed by the payload.
+ *
+ * This class is not thread-safe.
+ *
+ * {@hide}
+ */
+public class MessageBatch {
+    /** The maximum number of messages that can be received at once. */
+    public static final int MAX_MESSAGES = 64;
+
+    // Sync from BatchMessageHeader in android_net_util_TetheringUtils.cpp.
+    @VisibleForTesting
+    static final int HEADER_LEN = 32;
+    private static final int LENGTH_OFFSET = 0;
+    private static final int FLAGS_OFFSET = 4;
+    private static final int IFINDEX_OFFSET = 8;
+    private static final int FAMILY_OFFSET = 12;
+    private static final int ADDR_LEN_OFFSET = 14;
+    private static final int ADDR_OFFSET = 16;
+    private static final int ADDR_MAX_LEN = 16;
+
+    // From include/uapi/linux/socket.h.
+    private static final int MSG_TRUNC = 0x20;
+
+    @NonNull
+    private final ByteBuffer mBuffer;
+    private final int mSlotSize;
+    private final int mMaxMessages;
+    private int mCount;
+
+    /**
+     * Create a batch that can hold up to maxMessages datagrams of up to maxMessageSize bytes.
+     * Longer datagrams are truncated.
+     */
+    public MessageBatch(int maxMessages, int maxMessageSize) {
+        if (maxMessages <= 0 || maxMessages > MAX_MESSAGES || maxMessageSize <= 0) {
+            throw new IllegalArgumentException("Invalid batch size " + maxMessages + " x "
+                    + maxMessageSize);
+        }
+        mMaxMessages = maxMessages;
+        mSlotSize = HEADER_LEN + maxMessageSize;
+        mBuffer = ByteBuffer.allocateDirect(mSlotSize * maxMessages);
+        mBuffer.order(ByteOrder.nativeOrder());
+    }
+
+    /**
+     * Replace the content of the batch with the datagrams queued on the given socket.
+     * Blocks until at least one datagram is available, unless the socket is non-blocking.
+     *
+     * @return the number of datagrams received.
+     * @throws ErrnoException if the receive failed, e.g. with EAGAIN if the socket is non-blocking
+     *                        and there is nothing to read. The batch is empty in that case.
+     */
+    public int receive(@NonNull FileDescriptor fd) throws ErrnoException {
+        return receive(fd, 0 /* flags */);
+    }
+
+    /**
+     * Like {@link #receive(FileDescriptor)}, with additional recvmmsg flags. Pass MSG_DONTWAIT to
+     * drain a blocking socket that poll() reported readable without blocking.
+     */
+    public int receive(@NonNull FileDescriptor fd, int flags) throws ErrnoException {
+        mCount = 0;
+        mCount = TetheringUtils.recvMessageBatch(fd, mBuffer, mSlotSize, mMaxMessages, flags);
+        return mCount;
+    }
+
+    /** Empty the batch. */
+    public void clear() {
+        mCount = 0;
+    }
+
+    /** Returns the number of datagrams in the batch. */
+    public int size() {
+        return mCount;
+    }
+
+    private int slot(int index) {
+        if (index < 0 || index >= mCount) {
+            throw new IndexOutOfBoundsException("Message " + index + " of " + mCount);
+        }
+        return index * mSlotSize;
+    }
+
+    /** Returns the number of payload bytes stored for the given datagram. */
+    public int getLength(int index) {
+        return mBuffer.getInt(slot(index) + LENGTH_OFFSET);
+    }
+
+    /** Returns true if the given datagram was longer than the maximum message size. */
+    public boolean isTruncated(int index) {
+        return (mBuffer.getInt(slot(index) + FLAGS_OFFSET) & MSG_TRUNC) != 0;
+    }
+
+    /** Returns the index of the interface the datagram was received on, or 0 if unknown. */
+    public int getInterfaceIndex(int index) {
+        return mBuffer.getInt(slot(index) + IFINDEX_OFFSET);
+    }
+
+    /** Returns the address family of the datagram's source address, e.g. AF_INET6. */
+    public int getFamily(int index) {
+        return mBuffer.getShort(slot(index) + FAMILY_OFFSET) & 0xffff;
+    }
+
+    /**
+     * Returns the raw source address of the datagram: an IPv6 address for AF_INET6 sockets or a
+     * link-layer address for AF_PACKET sockets.
+     */
+    @NonNull
+    public byte[] getRawSourceAddress(int index) {
+        final int base = slot(index);
+        final int len = Math.min(mBuffer.getShort(base + ADDR_LEN_OFFSET) & 0xffff, ADDR_MAX_LEN);
+        final byte[] addr = new byte[len];
+        for (int i = 0; i < len; i++) {
+            addr[i] = mBuffer.get(base + ADDR_OFFSET + i);
+        }
+        return addr;
+    }
+
+    /**
+     * Returns the IPv6 source address of the datagram, scoped to the receiving interface, or null
+     * if the datagram was not received on an AF_INET6 socket.
+     */
+    @Nullable
+    public Inet6Address getSourceAddress(int index) {
+        if (getFamily(index) != AF_INET6) return null;
+        try {
+            return Inet6Address.getByAddress(null /* host */, getRawSourceAddress(index),
+                    getInterfaceIndex(index));
+        } catch (UnknownHostException impossible) {
+            throw new AssertionError("16-byte array not valid IPv6 address?");
+        }
+    }
+
+    /** Returns the payload byte at the given offset of the given datagram. */
+    public byte getByte(int index, int offset) {
+        if (offset < 0 || offset >= getLength(index)) {
+            throw new IndexOutOfBoundsException("Offset " + offset + " of " + getLength(index));
+        }
+        return mBuffer.get(slot(index) + HEADER_LEN + offset);
+    }
+
+    /**
+     * Copy the payload of the given datagram into dst.
+     *
+     * @return the number of bytes copied, which is less than the payload length if dst is shorter.
+     */
+    public int copyPayload(int index, @NonNull byte[] dst) {
+        final int len = Math.min(getLength(index), dst.length);
+        final ByteBuffer view = mBuffer.duplicate();
+        view.position(slot(index) + HEADER_LEN);
+        view.get(dst, 0, len);
+        return len;
+    }
+}
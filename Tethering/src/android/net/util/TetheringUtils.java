@@ -17,9 +17,11 @@ package android.net.util;
 
 import android.net.TetherStatsParcel;
 import android.net.TetheringRequestParcel;
+import android.system.ErrnoException;
 import android.util.Log;
 
 import androidx.annotation.NonNull;
+import androidx.annotation.Nullable;
 
 import com.android.networkstack.tethering.TetherStatsValue;
 
@@ -27,6 +29,7 @@ import java.io.FileDescriptor;
 import java.net.Inet6Address;
 import java.net.SocketException;
 import java.net.UnknownHostException;
+import java.nio.ByteBuffer;
 import java.util.Arrays;
 import java.util.Objects;
 
@@ -58,6 +61,34 @@ public class TetheringUtils {
     public static native void setupNsSocket(FileDescriptor fd)
             throws SocketException;
 
+    /**
+     * Replaces the filter of a socket configured by {@link #setupNsSocket} with one that also
+     * drops solicitations for unknown targets and rate limits solicitations per target address
+     * and per interface, so that a flood of neighbor solicitations does not wake up the process
+     * for every packet, even if it uses random source and target addresses.
+     *
+     * If the kernel does not support the eBPF filter, a classic filter that checks everything
+     * except the rate limit is attached instead.
+     *
+     * @param fd the socket's {@link FileDescriptor}.
+     * @param ifIndex the index of the interface the socket receives on.
+     * @param targets the concatenated 16-byte target addresses to accept, or null to accept any.
+     * @param burst the number of solicitations accepted per target address per interval, or 0 to
+     *              disable rate limiting. Four times as many are accepted per interface.
+     * @param intervalMs the rate limiting interval in milliseconds.
+     * @return true if the eBPF filter was attached, false if the classic filter was.
+     */
+    public static native boolean setupNsFloodFilter(FileDescriptor fd, int ifIndex,
+            @Nullable byte[] targets, int burst, int intervalMs) throws SocketException;
+
+    /**
+     * Removes the state written by {@link #setupNsFloodFilter} for an interface. Must be called
+     * once the socket is closed: the filter only has room for the state of a few interfaces.
+     *
+     * @param ifIndex the index of the interface passed to {@link #setupNsFloodFilter}.
+     */
+    public static native void clearNsFloodFilter(int ifIndex);
+
     /**
      *  The object which records offload Tx/Rx forwarded bytes/packets.
      *  TODO: Replace the inner class ForwardedStats of class OffloadHardwareInterface with
@@ -145,6 +176,19 @@ public class TetheringUtils {
     public static native void setupRaSocket(FileDescriptor fd, int ifIndex)
             throws SocketException;
 
+    /**
+     * Receives up to maxMessages datagrams from a socket with a single system call.
+     * See {@link MessageBatch} for the layout of the buffer.
+     * @param fd the socket's {@link FileDescriptor}.
+     * @param buffer a direct buffer of at least slotSize * maxMessages bytes.
+     * @param slotSize the size of each slot, including the per-message header.
+     * @param maxMessages the maximum number of datagrams to receive.
+     * @param flags additional recvmmsg flags, e.g. MSG_DONTWAIT.
+     * @return the number of datagrams received.
+     */
+    public static native int recvMessageBatch(FileDescriptor fd, ByteBuffer buffer, int slotSize,
+            int maxMessages, int flags) throws ErrnoException;
+
     /**
      * Read s as an unsigned 16-bit integer.
      */
@@ -24,12 +24,24 @@ import static android.net.NetworkStats.TAG_NONE;
 import static android.net.NetworkStats.UID_ALL;
 import static android.net.NetworkStats.UID_TETHERING;
 import static android.net.ip.ConntrackMonitor.ConntrackEvent;
+import static android.net.netlink.ConntrackMessage.ESTABLISHED_MASK;
 import static android.net.netstats.provider.NetworkStatsProvider.QUOTA_UNLIMITED;
+import static android.system.OsConstants.EEXIST;
+import static android.system.OsConstants.ENOENT;
 import static android.system.OsConstants.ETH_P_IP;
 import static android.system.OsConstants.ETH_P_IPV6;
 
 import static com.android.networkstack.tethering.BpfUtils.DOWNSTREAM;
 import static com.android.networkstack.tethering.BpfUtils.UPSTREAM;
+import static com.android.networkstack.tethering.MapWorker.OP_ADD_DOWNSTREAM4;
+import static com.android.networkstack.tethering.MapWorker.OP_ADD_UPSTREAM4;
+import static com.android.networkstack.tethering.MapWorker.OP_REFRESH_CONNTRACK;
+import static com.android.networkstack.tethering.MapWorker.OP_REMOVE_DOWNSTREAM4;
+import static com.android.networkstack.tethering.MapWorker.OP_REMOVE_UPSTREAM4;
+import static com.android.networkstack.tethering.OffloadBringUpTracker.PHASE_ATTACH_DOWNSTREAM;
+import static com.android.networkstack.tethering.OffloadBringUpTracker.PHASE_ATTACH_UPSTREAM;
+import static com.android.networkstack.tethering.OffloadBringUpTracker.PHASE_FIRST_RULE;
+import static com.android.networkstack.tethering.OffloadBringUpTracker.PHASE_UPSTREAM_MAPS;
 import static com.android.networkstack.tethering.TetheringConfiguration.DEFAULT_TETHER_OFFLOAD_POLL_INTERVAL_MS;
 
 import android.app.usage.NetworkStatsManager;
@@ -49,7 +61,9 @@ import android.net.util.SharedLog;
 import android.net.util.TetheringUtils.ForwardedStats;
 import android.os.ConditionVariable;
 import android.os.Handler;
+import android.os.SystemClock;
 import android.system.ErrnoException;
+import android.system.OsConstants;
 import android.text.TextUtils;
 import android.util.Log;
 import android.util.SparseArray;
@@ -64,9 +78,14 @@ import com.android.net.module.util.NetworkStackConstants;
 import com.android.net.module.util.Struct;
 import com.android.networkstack.tethering.apishim.common.BpfCoordinatorShim;
 
+import java.io.FileDescriptor;
+import java.io.IOException;
 import java.net.Inet4Address;
 import java.net.Inet6Address;
 import java.net.InetAddress;
+import java.net.InterfaceAddress;
+import java.net.NetworkInterface;
+import java.net.SocketException;
 import java.net.UnknownHostException;
 import java.util.ArrayList;
 import java.util.Collection;
@@ -96,6 +115,26 @@ public class BpfCoordinator {
 
     private static final String TAG = BpfCoordinator.class.getSimpleName();
     private static final int DUMP_TIMEOUT_MS = 10_000;
+    // Delay before dumping the existing connections of newly added clients.
+    @VisibleForTesting
+    static final int CONNTRACK_DUMP_DELAY_MS = 500;
+    // Interval between reconciliations of the IPv6 forwarding maps with the rules.
+    @VisibleForTesting
+    static final int RECONCILE_INTERVAL_MS = 60_000;
+    // Interval between refreshes of the conntrack timeouts of the offloaded IPv4 flows. Must be
+    // shorter than the shortest timeout set below.
+    @VisibleForTesting
+    static final int CONNTRACK_TIMEOUT_UPDATE_INTERVAL_MS = 60_000;
+    // Sync from net/netfilter/nf_conntrack_proto_{tcp,udp}.c.
+    private static final int NF_CONNTRACK_TCP_TIMEOUT_ESTABLISHED = 432_000;
+    private static final int NF_CONNTRACK_UDP_TIMEOUT_STREAM = 180;
+    // Sync from include/uapi/linux/netfilter/nf_conntrack_common.h.
+    private static final int IPS_SEEN_REPLY = 1 << 1;
+    private static final int IPS_CONFIRMED = 1 << 3;
+    private static final int IPS_SRC_NAT_DONE = 1 << 7;
+    // Sync from TETHER_LAST_USED_TENTATIVE in bpf_tethering.h.
+    @VisibleForTesting
+    static final long LAST_USED_TENTATIVE = 1;
     private static final MacAddress NULL_MAC_ADDRESS = MacAddress.fromString(
             "00:00:00:00:00:00");
     private static final String TETHER_DOWNSTREAM4_MAP_PATH = makeMapPath(DOWNSTREAM, 4);
@@ -139,6 +178,17 @@ public class BpfCoordinator {
     private final BpfCoordinatorShim mBpfCoordinatorShim;
     @NonNull
     private final BpfConntrackEventConsumer mBpfConntrackEventConsumer;
+    // Writes the IPv4 rules and refreshes the conntrack timeouts off the handler thread while
+    // conntrack events are monitored. Null if disabled.
+    @Nullable
+    private final MapWorker mMapWorker;
+    // Forwards the pairs whose BPF programs are placeholders through a netfilter flowtable. Null if
+    // disabled.
+    @Nullable
+    private final FlowtableOffload mFlowtableOffload;
+    // Measures the time from attaching the programs of a downstream to its first offload rule.
+    @NonNull
+    private final OffloadBringUpTracker mBringUps;
 
     // True if BPF offload is supported, false otherwise. The BPF offload could be disabled by
     // a runtime resource overlay package or device configuration. This flag is only initialized
@@ -146,6 +196,16 @@ public class BpfCoordinator {
     // configuration is changed. Especially the forwarding rules. Keep the same setting
     // to make it simpler. See also TetheringConfiguration.
     private final boolean mIsBpfEnabled;
+    // Whether IPv4 rules are installed, tentatively, before their connections are established.
+    private final boolean mIsEarlyOffloadEnabled;
+    // Whether the DNS queries of clients are steered to the local resolver of their downstream.
+    private final boolean mIsDnsSteeringEnabled;
+    // QoS marking of the packets forwarded by the upstream and the downstream rules. The same
+    // marking is used for all the rules of a direction, see TETHER_OFFLOAD_UPSTREAM_DSCP.
+    @NonNull
+    private final QosMarking mUpstreamQos;
+    @NonNull
+    private final QosMarking mDownstreamQos;
 
     // Tracks whether BPF tethering is started or not. This is set by tethering before it
     // starts the first IpServer and is cleared by tethering shortly before the last IpServer
@@ -221,6 +281,30 @@ public class BpfCoordinator {
     // Map for upstream and downstream pair.
     private final HashMap<String, HashSet<String>> mForwardingPairs = new HashMap<>();
 
+    // Clients whose existing connections are waiting for the next conntrack dump.
+    private final HashSet<Inet4Address> mClientsPendingDump = new HashSet<>();
+
+    // Runnable that dumps the existing connections of the pending clients. Delayed so that the
+    // clients which come back together, e.g. after the tethering module restarted, share one dump.
+    private final Runnable mConntrackDumpTask = () -> {
+        if (mConntrackMonitor instanceof ConntrackEventReader) {
+            ((ConntrackEventReader) mConntrackMonitor).dumpExisting(mClientsPendingDump);
+        }
+        mClientsPendingDump.clear();
+    };
+
+    // Runnable that periodically brings the IPv6 forwarding maps back in sync with the rules.
+    private final Runnable mScheduledReconcileTask = () -> {
+        reconcileIpv6Rules();
+        maybeScheduleReconcile();
+    };
+
+    // Runnable that periodically keeps the conntrack entries of active offloaded flows alive.
+    private final Runnable mScheduledConntrackTimeoutUpdate = () -> {
+        refreshAllConntrackTimeouts();
+        maybeScheduleConntrackTimeoutUpdate();
+    };
+
     // Runnable that used by scheduling next polling of stats.
     private final Runnable mScheduledPollingTask = () -> {
         updateForwardedStats();
@@ -247,7 +331,45 @@ public class BpfCoordinator {
 
         /** Get conntrack monitor. */
         @NonNull public ConntrackMonitor getConntrackMonitor(ConntrackEventConsumer consumer) {
-            return new ConntrackMonitor(getHandler(), getSharedLog(), consumer);
+            final TetheringConfiguration config = getTetherConfig();
+            if (config == null || !config.isNativeConntrackReaderEnabled()) {
+                return new ConntrackMonitor(getHandler(), getSharedLog(), consumer);
+            }
+            // Only the connections that BpfConntrackEventConsumer can offload are passed up, so
+            // that events for connections that are still being set up or are closing do not
+            // wake up the handler thread.
+            final boolean earlyOffload = config.isEarlyOffloadEnabled();
+            return new ConntrackEventReader(getHandler(), getSharedLog(), consumer,
+                    earlyOffload ? (IPS_CONFIRMED | IPS_SRC_NAT_DONE) : ESTABLISHED_MASK);
+        }
+
+        /** Get the worker that runs the IPv4 rule operations off the handler thread. */
+        @NonNull public MapWorker getMapWorker(@NonNull MapWorker.Callback callback) {
+            return new MapWorker(getHandler(), getSharedLog(), callback,
+                    TETHER_UPSTREAM4_MAP_PATH, TETHER_DOWNSTREAM4_MAP_PATH);
+        }
+
+        /** Get the netfilter flowtable backend. */
+        @NonNull public FlowtableOffload getFlowtableOffload() {
+            return new FlowtableOffload(getSharedLog());
+        }
+
+        /**
+         * Get whether the IPv4 BPF program attached to a given interface forwards nothing, as on
+         * the kernels that only load the placeholder programs.
+         */
+        public boolean isIpv4ProgramStub(@NonNull String ifName, boolean downstream) {
+            try {
+                return BpfUtils.isIpv4ProgramStub(ifName, downstream);
+            } catch (IOException e) {
+                Log.e(TAG, "Cannot check the program of " + ifName + ": " + e);
+                return false;
+            }
+        }
+
+        /** Get the time since boot, in nanoseconds. */
+        public long elapsedRealtimeNanos() {
+            return SystemClock.elapsedRealtimeNanos();
         }
 
         /** Get interface information for a given interface. */
@@ -255,6 +377,22 @@ public class BpfCoordinator {
             return InterfaceParams.getByName(ifName);
         }
 
+        /** Get an IPv4 address of a given interface, or null if it has none. */
+        @Nullable public Inet4Address getInterfaceIpv4Address(String ifName) {
+            try {
+                final NetworkInterface iface = NetworkInterface.getByName(ifName);
+                if (iface == null) return null;
+                for (InterfaceAddress addr : iface.getInterfaceAddresses()) {
+                    if (addr.getAddress() instanceof Inet4Address) {
+                        return (Inet4Address) addr.getAddress();
+                    }
+                }
+            } catch (SocketException e) {
+                Log.e(TAG, "Cannot get addresses of " + ifName + ": " + e);
+            }
+            return null;
+        }
+
         /**
          * Check OS Build at least S.
          *
@@ -346,6 +484,10 @@ public class BpfCoordinator {
         mNetd = mDeps.getNetd();
         mLog = mDeps.getSharedLog().forSubComponent(TAG);
         mIsBpfEnabled = isBpfEnabled();
+        mIsEarlyOffloadEnabled = isEarlyOffloadEnabled();
+        mIsDnsSteeringEnabled = isDnsSteeringEnabled();
+        mUpstreamQos = getQosMarking(true /* upstream */);
+        mDownstreamQos = getQosMarking(false /* upstream */);
 
         // The conntrack consummer needs to be initialized in BpfCoordinator constructor because it
         // have to access the data members of BpfCoordinator which is not a static class. The
@@ -353,6 +495,9 @@ public class BpfCoordinator {
         // mocked for testing.
         mBpfConntrackEventConsumer = new BpfConntrackEventConsumer();
         mConntrackMonitor = mDeps.getConntrackMonitor(mBpfConntrackEventConsumer);
+        mMapWorker = isMapWorkerEnabled() ? mDeps.getMapWorker(this::onMapWorkerComplete) : null;
+        mFlowtableOffload = isFlowtableOffloadEnabled() ? mDeps.getFlowtableOffload() : null;
+        mBringUps = new OffloadBringUpTracker(mDeps::elapsedRealtimeNanos);
 
         BpfTetherStatsProvider provider = new BpfTetherStatsProvider();
         try {
@@ -370,6 +515,7 @@ public class BpfCoordinator {
         if (!mBpfCoordinatorShim.isInitialized()) {
             mLog.e("Bpf shim not initialized");
         }
+        mBpfCoordinatorShim.setQosMarking(mUpstreamQos, mDownstreamQos);
     }
 
     /**
@@ -388,6 +534,7 @@ public class BpfCoordinator {
 
         mPollingStarted = true;
         maybeSchedulePollingStats();
+        maybeScheduleReconcile();
 
         mLog.i("Polling started");
     }
@@ -407,6 +554,7 @@ public class BpfCoordinator {
         if (mHandler.hasCallbacks(mScheduledPollingTask)) {
             mHandler.removeCallbacks(mScheduledPollingTask);
         }
+        mHandler.removeCallbacks(mScheduledReconcileTask);
         updateForwardedStats();
         mPollingStarted = false;
 
@@ -417,6 +565,24 @@ public class BpfCoordinator {
         return mIsBpfEnabled && mBpfCoordinatorShim.isInitialized();
     }
 
+    /**
+     * Returns whether BPF offload is in use and started. Rule writers outside this class, such
+     * as the native neighbor rule monitor, must not touch the BPF maps otherwise.
+     * Note that this can be only called on handler thread.
+     */
+    public boolean isStarted() {
+        return isUsingBpf() && mPollingStarted;
+    }
+
+    /**
+     * Returns the QoS marking of the downstream rules, for rule writers outside this class that
+     * must write the same rules as this class does.
+     */
+    @NonNull
+    public QosMarking getDownstreamQos() {
+        return mDownstreamQos;
+    }
+
     /**
      * Start conntrack message monitoring.
      * Note that this can be only called on handler thread.
@@ -452,9 +618,15 @@ public class BpfCoordinator {
         if (mMonitoringIpServers.isEmpty()) {
             mConntrackMonitor.start();
             mLog.i("Monitoring started");
+            if (mMapWorker != null && mMapWorker.start()) {
+                mMapWorker.setConntrackRefresh(CONNTRACK_TIMEOUT_UPDATE_INTERVAL_MS,
+                        CONNTRACK_TIMEOUT_UPDATE_INTERVAL_MS * 1_000_000L,
+                        NF_CONNTRACK_TCP_TIMEOUT_ESTABLISHED, NF_CONNTRACK_UDP_TIMEOUT_STREAM);
+            }
         }
 
         mMonitoringIpServers.add(ipServer);
+        maybeScheduleConntrackTimeoutUpdate();
     }
 
     /**
@@ -469,7 +641,15 @@ public class BpfCoordinator {
 
         if (!mMonitoringIpServers.isEmpty()) return;
 
+        mHandler.removeCallbacks(mConntrackDumpTask);
+        mHandler.removeCallbacks(mScheduledConntrackTimeoutUpdate);
+        mClientsPendingDump.clear();
+        if (mConntrackMonitor instanceof ConntrackEventReader) {
+            ((ConntrackEventReader) mConntrackMonitor).cancelDumps();
+        }
         mConntrackMonitor.stop();
+        // Rules that were still queued are written before this returns.
+        if (mMapWorker != null) mMapWorker.stop();
         mLog.i("Monitoring stopped");
     }
 
@@ -483,7 +663,11 @@ public class BpfCoordinator {
         if (!isUsingBpf()) return;
 
         // TODO: Perhaps avoid to add a duplicate rule.
-        if (!mBpfCoordinatorShim.tetherOffloadRuleAdd(rule)) return;
+        final int downstream = rule.downstreamIfindex;
+        mBringUps.beginPhase(downstream, PHASE_FIRST_RULE);
+        final boolean added = mBpfCoordinatorShim.tetherOffloadRuleAdd(rule);
+        mBringUps.endPhase(downstream, PHASE_FIRST_RULE);
+        if (!added) return;
 
         if (!mIpv6ForwardingRules.containsKey(ipServer)) {
             mIpv6ForwardingRules.put(ipServer, new LinkedHashMap<Inet6Address,
@@ -492,10 +676,10 @@ public class BpfCoordinator {
         LinkedHashMap<Inet6Address, Ipv6ForwardingRule> rules = mIpv6ForwardingRules.get(ipServer);
 
         // When the first rule is added to an upstream, setup upstream forwarding and data limit.
+        mBringUps.beginPhase(downstream, PHASE_UPSTREAM_MAPS);
         maybeSetLimit(rule.upstreamIfindex);
 
         if (!isAnyRuleFromDownstreamToUpstream(rule.downstreamIfindex, rule.upstreamIfindex)) {
-            final int downstream = rule.downstreamIfindex;
             final int upstream = rule.upstreamIfindex;
             // TODO: support upstream forwarding on non-point-to-point interfaces.
             // TODO: get the MTU from LinkProperties and update the rules when it changes.
@@ -505,6 +689,8 @@ public class BpfCoordinator {
                         + mInterfaceNames.get(downstream) + " to " + mInterfaceNames.get(upstream));
             }
         }
+        mBringUps.endPhase(downstream, PHASE_UPSTREAM_MAPS);
+        mBringUps.complete(downstream);
 
         // Must update the adding rule after calling #isAnyRuleOnUpstream because it needs to
         // check if it is about adding a first rule for a given upstream.
@@ -551,6 +737,27 @@ public class BpfCoordinator {
         maybeClearLimit(rule.upstreamIfindex);
     }
 
+    /**
+     * Bring the IPv6 forwarding maps in sync with the rules of all downstreams.
+     *
+     * The maps are pinned and may have been modified behind the coordinator's back, e.g. by a
+     * failed or partial write. Rather than clearing and rebuilding them, only the entries that
+     * differ are fixed, so that offloaded traffic is not interrupted.
+     * Note that this can be only called on handler thread.
+     */
+    public void reconcileIpv6Rules() {
+        if (!isUsingBpf()) return;
+
+        final ArrayList<Ipv6ForwardingRule> allRules = new ArrayList<>();
+        for (LinkedHashMap<Inet6Address, Ipv6ForwardingRule> rules
+                : mIpv6ForwardingRules.values()) {
+            allRules.addAll(rules.values());
+        }
+        if (!mBpfCoordinatorShim.reconcileIpv6Rules(allRules)) {
+            mLog.e("Failed to reconcile " + allRules.size() + " IPv6 forwarding rules");
+        }
+    }
+
     /**
      * Clear all forwarding rules for a given downstream.
      * Note that this can be only called on handler thread.
@@ -636,6 +843,19 @@ public class BpfCoordinator {
 
         HashMap<Inet4Address, ClientInfo> clients = mTetherClients.get(ipServer);
         clients.put(client.clientAddress, client);
+
+        maybeScheduleConntrackDump(client.clientAddress);
+    }
+
+    // The client may already have established connections, e.g. if the tethering module restarted
+    // while it was connected. Those get no conntrack event until they are torn down, so offload
+    // them from a dump of the conntrack table.
+    private void maybeScheduleConntrackDump(@NonNull final Inet4Address clientAddress) {
+        if (mMonitoringIpServers.isEmpty()) return;
+
+        final boolean pending = !mClientsPendingDump.isEmpty();
+        mClientsPendingDump.add(clientAddress);
+        if (!pending) mHandler.postDelayed(mConntrackDumpTask, CONNTRACK_DUMP_DELAY_MS);
     }
 
     /**
@@ -702,11 +922,19 @@ public class BpfCoordinator {
         boolean firstDownstreamForThisUpstream = !isAnyForwardingPairOnUpstream(extIface);
         forwardingPairAdd(intIface, extIface);
 
+        final int intIndex = getDownstreamIfindex(intIface);
+        if (intIndex != 0) mBringUps.start(intIndex, intIface, extIface);
+        mBringUps.beginPhase(intIndex, PHASE_ATTACH_UPSTREAM);
         mBpfCoordinatorShim.attachProgram(intIface, UPSTREAM);
+        mBringUps.endPhase(intIndex, PHASE_ATTACH_UPSTREAM);
+        maybeStartDnsSteering(intIface);
         // Attach if the upstream is the first time to be used in a forwarding pair.
         if (firstDownstreamForThisUpstream) {
+            mBringUps.beginPhase(intIndex, PHASE_ATTACH_DOWNSTREAM);
             mBpfCoordinatorShim.attachProgram(extIface, DOWNSTREAM);
+            mBringUps.endPhase(intIndex, PHASE_ATTACH_DOWNSTREAM);
         }
+        maybeAddFlowtablePair(intIface, extIface);
     }
 
     /**
@@ -714,13 +942,68 @@ public class BpfCoordinator {
      */
     public void maybeDetachProgram(@NonNull String intIface, @NonNull String extIface) {
         forwardingPairRemove(intIface, extIface);
+        mBringUps.stop(intIface);
 
         // Detaching program may fail because the interface has been removed already.
+        if (mIsDnsSteeringEnabled) mBpfCoordinatorShim.stopDnsSteering(intIface);
         mBpfCoordinatorShim.detachProgram(intIface);
         // Detach if no more forwarding pair is using the upstream.
         if (!isAnyForwardingPairOnUpstream(extIface)) {
             mBpfCoordinatorShim.detachProgram(extIface);
         }
+        if (mFlowtableOffload != null) mFlowtableOffload.removePair(intIface, extIface);
+    }
+
+    private int getDownstreamIfindex(@NonNull String intIface) {
+        final InterfaceParams params = mDeps.getInterfaceParams(intIface);
+        return params != null ? params.index : 0;
+    }
+
+    // Forward the pair through the flowtable if its BPF programs cannot.
+    private void maybeAddFlowtablePair(@NonNull String intIface, @NonNull String extIface) {
+        if (mFlowtableOffload == null || !isUsingBpf()) return;
+        // Clat interfaces are not in mInterfaceNames, so their traffic could not be reported.
+        if (extIface.startsWith("v4-")) return;
+        // Neither the BPF limit nor the iptables quota would see the traffic of the flowtable.
+        if (getQuotaBytes(extIface) != QUOTA_UNLIMITED) return;
+        if (!mDeps.isIpv4ProgramStub(intIface, UPSTREAM)
+                && !mDeps.isIpv4ProgramStub(extIface, DOWNSTREAM)) {
+            return;
+        }
+
+        final InterfaceParams intParams = mDeps.getInterfaceParams(intIface);
+        final InterfaceParams extParams = mDeps.getInterfaceParams(extIface);
+        if (intParams == null || extParams == null) return;
+        if (mFlowtableOffload.addPair(intIface, intParams.index, extIface, extParams.index)) {
+            mLog.i("Forwarding " + intIface + " <-> " + extIface + " through the flowtable");
+        }
+    }
+
+    // Re-evaluate the flowtable pairs of an upstream whose data limit changed.
+    private void updateFlowtablePairs(@NonNull String extIface) {
+        if (mFlowtableOffload == null) return;
+        final HashSet<String> downstreams = mForwardingPairs.get(extIface);
+        if (downstreams == null) return;
+
+        for (String intIface : downstreams) {
+            if (getQuotaBytes(extIface) == QUOTA_UNLIMITED) {
+                maybeAddFlowtablePair(intIface, extIface);
+            } else {
+                mFlowtableOffload.removePair(intIface, extIface);
+            }
+        }
+    }
+
+    // The local resolver listens on the address of the downstream, so steer the queries there.
+    private void maybeStartDnsSteering(@NonNull String intIface) {
+        if (!mIsDnsSteeringEnabled) return;
+
+        final Inet4Address proxy = mDeps.getInterfaceIpv4Address(intIface);
+        if (proxy == null) {
+            mLog.e("Cannot steer DNS on " + intIface + " without an IPv4 address");
+            return;
+        }
+        mBpfCoordinatorShim.startDnsSteering(intIface, proxy);
     }
 
     // TODO: make mInterfaceNames accessible to the shim and move this code to there.
@@ -738,6 +1021,24 @@ public class BpfCoordinator {
         final ConditionVariable dumpDone = new ConditionVariable();
         mHandler.post(() -> {
             pw.println("mIsBpfEnabled: " + mIsBpfEnabled);
+            pw.println("mIsEarlyOffloadEnabled: " + mIsEarlyOffloadEnabled);
+            pw.println("mIsDnsSteeringEnabled: " + mIsDnsSteeringEnabled);
+            pw.println("Map worker " + (mMapWorker == null ? "disabled"
+                    : (mMapWorker.isStarted()
+                            ? "started, backlog " + mMapWorker.getBacklogSize()
+                            : "not started")));
+            pw.println("Offload bring-ups:");
+            pw.increaseIndent();
+            mBringUps.dump(pw);
+            pw.decreaseIndent();
+            if (mFlowtableOffload != null) {
+                pw.println("Flowtable pairs:");
+                pw.increaseIndent();
+                mFlowtableOffload.dump(pw);
+                pw.decreaseIndent();
+            }
+            pw.println("Upstream QoS marking: " + mUpstreamQos);
+            pw.println("Downstream QoS marking: " + mDownstreamQos);
             pw.println("Polling " + (mPollingStarted ? "started" : "not started"));
             pw.println("Stats provider " + (mStatsProvider != null
                     ? "registered" : "not registered"));
@@ -774,6 +1075,26 @@ public class BpfCoordinator {
         }
     }
 
+    /**
+     * Write a binary snapshot of all the BPF maps to the given file descriptor, for offline
+     * analysis with libtetheroffloadsnapshot. See offload_snapshot_format.h.
+     * Unlike #dump, this reads the maps directly on the calling thread.
+     *
+     * The output is binary, so errors are only logged: nothing else is written to fd, and a
+     * failed snapshot is empty or truncated, which the reader rejects.
+     */
+    public void dumpSnapshot(@NonNull FileDescriptor fd) {
+        if (!mDeps.isAtLeastS()) {
+            mLog.e("Not writing snapshot: no BPF map support");
+            return;
+        }
+        try {
+            writeOffloadSnapshot(fd);
+        } catch (ErrnoException | IOException e) {
+            mLog.e("Error writing snapshot: " + e);
+        }
+    }
+
     private void dumpStats(@NonNull IndentingPrintWriter pw) {
         for (int i = 0; i < mStats.size(); i++) {
             final int upstreamIfindex = mStats.keyAt(i);
@@ -899,6 +1220,58 @@ public class BpfCoordinator {
         }
     }
 
+    /**
+     * QoS marking that the offload programs apply to the packets forwarded by a rule, since these
+     * bypass the mangle table rules that would otherwise mark them.
+     */
+    public static class QosMarking {
+        // Sync from TETHER_QOS_FLAG_DSCP in bpf_tethering.h.
+        public static final short FLAG_DSCP = 1;
+        // DSCP is a 6-bit field.
+        public static final int MAX_DSCP = 63;
+
+        /** Leave the DSCP and the priority of the forwarded packets unchanged. */
+        public static final QosMarking NONE = new QosMarking(-1 /* dscp */, 0 /* priority */);
+
+        // The skb priority to set, or 0 to leave it unchanged.
+        public final long priority;
+        // The DSCP to set, iff FLAG_DSCP is set in flags.
+        public final short dscp;
+        public final short flags;
+
+        /**
+         * @param dscp the DSCP to set, or -1 to leave it unchanged.
+         * @param priority the skb priority to set, or 0 to leave it unchanged.
+         */
+        public QosMarking(int dscp, long priority) {
+            if (dscp < -1 || dscp > MAX_DSCP) {
+                throw new IllegalArgumentException("Invalid DSCP " + dscp);
+            }
+            this.dscp = (short) Math.max(dscp, 0);
+            this.flags = (dscp >= 0) ? FLAG_DSCP : 0;
+            this.priority = priority;
+        }
+
+        @Override
+        public boolean equals(Object o) {
+            if (!(o instanceof QosMarking)) return false;
+            final QosMarking that = (QosMarking) o;
+            return this.priority == that.priority && this.dscp == that.dscp
+                    && this.flags == that.flags;
+        }
+
+        @Override
+        public int hashCode() {
+            return Objects.hash(priority, dscp, flags);
+        }
+
+        @Override
+        public String toString() {
+            return "dscp: " + (((flags & FLAG_DSCP) != 0) ? dscp : "unchanged")
+                    + ", priority: " + (priority != 0 ? priority : "unchanged");
+        }
+    }
+
     /** IPv6 forwarding rule class. */
     public static class Ipv6ForwardingRule {
         // The upstream6 and downstream6 rules are built as the following tables. Only raw ip
@@ -1015,8 +1388,17 @@ public class BpfCoordinator {
          */
         @NonNull
         public Tether6Value makeTether6Value() {
+            return makeTether6Value(QosMarking.NONE);
+        }
+
+        /**
+         * Return a Tether6Value object built from the rule, marking the forwarded packets with
+         * the given QoS.
+         */
+        @NonNull
+        public Tether6Value makeTether6Value(@NonNull QosMarking qos) {
             return new Tether6Value(downstreamIfindex, dstMac, srcMac, ETH_P_IPV6,
-                    NetworkStackConstants.ETHER_MTU);
+                    NetworkStackConstants.ETHER_MTU, qos.priority, qos.dscp, qos.flags);
         }
 
         @Override
@@ -1121,6 +1503,7 @@ public class BpfCoordinator {
                     mInterfaceQuotas.put(iface, quotaBytes);
                 }
                 maybeUpdateDataLimit(iface);
+                updateFlowtablePairs(iface);
             });
         }
 
@@ -1182,24 +1565,25 @@ public class BpfCoordinator {
 
         @NonNull
         private Tether4Value makeTetherUpstream4Value(@NonNull ConntrackEvent e,
-                int upstreamIndex) {
+                int upstreamIndex, long lastUsed) {
             return new Tether4Value(upstreamIndex,
                     NULL_MAC_ADDRESS /* ethDstMac (rawip) */,
                     NULL_MAC_ADDRESS /* ethSrcMac (rawip) */, ETH_P_IP,
                     NetworkStackConstants.ETHER_MTU, toIpv4MappedAddressBytes(e.tupleReply.dstIp),
                     toIpv4MappedAddressBytes(e.tupleReply.srcIp), e.tupleReply.dstPort,
-                    e.tupleReply.srcPort, 0 /* lastUsed, filled by bpf prog only */);
+                    e.tupleReply.srcPort, lastUsed, mUpstreamQos.priority, mUpstreamQos.dscp,
+                    mUpstreamQos.flags);
         }
 
         @NonNull
         private Tether4Value makeTetherDownstream4Value(@NonNull ConntrackEvent e,
-                @NonNull ClientInfo c, int upstreamIndex) {
+                @NonNull ClientInfo c, int upstreamIndex, long lastUsed) {
             return new Tether4Value(c.downstreamIfindex,
                     c.clientMac, c.downstreamMac, ETH_P_IP, NetworkStackConstants.ETHER_MTU,
                     toIpv4MappedAddressBytes(e.tupleOrig.dstIp),
                     toIpv4MappedAddressBytes(e.tupleOrig.srcIp),
-                    e.tupleOrig.dstPort, e.tupleOrig.srcPort,
-                    0 /* lastUsed, filled by bpf prog only */);
+                    e.tupleOrig.dstPort, e.tupleOrig.srcPort, lastUsed, mDownstreamQos.priority,
+                    mDownstreamQos.dscp, mDownstreamQos.flags);
         }
 
         @NonNull
@@ -1215,6 +1599,11 @@ public class BpfCoordinator {
             return addr6;
         }
 
+        private boolean isUnrepliedNatConnection(int status) {
+            final int mask = IPS_CONFIRMED | IPS_SRC_NAT_DONE | IPS_SEEN_REPLY;
+            return (status & mask) == (IPS_CONFIRMED | IPS_SRC_NAT_DONE);
+        }
+
         public void accept(ConntrackEvent e) {
             final ClientInfo tetherClient = getClientInfo(e.tupleOrig.srcIp);
             if (tetherClient == null) return;
@@ -1228,19 +1617,102 @@ public class BpfCoordinator {
 
             if (e.msgType == (NetlinkConstants.NFNL_SUBSYS_CTNETLINK << 8
                     | NetlinkConstants.IPCTNL_MSG_CT_DELETE)) {
-                mBpfCoordinatorShim.tetherOffloadRuleRemove(UPSTREAM, upstream4Key);
-                mBpfCoordinatorShim.tetherOffloadRuleRemove(DOWNSTREAM, downstream4Key);
+                tetherOffloadRule4Remove(UPSTREAM, upstream4Key);
+                tetherOffloadRule4Remove(DOWNSTREAM, downstream4Key);
                 maybeClearLimit(upstreamIndex);
                 return;
             }
 
-            final Tether4Value upstream4Value = makeTetherUpstream4Value(e, upstreamIndex);
+            // Rules are normally installed once the connection is established. With early
+            // offload, they are installed as soon as the NAT mapping is known, before the
+            // connection saw any reply, and marked tentative. The BPF programs confirm them on
+            // the first reply packet. Later events do not overwrite them, since rules are only
+            // inserted if absent.
+            final long lastUsed;
+            if ((e.status & ESTABLISHED_MASK) == ESTABLISHED_MASK) {
+                lastUsed = 0;
+            } else if (mIsEarlyOffloadEnabled && isUnrepliedNatConnection(e.status)) {
+                lastUsed = LAST_USED_TENTATIVE;
+            } else {
+                return;
+            }
+
+            final Tether4Value upstream4Value = makeTetherUpstream4Value(e, upstreamIndex,
+                    lastUsed);
             final Tether4Value downstream4Value = makeTetherDownstream4Value(e, tetherClient,
-                    upstreamIndex);
+                    upstreamIndex, lastUsed);
 
+            // With the map worker, the rules are only queued when the bring-up completes.
+            final int downstreamIndex = tetherClient.downstreamIfindex;
+            mBringUps.beginPhase(downstreamIndex, PHASE_UPSTREAM_MAPS);
             maybeSetLimit(upstreamIndex);
-            mBpfCoordinatorShim.tetherOffloadRuleAdd(UPSTREAM, upstream4Key, upstream4Value);
-            mBpfCoordinatorShim.tetherOffloadRuleAdd(DOWNSTREAM, downstream4Key, downstream4Value);
+            mBringUps.endPhase(downstreamIndex, PHASE_UPSTREAM_MAPS);
+            mBringUps.beginPhase(downstreamIndex, PHASE_FIRST_RULE);
+            tetherOffloadRule4Add(UPSTREAM, upstream4Key, upstream4Value);
+            tetherOffloadRule4Add(DOWNSTREAM, downstream4Key, downstream4Value);
+            mBringUps.endPhase(downstreamIndex, PHASE_FIRST_RULE);
+            mBringUps.complete(downstreamIndex);
+        }
+    }
+
+    // Adds an IPv4 rule through the map worker if it runs, otherwise on this thread. The worker
+    // keeps the operations in order even when its queue is full.
+    private void tetherOffloadRule4Add(boolean downstream, @NonNull Tether4Key key,
+            @NonNull Tether4Value value) {
+        final int op = downstream ? OP_ADD_DOWNSTREAM4 : OP_ADD_UPSTREAM4;
+        if (mMapWorker == null || !mMapWorker.submitRule4(op, key, value)) {
+            mBpfCoordinatorShim.tetherOffloadRuleAdd(downstream, key, value);
+            return;
+        }
+        // Counted as soon as it is queued, so that the data limit of the upstream is not cleared
+        // while the rule is in flight. Uncounted again if the write fails.
+        if (downstream) mBpfCoordinatorShim.updateIpv4RuleCount((int) key.iif, true /* added */);
+    }
+
+    private void tetherOffloadRule4Remove(boolean downstream, @NonNull Tether4Key key) {
+        final int op = downstream ? OP_REMOVE_DOWNSTREAM4 : OP_REMOVE_UPSTREAM4;
+        if (mMapWorker == null || !mMapWorker.submitRule4(op, key, null /* value */)) {
+            mBpfCoordinatorShim.tetherOffloadRuleRemove(downstream, key);
+        }
+    }
+
+    // Same error handling as the IPv4 rule functions of the BpfCoordinatorShim.
+    private void onMapWorkerComplete(int op, int upstreamIfindex, int result) {
+        switch (op) {
+            case OP_ADD_UPSTREAM4:
+                if (result != 0 && result != EEXIST) {
+                    mLog.e("Could not insert upstream rule: " + OsConstants.errnoName(result));
+                }
+                break;
+            case OP_REMOVE_UPSTREAM4:
+                if (result != 0 && result != ENOENT) {
+                    mLog.e("Could not delete upstream rule: " + OsConstants.errnoName(result));
+                }
+                break;
+            case OP_ADD_DOWNSTREAM4:
+                if (result == 0) break;
+                if (result != EEXIST) {
+                    mLog.e("Could not insert downstream rule: " + OsConstants.errnoName(result));
+                }
+                mBpfCoordinatorShim.updateIpv4RuleCount(upstreamIfindex, false /* added */);
+                maybeClearLimit(upstreamIfindex);
+                break;
+            case OP_REMOVE_DOWNSTREAM4:
+                if (result != 0) {
+                    mLog.e("Could not delete downstream rule: " + OsConstants.errnoName(result));
+                    break;
+                }
+                mBpfCoordinatorShim.updateIpv4RuleCount(upstreamIfindex, false /* added */);
+                maybeClearLimit(upstreamIfindex);
+                break;
+            case OP_REFRESH_CONNTRACK:
+                if (result < 0) {
+                    mLog.e("Failed to refresh conntrack timeouts: "
+                            + OsConstants.errnoName(-result));
+                }
+                break;
+            default:
+                Log.wtf(TAG, "Unknown map worker operation " + op);
         }
     }
 
@@ -1249,6 +1721,34 @@ public class BpfCoordinator {
         return (config != null) ? config.isBpfOffloadEnabled() : true /* default value */;
     }
 
+    private boolean isEarlyOffloadEnabled() {
+        final TetheringConfiguration config = mDeps.getTetherConfig();
+        return (config != null) ? config.isEarlyOffloadEnabled() : false /* default value */;
+    }
+
+    @NonNull
+    private QosMarking getQosMarking(boolean upstream) {
+        final TetheringConfiguration config = mDeps.getTetherConfig();
+        final QosMarking qos = (config == null) ? null
+                : (upstream ? config.getOffloadUpstreamQos() : config.getOffloadDownstreamQos());
+        return (qos != null) ? qos : QosMarking.NONE;
+    }
+
+    private boolean isMapWorkerEnabled() {
+        final TetheringConfiguration config = mDeps.getTetherConfig();
+        return (config != null) ? config.isMapWorkerEnabled() : false /* default value */;
+    }
+
+    private boolean isFlowtableOffloadEnabled() {
+        final TetheringConfiguration config = mDeps.getTetherConfig();
+        return (config != null) ? config.isFlowtableOffloadEnabled() : false /* default value */;
+    }
+
+    private boolean isDnsSteeringEnabled() {
+        final TetheringConfiguration config = mDeps.getTetherConfig();
+        return (config != null) ? config.isDnsSteeringEnabled() : false /* default value */;
+    }
+
     private int getInterfaceIndexFromRules(@NonNull String ifName) {
         for (LinkedHashMap<Inet6Address, Ipv6ForwardingRule> rules : mIpv6ForwardingRules
                 .values()) {
@@ -1439,30 +1939,53 @@ public class BpfCoordinator {
             // Update the local cache for counting tether stats delta.
             mStats.put(ifIndex, curr);
 
-            // Update the accumulated tether stats delta to the stats provider for the service
-            // querying.
-            if (mStatsProvider != null) {
-                try {
-                    mStatsProvider.accumulateDiff(
-                            buildNetworkStats(StatsType.STATS_PER_IFACE, ifIndex, diff),
-                            buildNetworkStats(StatsType.STATS_PER_UID, ifIndex, diff));
-                } catch (ArrayIndexOutOfBoundsException e) {
-                    Log.wtf(TAG, "Fail to update the accumulated stats delta for interface index "
-                            + ifIndex + " : ", e);
-                }
-            }
+            accumulateStatsDiff(ifIndex, diff);
+        }
+
+        useAlertQuota(usedAlertQuota);
+
+        // TODO: Count the used limit quota for notifying data limit reached.
+    }
+
+    // Update the accumulated tether stats delta to the stats provider for the service querying.
+    private void accumulateStatsDiff(int ifIndex, @NonNull ForwardedStats diff) {
+        if (mStatsProvider == null) return;
+
+        try {
+            mStatsProvider.accumulateDiff(
+                    buildNetworkStats(StatsType.STATS_PER_IFACE, ifIndex, diff),
+                    buildNetworkStats(StatsType.STATS_PER_UID, ifIndex, diff));
+        } catch (ArrayIndexOutOfBoundsException e) {
+            Log.wtf(TAG, "Fail to update the accumulated stats delta for interface index "
+                    + ifIndex + " : ", e);
         }
+    }
 
+    private void useAlertQuota(long usedAlertQuota) {
         if (mRemainingAlertQuota > 0 && usedAlertQuota > 0) {
             // Trim to zero if overshoot.
             final long newQuota = Math.max(mRemainingAlertQuota - usedAlertQuota, 0);
             updateAlertQuota(newQuota);
         }
+    }
 
-        // TODO: Count the used limit quota for notifying data limit reached.
+    // The flowtable reports the traffic it forwarded since the last poll rather than totals.
+    private void updateFlowtableStats() {
+        if (mFlowtableOffload == null) return;
+
+        final SparseArray<ForwardedStats> diffs = mFlowtableOffload.pollStats();
+        long usedAlertQuota = 0;
+        for (int i = 0; i < diffs.size(); i++) {
+            final ForwardedStats diff = diffs.valueAt(i);
+            usedAlertQuota += diff.rxBytes + diff.txBytes;
+            accumulateStatsDiff(diffs.keyAt(i), diff);
+        }
+        useAlertQuota(usedAlertQuota);
     }
 
     private void updateForwardedStats() {
+        updateFlowtableStats();
+
         final SparseArray<TetherStatsValue> tetherStatsList =
                 mBpfCoordinatorShim.tetherOffloadGetStats();
 
@@ -1495,6 +2018,32 @@ public class BpfCoordinator {
         mHandler.postDelayed(mScheduledPollingTask, getPollingInterval());
     }
 
+    private void refreshAllConntrackTimeouts() {
+        try {
+            refreshConntrackTimeouts(CONNTRACK_TIMEOUT_UPDATE_INTERVAL_MS * 1_000_000L,
+                    NF_CONNTRACK_TCP_TIMEOUT_ESTABLISHED, NF_CONNTRACK_UDP_TIMEOUT_STREAM);
+        } catch (ErrnoException e) {
+            mLog.e("Failed to refresh conntrack timeouts: " + e);
+        }
+    }
+
+    private void maybeScheduleConntrackTimeoutUpdate() {
+        if (mMonitoringIpServers.isEmpty()) return;
+        // The map worker refreshes them from its own timer.
+        if (mMapWorker != null && mMapWorker.isStarted()) return;
+        if (mHandler.hasCallbacks(mScheduledConntrackTimeoutUpdate)) return;
+
+        mHandler.postDelayed(mScheduledConntrackTimeoutUpdate,
+                CONNTRACK_TIMEOUT_UPDATE_INTERVAL_MS);
+    }
+
+    private void maybeScheduleReconcile() {
+        if (!mPollingStarted) return;
+
+        mHandler.removeCallbacks(mScheduledReconcileTask);
+        mHandler.postDelayed(mScheduledReconcileTask, RECONCILE_INTERVAL_MS);
+    }
+
     // Return forwarding rule map. This is used for testing only.
     // Note that this can be only called on handler thread.
     @NonNull
@@ -1521,4 +2070,11 @@ public class BpfCoordinator {
     }
 
     private static native String[] getBpfCounterNames();
+
+    // Returns the number of flows whose conntrack timeout was refreshed.
+    private static native int refreshConntrackTimeouts(long maxIdleNs, int tcpTimeoutSec,
+            int udpTimeoutSec) throws ErrnoException;
+
+    private static native void writeOffloadSnapshot(FileDescriptor fd)
+            throws ErrnoException, IOException;
 }
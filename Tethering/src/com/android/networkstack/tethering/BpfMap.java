@@ -28,6 +28,7 @@ import com.android.net.module.util.Struct;
 
 import java.nio.ByteBuffer;
 import java.nio.ByteOrder;
+import java.util.Map;
 import java.util.NoSuchElementException;
 import java.util.Objects;
 import java.util.function.BiConsumer;
@@ -251,6 +252,28 @@ public class BpfMap<K extends Struct, V extends Struct> implements AutoCloseable
         }
     }
 
+    /**
+     * Makes the content of the map equal to the given entries, deleting or writing only the entries
+     * that differ. The map is read and written in batches where the kernel supports it (5.6+).
+     *
+     * This is meant to bring a map that outlived its writer back in sync with the writer's state,
+     * without the traffic disruption of clearing and rebuilding it. Entries written by the data
+     * path during the call may be lost.
+     *
+     * @return the number of entries that were deleted or written.
+     * @throws ErrnoException if the map could not be read, or an entry could not be deleted or
+     *                        written. The map may be partially reconciled in that case.
+     */
+    public int reconcile(@NonNull Map<K, V> entries) throws ErrnoException {
+        final ByteBuffer keys = ByteBuffer.allocate(entries.size() * mKeySize);
+        final ByteBuffer values = ByteBuffer.allocate(entries.size() * mValueSize);
+        for (Map.Entry<K, V> entry : entries.entrySet()) {
+            keys.put(entry.getKey().writeToBytes());
+            values.put(entry.getValue().writeToBytes());
+        }
+        return reconcile(mMapFd, mKeySize, mValueSize, keys.array(), values.array());
+    }
+
     @Override
     public void close() throws ErrnoException {
         closeMap(mMapFd);
@@ -285,4 +308,7 @@ public class BpfMap<K extends Struct, V extends Struct> implements AutoCloseable
     private native boolean getNextMapKey(int fd, byte[] key, byte[] nextKey) throws ErrnoException;
 
     private native boolean findMapEntry(int fd, byte[] key, byte[] value) throws ErrnoException;
+
+    private native int reconcile(int fd, int keySize, int valueSize, byte[] keys, byte[] values)
+            throws ErrnoException;
 }
@@ -19,10 +19,12 @@ import static android.system.OsConstants.ETH_P_IP;
 import static android.system.OsConstants.ETH_P_IPV6;
 
 import android.net.util.InterfaceParams;
+import android.util.Log;
 
 import androidx.annotation.NonNull;
 
 import java.io.IOException;
+import java.net.Inet4Address;
 
 /**
  * The classes and the methods for BPF utilization.
@@ -34,6 +36,8 @@ public class BpfUtils {
         System.loadLibrary("tetherutilsjni");
     }
 
+    private static final String TAG = BpfUtils.class.getSimpleName();
+
     // For better code clarity when used for 'bool ingress' parameter.
     static final boolean EGRESS = false;
     static final boolean INGRESS = true;
@@ -66,6 +70,33 @@ public class BpfUtils {
         return path;
     }
 
+    // Optional variant of the downstream IPv6 ethernet program that also answers neighbor
+    // solicitations for offloaded clients. Sync from bpf_tethering.h.
+    private static final String NDP_PROXY_PROG_PATH =
+            "/sys/fs/bpf/tethering/prog_offload_schedcls_tether_downstream6_ndp_ether";
+
+    // Attaches the downstream IPv6 program to an ethernet upstream, preferring the variant with the
+    // neighbor discovery proxy fast path if the kernel could load it.
+    private static void attachDownstream6EtherProgram(@NonNull InterfaceParams params)
+            throws IOException {
+        try {
+            tcFilterAddDevBpf(params.index, INGRESS, PRIO_TETHER6, (short) ETH_P_IPV6,
+                    NDP_PROXY_PROG_PATH);
+        } catch (IOException e) {
+            tcFilterAddDevBpf(params.index, INGRESS, PRIO_TETHER6, (short) ETH_P_IPV6,
+                    makeProgPath(true /* downstream */, 6, true /* ether */));
+            return;
+        }
+
+        if (params.macAddr == null) return;
+        try {
+            ndpProxyAdd(params.index, params.macAddr.toByteArray());
+        } catch (IOException e) {
+            // Forwarding still works, solicitations just keep going through the kernel.
+            Log.e(TAG, "Could not enable ndp proxy on " + params.name + ": " + e);
+        }
+    }
+
     /**
      * Attach BPF program
      *
@@ -88,8 +119,12 @@ public class BpfUtils {
         try {
             // tc filter add dev .. ingress prio 1 protocol ipv6 bpf object-pinned /sys/fs/bpf/...
             // direct-action
-            tcFilterAddDevBpf(params.index, INGRESS, PRIO_TETHER6, (short) ETH_P_IPV6,
-                    makeProgPath(downstream, 6, ether));
+            if (downstream && ether) {
+                attachDownstream6EtherProgram(params);
+            } else {
+                tcFilterAddDevBpf(params.index, INGRESS, PRIO_TETHER6, (short) ETH_P_IPV6,
+                        makeProgPath(downstream, 6, ether));
+            }
         } catch (IOException e) {
             throw new IOException("tc filter add dev (" + params.index + "[" + iface
                     + "]) ingress prio PRIO_TETHER6 protocol ipv6 failure: " + e);
@@ -106,6 +141,15 @@ public class BpfUtils {
         }
     }
 
+    /**
+     * Returns whether the IPv4 program that #attachProgram would attach to the given interface is
+     * a placeholder that forwards nothing, as loaded on kernels without the required BPF support.
+     */
+    public static boolean isIpv4ProgramStub(@NonNull String iface, boolean downstream)
+            throws IOException {
+        return isStubProgram(makeProgPath(downstream, 4, isEthernet(iface)));
+    }
+
     /**
      * Detach BPF program
      *
@@ -117,6 +161,9 @@ public class BpfUtils {
             throw new IOException("Fail to get interface params for interface " + iface);
         }
 
+        // No-op unless the ndp proxy was enabled on this interface.
+        ndpProxyRemove(params.index);
+
         try {
             // tc filter del dev .. ingress prio 1 protocol ipv6
             tcFilterDelDev(params.index, INGRESS, PRIO_TETHER6, (short) ETH_P_IPV6);
@@ -134,11 +181,82 @@ public class BpfUtils {
         }
     }
 
+    // Sync from bpf_tethering.h.
+    private static final String DNS_STEER_EGRESS_PROG_PATH =
+            "/sys/fs/bpf/tethering/prog_offload_schedcls_tether_dns_steer_egress_ether";
+
+    /**
+     * Steer the IPv4 UDP DNS queries of the clients of an ethernet downstream to the resolver at
+     * the given address and port, and restore the original resolver as the source of its replies.
+     *
+     * Takes effect only while the upstream BPF program is attached to the downstream.
+     */
+    public static void startDnsSteering(@NonNull String iface, @NonNull Inet4Address proxy,
+            int port) throws IOException {
+        final InterfaceParams params = InterfaceParams.getByName(iface);
+        if (params == null) {
+            throw new IOException("Fail to get interface params for interface " + iface);
+        }
+        if (!isEthernet(iface)) {
+            throw new IOException("DNS steering not supported on rawip interface " + iface);
+        }
+
+        try {
+            // tc filter add dev .. egress prio 2 protocol ip bpf object-pinned /sys/fs/bpf/...
+            // direct-action
+            tcFilterAddDevBpf(params.index, EGRESS, PRIO_TETHER4, (short) ETH_P_IP,
+                    DNS_STEER_EGRESS_PROG_PATH);
+        } catch (IOException e) {
+            throw new IOException("tc filter add dev (" + params.index + "[" + iface
+                    + "]) egress prio PRIO_TETHER4 protocol ip failure: " + e);
+        }
+
+        try {
+            dnsSteerAdd(params.index, proxy.getAddress(), (short) port);
+        } catch (IOException e) {
+            tcFilterDelDev(params.index, EGRESS, PRIO_TETHER4, (short) ETH_P_IP);
+            throw e;
+        }
+    }
+
+    /**
+     * Stop steering the DNS queries of the clients of a downstream, and forget the resolvers
+     * their steered queries were sent to.
+     */
+    public static void stopDnsSteering(@NonNull String iface) throws IOException {
+        final InterfaceParams params = InterfaceParams.getByName(iface);
+        if (params == null) {
+            throw new IOException("Fail to get interface params for interface " + iface);
+        }
+
+        // No-op unless DNS steering was enabled on this interface.
+        dnsSteerRemove(params.index);
+
+        try {
+            // tc filter del dev .. egress prio 2 protocol ip
+            tcFilterDelDev(params.index, EGRESS, PRIO_TETHER4, (short) ETH_P_IP);
+        } catch (IOException e) {
+            throw new IOException("tc filter del dev (" + params.index + "[" + iface
+                    + "]) egress prio PRIO_TETHER4 protocol ip failure: " + e);
+        }
+    }
+
     private static native boolean isEthernet(String iface) throws IOException;
 
+    private static native boolean isStubProgram(String bpfProgPath);
+
     private static native void tcFilterAddDevBpf(int ifIndex, boolean ingress, short prio,
             short proto, String bpfProgPath) throws IOException;
 
     private static native void tcFilterDelDev(int ifIndex, boolean ingress, short prio,
             short proto) throws IOException;
+
+    private static native void ndpProxyAdd(int ifIndex, byte[] mac) throws IOException;
+
+    private static native void ndpProxyRemove(int ifIndex);
+
+    private static native void dnsSteerAdd(int ifIndex, byte[] proxy, short port)
+            throws IOException;
+
+    private static native void dnsSteerRemove(int ifIndex);
 }
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.networkstack.tethering;
+
+import static android.net.netlink.ConntrackMessage.Tuple;
+import static android.net.netlink.ConntrackMessage.TupleIpv4;
+import static android.net.netlink.ConntrackMessage.TupleProto;
+import static android.os.MessageQueue.OnFileDescriptorEventListener.EVENT_ERROR;
+import static android.os.MessageQueue.OnFileDescriptorEventListener.EVENT_INPUT;
+import static android.system.OsConstants.EAGAIN;
+import static android.system.OsConstants.ENOBUFS;
+
+import android.net.ip.ConntrackMonitor;
+import android.net.util.SharedLog;
+import android.os.Handler;
+import android.os.MessageQueue.OnFileDescriptorEventListener;
+import android.system.ErrnoException;
+import android.system.Os;
+
+import androidx.annotation.NonNull;
+
+import com.android.internal.annotations.VisibleForTesting;
+
+import java.io.FileDescriptor;
+import java.net.Inet4Address;
+import java.net.InetAddress;
+import java.net.UnknownHostException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.util.ArrayList;
+import java.util.Collection;
+
+/**
+ * A conntrack event monitor that receives and decodes events in native code.
+ *
+ * Under connection storms the Java netlink parser in {@link ConntrackMonitor} cannot keep up and
+ * the socket overruns. This reader instead drains up to {@link #MAX_EVENTS} events per system call
+ * into a preallocated buffer, decodes only the attributes needed for the IPv4 offload rules
+ * without allocating, and drops non-IPv4 events in the kernel before they are queued.
+ *
+ * {@hide}
+ */
+public class ConntrackEventReader extends ConntrackMonitor {
+    static {
+        System.loadLibrary("tetherutilsjni");
+    }
+
+    private static final String TAG = ConntrackEventReader.class.getSimpleName();
+
+    @VisibleForTesting
+    static final int MAX_EVENTS = 64;
+    // Large enough for any conntrack event message.
+    private static final int RECV_SLOT_SIZE = 2048;
+    // Room for the burst of events caused by several thousand new connections.
+    private static final int SOCKET_RECV_BUFSIZE = 2 * 1024 * 1024;
+
+    // Sync from ConntrackEventRecord in conntrack_event_parser.h.
+    @VisibleForTesting
+    static final int RECORD_LEN = 36;
+    private static final int MSG_TYPE_OFFSET = 0;
+    private static final int PROTO_OFFSET = 2;
+    private static final int STATUS_OFFSET = 4;
+    private static final int TIMEOUT_OFFSET = 8;
+    private static final int ORIG_TUPLE_OFFSET = 12;
+    private static final int REPLY_TUPLE_OFFSET = 24;
+    // Offsets within a tuple.
+    private static final int TUPLE_SRC_OFFSET = 0;
+    private static final int TUPLE_DST_OFFSET = 4;
+    private static final int TUPLE_SRC_PORT_OFFSET = 8;
+    private static final int TUPLE_DST_PORT_OFFSET = 10;
+
+    // Dump replies are batched by the kernel into datagrams of up to 32kB on most devices.
+    private static final int DUMP_RECV_BUFSIZE = 64 * 1024;
+    // Every conntrack message is at least 64 bytes long, so a dump datagram cannot hold more.
+    private static final int MAX_DUMP_RECORDS = DUMP_RECV_BUFSIZE / 64;
+    // Dump datagrams decoded per wakeup of the handler thread, so that a large conntrack table
+    // does not hold up the other users of the thread.
+    private static final int DUMP_DATAGRAMS_PER_WAKEUP = 4;
+    // How long a dump may take before it is abandoned, e.g. if the kernel never answers.
+    private static final long DUMP_TIMEOUT_MS = 10_000;
+
+    // Sync from include/uapi/linux/netfilter/nfnetlink_compat.h.
+    private static final int NF_NETLINK_CONNTRACK_NEW = 0x00000001;
+    private static final int NF_NETLINK_CONNTRACK_UPDATE = 0x00000002;
+    private static final int NF_NETLINK_CONNTRACK_DESTROY = 0x00000004;
+
+    @NonNull
+    private final SharedLog mLog;
+    @NonNull
+    private final ConntrackEventConsumer mConsumer;
+    private final ByteBuffer mRecvBuffer = ByteBuffer.allocateDirect(MAX_EVENTS * RECV_SLOT_SIZE);
+    private final ByteBuffer mRecords =
+            ByteBuffer.allocateDirect(MAX_EVENTS * RECORD_LEN).order(ByteOrder.nativeOrder());
+    private final byte[] mAddr = new byte[4];
+    private final int mNewEventStatusMask;
+    @NonNull
+    private final Handler mHandler;
+    // Dumps being read on the handler thread.
+    private final ArrayList<ConntrackDump> mDumps = new ArrayList<>();
+    private long mOverruns;
+
+    /**
+     * @param newEventStatusMask the CTA_STATUS bits that a new or updated connection must all have
+     *        to be passed to the consumer, e.g. {@code ConntrackMessage.ESTABLISHED_MASK}. Other
+     *        events are dropped in native code. Deletions are always passed.
+     */
+    public ConntrackEventReader(@NonNull Handler h, @NonNull SharedLog log,
+            @NonNull ConntrackEventConsumer cb, int newEventStatusMask) {
+        super(h, log, cb);
+        mHandler = h;
+        mLog = log.forSubComponent(TAG);
+        mConsumer = cb;
+        mNewEventStatusMask = newEventStatusMask;
+    }
+
+    @Override
+    protected FileDescriptor createFd() {
+        try {
+            return nativeCreateSocket(NF_NETLINK_CONNTRACK_NEW | NF_NETLINK_CONNTRACK_UPDATE
+                    | NF_NETLINK_CONNTRACK_DESTROY, SOCKET_RECV_BUFSIZE, true /* ipv4Only */);
+        } catch (ErrnoException e) {
+            mLog.e("Failed to create conntrack socket: " + e);
+            return null;
+        }
+    }
+
+    // Returns the number of decoded events in mRecords rather than a number of bytes.
+    @Override
+    protected int readPacket(@NonNull FileDescriptor fd, @NonNull byte[] packetBuffer)
+            throws Exception {
+        while (true) {
+            try {
+                return nativeReadEvents(fd, mRecvBuffer, RECV_SLOT_SIZE, mRecords, MAX_EVENTS,
+                        mNewEventStatusMask);
+            } catch (ErrnoException e) {
+                if (e.errno != ENOBUFS) throw e;
+                // The kernel already dropped the events, keep reading the ones that are queued.
+                mOverruns++;
+                mLog.w("Conntrack socket overrun, " + mOverruns + " so far");
+            }
+        }
+    }
+
+    /**
+     * Dump the existing IPv4 conntrack entries originating from the given clients, and pass the
+     * ones that pass the event filter to the consumer as new connections.
+     *
+     * This lets connections that were established before the clients were offloaded, e.g. before
+     * the tethering module restarted, be offloaded without waiting for their next conntrack event,
+     * which for a long-lived established connection may never come.
+     *
+     * The dump is read from a non-blocking socket on the handler thread, a few datagrams each
+     * time the socket becomes readable, so this returns immediately. Must be called on the
+     * handler thread.
+     */
+    public void dumpExisting(@NonNull Collection<Inet4Address> clients) {
+        if (clients.isEmpty()) return;
+        final ByteBuffer clientAddrs = ByteBuffer.allocate(clients.size() * 4);
+        for (Inet4Address client : clients) clientAddrs.put(client.getAddress());
+
+        final FileDescriptor fd;
+        try {
+            fd = nativeStartDump();
+        } catch (ErrnoException e) {
+            mLog.e("Failed to dump conntrack entries: " + e);
+            return;
+        }
+        final ConntrackDump dump = new ConntrackDump(fd, clientAddrs.array());
+        mDumps.add(dump);
+        mHandler.getLooper().getQueue().addOnFileDescriptorEventListener(fd,
+                EVENT_INPUT | EVENT_ERROR, dump);
+        mHandler.postDelayed(dump.mTimeout, DUMP_TIMEOUT_MS);
+    }
+
+    /** Abandon the dumps in progress. Must be called on the handler thread. */
+    public void cancelDumps() {
+        while (!mDumps.isEmpty()) {
+            mDumps.get(mDumps.size() - 1).finish("cancelled");
+        }
+    }
+
+    private final class ConntrackDump implements OnFileDescriptorEventListener {
+        @NonNull
+        private final FileDescriptor mFd;
+        @NonNull
+        private final byte[] mClientAddrs;
+        private final ByteBuffer mRecvBuffer = ByteBuffer.allocateDirect(DUMP_RECV_BUFSIZE);
+        private final ByteBuffer mDumpRecords =
+                ByteBuffer.allocateDirect(MAX_DUMP_RECORDS * RECORD_LEN)
+                        .order(ByteOrder.nativeOrder());
+        private final Runnable mTimeout = () -> finish("timed out");
+        private int mTotal;
+
+        ConntrackDump(@NonNull FileDescriptor fd, @NonNull byte[] clientAddrs) {
+            mFd = fd;
+            mClientAddrs = clientAddrs;
+        }
+
+        @Override
+        public int onFileDescriptorEvents(@NonNull FileDescriptor fd, int events) {
+            try {
+                for (int i = 0; i < DUMP_DATAGRAMS_PER_WAKEUP; i++) {
+                    final int count = nativeReadDump(mFd, mRecvBuffer, mDumpRecords,
+                            MAX_DUMP_RECORDS, mClientAddrs, mNewEventStatusMask);
+                    if (count < 0) {
+                        finish("done");
+                        return 0;
+                    }
+                    for (int j = 0; j < count; j++) {
+                        mConsumer.accept(decodeEvent(mDumpRecords, j * RECORD_LEN));
+                    }
+                    mTotal += count;
+                }
+            } catch (ErrnoException e) {
+                if (e.errno == EAGAIN) return EVENT_INPUT | EVENT_ERROR;
+                finish("failed: " + e);
+                return 0;
+            } catch (IllegalArgumentException e) {
+                finish("failed: " + e);
+                return 0;
+            }
+            return EVENT_INPUT | EVENT_ERROR;
+        }
+
+        void finish(@NonNull String reason) {
+            if (!mDumps.remove(this)) return;
+            mHandler.removeCallbacks(mTimeout);
+            mHandler.getLooper().getQueue().removeOnFileDescriptorEventListener(mFd);
+            closeFd(mFd);
+            mLog.i("Conntrack dump " + reason + ", " + mTotal + " existing connections of "
+                    + (mClientAddrs.length / 4) + " clients offloaded");
+        }
+    }
+
+    private static void closeFd(FileDescriptor fd) {
+        if (fd == null) return;
+        try {
+            Os.close(fd);
+        } catch (ErrnoException ignored) { }
+    }
+
+    @Override
+    protected void handlePacket(@NonNull byte[] recvbuf, int count) {
+        for (int i = 0; i < count; i++) {
+            mConsumer.accept(decodeEvent(mRecords, i * RECORD_LEN));
+        }
+    }
+
+    @NonNull
+    private ConntrackEvent decodeEvent(@NonNull ByteBuffer records, int base) {
+        return new ConntrackEvent(
+                records.getShort(base + MSG_TYPE_OFFSET),
+                decodeTuple(records, base, base + ORIG_TUPLE_OFFSET),
+                decodeTuple(records, base, base + REPLY_TUPLE_OFFSET),
+                records.getInt(base + STATUS_OFFSET),
+                records.getInt(base + TIMEOUT_OFFSET));
+    }
+
+    @NonNull
+    private Tuple decodeTuple(@NonNull ByteBuffer records, int base, int tupleBase) {
+        return new Tuple(
+                new TupleIpv4(getInet4Address(records, tupleBase + TUPLE_SRC_OFFSET),
+                        getInet4Address(records, tupleBase + TUPLE_DST_OFFSET)),
+                new TupleProto(records.get(base + PROTO_OFFSET),
+                        records.getShort(tupleBase + TUPLE_SRC_PORT_OFFSET),
+                        records.getShort(tupleBase + TUPLE_DST_PORT_OFFSET)));
+    }
+
+    @NonNull
+    private Inet4Address getInet4Address(@NonNull ByteBuffer records, int offset) {
+        for (int i = 0; i < mAddr.length; i++) {
+            mAddr[i] = records.get(offset + i);
+        }
+        try {
+            return (Inet4Address) InetAddress.getByAddress(mAddr);
+        } catch (UnknownHostException | ClassCastException impossible) {
+            throw new AssertionError("4-byte array not valid IPv4 address?");
+        }
+    }
+
+    private static native FileDescriptor nativeCreateSocket(int groups, int rcvbufBytes,
+            boolean ipv4Only) throws ErrnoException;
+
+    private static native int nativeReadEvents(FileDescriptor fd, ByteBuffer recvBuffer,
+            int slotSize, ByteBuffer records, int maxRecords, int newStatusMask)
+            throws ErrnoException;
+
+    private static native FileDescriptor nativeStartDump() throws ErrnoException;
+
+    private static native int nativeReadDump(FileDescriptor fd, ByteBuffer recvBuffer,
+            ByteBuffer records, int maxRecords, byte[] clientAddrs, int newStatusMask)
+            throws ErrnoException;
+}
@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.networkstack.tethering;
+
+import android.net.util.SharedLog;
+import android.net.util.TetheringUtils.ForwardedStats;
+import android.system.ErrnoException;
+import android.util.SparseArray;
+import android.util.SparseIntArray;
+
+import androidx.annotation.NonNull;
+
+import com.android.internal.util.IndentingPrintWriter;
+
+/**
+ * Forwards the traffic of tethering (downstream, upstream) pairs through a netfilter flowtable.
+ *
+ * This is the fast path of the kernels on which offload.c only loads the placeholder programs,
+ * provided they have flowtable support (4.16+). Once the iptables FORWARD chain accepted a flow of
+ * an offloaded pair, its packets are forwarded by the flowtable from the ingress hook of the
+ * receiving interface. The traffic forwarded that way is counted per interface and reported per
+ * upstream, like the BPF offload stats.
+ *
+ * A downstream is only offloaded with one upstream at a time, so that its traffic can be
+ * attributed to that upstream.
+ *
+ * This class is not thread-safe and must be used from the handler thread.
+ *
+ * @hide
+ */
+public class FlowtableOffload {
+    static {
+        System.loadLibrary("tetherutilsjni");
+    }
+
+    private static final String TAG = FlowtableOffload.class.getSimpleName();
+
+    // Sync from com_android_networkstack_tethering_FlowtableOffload.cpp.
+    private static final int COUNTER_LONGS = 5;
+
+    @NonNull
+    private final SharedLog mLog;
+    // Maps downstream interface index to the index of the upstream it is offloaded with.
+    private final SparseIntArray mPairs = new SparseIntArray();
+    // Maps the interface index of the interfaces of the pairs to their names.
+    private final SparseArray<String> mNames = new SparseArray<>();
+    // Maps the interface index of the interfaces whose traffic is counted to the bytes and packets
+    // they forwarded through the flowtable, as of the last read of the counters.
+    private final SparseArray<long[]> mCounted = new SparseArray<>();
+    // Traffic per upstream interface index that was counted but not yet returned by #pollStats.
+    private SparseArray<ForwardedStats> mPendingStats = new SparseArray<>();
+    // Cleared if the kernel cannot set up the flowtable.
+    private boolean mSupported = true;
+
+    public FlowtableOffload(@NonNull SharedLog log) {
+        mLog = log.forSubComponent(TAG);
+    }
+
+    /**
+     * Offload the traffic between a downstream and an upstream. Returns false if the pair is not
+     * offloaded, e.g. because the downstream is already offloaded with another upstream or the
+     * kernel has no flowtable support.
+     */
+    public boolean addPair(@NonNull String downstream, int downstreamIfindex,
+            @NonNull String upstream, int upstreamIfindex) {
+        if (!mSupported) return false;
+
+        final int current = mPairs.get(downstreamIfindex, 0);
+        if (current == upstreamIfindex) return true;
+        if (current != 0) {
+            mLog.i("Not offloading " + downstream + " with a second upstream " + upstream);
+            return false;
+        }
+
+        final boolean first = mPairs.size() == 0;
+        if (first) {
+            removeStaleState();
+        } else {
+            collectStats();
+        }
+        mPairs.put(downstreamIfindex, upstreamIfindex);
+        mNames.put(downstreamIfindex, downstream);
+        mNames.put(upstreamIfindex, upstream);
+        if (applyPairs()) return true;
+
+        removePair(downstream, upstream);
+        if (first) {
+            // Assume that a kernel which cannot offload one pair cannot offload any.
+            mLog.e("Flowtable offload not supported");
+            mSupported = false;
+        }
+        return false;
+    }
+
+    /** Stop offloading the traffic between a downstream and an upstream, if it is. */
+    public void removePair(@NonNull String downstream, @NonNull String upstream) {
+        final int downstreamIfindex = getIfindex(downstream);
+        if (downstreamIfindex == 0) return;
+        if (mPairs.get(downstreamIfindex, 0) != getIfindex(upstream)) return;
+
+        collectStats();
+        mPairs.delete(downstreamIfindex);
+        applyPairs();
+    }
+
+    /** Returns whether any pair is offloaded. */
+    public boolean hasPairs() {
+        return mPairs.size() > 0;
+    }
+
+    /**
+     * Returns the traffic forwarded through the flowtable since the last call, per upstream
+     * interface index. Upstream means received by the downstream, as the BPF offload stats.
+     */
+    @NonNull
+    public SparseArray<ForwardedStats> pollStats() {
+        collectStats();
+        final SparseArray<ForwardedStats> stats = mPendingStats;
+        mPendingStats = new SparseArray<>();
+        return stats;
+    }
+
+    /** Dump the offloaded pairs. */
+    public void dump(@NonNull IndentingPrintWriter pw) {
+        if (!mSupported) {
+            pw.println("Not supported by the kernel");
+            return;
+        }
+        if (mPairs.size() == 0) {
+            pw.println("<empty>");
+            return;
+        }
+        for (int i = 0; i < mPairs.size(); i++) {
+            pw.println(mNames.get(mPairs.keyAt(i)) + " <-> " + mNames.get(mPairs.valueAt(i)));
+        }
+    }
+
+    private int getIfindex(@NonNull String iface) {
+        for (int i = 0; i < mNames.size(); i++) {
+            if (iface.equals(mNames.valueAt(i))) return mNames.keyAt(i);
+        }
+        return 0;
+    }
+
+    // Removes what a previous tethering process may have left in the kernel.
+    private void removeStaleState() {
+        try {
+            final long[] counters = nativeGetCounters();
+            for (int i = 0; i + COUNTER_LONGS <= counters.length; i += COUNTER_LONGS) {
+                nativeRemoveCounters((int) counters[i]);
+            }
+            nativeSetFlowtable(new String[0], new int[0]);
+        } catch (ErrnoException e) {
+            mLog.e("Could not remove stale flowtable state: " + e);
+        }
+        mCounted.clear();
+    }
+
+    // Brings the kernel state in line with mPairs. Interfaces are counted before they are added to
+    // the flowtable and stop being counted after they are removed from it, so no forwarded
+    // traffic is missed. Returns false if the flowtable could not be set.
+    private boolean applyPairs() {
+        final SparseArray<String> devices = new SparseArray<>();
+        final int[] pairs = new int[mPairs.size() * 2];
+        for (int i = 0; i < mPairs.size(); i++) {
+            pairs[2 * i] = mPairs.keyAt(i);
+            pairs[2 * i + 1] = mPairs.valueAt(i);
+            devices.put(pairs[2 * i], mNames.get(pairs[2 * i]));
+            devices.put(pairs[2 * i + 1], mNames.get(pairs[2 * i + 1]));
+        }
+
+        final String[] names = new String[devices.size()];
+        for (int i = 0; i < devices.size(); i++) {
+            final int ifindex = devices.keyAt(i);
+            names[i] = devices.valueAt(i);
+            if (mCounted.get(ifindex) != null) continue;
+            try {
+                nativeAddCounters(ifindex, names[i]);
+            } catch (ErrnoException e) {
+                mLog.e("Could not count the traffic of " + names[i] + ": " + e);
+                return false;
+            }
+            mCounted.put(ifindex, new long[2]);
+        }
+
+        try {
+            nativeSetFlowtable(names, pairs);
+        } catch (ErrnoException e) {
+            // The previous flowtable is still in place, so keep counting its interfaces.
+            mLog.e("Could not update the flowtable: " + e);
+            return false;
+        }
+
+        for (int i = mCounted.size() - 1; i >= 0; i--) {
+            final int ifindex = mCounted.keyAt(i);
+            if (devices.get(ifindex) != null) continue;
+            try {
+                nativeRemoveCounters(ifindex);
+            } catch (ErrnoException e) {
+                mLog.e("Could not remove the counters of " + mNames.get(ifindex) + ": " + e);
+            }
+            mCounted.removeAt(i);
+        }
+        for (int i = mNames.size() - 1; i >= 0; i--) {
+            if (devices.get(mNames.keyAt(i)) == null) mNames.removeAt(i);
+        }
+        return true;
+    }
+
+    // Adds the traffic counted since the last read to mPendingStats, attributed per the current
+    // pairs.
+    private void collectStats() {
+        if (mCounted.size() == 0) return;
+
+        final long[] counters;
+        try {
+            counters = nativeGetCounters();
+        } catch (ErrnoException e) {
+            mLog.e("Could not read the flowtable counters: " + e);
+            return;
+        }
+
+        for (int i = 0; i + COUNTER_LONGS <= counters.length; i += COUNTER_LONGS) {
+            final int ifindex = (int) counters[i];
+            final long[] last = mCounted.get(ifindex);
+            if (last == null) continue;
+
+            // Received by the interface, minus what was left to the stack by the flowtable.
+            final long bytes = Math.max(counters[i + 1] - counters[i + 3], 0);
+            final long packets = Math.max(counters[i + 2] - counters[i + 4], 0);
+            final long bytesDiff = Math.max(bytes - last[0], 0);
+            final long packetsDiff = Math.max(packets - last[1], 0);
+            last[0] = bytes;
+            last[1] = packets;
+            if (bytesDiff == 0 && packetsDiff == 0) continue;
+
+            final int upstreamIfindex;
+            final ForwardedStats diff;
+            if (mPairs.get(ifindex, 0) != 0) {
+                upstreamIfindex = mPairs.get(ifindex);
+                diff = new ForwardedStats(0, 0, bytesDiff, packetsDiff);
+            } else if (mPairs.indexOfValue(ifindex) >= 0) {
+                upstreamIfindex = ifindex;
+                diff = new ForwardedStats(bytesDiff, packetsDiff, 0, 0);
+            } else {
+                continue;
+            }
+            final ForwardedStats pending = mPendingStats.get(upstreamIfindex);
+            mPendingStats.put(upstreamIfindex, pending != null ? pending.add(diff) : diff);
+        }
+    }
+
+    private static native void nativeSetFlowtable(String[] devices, int[] pairs)
+            throws ErrnoException;
+    private static native void nativeAddCounters(int ifindex, String ifname)
+            throws ErrnoException;
+    private static native void nativeRemoveCounters(int ifindex) throws ErrnoException;
+    private static native long[] nativeGetCounters() throws ErrnoException;
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.networkstack.tethering;
+
+import static android.os.MessageQueue.OnFileDescriptorEventListener.EVENT_INPUT;
+import static android.system.OsConstants.EINTR;
+import static android.system.OsConstants.POLLIN;
+
+import android.net.util.SharedLog;
+import android.os.Handler;
+import android.system.ErrnoException;
+import android.system.Os;
+import android.system.StructPollfd;
+
+import androidx.annotation.NonNull;
+import androidx.annotation.Nullable;
+
+import java.io.FileDescriptor;
+import java.io.IOException;
+import java.util.ArrayDeque;
+
+/**
+ * Runs BPF map maintenance on a dedicated native thread.
+ *
+ * BpfCoordinator shares its handler thread with the tethering state machines, so slow map
+ * operations delay tethering state transitions. This worker takes the IPv4 rule writes and the
+ * periodic conntrack timeout refresh off that thread. Rule operations are queued through a
+ * lock-free ring and executed in submission order; the conntrack refresh runs from a timer of the
+ * worker. Completions are delivered on the handler thread.
+ *
+ * The ring is bounded. Operations submitted while it is full wait in a backlog on the Java side,
+ * and are moved to the ring in order as completions free up room, so they never overtake the
+ * operations queued before them.
+ *
+ * This class is not thread-safe and must be used from the handler thread.
+ *
+ * @hide
+ */
+public class MapWorker {
+    static {
+        System.loadLibrary("tetherutilsjni");
+    }
+
+    private static final String TAG = MapWorker.class.getSimpleName();
+
+    // Sync from com_android_networkstack_tethering_MapWorker.cpp.
+    public static final int OP_ADD_UPSTREAM4 = 1;
+    public static final int OP_ADD_DOWNSTREAM4 = 2;
+    public static final int OP_REMOVE_UPSTREAM4 = 3;
+    public static final int OP_REMOVE_DOWNSTREAM4 = 4;
+    public static final int OP_REFRESH_CONNTRACK = 5;
+    private static final int COMPLETION_INTS = 3;
+    private static final int MAX_COMPLETIONS_PER_DRAIN = 64;
+    // How long stop() waits for the worker to make room for the backlog before giving up on it.
+    private static final int STOP_TIMEOUT_MS = 5000;
+
+    /** Receives the results of the worker operations on the handler thread. */
+    public interface Callback {
+        /**
+         * Called when an operation completed.
+         *
+         * @param op one of the OP_* constants.
+         * @param upstreamIfindex the upstream of a downstream rule, otherwise 0.
+         * @param result for rule operations, 0 or the errno of the failure. For the conntrack
+         *               refresh, the number of flows refreshed or the negated errno.
+         */
+        void onComplete(int op, int upstreamIfindex, int result);
+    }
+
+    @NonNull
+    private final Handler mHandler;
+    @NonNull
+    private final SharedLog mLog;
+    @NonNull
+    private final Callback mCallback;
+    @NonNull
+    private final String mUpstream4MapPath;
+    @NonNull
+    private final String mDownstream4MapPath;
+    private final int[] mCompletions = new int[MAX_COMPLETIONS_PER_DRAIN * COMPLETION_INTS];
+    // Rule operations that did not fit in the ring yet, in submission order.
+    private final ArrayDeque<PendingRule4> mBacklog = new ArrayDeque<>();
+    @Nullable
+    private FileDescriptor mCompletionFd;
+    private long mNativeWorker;
+
+    private static class PendingRule4 {
+        public final int op;
+        @NonNull
+        public final byte[] key;
+        @Nullable
+        public final byte[] value;
+
+        PendingRule4(int op, @NonNull byte[] key, @Nullable byte[] value) {
+            this.op = op;
+            this.key = key;
+            this.value = value;
+        }
+    }
+
+    /**
+     * @param upstream4MapPath the pinned path of the upstream IPv4 rule map.
+     * @param downstream4MapPath the pinned path of the downstream IPv4 rule map.
+     */
+    public MapWorker(@NonNull Handler handler, @NonNull SharedLog log,
+            @NonNull Callback callback, @NonNull String upstream4MapPath,
+            @NonNull String downstream4MapPath) {
+        mHandler = handler;
+        mLog = log.forSubComponent(TAG);
+        mCallback = callback;
+        mUpstream4MapPath = upstream4MapPath;
+        mDownstream4MapPath = downstream4MapPath;
+    }
+
+    /** Start the worker thread. Returns false if the worker could not be started. */
+    public boolean start() {
+        if (mNativeWorker != 0) return true;
+
+        try {
+            mNativeWorker = nativeStart(mUpstream4MapPath, mDownstream4MapPath);
+        } catch (IOException e) {
+            mLog.e("Could not start map worker: " + e);
+            return false;
+        }
+        mCompletionFd = nativeGetCompletionFd(mNativeWorker);
+        mHandler.getLooper().getQueue().addOnFileDescriptorEventListener(mCompletionFd,
+                EVENT_INPUT, (fd, events) -> {
+                    drain();
+                    return EVENT_INPUT;
+                });
+        return true;
+    }
+
+    /**
+     * Stop the worker thread. The operations that were already submitted, including the backlog,
+     * are executed first and their completions are delivered before this returns.
+     */
+    public void stop() {
+        if (mNativeWorker == 0) return;
+
+        mHandler.getLooper().getQueue().removeOnFileDescriptorEventListener(mCompletionFd);
+        flushBacklogBlocking();
+        nativeStop(mNativeWorker);
+        drain();
+        nativeDestroy(mNativeWorker);
+        mNativeWorker = 0;
+        mCompletionFd = null;
+    }
+
+    /** Returns whether the worker is running. */
+    public boolean isStarted() {
+        return mNativeWorker != 0;
+    }
+
+    /**
+     * Queue an IPv4 rule operation. Returns false if the worker is not running, in which case the
+     * caller should apply the rule itself.
+     *
+     * @param value the rule value for additions, null for removals.
+     */
+    public boolean submitRule4(int op, @NonNull Tether4Key key, @Nullable Tether4Value value) {
+        if (mNativeWorker == 0) return false;
+        final byte[] keyBytes = key.writeToBytes();
+        final byte[] valueBytes = (value == null) ? null : value.writeToBytes();
+        if (mBacklog.isEmpty() && nativeSubmit(mNativeWorker, op, keyBytes, valueBytes)) {
+            return true;
+        }
+        mBacklog.add(new PendingRule4(op, keyBytes, valueBytes));
+        return true;
+    }
+
+    /** Returns the number of rule operations waiting for room in the worker queue. */
+    public int getBacklogSize() {
+        return mBacklog.size();
+    }
+
+    /**
+     * Refresh the conntrack timeouts of the flows offloaded in the last maxIdleNs nanoseconds
+     * every intervalMs milliseconds, or stop refreshing them if intervalMs is 0.
+     */
+    public void setConntrackRefresh(long intervalMs, long maxIdleNs, int tcpTimeoutSec,
+            int udpTimeoutSec) {
+        if (mNativeWorker == 0) return;
+
+        try {
+            nativeSetConntrackRefresh(mNativeWorker, intervalMs, maxIdleNs, tcpTimeoutSec,
+                    udpTimeoutSec);
+        } catch (ErrnoException e) {
+            mLog.e("Could not schedule conntrack refresh: " + e);
+        }
+    }
+
+    private void drain() {
+        int count;
+        do {
+            count = nativeDrain(mNativeWorker, mCompletions);
+            for (int i = 0; i < count; i++) {
+                final int offset = i * COMPLETION_INTS;
+                mCallback.onComplete(mCompletions[offset], mCompletions[offset + 1],
+                        mCompletions[offset + 2]);
+            }
+        } while (count == MAX_COMPLETIONS_PER_DRAIN);
+        flushBacklog();
+    }
+
+    // Moves the backlog to the ring, in order, until the ring is full.
+    private void flushBacklog() {
+        while (!mBacklog.isEmpty()) {
+            final PendingRule4 rule = mBacklog.peek();
+            if (!nativeSubmit(mNativeWorker, rule.op, rule.key, rule.value)) return;
+            mBacklog.remove();
+        }
+    }
+
+    // Waits for completions to make room until the whole backlog is in the ring. Only used when
+    // stopping, when the handler thread has nothing else to do for the worker.
+    private void flushBacklogBlocking() {
+        final StructPollfd pollFd = new StructPollfd();
+        pollFd.fd = mCompletionFd;
+        pollFd.events = (short) POLLIN;
+        final StructPollfd[] fds = { pollFd };
+        while (!mBacklog.isEmpty()) {
+            try {
+                if (Os.poll(fds, STOP_TIMEOUT_MS) == 0) {
+                    mLog.e("Timed out, dropping " + mBacklog.size() + " rule operations");
+                    mBacklog.clear();
+                    return;
+                }
+            } catch (ErrnoException e) {
+                if (e.errno == EINTR) continue;
+                mLog.e("Could not wait for the map worker: " + e);
+                mBacklog.clear();
+                return;
+            }
+            drain();
+        }
+    }
+
+    private static native long nativeStart(String upstream4MapPath, String downstream4MapPath)
+            throws IOException;
+    private static native FileDescriptor nativeGetCompletionFd(long worker);
+    private static native boolean nativeSubmit(long worker, int op, byte[] key, byte[] value);
+    private static native void nativeSetConntrackRefresh(long worker, long intervalMs,
+            long maxIdleNs, int tcpTimeoutSec, int udpTimeoutSec) throws ErrnoException;
+    private static native int nativeDrain(long worker, int[] completions);
+    private static native void nativeStop(long worker);
+    private static native void nativeDestroy(long worker);
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.networkstack.tethering;
+
+import android.os.Trace;
+import android.util.SparseArray;
+
+import androidx.annotation.NonNull;
+
+import com.android.internal.util.IndentingPrintWriter;
+
+import java.util.ArrayDeque;
+import java.util.concurrent.TimeUnit;
+import java.util.function.LongSupplier;
+
+/**
+ * Measures how long it takes for the offload of a downstream to start working, from the attach
+ * of its programs to its first offload rule, step by step.
+ *
+ * Each step is also a systrace section, and each bring-up an async systrace section named after
+ * the downstream, so the native sections of the JNI calls can be seen in context.
+ *
+ * This class is not thread-safe and must be used from the handler thread.
+ *
+ * @hide
+ */
+public class OffloadBringUpTracker {
+    /** Attaching the upstream programs to the downstream interface. */
+    public static final int PHASE_ATTACH_UPSTREAM = 0;
+    /** Attaching the downstream programs to the upstream interface, if not already attached. */
+    public static final int PHASE_ATTACH_DOWNSTREAM = 1;
+    /** Writing the upstream limit and stats entries, and the IPv6 upstream rule. */
+    public static final int PHASE_UPSTREAM_MAPS = 2;
+    /** Writing the first offload rule of the downstream. */
+    public static final int PHASE_FIRST_RULE = 3;
+    private static final String[] PHASE_NAMES = {
+            "attach upstream program", "attach downstream program", "upstream maps", "first rule"};
+
+    private static final int MAX_COMPLETED = 8;
+
+    private static class BringUp {
+        final String downstream;
+        final String upstream;
+        final long startNs;
+        final long[] phaseNs = new long[PHASE_NAMES.length];
+        long phaseStartNs;
+        long totalNs;
+
+        BringUp(String downstream, String upstream, long startNs) {
+            this.downstream = downstream;
+            this.upstream = upstream;
+            this.startNs = startNs;
+        }
+
+        @Override
+        public String toString() {
+            final StringBuilder sb = new StringBuilder(downstream + " -> " + upstream + ":");
+            for (int i = 0; i < PHASE_NAMES.length; i++) {
+                sb.append(" ").append(PHASE_NAMES[i]).append(" ").append(toUs(phaseNs[i]));
+                sb.append(",");
+            }
+            sb.append(" total ").append(totalNs > 0 ? toUs(totalNs) : "pending");
+            return sb.toString();
+        }
+
+        private static String toUs(long ns) {
+            return TimeUnit.NANOSECONDS.toMicros(ns) + "us";
+        }
+    }
+
+    @NonNull
+    private final LongSupplier mClock;
+    // Bring-ups that have no rule yet, by downstream interface index.
+    private final SparseArray<BringUp> mPending = new SparseArray<>();
+    private final ArrayDeque<BringUp> mCompleted = new ArrayDeque<>();
+
+    public OffloadBringUpTracker(@NonNull LongSupplier elapsedRealtimeNanos) {
+        mClock = elapsedRealtimeNanos;
+    }
+
+    /** Start measuring the bring-up of a downstream. Restarts it if it is already measured. */
+    public void start(int downstreamIfindex, @NonNull String downstream,
+            @NonNull String upstream) {
+        stop(downstreamIfindex);
+        Trace.beginAsyncSection(traceName(downstream), downstreamIfindex);
+        mPending.put(downstreamIfindex, new BringUp(downstream, upstream, mClock.getAsLong()));
+    }
+
+    /**
+     * Stop measuring the bring-up of a downstream, e.g. because it was torn down. Takes the name
+     * since the interface may already be gone.
+     */
+    public void stop(@NonNull String downstream) {
+        for (int i = 0; i < mPending.size(); i++) {
+            if (downstream.equals(mPending.valueAt(i).downstream)) {
+                stop(mPending.keyAt(i));
+                return;
+            }
+        }
+    }
+
+    private void stop(int downstreamIfindex) {
+        final BringUp bringUp = mPending.get(downstreamIfindex);
+        if (bringUp == null) return;
+        mPending.remove(downstreamIfindex);
+        Trace.endAsyncSection(traceName(bringUp.downstream), downstreamIfindex);
+    }
+
+    /** Mark the start of a step of the bring-up of a downstream, if it is being measured. */
+    public void beginPhase(int downstreamIfindex, int phase) {
+        final BringUp bringUp = mPending.get(downstreamIfindex);
+        if (bringUp == null) return;
+        Trace.beginSection(PHASE_NAMES[phase]);
+        bringUp.phaseStartNs = mClock.getAsLong();
+    }
+
+    /** Mark the end of a step started by #beginPhase. */
+    public void endPhase(int downstreamIfindex, int phase) {
+        final BringUp bringUp = mPending.get(downstreamIfindex);
+        if (bringUp == null) return;
+        Trace.endSection();
+        bringUp.phaseNs[phase] += mClock.getAsLong() - bringUp.phaseStartNs;
+    }
+
+    /** Complete the bring-up of a downstream once its first rule and upstream state are set. */
+    public void complete(int downstreamIfindex) {
+        final BringUp bringUp = mPending.get(downstreamIfindex);
+        if (bringUp == null) return;
+        bringUp.totalNs = mClock.getAsLong() - bringUp.startNs;
+        stop(downstreamIfindex);
+        if (mCompleted.size() == MAX_COMPLETED) mCompleted.removeFirst();
+        mCompleted.addLast(bringUp);
+    }
+
+    /** Dump the pending bring-ups and the last completed ones. */
+    public void dump(@NonNull IndentingPrintWriter pw) {
+        if (mPending.size() == 0 && mCompleted.isEmpty()) {
+            pw.println("<empty>");
+            return;
+        }
+        for (BringUp bringUp : mCompleted) pw.println(bringUp);
+        for (int i = 0; i < mPending.size(); i++) pw.println(mPending.valueAt(i));
+    }
+
+    private static String traceName(@NonNull String downstream) {
+        return "tether offload bring-up " + downstream;
+    }
+}
@@ -60,10 +60,28 @@ public class Tether4Value extends Struct {
     @Field(order = 9, type = Type.U63)
     public final long lastUsed;
 
+    @Field(order = 10, type = Type.U32)
+    public final long priority;  // skb priority of the forwarded packets (0 == unchanged).
+
+    @Field(order = 11, type = Type.U8)
+    public final short dscp;  // DSCP of the forwarded packets, iff QosMarking#FLAG_DSCP.
+
+    @Field(order = 12, type = Type.U8, padding = 2)
+    public final short qosFlags;
+
     public Tether4Value(final long oif, @NonNull final MacAddress ethDstMac,
             @NonNull final MacAddress ethSrcMac, final int ethProto, final int pmtu,
             final byte[] src46, final byte[] dst46, final int srcPort,
             final int dstPort, final long lastUsed) {
+        this(oif, ethDstMac, ethSrcMac, ethProto, pmtu, src46, dst46, srcPort, dstPort, lastUsed,
+                0 /* priority */, (short) 0 /* dscp */, (short) 0 /* qosFlags */);
+    }
+
+    public Tether4Value(final long oif, @NonNull final MacAddress ethDstMac,
+            @NonNull final MacAddress ethSrcMac, final int ethProto, final int pmtu,
+            final byte[] src46, final byte[] dst46, final int srcPort,
+            final int dstPort, final long lastUsed, final long priority, final short dscp,
+            final short qosFlags) {
         Objects.requireNonNull(ethDstMac);
         Objects.requireNonNull(ethSrcMac);
 
@@ -77,6 +95,9 @@ public class Tether4Value extends Struct {
         this.srcPort = srcPort;
         this.dstPort = dstPort;
         this.lastUsed = lastUsed;
+        this.priority = priority;
+        this.dscp = dscp;
+        this.qosFlags = qosFlags;
     }
 
     @Override
@@ -85,11 +106,11 @@ public class Tether4Value extends Struct {
             return String.format(
                     "oif: %d, ethDstMac: %s, ethSrcMac: %s, ethProto: %d, pmtu: %d, "
                             + "src46: %s, dst46: %s, srcPort: %d, dstPort: %d, "
-                            + "lastUsed: %d",
+                            + "lastUsed: %d, priority: %d, dscp: %d, qosFlags: %d",
                     oif, ethDstMac, ethSrcMac, ethProto, pmtu,
                     InetAddress.getByAddress(src46), InetAddress.getByAddress(dst46),
                     Short.toUnsignedInt((short) srcPort), Short.toUnsignedInt((short) dstPort),
-                    lastUsed);
+                    lastUsed, priority, dscp, qosFlags);
         } catch (UnknownHostException | IllegalArgumentException e) {
             return String.format("Invalid IP address", e);
         }
@@ -40,8 +40,24 @@ public class Tether6Value extends Struct {
     @Field(order = 4, type = Type.U16)
     public final int pmtu; // The maximum L3 output path/route mtu.
 
+    @Field(order = 5, type = Type.U32)
+    public final long priority; // The skb priority of the forwarded packets (0 == unchanged).
+
+    @Field(order = 6, type = Type.U8)
+    public final short dscp; // The DSCP of the forwarded packets, iff QosMarking#FLAG_DSCP.
+
+    @Field(order = 7, type = Type.U8, padding = 2)
+    public final short qosFlags; // The QOS_FLAG_* flags.
+
     public Tether6Value(final int oif, @NonNull final MacAddress ethDstMac,
             @NonNull final MacAddress ethSrcMac, final int ethProto, final int pmtu) {
+        this(oif, ethDstMac, ethSrcMac, ethProto, pmtu, 0 /* priority */, (short) 0 /* dscp */,
+                (short) 0 /* qosFlags */);
+    }
+
+    public Tether6Value(final int oif, @NonNull final MacAddress ethDstMac,
+            @NonNull final MacAddress ethSrcMac, final int ethProto, final int pmtu,
+            final long priority, final short dscp, final short qosFlags) {
         Objects.requireNonNull(ethSrcMac);
         Objects.requireNonNull(ethDstMac);
 
@@ -50,11 +66,15 @@ public class Tether6Value extends Struct {
         this.ethSrcMac = ethSrcMac;
         this.ethProto = ethProto;
         this.pmtu = pmtu;
+        this.priority = priority;
+        this.dscp = dscp;
+        this.qosFlags = qosFlags;
     }
 
     @Override
     public String toString() {
-        return String.format("oif: %d, dstMac: %s, srcMac: %s, proto: %d, pmtu: %d", oif,
-                ethDstMac, ethSrcMac, ethProto, pmtu);
+        return String.format("oif: %d, dstMac: %s, srcMac: %s, proto: %d, pmtu: %d, "
+                + "priority: %d, dscp: %d, qosFlags: %d", oif, ethDstMac, ethSrcMac, ethProto,
+                pmtu, priority, dscp, qosFlags);
     }
 }
@@ -2256,6 +2256,12 @@ public class Tethering {
             return;
         }
 
+        // Binary output, e.g. adb shell dumpsys tethering bpfsnapshot > tethering.snap
+        if (argsContain(args, "bpfsnapshot")) {
+            mBpfCoordinator.dumpSnapshot(fd);
+            return;
+        }
+
         pw.println("Tethering:");
         pw.increaseIndent();
 
@@ -2457,7 +2463,8 @@ public class Tethering {
         final TetherState tetherState = new TetherState(
                 new IpServer(iface, mLooper, interfaceType, mLog, mNetd, mBpfCoordinator,
                              makeControlCallback(), mConfig.enableLegacyDhcpServer,
-                             mConfig.isBpfOffloadEnabled(), mPrivateAddressCoordinator,
+                             mConfig.isBpfOffloadEnabled(), mConfig.isXskControlEnabled(),
+                             mPrivateAddressCoordinator,
                              mDeps.getIpServerDependencies()));
         mTetherStates.put(iface, tetherState);
         tetherState.ipServer.start();
@@ -32,9 +32,12 @@ import android.telephony.SubscriptionManager;
 import android.telephony.TelephonyManager;
 import android.text.TextUtils;
 
+import androidx.annotation.NonNull;
+
 import com.android.internal.annotations.VisibleForTesting;
 import com.android.modules.utils.build.SdkLevel;
 import com.android.net.module.util.DeviceConfigUtils;
+import com.android.networkstack.tethering.BpfCoordinator.QosMarking;
 
 import java.io.PrintWriter;
 import java.util.ArrayList;
@@ -95,6 +98,66 @@ public class TetheringConfiguration {
     public static final String TETHER_ENABLE_SELECT_ALL_PREFIX_RANGES =
             "tether_enable_select_all_prefix_ranges";
 
+    /**
+     * Flag to install the IPv4 offload rules of a connection as soon as its NAT mapping is known,
+     * instead of waiting for the connection to be established. See BpfCoordinator.
+     */
+    public static final String TETHER_ENABLE_EARLY_OFFLOAD = "tether_enable_early_offload";
+
+    /**
+     * Flag to steer the UDP DNS queries of tethered clients to the local resolver in the BPF
+     * offload programs, whatever resolver they are addressed to. See BpfCoordinator.
+     */
+    public static final String TETHER_ENABLE_DNS_STEERING = "tether_enable_dns_steering";
+
+    /**
+     * Flag to read and decode the conntrack events natively, and only pass up those of
+     * connections that can be offloaded, instead of reading them with ConntrackMonitor. See
+     * ConntrackEventReader.
+     */
+    public static final String TETHER_ENABLE_NATIVE_CONNTRACK_READER =
+            "tether_enable_native_conntrack_reader";
+
+    /**
+     * Flag to receive the router solicitations of downstreams through an AF_XDP socket instead
+     * of a raw socket. Only takes effect when BPF offload is enabled. See XskReceiver.
+     */
+    public static final String TETHER_ENABLE_XSK_CONTROL = "tether_enable_xsk_control";
+
+    /**
+     * Flag to write the IPv4 offload rules and refresh the conntrack timeouts of offloaded flows
+     * from a native worker thread instead of the BpfCoordinator handler thread. See MapWorker.
+     */
+    public static final String TETHER_ENABLE_MAP_WORKER = "tether_enable_map_worker";
+
+    /**
+     * Flag to forward the traffic of the downstream and upstream pairs through a netfilter
+     * flowtable when the kernel only has the placeholder BPF offload programs. See
+     * FlowtableOffload.
+     */
+    public static final String TETHER_ENABLE_FLOWTABLE_OFFLOAD = "tether_enable_flowtable_offload";
+
+    /**
+     * DSCP that the BPF offload programs set on the forwarded packets of the upstream (resp.
+     * downstream) direction, for the mangle table rules that these packets bypass. Unset, -1 or
+     * any invalid value leaves the DSCP unchanged. See BpfCoordinator.QosMarking.
+     *
+     * This is one marking per direction, not a per-flow policy: every rule of a direction gets
+     * the same marking, including the IPv6 rules written by NeighborRuleMonitor. Operators whose
+     * mangle rules match on more than the direction still need to disable offload.
+     */
+    public static final String TETHER_OFFLOAD_UPSTREAM_DSCP = "tether_offload_upstream_dscp";
+    public static final String TETHER_OFFLOAD_DOWNSTREAM_DSCP = "tether_offload_downstream_dscp";
+
+    /**
+     * skb priority that the BPF offload programs set on the forwarded packets of the upstream
+     * (resp. downstream) direction. Unset or 0 leaves the priority unchanged.
+     */
+    public static final String TETHER_OFFLOAD_UPSTREAM_PRIORITY =
+            "tether_offload_upstream_priority";
+    public static final String TETHER_OFFLOAD_DOWNSTREAM_PRIORITY =
+            "tether_offload_downstream_priority";
+
     /**
      * Experiment flag to force choosing upstreams automatically.
      *
@@ -141,6 +204,16 @@ public class TetheringConfiguration {
     private final boolean mEnableWifiP2pDedicatedIp;
 
     private final boolean mEnableSelectAllPrefixRange;
+    private final boolean mEnableEarlyOffload;
+    private final boolean mEnableDnsSteering;
+    private final boolean mEnableNativeConntrackReader;
+    private final boolean mEnableXskControl;
+    private final boolean mEnableMapWorker;
+    private final boolean mEnableFlowtableOffload;
+    @NonNull
+    private final QosMarking mOffloadUpstreamQos;
+    @NonNull
+    private final QosMarking mOffloadDownstreamQos;
 
     public TetheringConfiguration(Context ctx, SharedLog log, int id) {
         final SharedLog configLog = log.forSubComponent("config");
@@ -195,6 +268,29 @@ public class TetheringConfiguration {
         mEnableSelectAllPrefixRange = getDeviceConfigBoolean(
                 TETHER_ENABLE_SELECT_ALL_PREFIX_RANGES, true /* defaultValue */);
 
+        mEnableEarlyOffload = getDeviceConfigBoolean(
+                TETHER_ENABLE_EARLY_OFFLOAD, false /* defaultValue */);
+
+        mEnableDnsSteering = getDeviceConfigBoolean(
+                TETHER_ENABLE_DNS_STEERING, false /* defaultValue */);
+
+        mEnableNativeConntrackReader = getDeviceConfigBoolean(
+                TETHER_ENABLE_NATIVE_CONNTRACK_READER, false /* defaultValue */);
+
+        mEnableXskControl = getDeviceConfigBoolean(
+                TETHER_ENABLE_XSK_CONTROL, false /* defaultValue */);
+
+        mEnableMapWorker = getDeviceConfigBoolean(
+                TETHER_ENABLE_MAP_WORKER, false /* defaultValue */);
+
+        mEnableFlowtableOffload = getDeviceConfigBoolean(
+                TETHER_ENABLE_FLOWTABLE_OFFLOAD, false /* defaultValue */);
+
+        mOffloadUpstreamQos = new QosMarking(getOffloadDscp(TETHER_OFFLOAD_UPSTREAM_DSCP),
+                getOffloadPriority(TETHER_OFFLOAD_UPSTREAM_PRIORITY));
+        mOffloadDownstreamQos = new QosMarking(getOffloadDscp(TETHER_OFFLOAD_DOWNSTREAM_DSCP),
+                getOffloadPriority(TETHER_OFFLOAD_DOWNSTREAM_PRIORITY));
+
         configLog.log(toString());
     }
 
@@ -283,6 +379,30 @@ public class TetheringConfiguration {
 
         pw.print("mEnableSelectAllPrefixRange: ");
         pw.println(mEnableSelectAllPrefixRange);
+
+        pw.print("enableEarlyOffload: ");
+        pw.println(mEnableEarlyOffload);
+
+        pw.print("enableDnsSteering: ");
+        pw.println(mEnableDnsSteering);
+
+        pw.print("enableNativeConntrackReader: ");
+        pw.println(mEnableNativeConntrackReader);
+
+        pw.print("enableXskControl: ");
+        pw.println(mEnableXskControl);
+
+        pw.print("enableMapWorker: ");
+        pw.println(mEnableMapWorker);
+
+        pw.print("enableFlowtableOffload: ");
+        pw.println(mEnableFlowtableOffload);
+
+        pw.print("offloadUpstreamQos: ");
+        pw.println(mOffloadUpstreamQos);
+
+        pw.print("offloadDownstreamQos: ");
+        pw.println(mOffloadDownstreamQos);
     }
 
     /** Returns the string representation of this object.*/
@@ -348,6 +468,42 @@ public class TetheringConfiguration {
         return mEnableSelectAllPrefixRange;
     }
 
+    public boolean isEarlyOffloadEnabled() {
+        return mEnableEarlyOffload;
+    }
+
+    public boolean isDnsSteeringEnabled() {
+        return mEnableDnsSteering;
+    }
+
+    public boolean isNativeConntrackReaderEnabled() {
+        return mEnableNativeConntrackReader;
+    }
+
+    public boolean isXskControlEnabled() {
+        return mEnableXskControl;
+    }
+
+    public boolean isMapWorkerEnabled() {
+        return mEnableMapWorker;
+    }
+
+    public boolean isFlowtableOffloadEnabled() {
+        return mEnableFlowtableOffload;
+    }
+
+    /** QoS marking of the offloaded packets sent to the upstream. */
+    @NonNull
+    public QosMarking getOffloadUpstreamQos() {
+        return mOffloadUpstreamQos;
+    }
+
+    /** QoS marking of the offloaded packets sent to the clients. */
+    @NonNull
+    public QosMarking getOffloadDownstreamQos() {
+        return mOffloadDownstreamQos;
+    }
+
     private static Collection<Integer> getUpstreamIfaceTypes(Resources res, boolean dunRequired) {
         final int[] ifaceTypes = res.getIntArray(R.array.config_tether_upstream_types);
         final ArrayList<Integer> upstreamIfaceTypes = new ArrayList<>(ifaceTypes.length);
@@ -466,6 +622,26 @@ public class TetheringConfiguration {
         return value != null ? Boolean.parseBoolean(value) : defaultValue;
     }
 
+    private int getDeviceConfigInt(final String name, final int defaultValue) {
+        // See #getDeviceConfigBoolean for why #getDeviceConfigProperty is used.
+        final String value = getDeviceConfigProperty(name);
+        if (value == null) return defaultValue;
+        try {
+            return Integer.parseInt(value);
+        } catch (NumberFormatException e) {
+            return defaultValue;
+        }
+    }
+
+    private int getOffloadDscp(final String name) {
+        final int dscp = getDeviceConfigInt(name, -1 /* defaultValue */);
+        return (dscp >= 0 && dscp <= QosMarking.MAX_DSCP) ? dscp : -1;
+    }
+
+    private long getOffloadPriority(final String name) {
+        return Math.max(getDeviceConfigInt(name, 0 /* defaultValue */), 0);
+    }
+
     @VisibleForTesting
     protected String getDeviceConfigProperty(String name) {
         return DeviceConfig.getProperty(NAMESPACE_CONNECTIVITY, name);
@@ -0,0 +1,553 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Microbenchmarks of the map operations behind BpfMap.java, i.e. the system calls made by
+// jni/com_android_networkstack_tethering_BpfMap.cpp, run against maps with the key and value
+// layouts of the tethering maps. The maps are created by the benchmark, so it runs wherever the
+// bpf() system call is allowed, including a Linux host as root.
+//
+// Each operation is reported as items_per_second, and a sample of the operations is timed one by
+// one to report their latency percentiles as p50_ns, p90_ns and p99_ns.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#define BPF_FD_JUST_USE_INT
+#include "BpfSyscallWrappers.h"
+#include "bpf_map_batch.h"
+#include "bpf_map_iter.h"
+#include "bpf_tethering.h"
+
+namespace android {
+namespace {
+
+// Time one operation out of kSampleInterval, to keep the cost of reading the clock out of the
+// throughput numbers.
+constexpr int kSampleInterval = 8;
+constexpr size_t kMaxSamples = 1 << 20;
+
+// The tethering map layouts. Key(i) returns distinct keys for distinct i, spread over the hash
+// buckets the way real flows are.
+struct Ipv4Rule {
+    typedef Tether4Key Key;
+    typedef Tether4Value Value;
+    static Key key(uint32_t i) {
+        Key k = {.iif = 2, .l4Proto = IPPROTO_TCP};
+        k.src4.s_addr = htonl(0xc0a82a00 | (i & 0xff));  // 192.168.42.x
+        k.dst4.s_addr = htonl(0x08080808);
+        k.srcPort = htons(32768 + (i >> 8));
+        k.dstPort = htons(443);
+        return k;
+    }
+};
+
+struct Ipv6Rule {
+    typedef TetherDownstream6Key Key;
+    typedef Tether6Value Value;
+    static Key key(uint32_t i) {
+        Key k = {.iif = 3};
+        k.neigh6.s6_addr[0] = 0x20;
+        k.neigh6.s6_addr[1] = 0x01;
+        k.neigh6.s6_addr32[3] = htonl(i);
+        return k;
+    }
+};
+
+struct Stats {
+    typedef TetherStatsKey Key;
+    typedef TetherStatsValue Value;
+    static Key key(uint32_t i) { return i; }
+};
+
+const char* mapTypeName(int type) {
+    switch (type) {
+        case BPF_MAP_TYPE_HASH:
+            return "hash";
+        case BPF_MAP_TYPE_LRU_HASH:
+            return "lru_hash";
+        case BPF_MAP_TYPE_ARRAY:
+            return "array";
+        default:
+            return "unknown";
+    }
+}
+
+template <typename Layout>
+class TestMap {
+  public:
+    typedef typename Layout::Key Key;
+    typedef typename Layout::Value Value;
+
+    TestMap(benchmark::State& state, uint32_t flags = 0)
+        : mType(static_cast<bpf_map_type>(state.range(0))), mEntries(state.range(1)) {
+        state.SetLabel(mapTypeName(mType));
+        mFd = bpf::createMap(mType, sizeof(Key), sizeof(Value), mEntries, flags);
+        if (mFd == -1) {
+            state.SkipWithError(strerror(errno));
+            return;
+        }
+        // Only the stats layout is used with arrays, and its keys are the array indexes.
+        for (uint32_t i = 0; i < mEntries; i++) mKeys.push_back(Layout::key(i));
+    }
+
+    ~TestMap() {
+        if (mFd != -1) close(mFd);
+    }
+
+    bool ok() const { return mFd != -1; }
+    int fd() const { return mFd; }
+    uint32_t entries() const { return mEntries; }
+    const Key& key(uint32_t i) const { return mKeys[i]; }
+
+    static Value value(uint32_t i) {
+        Value v;
+        memset(&v, static_cast<uint8_t>(i), sizeof(v));
+        return v;
+    }
+
+    bool fill(benchmark::State& state) {
+        for (uint32_t i = 0; i < mEntries; i++) {
+            const Value v = value(i);
+            if (bpf::writeToMapEntry(mFd, &mKeys[i], &v, BPF_ANY)) {
+                state.SkipWithError(strerror(errno));
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> keyBytes() const {
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(mKeys.data());
+        return std::vector<uint8_t>(p, p + mKeys.size() * sizeof(Key));
+    }
+
+    std::vector<uint8_t> valueBytes() const {
+        std::vector<uint8_t> bytes(mEntries * sizeof(Value));
+        for (uint32_t i = 0; i < mEntries; i++) {
+            const Value v = value(i);
+            memcpy(bytes.data() + i * sizeof(Value), &v, sizeof(v));
+        }
+        return bytes;
+    }
+
+  private:
+    const bpf_map_type mType;
+    const uint32_t mEntries;
+    int mFd;
+    std::vector<Key> mKeys;
+};
+
+class LatencySampler {
+  public:
+    explicit LatencySampler(benchmark::State& state) : mState(state) {}
+
+    ~LatencySampler() {
+        if (mSamples.empty()) return;
+        std::sort(mSamples.begin(), mSamples.end());
+        auto percentile = [this](size_t p) {
+            return static_cast<double>(mSamples[(mSamples.size() - 1) * p / 100]);
+        };
+        mState.counters["p50_ns"] = percentile(50);
+        mState.counters["p90_ns"] = percentile(90);
+        mState.counters["p99_ns"] = percentile(99);
+    }
+
+    // Runs op, timing it if it is sampled.
+    template <typename Op>
+    void run(Op op) {
+        if (mCount++ % kSampleInterval != 0 || mSamples.size() == kMaxSamples) {
+            op();
+            return;
+        }
+        const uint64_t start = nowNs();
+        op();
+        mSamples.push_back(nowNs() - start);
+    }
+
+  private:
+    static uint64_t nowNs() {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    benchmark::State& mState;
+    uint64_t mCount = 0;
+    std::vector<uint64_t> mSamples;
+};
+
+// Per-entry operations, as made by BpfMap#getValue, #updateEntry, #deleteEntry and
+// #getNextKey.
+
+template <typename Layout>
+void BM_Find(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok() || !map.fill(state)) return;
+    typename Layout::Value value;
+    uint32_t i = 0;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            sampler.run([&] { bpf::findMapEntry(map.fd(), &map.key(i), &value); });
+            benchmark::DoNotOptimize(value);
+            if (++i == map.entries()) i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename Layout>
+void BM_FindMissing(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok() || !map.fill(state)) return;
+    const typename Layout::Key key = Layout::key(map.entries());
+    typename Layout::Value value;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            sampler.run([&] { bpf::findMapEntry(map.fd(), &key, &value); });
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+template <typename Layout>
+void BM_Update(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok() || !map.fill(state)) return;
+    uint32_t i = 0;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            const typename Layout::Value value = map.value(i + 1);
+            sampler.run([&] { bpf::writeToMapEntry(map.fd(), &map.key(i), &value, BPF_ANY); });
+            if (++i == map.entries()) i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Deletes an entry and adds it back, as when a rule is removed and another one added.
+template <typename Layout>
+void BM_DeleteInsert(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok() || !map.fill(state)) return;
+    const typename Layout::Value value = map.value(0);
+    uint32_t i = 0;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            sampler.run([&] { bpf::deleteMapEntry(map.fd(), &map.key(i)); });
+            sampler.run([&] { bpf::writeToMapEntry(map.fd(), &map.key(i), &value, BPF_NOEXIST); });
+            if (++i == map.entries()) i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * 2);
+}
+
+// Whole map operations, as made by BpfMap#forEach and BpfMap#clear from Java one entry at a time,
+// and by BpfMap#reconcile in batches.
+
+template <typename Layout>
+void BM_ReadAllPerEntry(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok() || !map.fill(state)) return;
+    typename Layout::Key key, nextKey;
+    typename Layout::Value value;
+    int64_t items = 0;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            int ret = bpf::getFirstMapKey(map.fd(), &nextKey);
+            while (ret == 0) {
+                key = nextKey;
+                sampler.run([&] {
+                    ret = bpf::getNextMapKey(map.fd(), &key, &nextKey);
+                    bpf::findMapEntry(map.fd(), &key, &value);
+                });
+                benchmark::DoNotOptimize(value);
+                items++;
+            }
+        }
+    }
+    state.SetItemsProcessed(items);
+}
+
+template <typename Layout>
+void BM_ReadAllBatched(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok() || !map.fill(state)) return;
+    std::vector<uint8_t> keys, values;
+    int64_t items = 0;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            keys.clear();
+            values.clear();
+            sampler.run([&] {
+                readAllMapEntries(map.fd(), sizeof(typename Layout::Key),
+                                  sizeof(typename Layout::Value), &keys, &values);
+            });
+            items += keys.size() / sizeof(typename Layout::Key);
+        }
+    }
+    state.SetItemsProcessed(items);
+}
+
+// Reads the whole map from a map element iterator, as the dump code does when it is allowed to.
+template <typename Layout>
+void BM_ReadAllStreamed(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok() || !map.fill(state)) return;
+    std::vector<uint8_t> keys, values;
+    int64_t items = 0;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            keys.clear();
+            values.clear();
+            int ret;
+            sampler.run([&] {
+                ret = streamAllMapEntries(map.fd(), sizeof(typename Layout::Key),
+                                          sizeof(typename Layout::Value), &keys, &values);
+            });
+            if (ret) {
+                state.SkipWithError(strerror(errno));
+                break;
+            }
+            items += keys.size() / sizeof(typename Layout::Key);
+        }
+    }
+    state.SetItemsProcessed(items);
+}
+
+template <typename Layout>
+void BM_WriteAllPerEntry(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok()) return;
+    const std::vector<uint8_t> keys = map.keyBytes();
+    const std::vector<uint8_t> values = map.valueBytes();
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            for (uint32_t i = 0; i < map.entries(); i++) {
+                sampler.run([&] {
+                    bpf::writeToMapEntry(map.fd(), keys.data() + i * sizeof(typename Layout::Key),
+                                         values.data() + i * sizeof(typename Layout::Value),
+                                         BPF_ANY);
+                });
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * map.entries());
+}
+
+template <typename Layout>
+void BM_WriteAllBatched(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok()) return;
+    const std::vector<uint8_t> keys = map.keyBytes();
+    const std::vector<uint8_t> values = map.valueBytes();
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            sampler.run([&] {
+                writeMapEntries(map.fd(), sizeof(typename Layout::Key),
+                                sizeof(typename Layout::Value), keys, values);
+            });
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * map.entries());
+}
+
+template <typename Layout>
+void BM_DeleteAllPerEntry(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok()) return;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            state.PauseTiming();
+            if (!map.fill(state)) break;
+            state.ResumeTiming();
+            for (uint32_t i = 0; i < map.entries(); i++) {
+                sampler.run([&] { bpf::deleteMapEntry(map.fd(), &map.key(i)); });
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * map.entries());
+}
+
+template <typename Layout>
+void BM_DeleteAllBatched(benchmark::State& state) {
+    TestMap<Layout> map(state);
+    if (!map.ok()) return;
+    const std::vector<uint8_t> keys = map.keyBytes();
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            state.PauseTiming();
+            if (!map.fill(state)) break;
+            state.ResumeTiming();
+            sampler.run([&] {
+                deleteMapEntries(map.fd(), sizeof(typename Layout::Key), keys);
+            });
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * map.entries());
+}
+
+// Zero-copy access to the values of a BPF_F_MMAPABLE array, e.g. per-upstream stats indexed by
+// interface index, compared to reading them with the system calls above. Needs kernel 5.5.
+
+class MappedStats {
+  public:
+    explicit MappedStats(const TestMap<Stats>& map)
+        : mSize(map.entries() * sizeof(TetherStatsValue)) {
+        void* addr = mmap(nullptr, mSize, PROT_READ | PROT_WRITE, MAP_SHARED, map.fd(), 0);
+        mValues = addr != MAP_FAILED ? static_cast<TetherStatsValue*>(addr) : nullptr;
+    }
+
+    ~MappedStats() {
+        if (mValues) munmap(mValues, mSize);
+    }
+
+    TetherStatsValue* values() const { return mValues; }
+
+  private:
+    const size_t mSize;
+    TetherStatsValue* mValues;
+};
+
+void BM_ZeroCopyFind(benchmark::State& state) {
+    TestMap<Stats> map(state, BPF_F_MMAPABLE);
+    if (!map.ok() || !map.fill(state)) return;
+    MappedStats mapped(map);
+    if (!mapped.values()) {
+        state.SkipWithError(strerror(errno));
+        return;
+    }
+    TetherStatsValue value;
+    uint32_t i = 0;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            sampler.run([&] { memcpy(&value, &mapped.values()[i], sizeof(value)); });
+            benchmark::DoNotOptimize(value);
+            if (++i == map.entries()) i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_ZeroCopyUpdate(benchmark::State& state) {
+    TestMap<Stats> map(state, BPF_F_MMAPABLE);
+    if (!map.ok() || !map.fill(state)) return;
+    MappedStats mapped(map);
+    if (!mapped.values()) {
+        state.SkipWithError(strerror(errno));
+        return;
+    }
+    uint32_t i = 0;
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            const TetherStatsValue value = map.value(i + 1);
+            sampler.run([&] { memcpy(&mapped.values()[i], &value, sizeof(value)); });
+            benchmark::ClobberMemory();
+            if (++i == map.entries()) i = 0;
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_ZeroCopyReadAll(benchmark::State& state) {
+    TestMap<Stats> map(state, BPF_F_MMAPABLE);
+    if (!map.ok() || !map.fill(state)) return;
+    MappedStats mapped(map);
+    if (!mapped.values()) {
+        state.SkipWithError(strerror(errno));
+        return;
+    }
+    std::vector<TetherStatsValue> values(map.entries());
+    {
+        LatencySampler sampler(state);
+        for (auto _ : state) {
+            sampler.run([&] {
+                memcpy(values.data(), mapped.values(), values.size() * sizeof(values[0]));
+            });
+            benchmark::DoNotOptimize(values.data());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * map.entries());
+}
+
+// The rule maps are hashes, some of them LRU. The sizes go from those of the tethering maps (64
+// IPv6 and 1024 IPv4 rules) to what a router with many clients would need.
+void RuleMaps(benchmark::internal::Benchmark* b) {
+    for (int type : {BPF_MAP_TYPE_HASH, BPF_MAP_TYPE_LRU_HASH}) {
+        for (int entries : {64, 1024, 16384}) b->Args({type, entries});
+    }
+}
+
+void StatsMaps(benchmark::internal::Benchmark* b) {
+    for (int type : {BPF_MAP_TYPE_HASH, BPF_MAP_TYPE_ARRAY}) {
+        for (int entries : {16, 256}) b->Args({type, entries});
+    }
+}
+
+void MmapableStatsMaps(benchmark::internal::Benchmark* b) {
+    for (int entries : {16, 256}) b->Args({BPF_MAP_TYPE_ARRAY, entries});
+}
+
+#define BENCHMARK_RULE_MAP(fn)                          \
+    BENCHMARK_TEMPLATE(fn, Ipv4Rule)->Apply(RuleMaps);  \
+    BENCHMARK_TEMPLATE(fn, Ipv6Rule)->Apply(RuleMaps)
+
+BENCHMARK_RULE_MAP(BM_Find);
+BENCHMARK_RULE_MAP(BM_FindMissing);
+BENCHMARK_RULE_MAP(BM_Update);
+BENCHMARK_RULE_MAP(BM_DeleteInsert);
+BENCHMARK_RULE_MAP(BM_ReadAllPerEntry);
+BENCHMARK_RULE_MAP(BM_ReadAllBatched);
+BENCHMARK_RULE_MAP(BM_ReadAllStreamed);
+BENCHMARK_RULE_MAP(BM_WriteAllPerEntry);
+BENCHMARK_RULE_MAP(BM_WriteAllBatched);
+BENCHMARK_RULE_MAP(BM_DeleteAllPerEntry);
+BENCHMARK_RULE_MAP(BM_DeleteAllBatched);
+
+BENCHMARK_TEMPLATE(BM_Find, Stats)->Apply(StatsMaps);
+BENCHMARK_TEMPLATE(BM_Update, Stats)->Apply(StatsMaps);
+BENCHMARK_TEMPLATE(BM_ReadAllPerEntry, Stats)->Apply(StatsMaps);
+BENCHMARK_TEMPLATE(BM_ReadAllBatched, Stats)->Apply(StatsMaps);
+BENCHMARK_TEMPLATE(BM_ReadAllStreamed, Stats)->Apply(StatsMaps);
+BENCHMARK(BM_ZeroCopyFind)->Apply(MmapableStatsMaps);
+BENCHMARK(BM_ZeroCopyUpdate)->Apply(MmapableStatsMaps);
+BENCHMARK(BM_ZeroCopyReadAll)->Apply(MmapableStatsMaps);
+
+}  // namespace
+}  // namespace android
+
+BENCHMARK_MAIN();
@@ -0,0 +1,321 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmark of the native steps of bringing up the offload of a downstream, on a veth pair: the
+// veth0 end plays the downstream and veth1 the upstream. Each iteration
+//   1. retrieves the pinned programs, as BpfUtils#tcFilterAddDevBpf does for every attach,
+//   2. attaches them with RTM_NEWTFILTER, IPv6 and IPv4, to both interfaces,
+//   3. writes the upstream limit, stats and IPv6 upstream rule entries,
+//   4. writes the first IPv4 rule pair,
+// and reports the time of each step as <step>_p50_us and <step>_p99_us. The programs and maps
+// stand in for the tethering ones, which are not needed.
+//
+// Needs root, and a bpffs mounted on /sys/fs/bpf to pin the program. The CachedProgram variant
+// retrieves the program once, to show what caching the program file descriptors would save.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/pkt_cls.h>
+#include <linux/rtnetlink.h>
+#include <linux/veth.h>
+#include <net/if.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#define BPF_FD_JUST_USE_INT
+#include "BpfSyscallWrappers.h"
+#include "bpf_tethering.h"
+#include "netlink_writer.h"
+#include "tc_filter.h"
+
+namespace android {
+namespace {
+
+constexpr char kDownstream[] = "tbench0";
+constexpr char kUpstream[] = "tbench1";
+constexpr char kProgPath[] = "/sys/fs/bpf/tether_bringup_benchmark_prog";
+
+// Sync from BpfUtils.java.
+constexpr uint16_t PRIO_TETHER6 = 1;
+constexpr uint16_t PRIO_TETHER4 = 2;
+
+enum Phase { RETRIEVE, ATTACH, UPSTREAM_MAPS, FIRST_RULE, PHASE_COUNT };
+const char* const kPhaseNames[PHASE_COUNT] = {"retrieve", "attach", "upstream_maps", "first_rule"};
+
+uint64_t nowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int sendRequest(const NetlinkWriter& w) {
+    return sendAndProcessNetlinkResponse(w.data(), w.size());
+}
+
+// ip link add kDownstream type veth peer name kUpstream
+int addVethPair() {
+    NetlinkWriter w;
+    const size_t msg = w.begin(RTM_NEWLINK, NETLINK_REQUEST_FLAGS | NLM_F_CREATE | NLM_F_EXCL);
+    const ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+    w.append(&ifi, sizeof(ifi));
+    w.putAttr(IFLA_IFNAME, kDownstream, sizeof(kDownstream));
+    const size_t linkInfo = w.beginNest(IFLA_LINKINFO);
+    w.putAttr(IFLA_INFO_KIND, "veth", sizeof("veth"));
+    const size_t data = w.beginNest(IFLA_INFO_DATA);
+    const size_t peer = w.beginNest(VETH_INFO_PEER);
+    w.append(&ifi, sizeof(ifi));
+    w.putAttr(IFLA_IFNAME, kUpstream, sizeof(kUpstream));
+    w.endNest(peer);
+    w.endNest(data);
+    w.endNest(linkInfo);
+    w.endMessage(msg);
+    return sendRequest(w);
+}
+
+int deleteLink(int ifindex) {
+    NetlinkWriter w;
+    const size_t msg = w.begin(RTM_DELLINK, NETLINK_REQUEST_FLAGS);
+    const ifinfomsg ifi = {.ifi_family = AF_UNSPEC, .ifi_index = ifindex};
+    w.append(&ifi, sizeof(ifi));
+    w.endMessage(msg);
+    return sendRequest(w);
+}
+
+// tc qdisc add dev .. clsact, as netd does for every interface.
+int addClsact(int ifindex) {
+    NetlinkWriter w;
+    const size_t msg = w.begin(RTM_NEWQDISC, NETLINK_REQUEST_FLAGS | NLM_F_CREATE | NLM_F_EXCL);
+    const tcmsg t = {
+            .tcm_family = AF_UNSPEC,
+            .tcm_ifindex = ifindex,
+            .tcm_handle = TC_H_MAKE(TC_H_CLSACT, 0),
+            .tcm_parent = TC_H_CLSACT,
+    };
+    w.append(&t, sizeof(t));
+    w.putAttr(TCA_KIND, "clsact", sizeof("clsact"));
+    w.endMessage(msg);
+    return sendRequest(w);
+}
+
+// A direct-action classifier that lets every packet through.
+int loadProgram() {
+    const bpf_insn insns[] = {
+            {.code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = TC_ACT_OK},
+            {.code = BPF_JMP | BPF_EXIT},
+    };
+    bpf_attr attr = {};
+    attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+    attr.insns = ptr_to_u64(insns);
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = ptr_to_u64("Apache 2.0");
+    return bpf::bpf(BPF_PROG_LOAD, attr);
+}
+
+class BringUpFixture {
+  public:
+    explicit BringUpFixture(benchmark::State& state) : mState(state) {
+        deleteLink(if_nametoindex(kDownstream));  // Left over by an interrupted run, if any.
+        unlink(kProgPath);
+        if (!check(addVethPair(), "add veth pair")) return;
+        mDownstreamIfindex = if_nametoindex(kDownstream);
+        mUpstreamIfindex = if_nametoindex(kUpstream);
+        if (!check(addClsact(mDownstreamIfindex), "add clsact") ||
+            !check(addClsact(mUpstreamIfindex), "add clsact")) {
+            return;
+        }
+
+        const int progFd = loadProgram();
+        if (!check(progFd == -1 ? -errno : 0, "load program")) return;
+        const int ret = bpf::bpfFdPin(progFd, kProgPath);
+        close(progFd);
+        if (!check(ret ? -errno : 0, "pin program on bpffs")) return;
+
+        mLimitFd = bpf::createMap(BPF_MAP_TYPE_HASH, sizeof(TetherLimitKey),
+                                  sizeof(TetherLimitValue), 16, 0);
+        mStatsFd = bpf::createMap(BPF_MAP_TYPE_HASH, sizeof(TetherStatsKey),
+                                  sizeof(TetherStatsValue), 16, 0);
+        mUpstream6Fd = bpf::createMap(BPF_MAP_TYPE_HASH, sizeof(TetherUpstream6Key),
+                                      sizeof(Tether6Value), 64, 0);
+        mUpstream4Fd = bpf::createMap(BPF_MAP_TYPE_HASH, sizeof(Tether4Key),
+                                      sizeof(Tether4Value), 1024, 0);
+        mDownstream4Fd = bpf::createMap(BPF_MAP_TYPE_HASH, sizeof(Tether4Key),
+                                        sizeof(Tether4Value), 1024, 0);
+        for (int fd : {mLimitFd, mStatsFd, mUpstream6Fd, mUpstream4Fd, mDownstream4Fd}) {
+            if (!check(fd == -1 ? -errno : 0, "create map")) return;
+        }
+        mOk = true;
+    }
+
+    ~BringUpFixture() {
+        for (int fd : {mLimitFd, mStatsFd, mUpstream6Fd, mUpstream4Fd, mDownstream4Fd}) {
+            if (fd != -1) close(fd);
+        }
+        unlink(kProgPath);
+        if (mDownstreamIfindex) deleteLink(mDownstreamIfindex);
+    }
+
+    bool ok() const { return mOk; }
+
+    // Runs one bring-up and adds the time of each step to samples. Returns false on error.
+    bool bringUp(int cachedProgFd, std::vector<uint64_t>* samples) {
+        uint64_t start = nowNs();
+        int progFd = cachedProgFd;
+        if (progFd == -1) {
+            progFd = bpf::retrieveProgram(kProgPath);
+            if (!check(progFd == -1 ? -errno : 0, "retrieveProgram")) return false;
+        }
+        start = lap(start, RETRIEVE, samples);
+
+        // The upstream programs on the downstream, the downstream programs on the upstream.
+        for (int ifindex : {mDownstreamIfindex, mUpstreamIfindex}) {
+            if (!check(tcFilterAddDevBpf(ifindex, true, PRIO_TETHER6, ETH_P_IPV6, progFd,
+                                         "tether6"),
+                       "RTM_NEWTFILTER") ||
+                !check(tcFilterAddDevBpf(ifindex, true, PRIO_TETHER4, ETH_P_IP, progFd,
+                                         "tether4"),
+                       "RTM_NEWTFILTER")) {
+                if (progFd != cachedProgFd) close(progFd);
+                return false;
+            }
+        }
+        if (progFd != cachedProgFd) close(progFd);
+        start = lap(start, ATTACH, samples);
+
+        const TetherLimitKey limitKey = mUpstreamIfindex;
+        const TetherLimitValue limit = UINT64_MAX;
+        const TetherStatsValue stats = {};
+        const TetherUpstream6Key upstream6Key = {.iif = static_cast<uint32_t>(mDownstreamIfindex)};
+        const Tether6Value upstream6Value = {.oif = static_cast<uint32_t>(mUpstreamIfindex)};
+        if (!check(writeEntry(mLimitFd, &limitKey, &limit), "write limit") ||
+            !check(writeEntry(mStatsFd, &limitKey, &stats), "write stats") ||
+            !check(writeEntry(mUpstream6Fd, &upstream6Key, &upstream6Value), "write upstream6")) {
+            return false;
+        }
+        start = lap(start, UPSTREAM_MAPS, samples);
+
+        const Tether4Key upstream4Key = {.iif = static_cast<uint32_t>(mDownstreamIfindex)};
+        const Tether4Key downstream4Key = {.iif = static_cast<uint32_t>(mUpstreamIfindex)};
+        const Tether4Value upstream4Value = {.oif = static_cast<uint32_t>(mUpstreamIfindex)};
+        const Tether4Value downstream4Value = {.oif = static_cast<uint32_t>(mDownstreamIfindex)};
+        if (!check(writeEntry(mUpstream4Fd, &upstream4Key, &upstream4Value), "write rule") ||
+            !check(writeEntry(mDownstream4Fd, &downstream4Key, &downstream4Value),
+                   "write rule")) {
+            return false;
+        }
+        lap(start, FIRST_RULE, samples);
+        return true;
+    }
+
+    // Undoes #bringUp.
+    bool tearDown() {
+        for (int ifindex : {mDownstreamIfindex, mUpstreamIfindex}) {
+            if (!check(tcFilterDelDev(ifindex, true, PRIO_TETHER6, ETH_P_IPV6), "RTM_DELTFILTER") ||
+                !check(tcFilterDelDev(ifindex, true, PRIO_TETHER4, ETH_P_IP), "RTM_DELTFILTER")) {
+                return false;
+            }
+        }
+        for (int fd : {mLimitFd, mStatsFd, mUpstream6Fd, mUpstream4Fd, mDownstream4Fd}) {
+            clearMap(fd);
+        }
+        return true;
+    }
+
+  private:
+    bool check(int ret, const char* what) {
+        if (ret == 0) return true;
+        mState.SkipWithError((std::string(what) + ": " + strerror(-ret)).c_str());
+        return false;
+    }
+
+    static int writeEntry(int fd, const void* key, const void* value) {
+        return bpf::writeToMapEntry(fd, key, value, BPF_ANY) ? -errno : 0;
+    }
+
+    static void clearMap(int fd) {
+        uint8_t key[64];
+        while (bpf::getFirstMapKey(fd, key) == 0) bpf::deleteMapEntry(fd, key);
+    }
+
+    static uint64_t lap(uint64_t start, Phase phase, std::vector<uint64_t>* samples) {
+        const uint64_t now = nowNs();
+        samples[phase].push_back(now - start);
+        return now;
+    }
+
+    benchmark::State& mState;
+    bool mOk = false;
+    int mDownstreamIfindex = 0;
+    int mUpstreamIfindex = 0;
+    int mLimitFd = -1;
+    int mStatsFd = -1;
+    int mUpstream6Fd = -1;
+    int mUpstream4Fd = -1;
+    int mDownstream4Fd = -1;
+};
+
+void reportPhases(benchmark::State& state, std::vector<uint64_t>* samples) {
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        std::vector<uint64_t>& s = samples[phase];
+        if (s.empty()) continue;
+        std::sort(s.begin(), s.end());
+        const std::string name = kPhaseNames[phase];
+        state.counters[name + "_p50_us"] = s[(s.size() - 1) * 50 / 100] / 1000.0;
+        state.counters[name + "_p99_us"] = s[(s.size() - 1) * 99 / 100] / 1000.0;
+    }
+}
+
+void runBringUp(benchmark::State& state, bool cacheProgram) {
+    BringUpFixture fixture(state);
+    if (!fixture.ok()) return;
+    const int cachedProgFd = cacheProgram ? bpf::retrieveProgram(kProgPath) : -1;
+
+    std::vector<uint64_t> samples[PHASE_COUNT];
+    for (auto _ : state) {
+        if (!fixture.bringUp(cachedProgFd, samples)) break;
+        state.PauseTiming();
+        const bool tornDown = fixture.tearDown();
+        state.ResumeTiming();
+        if (!tornDown) break;
+    }
+    if (cachedProgFd != -1) close(cachedProgFd);
+    reportPhases(state, samples);
+}
+
+void BM_BringUp(benchmark::State& state) {
+    runBringUp(state, false /* cacheProgram */);
+}
+
+void BM_BringUpCachedProgram(benchmark::State& state) {
+    runBringUp(state, true /* cacheProgram */);
+}
+
+// Bring-ups are slow and serialized on the rtnl lock, so a few hundred give stable percentiles.
+BENCHMARK(BM_BringUp)->Unit(benchmark::kMicrosecond)->Iterations(500);
+BENCHMARK(BM_BringUpCachedProgram)->Unit(benchmark::kMicrosecond)->Iterations(500);
+
+}  // namespace
+}  // namespace android
+
+BENCHMARK_MAIN();
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <map>
+
+#include <gtest/gtest.h>
+
+#include "bpf_map_iter.h"
+
+namespace android {
+namespace {
+
+// Entries do not divide the 8 page read buffer evenly, so every read ends mid-page.
+struct Key {
+    uint32_t a;
+    uint32_t b;
+    uint32_t c;
+};
+struct Value {
+    uint64_t x[5];
+};
+constexpr uint32_t kEntries = 5000;
+
+using Entries = std::map<std::vector<uint8_t>, std::vector<uint8_t>>;
+
+Entries toEntries(const std::vector<uint8_t>& keys, const std::vector<uint8_t>& values) {
+    Entries entries;
+    for (size_t i = 0; i < keys.size() / sizeof(Key); i++) {
+        entries.emplace(std::vector<uint8_t>(keys.begin() + i * sizeof(Key),
+                                              keys.begin() + (i + 1) * sizeof(Key)),
+                        std::vector<uint8_t>(values.begin() + i * sizeof(Value),
+                                             values.begin() + (i + 1) * sizeof(Value)));
+    }
+    return entries;
+}
+
+class BpfMapIterTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        bpf_attr attr = {};
+        attr.map_type = BPF_MAP_TYPE_HASH;
+        attr.key_size = sizeof(Key);
+        attr.value_size = sizeof(Value);
+        attr.max_entries = kEntries;
+        mMapFd = bpfBatch(BPF_MAP_CREATE, &attr);
+        if (mMapFd == -1) GTEST_SKIP() << "Cannot create BPF maps: " << strerror(errno);
+
+        std::vector<uint8_t> keys, values;
+        for (uint32_t i = 0; i < kEntries; i++) {
+            const Key key = {i, ~i, i * 7};
+            const Value value = {{i, i + 1, i + 2, i + 3, i + 4}};
+            const uint8_t* k = reinterpret_cast<const uint8_t*>(&key);
+            const uint8_t* v = reinterpret_cast<const uint8_t*>(&value);
+            keys.insert(keys.end(), k, k + sizeof(key));
+            values.insert(values.end(), v, v + sizeof(value));
+        }
+        ASSERT_EQ(0, writeMapEntries(mMapFd, sizeof(Key), sizeof(Value), keys, values));
+    }
+
+    void TearDown() override {
+        if (mMapFd != -1) close(mMapFd);
+    }
+
+    int mMapFd = -1;
+};
+
+TEST_F(BpfMapIterTest, StreamedEntriesMatchBatchedRead) {
+    std::vector<uint8_t> keys, values;
+    if (streamAllMapEntries(mMapFd, sizeof(Key), sizeof(Value), &keys, &values) != 0) {
+        GTEST_SKIP() << "Map element iterators unavailable: " << strerror(errno);
+    }
+    std::vector<uint8_t> expectedKeys, expectedValues;
+    ASSERT_EQ(0, readAllMapEntries(mMapFd, sizeof(Key), sizeof(Value), &expectedKeys,
+                                   &expectedValues));
+
+    ASSERT_EQ(kEntries * sizeof(Key), keys.size());
+    ASSERT_EQ(kEntries * sizeof(Value), values.size());
+    EXPECT_EQ(toEntries(expectedKeys, expectedValues), toEntries(keys, values));
+}
+
+TEST_F(BpfMapIterTest, StreamsEmptyMap) {
+    std::vector<uint8_t> keys, values;
+    ASSERT_EQ(0, readAllMapEntries(mMapFd, sizeof(Key), sizeof(Value), &keys, &values));
+    ASSERT_EQ(0, deleteMapEntries(mMapFd, sizeof(Key), keys));
+
+    keys.clear();
+    values.clear();
+    if (streamAllMapEntries(mMapFd, sizeof(Key), sizeof(Value), &keys, &values) != 0) {
+        GTEST_SKIP() << "Map element iterators unavailable: " << strerror(errno);
+    }
+    EXPECT_TRUE(keys.empty());
+    EXPECT_TRUE(values.empty());
+}
+
+}  // namespace
+}  // namespace android
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+
+#include <gtest/gtest.h>
+
+#include "conntrack_event_parser.h"
+#include "netlink_writer.h"
+
+namespace android {
+namespace {
+
+// Sync from ConntrackMessage.ESTABLISHED_MASK.
+constexpr uint32_t kEstablishedMask =
+        IPS_CONFIRMED | IPS_ASSURED | IPS_SEEN_REPLY | IPS_SRC_NAT_DONE;
+constexpr uint32_t kUnrepliedNatMask = IPS_CONFIRMED | IPS_SRC_NAT_DONE;
+constexpr uint16_t kCtNew = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_NEW;
+constexpr uint16_t kCtDelete = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_DELETE;
+constexpr uint16_t kCtGet = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+
+struct Tuple {
+    const char* src;
+    const char* dst;
+    uint16_t srcPort;
+    uint16_t dstPort;
+};
+
+// A client behind the NAT talking to a server, and the reply tuple after source NAT.
+const Tuple kOrig = {"192.168.80.12", "140.112.8.116", 62449, 443};
+const Tuple kReply = {"140.112.8.116", "100.81.179.1", 443, 62449};
+
+void putTuple(NetlinkWriter* w, uint16_t type, const Tuple& t, uint8_t proto) {
+    const size_t tuple = w->beginNest(type);
+    const size_t ip = w->beginNest(CTA_TUPLE_IP);
+    in_addr addr;
+    inet_pton(AF_INET, t.src, &addr);
+    w->putAttr(CTA_IP_V4_SRC, &addr, sizeof(addr));
+    inet_pton(AF_INET, t.dst, &addr);
+    w->putAttr(CTA_IP_V4_DST, &addr, sizeof(addr));
+    w->endNest(ip);
+    const size_t protoNest = w->beginNest(CTA_TUPLE_PROTO);
+    w->putAttr(CTA_PROTO_NUM, &proto, sizeof(proto));
+    const uint16_t srcPort = htons(t.srcPort), dstPort = htons(t.dstPort);
+    w->putAttr(CTA_PROTO_SRC_PORT, &srcPort, sizeof(srcPort));
+    w->putAttr(CTA_PROTO_DST_PORT, &dstPort, sizeof(dstPort));
+    w->endNest(protoNest);
+    w->endNest(tuple);
+}
+
+// Builds a ctnetlink message as the kernel sends it for a conntrack event or dump entry.
+void putEvent(NetlinkWriter* w, uint16_t type, uint8_t proto, uint32_t status, uint32_t timeout,
+              uint8_t family = AF_INET) {
+    const size_t msg = w->begin(type, 0);
+    const nfgenmsg nfg = {.nfgen_family = family, .version = NFNETLINK_V0};
+    w->append(&nfg, sizeof(nfg));
+    putTuple(w, CTA_TUPLE_ORIG, kOrig, proto);
+    putTuple(w, CTA_TUPLE_REPLY, kReply, proto);
+    const uint32_t beStatus = htonl(status);
+    w->putAttr(CTA_STATUS, &beStatus, sizeof(beStatus));
+    if (timeout) {
+        const uint32_t beTimeout = htonl(timeout);
+        w->putAttr(CTA_TIMEOUT, &beTimeout, sizeof(beTimeout));
+    }
+    w->endMessage(msg);
+}
+
+const nlmsghdr* header(const NetlinkWriter& w) {
+    return reinterpret_cast<const nlmsghdr*>(w.data());
+}
+
+void expectAddr(const char* expected, const uint8_t* actual) {
+    in_addr addr;
+    inet_pton(AF_INET, expected, &addr);
+    EXPECT_EQ(0, memcmp(&addr, actual, sizeof(addr))) << expected;
+}
+
+TEST(ConntrackEventParserTest, ParsesTcpEvent) {
+    NetlinkWriter w;
+    putEvent(&w, kCtNew, IPPROTO_TCP, kEstablishedMask, 432000);
+
+    ConntrackEventRecord rec;
+    ASSERT_TRUE(parseConntrackMessage(header(w), &rec));
+    EXPECT_EQ(kCtNew, rec.msgType);
+    EXPECT_EQ(IPPROTO_TCP, rec.proto);
+    EXPECT_EQ(kEstablishedMask, rec.status);
+    EXPECT_EQ(432000U, rec.timeoutSec);
+    expectAddr(kOrig.src, rec.origSrc);
+    expectAddr(kOrig.dst, rec.origDst);
+    EXPECT_EQ(kOrig.srcPort, rec.origSrcPort);
+    EXPECT_EQ(kOrig.dstPort, rec.origDstPort);
+    expectAddr(kReply.src, rec.replySrc);
+    expectAddr(kReply.dst, rec.replyDst);
+    EXPECT_EQ(kReply.srcPort, rec.replySrcPort);
+    EXPECT_EQ(kReply.dstPort, rec.replyDstPort);
+}
+
+TEST(ConntrackEventParserTest, ParsesUdpDeleteWithoutTimeout) {
+    NetlinkWriter w;
+    putEvent(&w, kCtDelete, IPPROTO_UDP, kEstablishedMask, 0 /* timeout */);
+
+    ConntrackEventRecord rec;
+    ASSERT_TRUE(parseConntrackMessage(header(w), &rec));
+    EXPECT_EQ(kCtDelete, rec.msgType);
+    EXPECT_EQ(IPPROTO_UDP, rec.proto);
+    EXPECT_EQ(0U, rec.timeoutSec);
+}
+
+TEST(ConntrackEventParserTest, RejectsUnusableMessages) {
+    ConntrackEventRecord rec;
+    {
+        // Not offloadable.
+        NetlinkWriter w;
+        putEvent(&w, kCtNew, IPPROTO_ICMP, kEstablishedMask, 30);
+        EXPECT_FALSE(parseConntrackMessage(header(w), &rec));
+    }
+    {
+        NetlinkWriter w;
+        putEvent(&w, kCtNew, IPPROTO_TCP, kEstablishedMask, 432000, AF_INET6);
+        EXPECT_FALSE(parseConntrackMessage(header(w), &rec));
+    }
+    {
+        // Dump replies are only accepted when reading a dump, and then reported as new entries.
+        NetlinkWriter w;
+        putEvent(&w, kCtGet, IPPROTO_TCP, kEstablishedMask, 432000);
+        EXPECT_FALSE(parseConntrackMessage(header(w), &rec));
+        ASSERT_TRUE(parseConntrackMessage(header(w), &rec, true /* allowDump */));
+        EXPECT_EQ(kCtNew, rec.msgType);
+    }
+    {
+        // Without a reply tuple the NAT mapping is unknown.
+        NetlinkWriter w;
+        const size_t msg = w.begin(kCtNew, 0);
+        const nfgenmsg nfg = {.nfgen_family = AF_INET, .version = NFNETLINK_V0};
+        w.append(&nfg, sizeof(nfg));
+        putTuple(&w, CTA_TUPLE_ORIG, kOrig, IPPROTO_TCP);
+        w.endMessage(msg);
+        EXPECT_FALSE(parseConntrackMessage(header(w), &rec));
+    }
+}
+
+TEST(ConntrackEventParserTest, IgnoresTruncatedAttributes) {
+    NetlinkWriter w;
+    putEvent(&w, kCtNew, IPPROTO_TCP, kEstablishedMask, 432000);
+    // Cut the message in the middle of the reply tuple, as a corrupted message would be.
+    nlmsghdr* nlh = const_cast<nlmsghdr*>(header(w));
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(nfgenmsg)) + 40;
+
+    ConntrackEventRecord rec;
+    EXPECT_FALSE(parseConntrackMessage(nlh, &rec));
+}
+
+bool parseAndFilter(uint16_t type, uint8_t proto, uint32_t status, uint32_t timeout,
+                    uint32_t newStatusMask) {
+    NetlinkWriter w;
+    putEvent(&w, type, proto, status, timeout);
+    ConntrackEventRecord rec;
+    return parseConntrackMessage(header(w), &rec) && shouldReportConntrackEvent(rec, newStatusMask);
+}
+
+TEST(ConntrackEventParserTest, ReportsOnlyEstablishedConnections) {
+    // SYN sent, then SYN/ACK seen, then established.
+    EXPECT_FALSE(parseAndFilter(kCtNew, IPPROTO_TCP, kUnrepliedNatMask, 120, kEstablishedMask));
+    EXPECT_FALSE(parseAndFilter(kCtNew, IPPROTO_TCP, kUnrepliedNatMask | IPS_SEEN_REPLY, 60,
+                                kEstablishedMask));
+    EXPECT_TRUE(parseAndFilter(kCtNew, IPPROTO_TCP, kEstablishedMask, 432000, kEstablishedMask));
+    EXPECT_TRUE(parseAndFilter(kCtNew, IPPROTO_UDP, kEstablishedMask, 120, kEstablishedMask));
+
+    // Not NATed, e.g. traffic to the device itself.
+    EXPECT_FALSE(parseAndFilter(kCtNew, IPPROTO_UDP, kEstablishedMask & ~IPS_SRC_NAT_DONE, 120,
+                                kEstablishedMask));
+}
+
+TEST(ConntrackEventParserTest, DropsClosingTcpConnections) {
+    // FIN_WAIT and TIME_WAIT keep the established status bits, with a short timeout.
+    EXPECT_FALSE(parseAndFilter(kCtNew, IPPROTO_TCP, kEstablishedMask, 120, kEstablishedMask));
+    EXPECT_FALSE(parseAndFilter(kCtNew, IPPROTO_TCP, kEstablishedMask, 10, kEstablishedMask));
+    // UDP has no closing states.
+    EXPECT_TRUE(parseAndFilter(kCtNew, IPPROTO_UDP, kEstablishedMask, 30, kEstablishedMask));
+}
+
+TEST(ConntrackEventParserTest, AlwaysReportsDeletions) {
+    EXPECT_TRUE(parseAndFilter(kCtDelete, IPPROTO_TCP, kUnrepliedNatMask, 0, kEstablishedMask));
+    EXPECT_TRUE(parseAndFilter(kCtDelete, IPPROTO_TCP, kEstablishedMask, 10, kEstablishedMask));
+}
+
+TEST(ConntrackEventParserTest, EarlyOffloadMaskReportsUnrepliedConnections) {
+    EXPECT_TRUE(parseAndFilter(kCtNew, IPPROTO_TCP, kUnrepliedNatMask, 120, kUnrepliedNatMask));
+    EXPECT_TRUE(parseAndFilter(kCtNew, IPPROTO_UDP, kUnrepliedNatMask, 30, kUnrepliedNatMask));
+    EXPECT_FALSE(parseAndFilter(kCtNew, IPPROTO_TCP, IPS_CONFIRMED, 120, kUnrepliedNatMask));
+}
+
+}  // namespace
+}  // namespace android
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+
+#include <gtest/gtest.h>
+
+#include "conntrack_event_parser.h"
+#include "conntrack_timeout.h"
+
+namespace android {
+namespace {
+
+constexpr uint64_t kCutoffNs = 1000000000ULL;
+
+// A client behind the NAT talking to a server, and the upstream address it is NATed to.
+constexpr uint32_t kClient = 0xc0a8500c;    // 192.168.80.12
+constexpr uint32_t kServer = 0x8c700874;    // 140.112.8.116
+constexpr uint32_t kUpstream = 0x6451b301;  // 100.81.179.1
+
+void setMapped(in6_addr* addr, uint32_t v4) {
+    *addr = {};
+    addr->s6_addr[10] = 0xff;
+    addr->s6_addr[11] = 0xff;
+    const uint32_t be = htonl(v4);
+    memcpy(&addr->s6_addr[12], &be, sizeof(be));
+}
+
+// The upstream rule of a client flow, keyed by the original tuple.
+void makeUpstream(uint16_t clientPort, uint64_t lastUsed, Tether4Key* k, Tether4Value* v) {
+    *k = {.l4Proto = IPPROTO_TCP, .srcPort = htons(clientPort), .dstPort = htons(443)};
+    k->src4.s_addr = htonl(kClient);
+    k->dst4.s_addr = htonl(kServer);
+    *v = {.last_used = lastUsed};
+}
+
+// The downstream rule of the same flow, keyed by the reply tuple, with the original tuple reversed
+// in its value.
+void makeDownstream(uint16_t clientPort, uint64_t lastUsed, Tether4Key* k, Tether4Value* v) {
+    *k = {.l4Proto = IPPROTO_TCP, .srcPort = htons(443), .dstPort = htons(clientPort)};
+    k->src4.s_addr = htonl(kServer);
+    k->dst4.s_addr = htonl(kUpstream);
+    *v = {.srcPort = htons(443), .dstPort = htons(clientPort), .last_used = lastUsed};
+    setMapped(&v->src46, kServer);
+    setMapped(&v->dst46, kClient);
+}
+
+void expectClientFlow(const ConntrackTuple& t, uint16_t clientPort) {
+    EXPECT_EQ(htonl(kClient), t.src);
+    EXPECT_EQ(htonl(kServer), t.dst);
+    EXPECT_EQ(htons(clientPort), t.srcPort);
+    EXPECT_EQ(htons(443), t.dstPort);
+    EXPECT_EQ(IPPROTO_TCP, t.proto);
+}
+
+TEST(ConntrackTimeoutTest, SelectsOnlyFlowsForwardedAfterCutoff) {
+    Tether4Key k[4];
+    Tether4Value v[4];
+    makeUpstream(1000, kCutoffNs + 1, &k[0], &v[0]);
+    makeUpstream(1001, kCutoffNs, &k[1], &v[1]);
+    makeUpstream(1002, 0 /* never used */, &k[2], &v[2]);
+    makeUpstream(1003, TETHER_LAST_USED_TENTATIVE, &k[3], &v[3]);
+
+    std::unordered_set<std::string> seen;
+    std::vector<ConntrackTuple> flows;
+    appendActiveFlows(k, v, 4, false /* downstream */, kCutoffNs, &seen, &flows);
+    ASSERT_EQ(1U, flows.size());
+    expectClientFlow(flows[0], 1000);
+}
+
+TEST(ConntrackTimeoutTest, DownstreamRulesGiveOriginalTuple) {
+    Tether4Key k;
+    Tether4Value v;
+    makeDownstream(1000, kCutoffNs + 1, &k, &v);
+
+    std::unordered_set<std::string> seen;
+    std::vector<ConntrackTuple> flows;
+    appendActiveFlows(&k, &v, 1, true /* downstream */, kCutoffNs, &seen, &flows);
+    ASSERT_EQ(1U, flows.size());
+    expectClientFlow(flows[0], 1000);
+}
+
+TEST(ConntrackTimeoutTest, RefreshesFlowActiveInBothDirectionsOnce) {
+    Tether4Key up[2], down[2];
+    Tether4Value upValue[2], downValue[2];
+    makeUpstream(1000, kCutoffNs + 1, &up[0], &upValue[0]);
+    makeUpstream(1001, kCutoffNs, &up[1], &upValue[1]);
+    makeDownstream(1000, kCutoffNs + 1, &down[0], &downValue[0]);
+    // Idle upstream, e.g. a download: still refreshed through its downstream rule.
+    makeDownstream(1001, kCutoffNs + 1, &down[1], &downValue[1]);
+
+    std::unordered_set<std::string> seen;
+    std::vector<ConntrackTuple> flows;
+    appendActiveFlows(up, upValue, 2, false /* downstream */, kCutoffNs, &seen, &flows);
+    appendActiveFlows(down, downValue, 2, true /* downstream */, kCutoffNs, &seen, &flows);
+    ASSERT_EQ(2U, flows.size());
+    expectClientFlow(flows[0], 1000);
+    expectClientFlow(flows[1], 1001);
+}
+
+TEST(ConntrackTimeoutTest, TimeoutUpdateOnlyReplacesExistingEntries) {
+    const ConntrackTuple t = {.src = htonl(kClient), .dst = htonl(kServer),
+                              .srcPort = htons(1000), .dstPort = htons(443),
+                              .proto = IPPROTO_UDP};
+    NetlinkWriter w;
+    appendTimeoutUpdate(&w, t, 180);
+    appendTimeoutUpdate(&w, t, 432000);
+
+    // Two messages packed in one buffer, as they are sent in one datagram.
+    int remaining = w.size();
+    std::vector<uint32_t> timeouts;
+    for (const nlmsghdr* nlh = reinterpret_cast<const nlmsghdr*>(w.data());
+         NLMSG_OK(nlh, remaining); nlh = NLMSG_NEXT(nlh, remaining)) {
+        EXPECT_EQ((NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_NEW, nlh->nlmsg_type);
+        // Without NLM_F_CREATE, an entry that expired in the meantime is not recreated.
+        EXPECT_EQ(NLM_F_REQUEST | NLM_F_REPLACE, nlh->nlmsg_flags);
+
+        const nfgenmsg* nfg = static_cast<const nfgenmsg*>(NLMSG_DATA(nlh));
+        EXPECT_EQ(AF_INET, nfg->nfgen_family);
+        const uint8_t* attrs = reinterpret_cast<const uint8_t*>(nfg) + NLMSG_ALIGN(sizeof(*nfg));
+        bool hasTuple = false;
+        forEachAttr(attrs, nlh->nlmsg_len - NLMSG_LENGTH(NLMSG_ALIGN(sizeof(*nfg))),
+                    [&](uint16_t type, const uint8_t* p, size_t len) {
+                        if (type == CTA_TUPLE_ORIG) hasTuple = true;
+                        if (type == CTA_TIMEOUT && len == 4) timeouts.push_back(getBe32(p));
+                    });
+        EXPECT_TRUE(hasTuple);
+    }
+    EXPECT_EQ(0, remaining);
+    EXPECT_EQ((std::vector<uint32_t>{180, 432000}), timeouts);
+}
+
+}  // namespace
+}  // namespace android
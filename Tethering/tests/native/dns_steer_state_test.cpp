@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+
+#include <gtest/gtest.h>
+
+#include "dns_steer_state.h"
+
+namespace android {
+namespace {
+
+constexpr uint32_t kDownstream = 10;
+constexpr uint32_t kOtherDownstream = 11;
+
+TetherDnsSteerStateKey makeKey(uint32_t iif, uint32_t client, uint16_t port, uint16_t fragId) {
+    TetherDnsSteerStateKey k = {.iif = iif, .clientPort = htons(port), .fragId = htons(fragId)};
+    k.client4.s_addr = htonl(client);
+    return k;
+}
+
+class DnsSteerStateTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        mMap = bpf::createMap(BPF_MAP_TYPE_LRU_HASH, sizeof(TetherDnsSteerStateKey),
+                              sizeof(TetherDnsSteerStateValue), 64, 0);
+        if (mMap == -1) GTEST_SKIP() << "Cannot create BPF maps: " << strerror(errno);
+    }
+
+    void TearDown() override {
+        if (mMap != -1) close(mMap);
+    }
+
+    void add(const TetherDnsSteerStateKey& k) {
+        const TetherDnsSteerStateValue v = {.resolverPort = htons(53)};
+        ASSERT_EQ(0, bpf::writeToMapEntry(mMap, &k, &v, BPF_ANY));
+    }
+
+    bool contains(const TetherDnsSteerStateKey& k) {
+        TetherDnsSteerStateValue v;
+        return bpf::findMapEntry(mMap, &k, &v) == 0;
+    }
+
+    int mMap = -1;
+};
+
+TEST_F(DnsSteerStateTest, ClearsOnlyTheDownstream) {
+    const TetherDnsSteerStateKey queries[] = {
+            makeKey(kDownstream, 0xc0a8500c, 40000, 0),
+            makeKey(kDownstream, 0xc0a8500c, 40001, 0),
+            makeKey(kDownstream, 0xc0a8500d, 40000, 0),
+            // An in-flight fragmented reply.
+            makeKey(kDownstream, 0xc0a8500c, 0, 0x1234),
+    };
+    const TetherDnsSteerStateKey other = makeKey(kOtherDownstream, 0xc0a8500c, 40000, 0);
+    for (const auto& k : queries) add(k);
+    add(other);
+
+    EXPECT_EQ(4, clearDnsSteerState(mMap, kDownstream));
+    for (const auto& k : queries) EXPECT_FALSE(contains(k));
+    EXPECT_TRUE(contains(other));
+
+    EXPECT_EQ(0, clearDnsSteerState(mMap, kDownstream));
+    EXPECT_EQ(1, clearDnsSteerState(mMap, kOtherDownstream));
+    EXPECT_FALSE(contains(other));
+}
+
+TEST_F(DnsSteerStateTest, ClearsEveryEntry) {
+    // Deleting while walking would restart or skip entries; every one must go.
+    for (uint16_t port = 1; port <= 48; port++) {
+        add(makeKey(port % 2 ? kDownstream : kOtherDownstream, 0xc0a8500c, port, 0));
+    }
+    EXPECT_EQ(24, clearDnsSteerState(mMap, kDownstream));
+    EXPECT_EQ(24, clearDnsSteerState(mMap, kOtherDownstream));
+    TetherDnsSteerStateKey k;
+    EXPECT_NE(0, bpf::getFirstMapKey(mMap, &k));
+}
+
+}  // namespace
+}  // namespace android
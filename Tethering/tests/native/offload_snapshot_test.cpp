@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "offload_snapshot.h"
+#include "offload_snapshot_reader.h"
+
+namespace android {
+namespace {
+
+constexpr uint64_t kBootTimeNs = 123456789012ULL;
+
+template <typename T>
+void appendBytes(std::vector<uint8_t>* out, const T& item) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(&item);
+    out->insert(out->end(), p, p + sizeof(item));
+}
+
+class OffloadSnapshotTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        const char* tmp = getenv("TMPDIR");
+        mPath = std::string(tmp ? tmp : "/tmp") + "/offload_snapshot_test.XXXXXX";
+        const int fd = mkstemp(mPath.data());
+        ASSERT_NE(-1, fd) << strerror(errno);
+        close(fd);
+    }
+
+    void TearDown() override { unlink(mPath.c_str()); }
+
+    void write(const std::vector<TetherSnapshotMapData>& maps) {
+        const int fd = open(mPath.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+        ASSERT_NE(-1, fd) << strerror(errno);
+        EXPECT_EQ(0, writeOffloadSnapshotMaps(fd, maps, kBootTimeNs));
+        close(fd);
+    }
+
+    std::unique_ptr<OffloadSnapshot> read() {
+        std::string error;
+        std::unique_ptr<OffloadSnapshot> snapshot = OffloadSnapshot::open(mPath.c_str(), &error);
+        EXPECT_NE(nullptr, snapshot) << error;
+        return snapshot;
+    }
+
+    std::string mPath;
+};
+
+TEST_F(OffloadSnapshotTest, RoundTrip) {
+    TetherSnapshotMapData upstream4 = {
+        .name = "tether_upstream4_map",
+        .keySize = sizeof(Tether4Key),
+        .valueSize = sizeof(Tether4Value),
+    };
+    for (uint16_t port = 1000; port < 1003; port++) {
+        appendBytes(&upstream4.keys, Tether4Key{.iif = 10, .srcPort = port, .dstPort = 443});
+        appendBytes(&upstream4.values, Tether4Value{.oif = 20, .srcPort = port, .last_used = port});
+    }
+    TetherSnapshotMapData stats = {
+        .name = "tether_stats_map",
+        .keySize = sizeof(TetherStatsKey),
+        .valueSize = sizeof(TetherStatsValue),
+    };
+    appendBytes(&stats.keys, TetherStatsKey{20});
+    appendBytes(&stats.values, TetherStatsValue{.rxPackets = 5, .rxBytes = 7000});
+    // Present on the device but empty.
+    TetherSnapshotMapData limit = {
+        .name = "tether_limit_map",
+        .keySize = sizeof(TetherLimitKey),
+        .valueSize = sizeof(TetherLimitValue),
+    };
+    write({upstream4, stats, limit});
+
+    const std::unique_ptr<OffloadSnapshot> snapshot = read();
+    ASSERT_NE(nullptr, snapshot);
+    EXPECT_EQ(static_cast<uint32_t>(BPF_TETHER_LAYOUT_VERSION), snapshot->layoutVersion());
+    EXPECT_EQ(kBootTimeNs, snapshot->bootTimeNs());
+    ASSERT_EQ(3U, snapshot->mapCount());
+    EXPECT_STREQ("tether_upstream4_map", snapshot->map(0).name);
+
+    OffloadSnapshotEntries<Tether4Key, Tether4Value> rules;
+    ASSERT_TRUE(snapshot->getEntries("tether_upstream4_map", &rules));
+    ASSERT_EQ(3U, rules.count);
+    EXPECT_EQ(0, memcmp(upstream4.keys.data(), rules.keys, upstream4.keys.size()));
+    EXPECT_EQ(0, memcmp(upstream4.values.data(), rules.values, upstream4.values.size()));
+    EXPECT_EQ(1002U, rules.values[2].last_used);
+
+    OffloadSnapshotEntries<TetherStatsKey, TetherStatsValue> statsEntries;
+    ASSERT_TRUE(snapshot->getEntries("tether_stats_map", &statsEntries));
+    ASSERT_EQ(1U, statsEntries.count);
+    EXPECT_EQ(20U, statsEntries.keys[0]);
+    EXPECT_EQ(7000U, statsEntries.values[0].rxBytes);
+
+    OffloadSnapshotEntries<TetherLimitKey, TetherLimitValue> limitEntries;
+    ASSERT_TRUE(snapshot->getEntries("tether_limit_map", &limitEntries));
+    EXPECT_EQ(0U, limitEntries.count);
+
+    // Absent maps and mismatched layouts are refused.
+    OffloadSnapshotEntries<TetherStatsKey, TetherStatsValue> absent;
+    EXPECT_FALSE(snapshot->getEntries("tether_downstream4_map", &absent));
+    OffloadSnapshotEntries<Tether4Key, Tether4Value> mismatched;
+    EXPECT_FALSE(snapshot->getEntries("tether_stats_map", &mismatched));
+}
+
+TEST_F(OffloadSnapshotTest, NoMaps) {
+    write({});
+    const std::unique_ptr<OffloadSnapshot> snapshot = read();
+    ASSERT_NE(nullptr, snapshot);
+    EXPECT_EQ(0U, snapshot->mapCount());
+}
+
+TEST_F(OffloadSnapshotTest, RejectsTruncatedOrForeignFiles) {
+    TetherSnapshotMapData stats = {
+        .name = "tether_stats_map",
+        .keySize = sizeof(TetherStatsKey),
+        .valueSize = sizeof(TetherStatsValue),
+    };
+    appendBytes(&stats.keys, TetherStatsKey{20});
+    appendBytes(&stats.values, TetherStatsValue{});
+    write({stats});
+
+    struct stat st;
+    ASSERT_EQ(0, stat(mPath.c_str(), &st));
+    ASSERT_EQ(0, truncate(mPath.c_str(), st.st_size - 8));
+    std::string error;
+    EXPECT_EQ(nullptr, OffloadSnapshot::open(mPath.c_str(), &error));
+    EXPECT_FALSE(error.empty());
+
+    // What dumpsys would have produced if it had printed an error instead of the snapshot.
+    const int fd = open(mPath.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+    ASSERT_NE(-1, fd);
+    const char text[] = "Error writing snapshot: ErrnoException: EPERM (Operation not permitted)\n";
+    ASSERT_EQ(0, writeFully(fd, text, sizeof(text) - 1));
+    close(fd);
+    EXPECT_EQ(nullptr, OffloadSnapshot::open(mPath.c_str(), &error));
+}
+
+}  // namespace
+}  // namespace android
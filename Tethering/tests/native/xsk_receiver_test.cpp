@@ -0,0 +1,296 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <linux/if_packet.h>
+#include <linux/if_tun.h>
+#include <linux/ipv6.h>
+#include <linux/veth.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "xsk_receiver.h"
+
+namespace android {
+namespace {
+
+// Loads an XDP program that passes every packet. Returns -1 if the process may not load BPF
+// programs.
+int loadXdpPass() {
+    const bpf_insn insns[] = {
+        { .code = BPF_ALU64 | BPF_MOV | BPF_K, .dst_reg = BPF_REG_0, .imm = XDP_PASS },
+        { .code = BPF_JMP | BPF_EXIT },
+    };
+    bpf_attr attr = {};
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = reinterpret_cast<uintptr_t>(insns);
+    attr.insn_cnt = sizeof(insns) / sizeof(insns[0]);
+    attr.license = reinterpret_cast<uintptr_t>("Apache 2.0");
+    return syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
+}
+
+// Creates a TAP interface, whose driver supports native XDP, and brings it up. Returns the file
+// descriptor that keeps it alive, or -1.
+int createTap(int* ifIndex) {
+    const int fd = open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+    if (fd == -1) return -1;
+    ifreq ifr = {};
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    strncpy(ifr.ifr_name, "xsktest%d", IFNAMSIZ - 1);
+    const int sock = socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    bool ok = ioctl(fd, TUNSETIFF, &ifr) == 0 && sock != -1 && ioctl(sock, SIOCGIFFLAGS, &ifr) == 0;
+    if (ok) {
+        ifr.ifr_flags |= IFF_UP;
+        ok = ioctl(sock, SIOCSIFFLAGS, &ifr) == 0;
+    }
+    if (sock != -1) close(sock);
+    *ifIndex = ok ? if_nametoindex(ifr.ifr_name) : 0;
+    if (*ifIndex == 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Appends a netlink attribute to msg and returns its offset, so that nested attributes can be
+// closed with endNested().
+size_t addAttr(std::vector<uint8_t>* msg, uint16_t type, const void* data, size_t len) {
+    const size_t off = msg->size();
+    const nlattr attr = { .nla_len = static_cast<uint16_t>(NLA_HDRLEN + len), .nla_type = type };
+    msg->resize(off + NLA_ALIGN(attr.nla_len));
+    memcpy(msg->data() + off, &attr, sizeof(attr));
+    if (len) memcpy(msg->data() + off + NLA_HDRLEN, data, len);
+    return off;
+}
+
+void endNested(std::vector<uint8_t>* msg, size_t off) {
+    reinterpret_cast<nlattr*>(msg->data() + off)->nla_len = msg->size() - off;
+}
+
+// Sends an rtnetlink request and returns the error in its acknowledgement.
+int sendRtnlRequest(std::vector<uint8_t>* msg) {
+    reinterpret_cast<nlmsghdr*>(msg->data())->nlmsg_len = msg->size();
+    const int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd == -1) return -errno;
+    const sockaddr_nl kernel = { .nl_family = AF_NETLINK };
+    struct {
+        nlmsghdr h;
+        nlmsgerr e;
+        char buf[256];
+    } resp = {};
+    int ret;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&kernel), sizeof(kernel)) ||
+        send(fd, msg->data(), msg->size(), 0) != static_cast<ssize_t>(msg->size())) {
+        ret = -errno;
+    } else if (recv(fd, &resp, sizeof(resp), 0) < static_cast<ssize_t>(NLMSG_SPACE(0)) ||
+               resp.h.nlmsg_type != NLMSG_ERROR) {
+        ret = -EPROTO;
+    } else {
+        ret = resp.e.error;
+    }
+    close(fd);
+    return ret;
+}
+
+// Returns an RTM_*LINK request for ifIndex that also brings it up.
+std::vector<uint8_t> linkRequest(uint16_t type, uint16_t flags, int ifIndex) {
+    std::vector<uint8_t> msg(NLMSG_SPACE(sizeof(ifinfomsg)));
+    nlmsghdr* n = reinterpret_cast<nlmsghdr*>(msg.data());
+    n->nlmsg_type = type;
+    n->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    ifinfomsg* i = reinterpret_cast<ifinfomsg*>(msg.data() + NLMSG_HDRLEN);
+    i->ifi_family = AF_UNSPEC;
+    i->ifi_index = ifIndex;
+    i->ifi_flags = IFF_UP;
+    i->ifi_change = IFF_UP;
+    return msg;
+}
+
+// Creates a veth pair with both ends up. Returns the index of the first end, or 0.
+int createVethPair(const char* name, const char* peer, int* peerIndex) {
+    std::vector<uint8_t> msg = linkRequest(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, 0);
+    // Neither end can be brought up before the pair exists.
+    reinterpret_cast<ifinfomsg*>(msg.data() + NLMSG_HDRLEN)->ifi_flags = 0;
+    addAttr(&msg, IFLA_IFNAME, name, strlen(name) + 1);
+    const size_t linkInfo = addAttr(&msg, IFLA_LINKINFO, nullptr, 0);
+    addAttr(&msg, IFLA_INFO_KIND, "veth", strlen("veth"));
+    const size_t infoData = addAttr(&msg, IFLA_INFO_DATA, nullptr, 0);
+    const size_t peerInfo = addAttr(&msg, VETH_INFO_PEER, nullptr, 0);
+    const ifinfomsg peerMsg = { .ifi_family = AF_UNSPEC };
+    const size_t off = msg.size();
+    msg.resize(off + NLMSG_ALIGN(sizeof(peerMsg)));
+    memcpy(msg.data() + off, &peerMsg, sizeof(peerMsg));
+    addAttr(&msg, IFLA_IFNAME, peer, strlen(peer) + 1);
+    endNested(&msg, peerInfo);
+    endNested(&msg, infoData);
+    endNested(&msg, linkInfo);
+    if (sendRtnlRequest(&msg) != 0) return 0;
+
+    *peerIndex = if_nametoindex(peer);
+    const int ifIndex = if_nametoindex(name);
+    std::vector<uint8_t> up = linkRequest(RTM_NEWLINK, 0, ifIndex);
+    std::vector<uint8_t> peerUp = linkRequest(RTM_NEWLINK, 0, *peerIndex);
+    if (*peerIndex == 0 || ifIndex == 0 || sendRtnlRequest(&up) != 0 ||
+        sendRtnlRequest(&peerUp) != 0) {
+        std::vector<uint8_t> del = linkRequest(RTM_DELLINK, 0, ifIndex);
+        sendRtnlRequest(&del);
+        return 0;
+    }
+    return ifIndex;
+}
+
+// Deletes both ends of a veth pair.
+void deleteVethPair(int ifIndex) {
+    std::vector<uint8_t> msg = linkRequest(RTM_DELLINK, 0, ifIndex);
+    sendRtnlRequest(&msg);
+}
+
+constexpr uint8_t kRouterSolicitation = 133;
+
+// Sends a Router Solicitation from ifIndex to the all-routers address.
+bool sendRouterSolicitation(int ifIndex) {
+    struct {
+        ipv6hdr ip6;
+        uint8_t rs[8];  // Type, code, checksum and reserved
+    } __attribute__((packed)) pkt = {};
+    pkt.ip6.version = 6;
+    pkt.ip6.payload_len = htons(sizeof(pkt.rs));
+    pkt.ip6.nexthdr = IPPROTO_ICMPV6;
+    pkt.ip6.hop_limit = 255;
+    pkt.ip6.daddr.s6_addr[0] = 0xff;
+    pkt.ip6.daddr.s6_addr[1] = 0x02;
+    pkt.ip6.daddr.s6_addr[15] = 0x02;
+    pkt.rs[0] = kRouterSolicitation;
+
+    const int fd = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, htons(ETH_P_IPV6));
+    if (fd == -1) return false;
+    sockaddr_ll addr = {
+        .sll_family = AF_PACKET,
+        .sll_protocol = htons(ETH_P_IPV6),
+        .sll_ifindex = ifIndex,
+        .sll_halen = ETH_ALEN,
+        .sll_addr = { 0x33, 0x33, 0, 0, 0, 0x02 },
+    };
+    const bool ok = sendto(fd, &pkt, sizeof(pkt), 0, reinterpret_cast<sockaddr*>(&addr),
+                           sizeof(addr)) == sizeof(pkt);
+    close(fd);
+    return ok;
+}
+
+// Returns true if nothing is attached to ifIndex in generic mode. A generic mode attach with
+// XDP_FLAGS_UPDATE_IF_NOEXIST fails with EBUSY otherwise.
+bool noGenericProgram(int ifIndex, int prog) {
+    const uint32_t flags = XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_SKB_MODE;
+    if (setXdpProgram(ifIndex, prog, flags) != 0) return false;
+    return setXdpProgram(ifIndex, -1, XDP_FLAGS_SKB_MODE) == 0;
+}
+
+class XskReceiverTest : public ::testing::Test {
+  protected:
+    void SetUp() override {
+        mProg = loadXdpPass();
+        if (mProg == -1) GTEST_SKIP() << "Cannot load XDP programs: " << strerror(errno);
+    }
+
+    void TearDown() override {
+        if (mProg != -1) close(mProg);
+    }
+
+    int mProg = -1;
+};
+
+TEST_F(XskReceiverTest, NoGenericModeFallback) {
+    // Loopback has no native XDP support.
+    const int lo = if_nametoindex("lo");
+    ASSERT_NE(0, lo);
+    EXPECT_EQ(-EOPNOTSUPP, attachNativeXdpProgram(lo, mProg));
+    EXPECT_TRUE(noGenericProgram(lo, mProg));
+}
+
+TEST_F(XskReceiverTest, AttachesInDriverMode) {
+    int ifIndex;
+    const int tap = createTap(&ifIndex);
+    if (tap == -1) GTEST_SKIP() << "Cannot create a TAP interface";
+
+    EXPECT_EQ(0, attachNativeXdpProgram(ifIndex, mProg));
+    // Never replaces a program that is already attached.
+    EXPECT_EQ(-EBUSY, attachNativeXdpProgram(ifIndex, mProg));
+    EXPECT_EQ(0, setXdpProgram(ifIndex, -1, XDP_FLAGS_DRV_MODE));
+    EXPECT_EQ(0, attachNativeXdpProgram(ifIndex, mProg));
+    EXPECT_EQ(0, setXdpProgram(ifIndex, -1, XDP_FLAGS_DRV_MODE));
+    close(tap);
+}
+
+TEST_F(XskReceiverTest, AttachesInGenericModeOnVeth) {
+    int peer;
+    const int veth = createVethPair("xskveth0", "xskveth1", &peer);
+    if (veth == 0) GTEST_SKIP() << "Cannot create a veth pair";
+
+    EXPECT_EQ(0, attachXdpProgram(veth, mProg, XDP_FLAGS_SKB_MODE));
+    EXPECT_EQ(-EBUSY, attachXdpProgram(veth, mProg, XDP_FLAGS_SKB_MODE));
+    EXPECT_EQ(0, setXdpProgram(veth, -1, XDP_FLAGS_SKB_MODE));
+    EXPECT_TRUE(noGenericProgram(veth, mProg));
+    deleteVethPair(veth);
+}
+
+TEST_F(XskReceiverTest, ReceivesSolicitationsInGenericModeOnVeth) {
+    int peer;
+    const int veth = createVethPair("xskveth0", "xskveth1", &peer);
+    if (veth == 0) GTEST_SKIP() << "Cannot create a veth pair";
+
+    XskReceiver xsk;
+    const int ret = xsk.open(veth, 0, true /* genericModeForTesting */);
+    if (ret == -ENOENT) {
+        deleteVethPair(veth);
+        GTEST_SKIP() << "The tethering programs and maps are not pinned";
+    }
+    ASSERT_EQ(0, ret) << strerror(-ret);
+    EXPECT_FALSE(noGenericProgram(veth, mProg));
+
+    ASSERT_TRUE(sendRouterSolicitation(peer)) << strerror(errno);
+    pollfd pfd = { .fd = xsk.fd(), .events = POLLIN };
+    ASSERT_EQ(1, poll(&pfd, 1, 1000));
+    uint32_t solicitations = 0;
+    xsk.receive([&](const uint8_t* frame, uint32_t len) {
+        const size_t typeOffset = ETH_HLEN + sizeof(ipv6hdr);
+        if (len > typeOffset && frame[typeOffset] == kRouterSolicitation) solicitations++;
+    });
+    EXPECT_EQ(1U, solicitations);
+
+    xsk.close();
+    EXPECT_TRUE(noGenericProgram(veth, mProg));
+    deleteVethPair(veth);
+}
+
+TEST_F(XskReceiverTest, FailedOpenLeavesNothingBehind) {
+    // Without the tethering programs and maps pinned, or on an interface without native XDP
+    // support, open() fails and the caller keeps its socket path.
+    const int lo = if_nametoindex("lo");
+    ASSERT_NE(0, lo);
+    XskReceiver xsk;
+    EXPECT_NE(0, xsk.open(lo, 0));
+    EXPECT_EQ(-1, xsk.fd());
+    EXPECT_TRUE(noGenericProgram(lo, mProg));
+}
+
+}  // namespace
+}  // namespace android
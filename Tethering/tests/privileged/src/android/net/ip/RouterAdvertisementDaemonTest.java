@@ -33,6 +33,7 @@ import static com.android.net.module.util.NetworkStackConstants.PIO_FLAG_AUTONOM
 import static com.android.net.module.util.NetworkStackConstants.PIO_FLAG_ON_LINK;
 
 import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertFalse;
 import static org.junit.Assert.assertNotNull;
 import static org.junit.Assert.assertTrue;
 import static org.junit.Assert.fail;
@@ -50,6 +51,7 @@ import android.os.Handler;
 import android.os.HandlerThread;
 import android.os.IBinder;
 import android.os.Looper;
+import android.os.SystemClock;
 
 import androidx.test.InstrumentationRegistry;
 import androidx.test.filters.SmallTest;
@@ -79,6 +81,7 @@ import org.mockito.MockitoAnnotations;
 import java.net.Inet6Address;
 import java.net.InetAddress;
 import java.nio.ByteBuffer;
+import java.util.ArrayList;
 import java.util.HashSet;
 import java.util.List;
 
@@ -88,6 +91,12 @@ public final class RouterAdvertisementDaemonTest {
     private static final String TAG = RouterAdvertisementDaemonTest.class.getSimpleName();
     private static final int DATA_BUFFER_LEN = 4096;
     private static final int PACKET_TIMEOUT_MS = 5_000;
+    // Offset of the hop limit in the IPv6 header.
+    private static final int IPV6_HOP_LIMIT_OFFSET = 7;
+    // Twice MAX_RA_DELAY_TIME of RFC 4861 section 10.
+    private static final int NO_RA_TIMEOUT_MS = 1_000;
+    // MIN_DELAY_BETWEEN_RAS of RFC 4861 section 10, less some slack for the packet reader.
+    private static final int MIN_MULTICAST_RA_GAP_MS = 3_000 - 100;
 
     @Rule
     public final TapPacketReaderRule mTetheredReader = new TapPacketReaderRule(
@@ -295,6 +304,53 @@ public final class RouterAdvertisementDaemonTest {
         assertTrue(isRaPacket(testRa, true /* multicast */));
     }
 
+    // Returns whether a unicast RA arrives within timeoutMs, ignoring any multicast RA.
+    private boolean receivedUnicastRa(long timeoutMs) throws Exception {
+        final long deadline = SystemClock.elapsedRealtime() + timeoutMs;
+        long remaining;
+        while ((remaining = deadline - SystemClock.elapsedRealtime()) > 0) {
+            final byte[] pkt = mTetheredPacketReader.poll(remaining);
+            if (pkt == null) return false;
+            if (pkt.length < (ETHER_HEADER_LEN + IPV6_HEADER_LEN + ICMPV6_RA_HEADER_LEN)) {
+                continue;
+            }
+            final ByteBuffer buf = ByteBuffer.wrap(pkt);
+            final EthernetHeader ethHdr = Struct.parse(EthernetHeader.class, buf);
+            if (ethHdr.etherType != ETHER_TYPE_IPV6) continue;
+            final Ipv6Header ipv6Hdr = Struct.parse(Ipv6Header.class, buf);
+            final Icmpv6Header icmpv6Hdr = Struct.parse(Icmpv6Header.class, buf);
+            if (icmpv6Hdr.type == (short) ICMPV6_ROUTER_ADVERTISEMENT
+                    && ipv6Hdr.dstIp.isLinkLocalAddress()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Returns the times at which multicast RAs arrive during durationMs.
+    private List<Long> receiveMulticastRaTimes(long durationMs) throws Exception {
+        final List<Long> times = new ArrayList<>();
+        final long deadline = SystemClock.elapsedRealtime() + durationMs;
+        long remaining;
+        while ((remaining = deadline - SystemClock.elapsedRealtime()) > 0) {
+            final byte[] pkt = mTetheredPacketReader.poll(remaining);
+            if (pkt == null) break;
+            if (pkt.length < (ETHER_HEADER_LEN + IPV6_HEADER_LEN + ICMPV6_RA_HEADER_LEN)) {
+                continue;
+            }
+            final ByteBuffer buf = ByteBuffer.wrap(pkt);
+            final EthernetHeader ethHdr = Struct.parse(EthernetHeader.class, buf);
+            if (ethHdr.etherType != ETHER_TYPE_IPV6) continue;
+            final Ipv6Header ipv6Hdr = Struct.parse(Ipv6Header.class, buf);
+            final Icmpv6Header icmpv6Hdr = Struct.parse(Icmpv6Header.class, buf);
+            if (icmpv6Hdr.type == (short) ICMPV6_ROUTER_ADVERTISEMENT
+                    && ipv6Hdr.dstIp.isMulticastAddress()) {
+                times.add(SystemClock.elapsedRealtime());
+            }
+        }
+        return times;
+    }
+
     private ByteBuffer createRsPacket(final String srcIp) throws Exception {
         final MacAddress dstMac = MacAddress.fromString("33:33:03:04:05:06");
         final MacAddress srcMac = mTetheredParams.macAddr;
@@ -341,4 +397,49 @@ public final class RouterAdvertisementDaemonTest {
         mTetheredPacketReader.sendResponse(rs);
         assertUnicastRaPacket(new TestRaPacket(null, params1));
     }
+
+    @Test
+    public void testSolicitationWithInvalidHopLimitIsIgnored() throws Exception {
+        sNetd.setProcSysNet(INetd.IPV6, INetd.CONF, mTetheredParams.name, "forwarding", "1");
+
+        assertTrue(mRaDaemon.start());
+        final RaParams params = createRaParams("2001:1122:3344::5566");
+        mRaDaemon.buildNewRa(null, params);
+        assertMulticastRaPacket(new TestRaPacket(null, params));
+
+        final String iface = mTetheredParams.name;
+        final RouteInfo linkLocalRoute =
+                new RouteInfo(new IpPrefix("fe80::/64"), null, iface, RTN_UNICAST);
+        RouteUtils.addRoutesToLocalNetwork(sNetd, iface, List.of(linkLocalRoute));
+
+        // A solicitation that went through a router must be dropped, as per RFC 4861 section
+        // 6.1.1. The hop limit is not covered by the ICMPv6 checksum.
+        final ByteBuffer forwardedRs = createRsPacket("fe80::1122:3344:5566:7788");
+        forwardedRs.put(ETHER_HEADER_LEN + IPV6_HOP_LIMIT_OFFSET, (byte) 64);
+        mTetheredPacketReader.sendResponse(forwardedRs);
+        assertFalse(receivedUnicastRa(NO_RA_TIMEOUT_MS));
+
+        mTetheredPacketReader.sendResponse(createRsPacket("fe80::1122:3344:5566:7788"));
+        assertTrue(receivedUnicastRa(PACKET_TIMEOUT_MS));
+    }
+
+    @Test
+    public void testSolicitedAndPeriodicMulticastRasAreSpaced() throws Exception {
+        assertTrue(mRaDaemon.start());
+        final RaParams params = createRaParams("2001:1122:3344::5566");
+        mRaDaemon.buildNewRa(null, params);
+        assertMulticastRaPacket(new TestRaPacket(null, params));
+        final long firstMs = SystemClock.elapsedRealtime();
+
+        // Solicitations from the unspecified address are answered with a multicast RA, which must
+        // not follow the urgent multicast RAs sent from Java too closely, and vice versa.
+        mTetheredPacketReader.sendResponse(createRsPacket("::"));
+        final List<Long> times = receiveMulticastRaTimes(3 * MIN_MULTICAST_RA_GAP_MS);
+        assertFalse(times.isEmpty());
+        times.add(0, firstMs);
+        for (int i = 1; i < times.size(); i++) {
+            final long gapMs = times.get(i) - times.get(i - 1);
+            assertTrue("Multicast RAs " + gapMs + "ms apart", gapMs >= MIN_MULTICAST_RA_GAP_MS);
+        }
+    }
 }
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package android.net.util;
+
+import static android.system.OsConstants.AF_INET6;
+import static android.system.OsConstants.EAGAIN;
+import static android.system.OsConstants.IPPROTO_UDP;
+import static android.system.OsConstants.MSG_DONTWAIT;
+import static android.system.OsConstants.SOCK_DGRAM;
+
+import static org.junit.Assert.assertArrayEquals;
+import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertFalse;
+import static org.junit.Assert.assertTrue;
+import static org.junit.Assert.fail;
+
+import android.net.InetAddresses;
+import android.system.ErrnoException;
+import android.system.Os;
+
+import androidx.test.filters.SmallTest;
+import androidx.test.runner.AndroidJUnit4;
+
+import org.junit.After;
+import org.junit.Before;
+import org.junit.BeforeClass;
+import org.junit.Test;
+import org.junit.runner.RunWith;
+
+import java.io.FileDescriptor;
+import java.net.Inet6Address;
+import java.net.InetSocketAddress;
+
+@RunWith(AndroidJUnit4.class)
+@SmallTest
+public class MessageBatchTest {
+    private static final Inet6Address LOOPBACK =
+            (Inet6Address) InetAddresses.parseNumericAddress("::1");
+
+    private FileDescriptor mSender;
+    private FileDescriptor mReceiver;
+    private InetSocketAddress mReceiverAddress;
+
+    @BeforeClass
+    public static void setupOnce() {
+        System.loadLibrary("tetherutilsjni");
+    }
+
+    @Before
+    public void setUp() throws Exception {
+        mSender = Os.socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+        mReceiver = Os.socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+        Os.bind(mReceiver, LOOPBACK, 0);
+        mReceiverAddress = (InetSocketAddress) Os.getsockname(mReceiver);
+    }
+
+    @After
+    public void tearDown() throws Exception {
+        if (mSender != null) Os.close(mSender);
+        if (mReceiver != null) Os.close(mReceiver);
+    }
+
+    private byte[] payload(int len, int seed) {
+        final byte[] data = new byte[len];
+        for (int i = 0; i < len; i++) data[i] = (byte) (seed + i);
+        return data;
+    }
+
+    private void send(byte[] data) throws Exception {
+        Os.sendto(mSender, data, 0, data.length, 0, mReceiverAddress.getAddress(),
+                mReceiverAddress.getPort());
+    }
+
+    @Test
+    public void testReceiveBatch() throws Exception {
+        final MessageBatch batch = new MessageBatch(8, 64);
+        for (int i = 0; i < 5; i++) send(payload(10 + i, i));
+
+        assertEquals(5, batch.receive(mReceiver));
+        assertEquals(5, batch.size());
+        for (int i = 0; i < 5; i++) {
+            assertEquals(10 + i, batch.getLength(i));
+            assertFalse(batch.isTruncated(i));
+            assertEquals(AF_INET6, batch.getFamily(i));
+            assertEquals(LOOPBACK, batch.getSourceAddress(i));
+            assertEquals((byte) i, batch.getByte(i, 0));
+            final byte[] copy = new byte[10 + i];
+            assertEquals(10 + i, batch.copyPayload(i, copy));
+            assertArrayEquals(payload(10 + i, i), copy);
+        }
+    }
+
+    @Test
+    public void testReceiveDrainsInBatches() throws Exception {
+        final MessageBatch batch = new MessageBatch(4, 64);
+        for (int i = 0; i < 10; i++) send(payload(8, i));
+
+        assertEquals(4, batch.receive(mReceiver));
+        assertEquals(0, batch.getByte(0, 0));
+        assertEquals(4, batch.receive(mReceiver));
+        assertEquals(4, batch.getByte(0, 0));
+        assertEquals(2, batch.receive(mReceiver));
+        assertEquals(8, batch.getByte(0, 0));
+        assertEquals(9, batch.getByte(1, 0));
+    }
+
+    @Test
+    public void testTruncation() throws Exception {
+        final MessageBatch batch = new MessageBatch(2, 8);
+        send(payload(20, 0));
+        send(payload(8, 0));
+
+        assertEquals(2, batch.receive(mReceiver));
+        assertEquals(8, batch.getLength(0));
+        assertTrue(batch.isTruncated(0));
+        assertEquals(8, batch.getLength(1));
+        assertFalse(batch.isTruncated(1));
+
+        // Only the stored bytes are copied, even into a larger array.
+        final byte[] copy = new byte[20];
+        assertEquals(8, batch.copyPayload(0, copy));
+    }
+
+    @Test
+    public void testReceiveDontWaitOnEmptySocket() throws Exception {
+        final MessageBatch batch = new MessageBatch(4, 64);
+        send(payload(8, 0));
+        assertEquals(1, batch.receive(mReceiver));
+
+        try {
+            batch.receive(mReceiver, MSG_DONTWAIT);
+            fail("Receiving from an empty socket with MSG_DONTWAIT should fail");
+        } catch (ErrnoException expected) {
+            assertEquals(EAGAIN, expected.errno);
+        }
+        // A failed receive leaves the batch empty.
+        assertEquals(0, batch.size());
+    }
+
+    @Test
+    public void testOutOfRangeAccess() throws Exception {
+        final MessageBatch batch = new MessageBatch(4, 64);
+        send(payload(8, 0));
+        assertEquals(1, batch.receive(mReceiver));
+
+        try {
+            batch.getLength(1);
+            fail("Accessing a message beyond the batch size should throw");
+        } catch (IndexOutOfBoundsException expected) { }
+        try {
+            batch.getByte(0, 8);
+            fail("Accessing a byte beyond the message length should throw");
+        } catch (IndexOutOfBoundsException expected) { }
+
+        batch.clear();
+        try {
+            batch.getLength(0);
+            fail("Accessing a message of a cleared batch should throw");
+        } catch (IndexOutOfBoundsException expected) { }
+    }
+
+    @Test
+    public void testInvalidBatchSize() {
+        for (int[] size : new int[][] {{0, 64}, {MessageBatch.MAX_MESSAGES + 1, 64}, {4, 0}}) {
+            try {
+                new MessageBatch(size[0], size[1]);
+                fail("Batch of " + size[0] + " x " + size[1] + " should be rejected");
+            } catch (IllegalArgumentException expected) { }
+        }
+    }
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package android.net.util;
+
+import static android.system.OsConstants.AF_PACKET;
+import static android.system.OsConstants.EAGAIN;
+import static android.system.OsConstants.ETH_P_IPV6;
+import static android.system.OsConstants.IPPROTO_ICMPV6;
+import static android.system.OsConstants.SOCK_DGRAM;
+import static android.system.OsConstants.SOCK_NONBLOCK;
+
+import static com.android.net.module.util.IpUtils.icmpv6Checksum;
+
+import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertNotNull;
+import static org.junit.Assume.assumeTrue;
+
+import android.net.InetAddresses;
+import android.net.MacAddress;
+import android.os.Handler;
+import android.os.HandlerThread;
+import android.system.ErrnoException;
+import android.system.Os;
+
+import androidx.test.filters.SmallTest;
+import androidx.test.runner.AndroidJUnit4;
+
+import com.android.testutils.TapPacketReader;
+import com.android.testutils.TapPacketReaderRule;
+
+import org.junit.After;
+import org.junit.Before;
+import org.junit.BeforeClass;
+import org.junit.Rule;
+import org.junit.Test;
+import org.junit.runner.RunWith;
+
+import java.io.FileDescriptor;
+import java.net.SocketAddress;
+import java.nio.ByteBuffer;
+import java.util.Arrays;
+
+@RunWith(AndroidJUnit4.class)
+@SmallTest
+public class NsFloodFilterTest {
+    private static final int DATA_BUFFER_LEN = 4096;
+    private static final int BURST = 2;
+    private static final int IFACE_BURST = BURST * 4;
+    // Long enough for the whole test to fit in one rate limiting interval.
+    private static final int INTERVAL_MS = 60_000;
+    private static final int SETTLE_MS = 200;
+
+    private static final int ETH_HEADER_LEN = 14;
+    private static final int IPV6_HEADER_LEN = 40;
+    private static final int ICMPV6_NS_LEN = 24;
+    private static final int ICMPV6_CHECKSUM_OFFSET = 2;
+    private static final int ICMPV6_NEIGHBOR_SOLICITATION = 135;
+
+    @Rule
+    public final TapPacketReaderRule mTapReader = new TapPacketReaderRule(
+            DATA_BUFFER_LEN, false /* autoStart */);
+
+    private HandlerThread mHandlerThread;
+    private TapPacketReader mReader;
+    private FileDescriptor mFd;
+    private int mIfIndex;
+
+    @BeforeClass
+    public static void setupOnce() {
+        System.loadLibrary("tetherutilsjni");
+    }
+
+    @Before
+    public void setUp() throws Exception {
+        mHandlerThread = new HandlerThread(getClass().getSimpleName());
+        mHandlerThread.start();
+        mTapReader.start(new Handler(mHandlerThread.getLooper()));
+        mReader = mTapReader.getReader();
+        final InterfaceParams params =
+                InterfaceParams.getByName(mTapReader.iface.getInterfaceName());
+        assertNotNull(params);
+        mIfIndex = params.index;
+
+        mFd = Os.socket(AF_PACKET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        TetheringUtils.setupNsSocket(mFd);
+        final boolean ebpf = TetheringUtils.setupNsFloodFilter(mFd, params.index,
+                null /* targets */, BURST, INTERVAL_MS);
+        final SocketAddress addr = SocketUtils.makePacketSocketAddress(ETH_P_IPV6, params.index);
+        Os.bind(mFd, addr);
+        // The classic filter does not rate limit.
+        assumeTrue("NS filter program not available", ebpf);
+    }
+
+    @After
+    public void tearDown() throws Exception {
+        if (mFd != null) SocketUtils.closeSocket(mFd);
+        TetheringUtils.clearNsFloodFilter(mIfIndex);
+        mTapReader.stop();
+        if (mHandlerThread != null) mHandlerThread.quitSafely();
+    }
+
+    private static ByteBuffer buildNs(String src, String target) {
+        final int len = ETH_HEADER_LEN + IPV6_HEADER_LEN + ICMPV6_NS_LEN;
+        final ByteBuffer buf = ByteBuffer.allocate(len);
+        buf.put(MacAddress.fromString("33:33:ff:00:00:01").toByteArray());
+        buf.put(MacAddress.fromString("02:00:00:00:00:01").toByteArray());
+        buf.putShort((short) ETH_P_IPV6);
+
+        buf.putInt(0x60000000);
+        buf.putShort((short) ICMPV6_NS_LEN);
+        buf.put((byte) IPPROTO_ICMPV6);
+        buf.put((byte) 255);
+        buf.put(InetAddresses.parseNumericAddress(src).getAddress());
+        buf.put(InetAddresses.parseNumericAddress("ff02::1:ff00:1").getAddress());
+
+        buf.put((byte) ICMPV6_NEIGHBOR_SOLICITATION);
+        buf.put((byte) 0);
+        buf.putShort((short) 0);
+        buf.putInt(0);
+        buf.put(InetAddresses.parseNumericAddress(target).getAddress());
+
+        final int transportOffset = ETH_HEADER_LEN + IPV6_HEADER_LEN;
+        buf.putShort(transportOffset + ICMPV6_CHECKSUM_OFFSET,
+                icmpv6Checksum(buf, ETH_HEADER_LEN, transportOffset, ICMPV6_NS_LEN));
+        buf.flip();
+        return buf;
+    }
+
+    // Returns the number of solicitations received, only counting those for the given target if
+    // it is not null. The kernel may send its own duplicate address detection probes on the
+    // interface, which the socket also sees and the filter also charges to the interface.
+    private int drainSocket(String target) throws Exception {
+        Thread.sleep(SETTLE_MS);
+        final byte[] expected =
+                target == null ? null : InetAddresses.parseNumericAddress(target).getAddress();
+        final byte[] buf = new byte[DATA_BUFFER_LEN];
+        final int targetOffset = IPV6_HEADER_LEN + 8;
+        int count = 0;
+        while (true) {
+            final int len;
+            try {
+                len = Os.read(mFd, buf, 0, buf.length);
+            } catch (ErrnoException e) {
+                if (e.errno == EAGAIN) return count;
+                throw e;
+            }
+            if (expected == null || (len >= targetOffset + expected.length
+                    && Arrays.equals(expected, Arrays.copyOfRange(buf, targetOffset,
+                            targetOffset + expected.length)))) {
+                count++;
+            }
+        }
+    }
+
+    @Test
+    public void testRateLimitsPerTarget() throws Exception {
+        for (int i = 0; i < 10; i++) {
+            // Spoofed sources do not get around the limit.
+            mReader.sendResponse(buildNs("fe80::" + (i + 1), "2001:db8::1"));
+        }
+        assertEquals(BURST, drainSocket("2001:db8::1"));
+
+        // Another target has its own budget.
+        for (int i = 0; i < 10; i++) mReader.sendResponse(buildNs("::", "2001:db8::2"));
+        assertEquals(BURST, drainSocket("2001:db8::2"));
+    }
+
+    @Test
+    public void testRandomTargetsBoundedPerInterface() throws Exception {
+        // Far more targets than fit in the LRU map; the interface bucket must still hold.
+        for (int i = 0; i < 2000; i++) {
+            mReader.sendResponse(buildNs("::", "2001:db8::" + Integer.toHexString(i + 1)));
+        }
+        assertEquals(IFACE_BURST, drainSocket(null /* target */));
+    }
+
+    @Test
+    public void testClearRemovesRateLimit() throws Exception {
+        TetheringUtils.clearNsFloodFilter(mIfIndex);
+        // Without its configuration the program behaves like the classic filter.
+        for (int i = 0; i < 10; i++) mReader.sendResponse(buildNs("::", "2001:db8::1"));
+        assertEquals(10, drainSocket("2001:db8::1"));
+    }
+}
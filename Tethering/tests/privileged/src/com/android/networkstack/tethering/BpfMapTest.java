@@ -361,6 +361,37 @@ public final class BpfMapTest {
         }
     }
 
+    @Test
+    public void testReconcile() throws Exception {
+        // Reconciling an empty map with no entries does nothing.
+        assertEquals(0, mTestMap.reconcile(new ArrayMap<>()));
+        assertTrue(mTestMap.isEmpty());
+
+        // Missing entries are written.
+        assertEquals(mTestData.size(), mTestMap.reconcile(mTestData));
+        for (int i = 0; i < mTestData.size(); i++) {
+            assertEquals(mTestData.valueAt(i), mTestMap.getValue(mTestData.keyAt(i)));
+        }
+
+        // Up to date entries are left alone.
+        assertEquals(0, mTestMap.reconcile(mTestData));
+
+        // Stale values are replaced, and entries that should not exist are deleted.
+        final ArrayMap<TetherDownstream6Key, Tether6Value> wanted = new ArrayMap<>();
+        final Tether6Value newValue = createTether6Value(44, "00:00:00:00:00:1a",
+                "44:44:44:00:00:1b", ETH_P_IPV6, 1280);
+        wanted.put(mTestData.keyAt(0), newValue);
+        wanted.put(mTestData.keyAt(1), mTestData.valueAt(1));
+        assertEquals(2, mTestMap.reconcile(wanted));
+        assertEquals(newValue, mTestMap.getValue(mTestData.keyAt(0)));
+        assertEquals(mTestData.valueAt(1), mTestMap.getValue(mTestData.keyAt(1)));
+        assertNull(mTestMap.getValue(mTestData.keyAt(2)));
+
+        // Reconciling with no entries clears the map.
+        assertEquals(2, mTestMap.reconcile(new ArrayMap<>()));
+        assertTrue(mTestMap.isEmpty());
+    }
+
     @Test
     public void testInsertOverflow() throws Exception {
         final ArrayMap<TetherDownstream6Key, Tether6Value> testData =
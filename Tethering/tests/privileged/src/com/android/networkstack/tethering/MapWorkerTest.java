@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.networkstack.tethering;
+
+import static android.system.OsConstants.ETH_P_IP;
+import static android.system.OsConstants.IPPROTO_TCP;
+
+import static com.android.networkstack.tethering.MapWorker.OP_ADD_UPSTREAM4;
+import static com.android.networkstack.tethering.MapWorker.OP_REMOVE_UPSTREAM4;
+
+import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertTrue;
+
+import android.net.MacAddress;
+import android.net.util.SharedLog;
+import android.os.Build;
+import android.os.ConditionVariable;
+import android.os.Handler;
+import android.os.HandlerThread;
+
+import androidx.test.runner.AndroidJUnit4;
+
+import com.android.testutils.DevSdkIgnoreRule.IgnoreUpTo;
+
+import org.junit.After;
+import org.junit.Before;
+import org.junit.Test;
+import org.junit.runner.RunWith;
+
+import java.net.InetAddress;
+import java.util.ArrayList;
+
+@RunWith(AndroidJUnit4.class)
+@IgnoreUpTo(Build.VERSION_CODES.R)
+public final class MapWorkerTest {
+    // Sync from packages/modules/Connectivity/Tethering/bpf_progs/test.c.
+    private static final String TETHER_UPSTREAM4_MAP_PATH =
+            "/sys/fs/bpf/tethering/map_test_tether_upstream4_map";
+    private static final String TETHER_DOWNSTREAM4_MAP_PATH =
+            "/sys/fs/bpf/tethering/map_test_tether_downstream4_map";
+    // Sync from kMaxInFlight in com_android_networkstack_tethering_MapWorker.cpp.
+    private static final int MAX_IN_FLIGHT = 1024;
+    private static final long TIMEOUT_MS = 10_000;
+
+    private final SharedLog mLog = new SharedLog("privileged-test");
+    private final ArrayList<int[]> mCompletions = new ArrayList<>();
+    private HandlerThread mHandlerThread;
+    private Handler mHandler;
+    private BpfMap<Tether4Key, Tether4Value> mUpstream4Map;
+    private MapWorker mMapWorker;
+
+    @Before
+    public void setUp() throws Exception {
+        mHandlerThread = new HandlerThread(getClass().getSimpleName());
+        mHandlerThread.start();
+        mHandler = new Handler(mHandlerThread.getLooper());
+
+        mUpstream4Map = new BpfMap<>(TETHER_UPSTREAM4_MAP_PATH, BpfMap.BPF_F_RDWR,
+                Tether4Key.class, Tether4Value.class);
+        mUpstream4Map.clear();
+        mMapWorker = new MapWorker(mHandler, mLog,
+                (op, upstreamIfindex, result) -> mCompletions.add(new int[] { op, result }),
+                TETHER_UPSTREAM4_MAP_PATH, TETHER_DOWNSTREAM4_MAP_PATH);
+    }
+
+    @After
+    public void tearDown() throws Exception {
+        runOnHandler(() -> mMapWorker.stop());
+        mUpstream4Map.clear();
+        mUpstream4Map.close();
+        mHandlerThread.quitSafely();
+    }
+
+    private void runOnHandler(Runnable r) {
+        final ConditionVariable done = new ConditionVariable();
+        mHandler.post(() -> {
+            r.run();
+            done.open();
+        });
+        assertTrue(done.block(TIMEOUT_MS));
+    }
+
+    private static Tether4Key makeKey() throws Exception {
+        return new Tether4Key(1 /* iif */, MacAddress.fromString("00:00:00:00:00:0a"),
+                (short) IPPROTO_TCP, InetAddress.getByName("192.168.80.12").getAddress(),
+                InetAddress.getByName("140.112.8.116").getAddress(), 62449, 443);
+    }
+
+    private static Tether4Value makeValue(long lastUsed) throws Exception {
+        final byte[] src46 = InetAddress.getByName("::ffff:100.81.179.1").getAddress();
+        final byte[] dst46 = InetAddress.getByName("::ffff:140.112.8.116").getAddress();
+        return new Tether4Value(2 /* oif */, MacAddress.ALL_ZEROS_ADDRESS,
+                MacAddress.ALL_ZEROS_ADDRESS, ETH_P_IP, 1500, src46, dst46, 62449, 443,
+                lastUsed);
+    }
+
+    @Test
+    public void testFullQueueKeepsOperationsInOrder() throws Exception {
+        final Tether4Key key = makeKey();
+        final int pairs = MAX_IN_FLIGHT * 2;
+        final long[] backlog = new long[1];
+        runOnHandler(() -> {
+            assertTrue(mMapWorker.start());
+            try {
+                // The handler thread does not drain completions while this runs, so the queue
+                // fills up after MAX_IN_FLIGHT operations and the rest go to the backlog.
+                for (int i = 0; i < pairs; i++) {
+                    assertTrue(mMapWorker.submitRule4(OP_ADD_UPSTREAM4, key, makeValue(i)));
+                    assertTrue(mMapWorker.submitRule4(OP_REMOVE_UPSTREAM4, key, null));
+                }
+                assertTrue(mMapWorker.submitRule4(OP_ADD_UPSTREAM4, key, makeValue(pairs)));
+            } catch (Exception e) {
+                throw new AssertionError(e);
+            }
+            backlog[0] = mMapWorker.getBacklogSize();
+            mMapWorker.stop();
+        });
+
+        assertTrue("Backlog not used", backlog[0] > 0);
+        // Every operation was executed after the one submitted before it: each addition found
+        // the key absent and each removal found it present.
+        assertEquals(pairs * 2 + 1, mCompletions.size());
+        for (int i = 0; i < mCompletions.size(); i++) {
+            final int[] c = mCompletions.get(i);
+            assertEquals(i % 2 == 0 ? OP_ADD_UPSTREAM4 : OP_REMOVE_UPSTREAM4, c[0]);
+            assertEquals("Operation " + i + " failed", 0, c[1]);
+        }
+        assertEquals(makeValue(pairs), mUpstream4Map.getValue(key));
+    }
+}
@@ -102,6 +102,7 @@ import androidx.test.runner.AndroidJUnit4;
 import com.android.net.module.util.NetworkStackConstants;
 import com.android.networkstack.tethering.BpfCoordinator;
 import com.android.networkstack.tethering.BpfCoordinator.Ipv6ForwardingRule;
+import com.android.networkstack.tethering.BpfCoordinator.QosMarking;
 import com.android.networkstack.tethering.BpfMap;
 import com.android.networkstack.tethering.PrivateAddressCoordinator;
 import com.android.networkstack.tethering.Tether4Key;
@@ -169,6 +170,7 @@ public class IpServerTest {
     @Mock private SharedLog mSharedLog;
     @Mock private IDhcpServer mDhcpServer;
     @Mock private DadProxy mDadProxy;
+    @Mock private NeighborRuleMonitor mNeighborRuleMonitor;
     @Mock private RouterAdvertisementDaemon mRaDaemon;
     @Mock private IpNeighborMonitor mIpNeighborMonitor;
     @Mock private IpServer.Dependencies mDependencies;
@@ -201,7 +203,7 @@ public class IpServerTest {
     private void initStateMachine(int interfaceType, boolean usingLegacyDhcp,
             boolean usingBpfOffload) throws Exception {
         when(mDependencies.getDadProxy(any(), any())).thenReturn(mDadProxy);
-        when(mDependencies.getRouterAdvertisementDaemon(any())).thenReturn(mRaDaemon);
+        when(mDependencies.getRouterAdvertisementDaemon(any(), anyBoolean())).thenReturn(mRaDaemon);
         when(mDependencies.getInterfaceParams(IFACE_NAME)).thenReturn(TEST_IFACE_PARAMS);
         when(mDependencies.getInterfaceParams(UPSTREAM_IFACE)).thenReturn(UPSTREAM_IFACE_PARAMS);
         when(mDependencies.getInterfaceParams(UPSTREAM_IFACE2)).thenReturn(UPSTREAM_IFACE_PARAMS2);
@@ -220,7 +222,8 @@ public class IpServerTest {
 
         mIpServer = new IpServer(
                 IFACE_NAME, mLooper.getLooper(), interfaceType, mSharedLog, mNetd, mBpfCoordinator,
-                mCallback, usingLegacyDhcp, usingBpfOffload, mAddressCoordinator, mDependencies);
+                mCallback, usingLegacyDhcp, usingBpfOffload, false /* usingXskControl */,
+                mAddressCoordinator, mDependencies);
         mIpServer.start();
         mNeighborEventConsumer = neighborCaptor.getValue();
 
@@ -346,7 +349,8 @@ public class IpServerTest {
                 .thenReturn(mIpNeighborMonitor);
         mIpServer = new IpServer(IFACE_NAME, mLooper.getLooper(), TETHERING_BLUETOOTH, mSharedLog,
                 mNetd, mBpfCoordinator, mCallback, false /* usingLegacyDhcp */,
-                DEFAULT_USING_BPF_OFFLOAD, mAddressCoordinator, mDependencies);
+                DEFAULT_USING_BPF_OFFLOAD, false /* usingXskControl */, mAddressCoordinator,
+                mDependencies);
         mIpServer.start();
         mLooper.dispatchAll();
         verify(mCallback).updateInterfaceState(
@@ -1196,6 +1200,14 @@ public class IpServerTest {
         verify(mIpNeighborMonitor, never()).start();
     }
 
+    @Test
+    public void doesNotUseXskControlByDefault() throws Exception {
+        initTetheredStateMachine(TETHERING_WIFI, UPSTREAM_IFACE, false /* usingLegacyDhcp */,
+                true /* usingBpfOffload */);
+
+        verify(mDependencies).getRouterAdvertisementDaemon(any(), eq(false) /* useXsk */);
+    }
+
     private LinkProperties buildIpv6OnlyLinkProperties(final String iface) {
         final LinkProperties linkProp = new LinkProperties();
         linkProp.setInterfaceName(iface);
@@ -1415,6 +1427,54 @@ public class IpServerTest {
         mLooper.dispatchAll();
     }
 
+    @Test @IgnoreUpTo(Build.VERSION_CODES.R)
+    public void neighborRuleMonitorUsesDownstreamQosMarking() throws Exception {
+        final QosMarking qos = new QosMarking(46 /* dscp */, 5 /* priority */);
+        doReturn(qos).when(mBpfCoordinator).getDownstreamQos();
+        when(mDependencies.getNeighborRuleMonitor(any(), any(), any()))
+                .thenReturn(mNeighborRuleMonitor);
+        when(mNeighborRuleMonitor.start()).thenReturn(true);
+
+        initTetheredStateMachine(TETHERING_WIFI, UPSTREAM_IFACE);
+        verify(mDependencies).getNeighborRuleMonitor(any(), eq(qos), any());
+        verify(mNeighborRuleMonitor).start();
+    }
+
+    @Test @IgnoreUpTo(Build.VERSION_CODES.R)
+    public void neighborRuleMonitorWritesOnlyWhenBpfStarted() throws Exception {
+        when(mDependencies.getNeighborRuleMonitor(any(), any(), any()))
+                .thenReturn(mNeighborRuleMonitor);
+        when(mNeighborRuleMonitor.start()).thenReturn(true);
+        InOrder inOrder = inOrder(mNeighborRuleMonitor);
+
+        // BPF offload is not started: the monitor gets no upstream, so it writes no rule.
+        initTetheredStateMachine(TETHERING_WIFI, UPSTREAM_IFACE);
+        inOrder.verify(mNeighborRuleMonitor).start();
+        inOrder.verify(mNeighborRuleMonitor).setUpstream(0);
+
+        // Once started, the monitor follows the upstream.
+        doReturn(true).when(mBpfCoordinator).isStarted();
+        LinkProperties lp = new LinkProperties();
+        lp.setInterfaceName(UPSTREAM_IFACE2);
+        dispatchTetherConnectionChanged(UPSTREAM_IFACE2, lp, 0);
+        inOrder.verify(mNeighborRuleMonitor).setUpstream(UPSTREAM_IFINDEX2);
+
+        // Lose IPv6 on the upstream.
+        dispatchTetherConnectionChanged(UPSTREAM_IFACE2, null, 0);
+        inOrder.verify(mNeighborRuleMonitor).setUpstream(0);
+
+        // Stopped again: regaining IPv6 does not give the monitor an upstream.
+        doReturn(false).when(mBpfCoordinator).isStarted();
+        LinkProperties lp2 = new LinkProperties();
+        lp2.setInterfaceName(UPSTREAM_IFACE);
+        dispatchTetherConnectionChanged(UPSTREAM_IFACE, lp2, 0);
+        inOrder.verify(mNeighborRuleMonitor).setUpstream(0);
+
+        mIpServer.stop();
+        mLooper.dispatchAll();
+        inOrder.verify(mNeighborRuleMonitor).stop();
+    }
+
     private void checkDadProxyEnabled(boolean expectEnabled) throws Exception {
         initTetheredStateMachine(TETHERING_WIFI, UPSTREAM_IFACE);
         InOrder inOrder = inOrder(mDadProxy);
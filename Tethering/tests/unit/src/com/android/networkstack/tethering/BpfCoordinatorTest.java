@@ -44,6 +44,9 @@ import static com.android.networkstack.tethering.BpfCoordinator.StatsType.STATS_
 import static com.android.networkstack.tethering.BpfCoordinator.StatsType.STATS_PER_UID;
 import static com.android.networkstack.tethering.BpfUtils.DOWNSTREAM;
 import static com.android.networkstack.tethering.BpfUtils.UPSTREAM;
+import static com.android.networkstack.tethering.MapWorker.OP_ADD_DOWNSTREAM4;
+import static com.android.networkstack.tethering.MapWorker.OP_ADD_UPSTREAM4;
+import static com.android.networkstack.tethering.MapWorker.OP_REMOVE_DOWNSTREAM4;
 import static com.android.networkstack.tethering.TetheringConfiguration.DEFAULT_TETHER_OFFLOAD_POLL_INTERVAL_MS;
 
 import static org.junit.Assert.assertEquals;
@@ -52,10 +55,12 @@ import static org.junit.Assert.assertNull;
 import static org.junit.Assert.assertTrue;
 import static org.junit.Assert.fail;
 import static org.mockito.Matchers.any;
+import static org.mockito.Matchers.anyBoolean;
 import static org.mockito.Matchers.anyInt;
 import static org.mockito.Matchers.anyLong;
 import static org.mockito.Matchers.anyString;
 import static org.mockito.Matchers.eq;
+import static org.mockito.Matchers.isNull;
 import static org.mockito.Mockito.argThat;
 import static org.mockito.Mockito.clearInvocations;
 import static org.mockito.Mockito.inOrder;
@@ -79,10 +84,12 @@ import android.net.ip.IpServer;
 import android.net.netlink.NetlinkConstants;
 import android.net.util.InterfaceParams;
 import android.net.util.SharedLog;
+import android.net.util.TetheringUtils.ForwardedStats;
 import android.os.Build;
 import android.os.Handler;
 import android.os.test.TestLooper;
 import android.system.ErrnoException;
+import android.util.SparseArray;
 
 import androidx.annotation.NonNull;
 import androidx.annotation.Nullable;
@@ -95,6 +102,7 @@ import com.android.net.module.util.Struct;
 import com.android.networkstack.tethering.BpfCoordinator.BpfConntrackEventConsumer;
 import com.android.networkstack.tethering.BpfCoordinator.ClientInfo;
 import com.android.networkstack.tethering.BpfCoordinator.Ipv6ForwardingRule;
+import com.android.networkstack.tethering.BpfCoordinator.QosMarking;
 import com.android.testutils.DevSdkIgnoreRule;
 import com.android.testutils.DevSdkIgnoreRule.IgnoreAfter;
 import com.android.testutils.DevSdkIgnoreRule.IgnoreUpTo;
@@ -203,6 +211,8 @@ public class BpfCoordinatorTest {
     @Mock private IpServer mIpServer2;
     @Mock private TetheringConfiguration mTetherConfig;
     @Mock private ConntrackMonitor mConntrackMonitor;
+    @Mock private MapWorker mMapWorker;
+    @Mock private FlowtableOffload mFlowtableOffload;
     @Mock private BpfMap<Tether4Key, Tether4Value> mBpfDownstream4Map;
     @Mock private BpfMap<Tether4Key, Tether4Value> mBpfUpstream4Map;
     @Mock private BpfMap<TetherDownstream6Key, Tether6Value> mBpfDownstream6Map;
@@ -1147,6 +1157,35 @@ public class BpfCoordinatorTest {
         }
     }
 
+    @Test
+    @IgnoreUpTo(Build.VERSION_CODES.R)
+    public void testDnsSteeringFollowsUpstreamProgram() throws Exception {
+        setupFunctioningNetdInterface();
+        when(mTetherConfig.isDnsSteeringEnabled()).thenReturn(true);
+
+        MockitoSession mockSession = ExtendedMockito.mockitoSession()
+                .mockStatic(BpfUtils.class)
+                .startMocking();
+        try {
+            final String intIface = "wlan1";
+            final String extIface = "rmnet_data0";
+            final Inet4Address proxy =
+                    (Inet4Address) InetAddresses.parseNumericAddress("192.168.43.1");
+            doReturn(proxy).when(mDeps).getInterfaceIpv4Address(intIface);
+            final BpfCoordinator coordinator = makeBpfCoordinator();
+
+            coordinator.maybeAttachProgram(intIface, extIface);
+            ExtendedMockito.verify(() -> BpfUtils.attachProgram(intIface, UPSTREAM));
+            ExtendedMockito.verify(() -> BpfUtils.startDnsSteering(intIface, proxy, 53));
+
+            coordinator.maybeDetachProgram(intIface, extIface);
+            ExtendedMockito.verify(() -> BpfUtils.stopDnsSteering(intIface));
+            ExtendedMockito.verify(() -> BpfUtils.detachProgram(intIface));
+        } finally {
+            mockSession.finishMocking();
+        }
+    }
+
     @Test
     public void testTetheringConfigSetPollingInterval() throws Exception {
         setupFunctioningNetdInterface();
@@ -1298,6 +1337,12 @@ public class BpfCoordinatorTest {
     private static final short PUBLIC_PORT = (short) 62449;
     private static final short PRIVATE_PORT = (short) 62449;
 
+    // Status of a NATed connection whose first packet went out and that has not seen any reply.
+    // Values from include/uapi/linux/netfilter/nf_conntrack_common.h.
+    private static final int UNREPLIED_NAT_STATUS = (1 << 3) /* IPS_CONFIRMED */
+            | (1 << 7) /* IPS_SRC_NAT_DONE */;
+    private static final int IPS_SEEN_REPLY = 1 << 1;
+
     @NonNull
     private Tether4Key makeUpstream4Key(int proto) {
         if (proto != IPPROTO_TCP && proto != IPPROTO_UDP) {
@@ -1319,22 +1364,38 @@ public class BpfCoordinatorTest {
 
     @NonNull
     private Tether4Value makeUpstream4Value() {
+        return makeUpstream4Value(0 /* lastUsed */);
+    }
+
+    @NonNull
+    private Tether4Value makeUpstream4Value(long lastUsed) {
         return new Tether4Value(UPSTREAM_IFINDEX,
                 MacAddress.ALL_ZEROS_ADDRESS /* ethDstMac (rawip) */,
                 MacAddress.ALL_ZEROS_ADDRESS /* ethSrcMac (rawip) */, ETH_P_IP,
                 NetworkStackConstants.ETHER_MTU, PUBLIC_ADDR_V4MAPPED_BYTES,
-                REMOTE_ADDR_V4MAPPED_BYTES, PUBLIC_PORT, REMOTE_PORT, 0 /* lastUsed */);
+                REMOTE_ADDR_V4MAPPED_BYTES, PUBLIC_PORT, REMOTE_PORT, lastUsed);
     }
 
     @NonNull
     private Tether4Value makeDownstream4Value() {
+        return makeDownstream4Value(0 /* lastUsed */);
+    }
+
+    @NonNull
+    private Tether4Value makeDownstream4Value(long lastUsed) {
         return new Tether4Value(DOWNSTREAM_IFINDEX, MAC_A /* client mac */, DOWNSTREAM_MAC,
                 ETH_P_IP, NetworkStackConstants.ETHER_MTU, REMOTE_ADDR_V4MAPPED_BYTES,
-                PRIVATE_ADDR_V4MAPPED_BYTES, REMOTE_PORT, PRIVATE_PORT, 0 /* lastUsed */);
+                PRIVATE_ADDR_V4MAPPED_BYTES, REMOTE_PORT, PRIVATE_PORT, lastUsed);
     }
 
     @NonNull
     private ConntrackEvent makeTestConntrackEvent(short msgType, int proto) {
+        final int status = (msgType == IPCTNL_MSG_CT_NEW) ? ESTABLISHED_MASK : DYING_MASK;
+        return makeTestConntrackEvent(msgType, proto, status);
+    }
+
+    @NonNull
+    private ConntrackEvent makeTestConntrackEvent(short msgType, int proto, int status) {
         if (msgType != IPCTNL_MSG_CT_NEW && msgType != IPCTNL_MSG_CT_DELETE) {
             fail("Not support message type " + msgType);
         }
@@ -1342,7 +1403,6 @@ public class BpfCoordinatorTest {
             fail("Not support protocol " + proto);
         }
 
-        final int status = (msgType == IPCTNL_MSG_CT_NEW) ? ESTABLISHED_MASK : DYING_MASK;
         final int timeoutSec = (msgType == IPCTNL_MSG_CT_NEW) ? 100 /* nonzero, new */
                 : 0 /* unused, delete */;
         return new ConntrackEvent(
@@ -1445,4 +1505,173 @@ public class BpfCoordinatorTest {
         verifyTetherOffloadGetAndClearStats(inOrder, UPSTREAM_IFINDEX);
         inOrder.verifyNoMoreInteractions();
     }
+
+    private BpfCoordinator setUpCoordinatorForRule4Test() throws Exception {
+        final BpfCoordinator coordinator = makeBpfCoordinator();
+        doReturn(UPSTREAM_IFACE_PARAMS).when(mDeps).getInterfaceParams(UPSTREAM_IFACE);
+        coordinator.addUpstreamNameToLookupTable(UPSTREAM_IFINDEX, UPSTREAM_IFACE);
+        setUpstreamInformationTo(coordinator);
+        setDownstreamAndClientInformationTo(coordinator);
+        return coordinator;
+    }
+
+    @Test
+    @IgnoreUpTo(Build.VERSION_CODES.R)
+    public void testUnestablishedConnectionNotOffloaded() throws Exception {
+        setUpCoordinatorForRule4Test();
+
+        mConsumer.accept(makeTestConntrackEvent(IPCTNL_MSG_CT_NEW, IPPROTO_TCP,
+                UNREPLIED_NAT_STATUS));
+        mConsumer.accept(makeTestConntrackEvent(IPCTNL_MSG_CT_NEW, IPPROTO_TCP,
+                UNREPLIED_NAT_STATUS | IPS_SEEN_REPLY));
+        verify(mBpfUpstream4Map, never()).insertEntry(any(), any());
+        verify(mBpfDownstream4Map, never()).insertEntry(any(), any());
+    }
+
+    @Test
+    @IgnoreUpTo(Build.VERSION_CODES.R)
+    public void testEarlyOffloadInstallsTentativeRules() throws Exception {
+        when(mTetherConfig.isEarlyOffloadEnabled()).thenReturn(true);
+        setUpCoordinatorForRule4Test();
+        final InOrder inOrder = inOrder(mBpfUpstream4Map, mBpfDownstream4Map);
+
+        // The first event of a connection installs a tentative rule pair.
+        mConsumer.accept(makeTestConntrackEvent(IPCTNL_MSG_CT_NEW, IPPROTO_TCP,
+                UNREPLIED_NAT_STATUS));
+        inOrder.verify(mBpfUpstream4Map).insertEntry(eq(makeUpstream4Key(IPPROTO_TCP)),
+                eq(makeUpstream4Value(BpfCoordinator.LAST_USED_TENTATIVE)));
+        inOrder.verify(mBpfDownstream4Map).insertEntry(eq(makeDownstream4Key(IPPROTO_TCP)),
+                eq(makeDownstream4Value(BpfCoordinator.LAST_USED_TENTATIVE)));
+        inOrder.verifyNoMoreInteractions();
+
+        // A TCP connection that has seen a reply but is not established yet is left alone, since
+        // only the BPF programs can tell when it is safe to confirm the rules.
+        mConsumer.accept(makeTestConntrackEvent(IPCTNL_MSG_CT_NEW, IPPROTO_TCP,
+                UNREPLIED_NAT_STATUS | IPS_SEEN_REPLY));
+        inOrder.verifyNoMoreInteractions();
+
+        // Established connections are offloaded as usual.
+        mConsumer.accept(makeTestConntrackEvent(IPCTNL_MSG_CT_NEW, IPPROTO_UDP));
+        inOrder.verify(mBpfUpstream4Map).insertEntry(eq(makeUpstream4Key(IPPROTO_UDP)),
+                eq(makeUpstream4Value()));
+        inOrder.verify(mBpfDownstream4Map).insertEntry(eq(makeDownstream4Key(IPPROTO_UDP)),
+                eq(makeDownstream4Value()));
+        inOrder.verifyNoMoreInteractions();
+    }
+
+    @Test
+    @IgnoreUpTo(Build.VERSION_CODES.R)
+    public void testQosMarkingAppliedToRule4() throws Exception {
+        final QosMarking upstreamQos = new QosMarking(46 /* dscp */, 0 /* priority */);
+        final QosMarking downstreamQos = new QosMarking(-1 /* dscp */, 6 /* priority */);
+        when(mTetherConfig.getOffloadUpstreamQos()).thenReturn(upstreamQos);
+        when(mTetherConfig.getOffloadDownstreamQos()).thenReturn(downstreamQos);
+        setUpCoordinatorForRule4Test();
+
+        mConsumer.accept(makeTestConntrackEvent(IPCTNL_MSG_CT_NEW, IPPROTO_TCP));
+        verify(mBpfUpstream4Map).insertEntry(eq(makeUpstream4Key(IPPROTO_TCP)),
+                argThat(v -> v.dscp == 46 && v.qosFlags == QosMarking.FLAG_DSCP
+                        && v.priority == 0));
+        verify(mBpfDownstream4Map).insertEntry(eq(makeDownstream4Key(IPPROTO_TCP)),
+                argThat(v -> v.qosFlags == 0 && v.priority == 6));
+    }
+
+    @Test
+    @IgnoreUpTo(Build.VERSION_CODES.R)
+    public void testMapWorkerWritesRule4() throws Exception {
+        when(mTetherConfig.isMapWorkerEnabled()).thenReturn(true);
+        final ArgumentCaptor<MapWorker.Callback> callbackCaptor =
+                ArgumentCaptor.forClass(MapWorker.Callback.class);
+        doReturn(mMapWorker).when(mDeps).getMapWorker(callbackCaptor.capture());
+        doReturn(true).when(mMapWorker).submitRule4(anyInt(), any(), any());
+        setUpCoordinatorForRule4Test();
+        final MapWorker.Callback callback = callbackCaptor.getValue();
+        final InOrder inOrder = inOrder(mBpfStatsMap, mBpfLimitMap);
+
+        // Rules are queued to the worker instead of being written on the handler thread.
+        mConsumer.accept(makeTestConntrackEvent(IPCTNL_MSG_CT_NEW, IPPROTO_TCP));
+        verify(mMapWorker).submitRule4(eq(OP_ADD_UPSTREAM4), eq(makeUpstream4Key(IPPROTO_TCP)),
+                eq(makeUpstream4Value()));
+        verify(mMapWorker).submitRule4(eq(OP_ADD_DOWNSTREAM4),
+                eq(makeDownstream4Key(IPPROTO_TCP)), eq(makeDownstream4Value()));
+        verify(mBpfUpstream4Map, never()).insertEntry(any(), any());
+        verify(mBpfDownstream4Map, never()).insertEntry(any(), any());
+        callback.onComplete(OP_ADD_DOWNSTREAM4, UPSTREAM_IFINDEX, 0 /* result */);
+
+        // The upstream is only cleaned up once the worker deleted its last rule.
+        updateStatsEntryForTetherOffloadGetAndClearStats(
+                buildTestTetherStatsParcel(UPSTREAM_IFINDEX, 0, 0, 0, 0));
+        mConsumer.accept(makeTestConntrackEvent(IPCTNL_MSG_CT_DELETE, IPPROTO_TCP));
+        verify(mMapWorker).submitRule4(eq(OP_REMOVE_DOWNSTREAM4),
+                eq(makeDownstream4Key(IPPROTO_TCP)), isNull());
+        verify(mBpfDownstream4Map, never()).deleteEntry(any());
+        inOrder.verify(mBpfStatsMap, never()).deleteEntry(any());
+
+        callback.onComplete(OP_REMOVE_DOWNSTREAM4, UPSTREAM_IFINDEX, 0 /* result */);
+        verifyTetherOffloadGetAndClearStats(inOrder, UPSTREAM_IFINDEX);
+    }
+
+    @Test
+    @IgnoreUpTo(Build.VERSION_CODES.R)
+    public void testFlowtableOffloadOfStubPrograms() throws Exception {
+        setupFunctioningNetdInterface();
+        when(mTetherConfig.isFlowtableOffloadEnabled()).thenReturn(true);
+        doReturn(mFlowtableOffload).when(mDeps).getFlowtableOffload();
+        doReturn(true).when(mDeps).isIpv4ProgramStub(anyString(), anyBoolean());
+        doReturn(true).when(mFlowtableOffload).addPair(anyString(), anyInt(), anyString(),
+                anyInt());
+        doReturn(new SparseArray<ForwardedStats>()).when(mFlowtableOffload).pollStats();
+
+        final String intIface = "wlan1";
+        final int intIfindex = 200;
+        doReturn(UPSTREAM_IFACE_PARAMS).when(mDeps).getInterfaceParams(UPSTREAM_IFACE);
+        doReturn(new InterfaceParams(intIface, intIfindex, DOWNSTREAM_MAC,
+                NetworkStackConstants.ETHER_MTU)).when(mDeps).getInterfaceParams(intIface);
+
+        MockitoSession mockSession = ExtendedMockito.mockitoSession()
+                .mockStatic(BpfUtils.class)
+                .startMocking();
+        try {
+            final BpfCoordinator coordinator = makeBpfCoordinator();
+            coordinator.startPolling();
+            coordinator.addUpstreamNameToLookupTable(UPSTREAM_IFINDEX, UPSTREAM_IFACE);
+
+            // [1] The pair is forwarded through the flowtable as well as attached to BPF.
+            coordinator.maybeAttachProgram(intIface, UPSTREAM_IFACE);
+            ExtendedMockito.verify(() -> BpfUtils.attachProgram(intIface, UPSTREAM));
+            verify(mFlowtableOffload).addPair(intIface, intIfindex, UPSTREAM_IFACE,
+                    UPSTREAM_IFINDEX);
+
+            // [2] The traffic of the flowtable is reported with the upstream.
+            final SparseArray<ForwardedStats> diffs = new SparseArray<>();
+            diffs.put(UPSTREAM_IFINDEX, new ForwardedStats(1000, 10, 2000, 20));
+            doReturn(diffs).when(mFlowtableOffload).pollStats();
+            updateStatsEntriesAndWaitForUpdate(new TetherStatsParcel[0]);
+            mTetherStatsProvider.pushTetherStats();
+            mTetherStatsProviderCb.expectNotifyStatsUpdated(
+                    new NetworkStats(0L, 1).addEntry(buildTestEntry(STATS_PER_IFACE,
+                            UPSTREAM_IFACE, 1000, 10, 2000, 20)),
+                    new NetworkStats(0L, 1).addEntry(buildTestEntry(STATS_PER_UID,
+                            UPSTREAM_IFACE, 1000, 10, 2000, 20)));
+            doReturn(new SparseArray<ForwardedStats>()).when(mFlowtableOffload).pollStats();
+
+            // [3] A data limit on the upstream takes the pair out of the flowtable.
+            mTetherStatsProvider.onSetLimit(UPSTREAM_IFACE, 1000);
+            waitForIdle();
+            verify(mFlowtableOffload).removePair(intIface, UPSTREAM_IFACE);
+
+            // [4] Removing the limit brings it back.
+            clearInvocations(mFlowtableOffload);
+            mTetherStatsProvider.onSetLimit(UPSTREAM_IFACE, QUOTA_UNLIMITED);
+            waitForIdle();
+            verify(mFlowtableOffload).addPair(intIface, intIfindex, UPSTREAM_IFACE,
+                    UPSTREAM_IFINDEX);
+
+            // [5] The pair leaves the flowtable with its programs.
+            coordinator.maybeDetachProgram(intIface, UPSTREAM_IFACE);
+            verify(mFlowtableOffload).removePair(intIface, UPSTREAM_IFACE);
+        } finally {
+            mockSession.finishMocking();
+        }
+    }
 }
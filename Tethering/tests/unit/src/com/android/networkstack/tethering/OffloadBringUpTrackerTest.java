@@ -0,0 +1,90 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.android.networkstack.tethering;
+
+import static com.android.networkstack.tethering.OffloadBringUpTracker.PHASE_ATTACH_DOWNSTREAM;
+import static com.android.networkstack.tethering.OffloadBringUpTracker.PHASE_ATTACH_UPSTREAM;
+import static com.android.networkstack.tethering.OffloadBringUpTracker.PHASE_FIRST_RULE;
+import static com.android.networkstack.tethering.OffloadBringUpTracker.PHASE_UPSTREAM_MAPS;
+
+import static org.junit.Assert.assertEquals;
+
+import androidx.test.filters.SmallTest;
+import androidx.test.runner.AndroidJUnit4;
+
+import com.android.internal.util.IndentingPrintWriter;
+
+import org.junit.Test;
+import org.junit.runner.RunWith;
+
+import java.io.StringWriter;
+
+@RunWith(AndroidJUnit4.class)
+@SmallTest
+public final class OffloadBringUpTrackerTest {
+    private static final int WLAN_IFINDEX = 10;
+    private static final int USB_IFINDEX = 11;
+
+    private long mNowNs = 0;
+    private final OffloadBringUpTracker mTracker = new OffloadBringUpTracker(() -> mNowNs);
+
+    private void advanceUs(long us) {
+        mNowNs += us * 1000;
+    }
+
+    private void runPhase(int ifindex, int phase, long us) {
+        mTracker.beginPhase(ifindex, phase);
+        advanceUs(us);
+        mTracker.endPhase(ifindex, phase);
+    }
+
+    private String dump() {
+        final StringWriter sw = new StringWriter();
+        mTracker.dump(new IndentingPrintWriter(sw, "  "));
+        return sw.toString().trim();
+    }
+
+    @Test
+    public void testBringUpBreakdown() {
+        assertEquals("<empty>", dump());
+
+        mTracker.start(WLAN_IFINDEX, "wlan0", "rmnet0");
+        runPhase(WLAN_IFINDEX, PHASE_ATTACH_UPSTREAM, 100);
+        runPhase(WLAN_IFINDEX, PHASE_ATTACH_DOWNSTREAM, 200);
+        advanceUs(5000);  // Waiting for the first connection.
+        assertEquals("wlan0 -> rmnet0: attach upstream program 100us, attach downstream program "
+                + "200us, upstream maps 0us, first rule 0us, total pending", dump());
+
+        runPhase(WLAN_IFINDEX, PHASE_UPSTREAM_MAPS, 30);
+        runPhase(WLAN_IFINDEX, PHASE_FIRST_RULE, 40);
+        mTracker.complete(WLAN_IFINDEX);
+        final String wlanBringUp = "wlan0 -> rmnet0: attach upstream program 100us, attach "
+                + "downstream program 200us, upstream maps 30us, first rule 40us, total 5370us";
+        assertEquals(wlanBringUp, dump());
+
+        // Later rules of the same downstream are not measured.
+        runPhase(WLAN_IFINDEX, PHASE_FIRST_RULE, 40);
+        mTracker.complete(WLAN_IFINDEX);
+        assertEquals(wlanBringUp, dump());
+
+        // A downstream torn down before its first rule is forgotten.
+        mTracker.start(USB_IFINDEX, "rndis0", "rmnet0");
+        runPhase(USB_IFINDEX, PHASE_ATTACH_UPSTREAM, 100);
+        mTracker.stop("rndis0");
+        assertEquals(wlanBringUp, dump());
+    }
+}
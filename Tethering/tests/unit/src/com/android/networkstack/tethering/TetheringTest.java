@@ -325,7 +325,7 @@ public class TetheringTest {
 
         @Override
         public RouterAdvertisementDaemon getRouterAdvertisementDaemon(
-                InterfaceParams ifParams) {
+                InterfaceParams ifParams, boolean useXsk) {
             return mRouterAdvertisementDaemon;
         }
 
@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "offload_snapshot_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace android {
+
+std::unique_ptr<OffloadSnapshot> OffloadSnapshot::open(const char* path, std::string* error) {
+    const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        *error = std::string("open: ") + strerror(errno);
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        *error = std::string("fstat: ") + strerror(errno);
+        close(fd);
+        return nullptr;
+    }
+    const size_t size = st.st_size;
+    if (size < sizeof(TetherSnapshotHeader)) {
+        *error = "File too short";
+        close(fd);
+        return nullptr;
+    }
+    void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        *error = std::string("mmap: ") + strerror(errno);
+        return nullptr;
+    }
+
+    std::unique_ptr<OffloadSnapshot> snapshot(
+            new OffloadSnapshot(static_cast<const uint8_t*>(data), size));
+    if (!snapshot->validate(error)) return nullptr;
+    return snapshot;
+}
+
+OffloadSnapshot::~OffloadSnapshot() {
+    munmap(const_cast<uint8_t*>(mData), mSize);
+}
+
+// Checks every offset once, so that the accessors do not have to.
+bool OffloadSnapshot::validate(std::string* error) const {
+    const TetherSnapshotHeader* h = header();
+    if (memcmp(h->magic, TETHER_SNAPSHOT_MAGIC, sizeof(h->magic))) {
+        *error = "Not a tethering offload snapshot";
+        return false;
+    }
+    if (h->formatVersion != TETHER_SNAPSHOT_FORMAT_VERSION) {
+        *error = "Unsupported format version " + std::to_string(h->formatVersion);
+        return false;
+    }
+    if (h->mapCount > (mSize - sizeof(*h)) / sizeof(TetherSnapshotMap)) {
+        *error = "Truncated map table";
+        return false;
+    }
+
+    auto inFile = [this](uint64_t offset, uint64_t count, uint32_t size) {
+        return offset % 8 == 0 && offset <= mSize &&
+                (size == 0 || count <= (mSize - offset) / size);
+    };
+    for (size_t i = 0; i < h->mapCount; i++) {
+        const TetherSnapshotMap& m = table()[i];
+        if (memchr(m.name, '\0', sizeof(m.name)) == nullptr || m.keySize == 0 ||
+                !inFile(m.keysOffset, m.count, m.keySize) ||
+                !inFile(m.valuesOffset, m.count, m.valueSize)) {
+            *error = "Invalid entry " + std::to_string(i) + " in map table";
+            return false;
+        }
+    }
+    return true;
+}
+
+const TetherSnapshotMap* OffloadSnapshot::findMap(const char* name) const {
+    for (size_t i = 0; i < mapCount(); i++) {
+        if (!strcmp(table()[i].name, name)) return &table()[i];
+    }
+    return nullptr;
+}
+
+}  // namespace android
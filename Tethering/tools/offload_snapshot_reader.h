@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+
+#include "offload_snapshot_format.h"
+
+namespace android {
+
+// Entries of one map of a snapshot, pointing into the mapped file.
+template <typename K, typename V>
+struct OffloadSnapshotEntries {
+    const K* keys = nullptr;
+    const V* values = nullptr;
+    size_t count = 0;
+};
+
+// Read-only view of an offload state snapshot written by writeOffloadSnapshot(), e.g. by
+// "adb shell dumpsys tethering bpfsnapshot" or "tetheroffloadinfo snapshot". The file is mapped
+// in memory and validated once, so that the entries can then be used in place.
+class OffloadSnapshot {
+  public:
+    // Maps and validates the snapshot at path. Returns null and sets error on failure.
+    static std::unique_ptr<OffloadSnapshot> open(const char* path, std::string* error);
+
+    ~OffloadSnapshot();
+
+    uint32_t layoutVersion() const { return header()->layoutVersion; }
+    // CLOCK_BOOTTIME of the device at capture time.
+    uint64_t bootTimeNs() const { return header()->bootTimeNs; }
+    size_t mapCount() const { return header()->mapCount; }
+    const TetherSnapshotMap& map(size_t i) const { return table()[i]; }
+
+    // Returns the map with the given name, e.g. "tether_upstream4_map", or null if the device
+    // did not have it.
+    const TetherSnapshotMap* findMap(const char* name) const;
+
+    // Gets the entries of the given map as arrays of K and V. Returns false if the map is absent
+    // or if its key or value size do not match, e.g. because the snapshot was written with
+    // another BPF_TETHER_LAYOUT_VERSION.
+    template <typename K, typename V>
+    bool getEntries(const char* name, OffloadSnapshotEntries<K, V>* entries) const {
+        const TetherSnapshotMap* m = findMap(name);
+        if (m == nullptr || m->keySize != sizeof(K) || m->valueSize != sizeof(V)) return false;
+        entries->keys = reinterpret_cast<const K*>(mData + m->keysOffset);
+        entries->values = reinterpret_cast<const V*>(mData + m->valuesOffset);
+        entries->count = m->count;
+        return true;
+    }
+
+  private:
+    OffloadSnapshot(const uint8_t* data, size_t size) : mData(data), mSize(size) {}
+
+    bool validate(std::string* error) const;
+    const TetherSnapshotHeader* header() const {
+        return reinterpret_cast<const TetherSnapshotHeader*>(mData);
+    }
+    const TetherSnapshotMap* table() const {
+        return reinterpret_cast<const TetherSnapshotMap*>(mData + sizeof(TetherSnapshotHeader));
+    }
+
+    const uint8_t* const mData;
+    const size_t mSize;
+};
+
+}  // namespace android
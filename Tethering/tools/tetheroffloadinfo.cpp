@@ -0,0 +1,303 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Prints the tethering offload state straight from the pinned BPF maps, without going through
+// BpfCoordinator and dumpsys. All the maps are opened read-only and streamed through map element
+// iterators, or read with batched lookups on kernels without them.
+//
+// Usage: tetheroffloadinfo [rules|stats|errors|all]
+//        tetheroffloadinfo watch [intervalSec]
+//        tetheroffloadinfo snapshot <file|->
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <net/if.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#define BPF_FD_JUST_USE_INT
+#include "BpfSyscallWrappers.h"
+#include "bpf_map_batch.h"
+#include "bpf_map_iter.h"
+#include "bpf_tethering.h"
+#include "offload_snapshot.h"
+
+namespace android {
+
+// Reads all the entries of the map at the given path. Returns false and prints an error on failure.
+template <typename K, typename V>
+static bool readMap(const char* path, std::vector<K>* keys, std::vector<V>* values) {
+    const int fd = bpf::mapRetrieveRO(path);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    std::vector<uint8_t> k, v;
+    const int ret = dumpAllMapEntries(fd, sizeof(K), sizeof(V), &k, &v);
+    const int err = errno;
+    close(fd);
+    if (ret) {
+        fprintf(stderr, "Cannot read %s: %s\n", path, strerror(err));
+        return false;
+    }
+    keys->resize(k.size() / sizeof(K));
+    values->resize(v.size() / sizeof(V));
+    memcpy(keys->data(), k.data(), k.size());
+    memcpy(values->data(), v.data(), v.size());
+    return true;
+}
+
+static std::string ifName(uint32_t ifindex) {
+    char name[IFNAMSIZ];
+    return std::to_string(ifindex) + "(" + (if_indextoname(ifindex, name) ? name : "?") + ")";
+}
+
+static std::string macToString(const uint8_t* mac) {
+    char buf[18];
+    snprintf(buf, sizeof(buf), "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3],
+             mac[4], mac[5]);
+    return buf;
+}
+
+static std::string addrToString(int family, const void* addr) {
+    char buf[INET6_ADDRSTRLEN];
+    return inet_ntop(family, addr, buf, sizeof(buf)) ? buf : "?";
+}
+
+// Prints IPv4 mapped addresses as IPv4, like the Java dump.
+static std::string addr46ToString(const in6_addr& addr) {
+    if (IN6_IS_ADDR_V4MAPPED(&addr)) return addrToString(AF_INET, &addr.s6_addr[12]);
+    return addrToString(AF_INET6, &addr);
+}
+
+static uint64_t nowNs(clockid_t clock) {
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Same format as BpfCoordinator#ipv4RuleToString, plus the protocol and the idle time.
+static void dumpIpv4Rules(const char* name, const char* path, uint64_t bootNs) {
+    std::vector<Tether4Key> keys;
+    std::vector<Tether4Value> values;
+    if (!readMap(path, &keys, &values)) return;
+    printf("IPv4 %s: %zu rules [inDstMac] proto iif(iface) src -> nat -> dst idle\n", name,
+           keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        const Tether4Key& k = keys[i];
+        const Tether4Value& v = values[i];
+        std::string idle = "never used";
+        if (v.last_used == TETHER_LAST_USED_TENTATIVE) {
+            idle = "tentative";
+        } else if (v.last_used != 0 && v.last_used <= bootNs) {
+            idle = std::to_string((bootNs - v.last_used) / 1000000) + "ms";
+        }
+        printf("  [%s] %u %s %s:%u -> %s %s:%u -> %s:%u %s\n", macToString(k.dstMac).c_str(),
+               k.l4Proto, ifName(k.iif).c_str(), addrToString(AF_INET, &k.src4).c_str(),
+               ntohs(k.srcPort), ifName(v.oif).c_str(), addr46ToString(v.src46).c_str(),
+               ntohs(v.srcPort), addrToString(AF_INET, &k.dst4).c_str(), ntohs(k.dstPort),
+               idle.c_str());
+    }
+}
+
+static void dumpIpv6Rules() {
+    std::vector<TetherUpstream6Key> upKeys;
+    std::vector<Tether6Value> upValues;
+    if (readMap(TETHER_UPSTREAM6_MAP_PATH, &upKeys, &upValues)) {
+        printf("IPv6 upstream: %zu rules iif(iface) inDstMac -> oif(iface) proto srcmac dstmac\n",
+               upKeys.size());
+        for (size_t i = 0; i < upKeys.size(); i++) {
+            const Tether6Value& v = upValues[i];
+            printf("  %s %s -> %s %04x %s %s\n", ifName(upKeys[i].iif).c_str(),
+                   macToString(upKeys[i].dstMac).c_str(), ifName(v.oif).c_str(),
+                   ntohs(v.macHeader.h_proto), macToString(v.macHeader.h_source).c_str(),
+                   macToString(v.macHeader.h_dest).c_str());
+        }
+    }
+
+    std::vector<TetherDownstream6Key> downKeys;
+    std::vector<Tether6Value> downValues;
+    if (readMap(TETHER_DOWNSTREAM6_MAP_PATH, &downKeys, &downValues)) {
+        printf("IPv6 downstream: %zu rules iif(iface) oif(iface) v6addr srcmac dstmac\n",
+               downKeys.size());
+        for (size_t i = 0; i < downKeys.size(); i++) {
+            const Tether6Value& v = downValues[i];
+            printf("  %s %s %s %s %s\n", ifName(downKeys[i].iif).c_str(), ifName(v.oif).c_str(),
+                   addrToString(AF_INET6, &downKeys[i].neigh6).c_str(),
+                   macToString(v.macHeader.h_source).c_str(),
+                   macToString(v.macHeader.h_dest).c_str());
+        }
+    }
+}
+
+static void dumpRules() {
+    const uint64_t bootNs = nowNs(CLOCK_BOOTTIME);  // Same clock as bpf_ktime_get_boot_ns().
+    dumpIpv4Rules("upstream", TETHER_UPSTREAM4_MAP_PATH, bootNs);
+    dumpIpv4Rules("downstream", TETHER_DOWNSTREAM4_MAP_PATH, bootNs);
+    dumpIpv6Rules();
+}
+
+static bool readStats(std::map<uint32_t, TetherStatsValue>* stats) {
+    std::vector<TetherStatsKey> keys;
+    std::vector<TetherStatsValue> values;
+    if (!readMap(TETHER_STATS_MAP_PATH, &keys, &values)) return false;
+    stats->clear();
+    for (size_t i = 0; i < keys.size(); i++) (*stats)[keys[i]] = values[i];
+    return true;
+}
+
+static void dumpStats() {
+    std::map<uint32_t, TetherStatsValue> stats;
+    if (!readStats(&stats)) return;
+    std::vector<TetherLimitKey> limitKeys;
+    std::vector<TetherLimitValue> limitValues;
+    std::map<uint32_t, uint64_t> limits;
+    if (readMap(TETHER_LIMIT_MAP_PATH, &limitKeys, &limitValues)) {
+        for (size_t i = 0; i < limitKeys.size(); i++) limits[limitKeys[i]] = limitValues[i];
+    }
+
+    printf("Stats: upstream rxPackets rxBytes rxErrors txPackets txBytes txErrors limit\n");
+    for (const auto& [ifindex, s] : stats) {
+        const auto limit = limits.find(ifindex);
+        printf("  %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+               " %s\n", ifName(ifindex).c_str(), s.rxPackets, s.rxBytes, s.rxErrors, s.txPackets,
+               s.txBytes, s.txErrors,
+               limit == limits.end() ? "none" : std::to_string(limit->second).c_str());
+    }
+}
+
+static bool readErrors(std::vector<uint32_t>* counts) {
+    std::vector<uint32_t> keys, values;
+    if (!readMap(TETHER_ERROR_MAP_PATH, &keys, &values)) return false;
+    counts->assign(BPF_TETHER_ERR__MAX, 0);
+    for (size_t i = 0; i < keys.size(); i++) {
+        if (keys[i] < BPF_TETHER_ERR__MAX) (*counts)[keys[i]] = values[i];
+    }
+    return true;
+}
+
+// Only prints the non-zero counters, like BpfCoordinator#dumpCounters.
+static void dumpErrors() {
+    std::vector<uint32_t> counts;
+    if (!readErrors(&counts)) return;
+    printf("Errors:\n");
+    for (size_t i = 0; i < counts.size(); i++) {
+        if (counts[i] > 0) printf("  %s: %u\n", bpf_tether_errors[i], counts[i]);
+    }
+}
+
+// Prints the per-second packet and byte rates of each upstream, and the error counters that
+// increased, every intervalSec seconds. Only the stats and error maps are read, which are small.
+static int watch(unsigned intervalSec) {
+    std::map<uint32_t, TetherStatsValue> prevStats, stats;
+    std::vector<uint32_t> prevErrors, errors;
+    if (!readStats(&prevStats) || !readErrors(&prevErrors)) return 1;
+    uint64_t prevNs = nowNs(CLOCK_MONOTONIC);
+
+    while (true) {
+        sleep(intervalSec);
+        if (!readStats(&stats) || !readErrors(&errors)) return 1;
+        const uint64_t now = nowNs(CLOCK_MONOTONIC);
+        const double sec = (now - prevNs) / 1e9;
+
+        for (const auto& [ifindex, s] : stats) {
+            const auto prev = prevStats.find(ifindex);
+            // A new upstream, or one whose stats were cleared, starts from zero.
+            const TetherStatsValue p = prev == prevStats.end() || prev->second.rxBytes > s.rxBytes
+                    ? TetherStatsValue{} : prev->second;
+            printf("%s rx %.0f pkt/s %.0f B/s tx %.0f pkt/s %.0f B/s\n", ifName(ifindex).c_str(),
+                   (s.rxPackets - p.rxPackets) / sec, (s.rxBytes - p.rxBytes) / sec,
+                   (s.txPackets - p.txPackets) / sec, (s.txBytes - p.txBytes) / sec);
+        }
+        for (size_t i = 0; i < errors.size(); i++) {
+            if (errors[i] > prevErrors[i]) {
+                printf("  %s: %.0f/s\n", bpf_tether_errors[i], (errors[i] - prevErrors[i]) / sec);
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+
+        prevStats.swap(stats);
+        prevErrors.swap(errors);
+        prevNs = now;
+    }
+}
+
+// Writes a binary snapshot of all the maps, to be decoded offline with libtetheroffloadsnapshot.
+static int snapshot(const char* path) {
+    const bool toStdout = !strcmp(path, "-");
+    const int fd = toStdout ? STDOUT_FILENO
+                            : open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    const int ret = writeOffloadSnapshot(fd, true /* useMapIterators */);
+    if (ret) fprintf(stderr, "Cannot write snapshot: %s\n", strerror(errno));
+    if (!toStdout) close(fd);
+    return ret ? 1 : 0;
+}
+
+static int usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [rules|stats|errors|all]\n"
+                    "       %s watch [intervalSec]\n"
+                    "       %s snapshot <file|->\n", prog, prog, prog);
+    return 2;
+}
+
+static int run(int argc, char** argv) {
+    const std::string cmd = argc > 1 ? argv[1] : "all";
+    if (cmd == "watch") {
+        const int interval = argc > 2 ? atoi(argv[2]) : 1;
+        if (interval <= 0) return usage(argv[0]);
+        return watch(interval);
+    }
+    if (cmd == "snapshot") {
+        if (argc != 3) return usage(argv[0]);
+        return snapshot(argv[2]);
+    }
+    if (argc > 2) return usage(argv[0]);
+
+    if (cmd == "rules") {
+        dumpRules();
+    } else if (cmd == "stats") {
+        dumpStats();
+    } else if (cmd == "errors") {
+        dumpErrors();
+    } else if (cmd == "all") {
+        dumpRules();
+        dumpStats();
+        dumpErrors();
+    } else {
+        return usage(argv[0]);
+    }
+    return 0;
+}
+
+}  // namespace android
+
+int main(int argc, char** argv) {
+    return android::run(argc, argv);
+}
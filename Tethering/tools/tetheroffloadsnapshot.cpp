@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool that decodes an offload state snapshot taken on a device.
+//
+// Usage: tetheroffloadsnapshot <file>
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <string>
+
+#include "bpf_tethering.h"
+#include "offload_snapshot_reader.h"
+
+namespace android {
+
+static std::string addrToString(int family, const void* addr) {
+    char buf[INET6_ADDRSTRLEN];
+    return inet_ntop(family, addr, buf, sizeof(buf)) ? buf : "?";
+}
+
+// Interface names are not known offline, so only indexes are printed.
+static void printIpv4Rules(const OffloadSnapshot& snapshot, const char* name) {
+    OffloadSnapshotEntries<Tether4Key, Tether4Value> rules;
+    if (!snapshot.getEntries(name, &rules)) return;
+    printf("%s: proto iif src -> oif nat -> dst idle\n", name);
+    for (size_t i = 0; i < rules.count; i++) {
+        const Tether4Key& k = rules.keys[i];
+        const Tether4Value& v = rules.values[i];
+        std::string idle = "never used";
+        if (v.last_used == TETHER_LAST_USED_TENTATIVE) {
+            idle = "tentative";
+        } else if (v.last_used != 0 && v.last_used <= snapshot.bootTimeNs()) {
+            idle = std::to_string((snapshot.bootTimeNs() - v.last_used) / 1000000) + "ms";
+        }
+        printf("  %u %u %s:%u -> %u %s:%u -> %s:%u %s\n", k.l4Proto, k.iif,
+               addrToString(AF_INET, &k.src4).c_str(), ntohs(k.srcPort), v.oif,
+               addrToString(AF_INET, &v.src46.s6_addr[12]).c_str(), ntohs(v.srcPort),
+               addrToString(AF_INET, &k.dst4).c_str(), ntohs(k.dstPort), idle.c_str());
+    }
+}
+
+static void printStats(const OffloadSnapshot& snapshot) {
+    OffloadSnapshotEntries<TetherStatsKey, TetherStatsValue> stats;
+    if (!snapshot.getEntries("tether_stats_map", &stats)) return;
+    printf("tether_stats_map: upstream rxPackets rxBytes txPackets txBytes\n");
+    for (size_t i = 0; i < stats.count; i++) {
+        const TetherStatsValue& s = stats.values[i];
+        printf("  %u %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", stats.keys[i],
+               s.rxPackets, s.rxBytes, s.txPackets, s.txBytes);
+    }
+}
+
+static int run(int argc, char** argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+        return 2;
+    }
+    std::string error;
+    const std::unique_ptr<OffloadSnapshot> snapshot = OffloadSnapshot::open(argv[1], &error);
+    if (snapshot == nullptr) {
+        fprintf(stderr, "Cannot read %s: %s\n", argv[1], error.c_str());
+        return 1;
+    }
+
+    printf("Layout version %u, captured at boot time %" PRIu64 "ns\n",
+           snapshot->layoutVersion(), snapshot->bootTimeNs());
+    for (size_t i = 0; i < snapshot->mapCount(); i++) {
+        const TetherSnapshotMap& m = snapshot->map(i);
+        printf("  %s: %" PRIu64 " entries\n", m.name, m.count);
+    }
+    if (snapshot->layoutVersion() != BPF_TETHER_LAYOUT_VERSION) {
+        // The sizes may still match, but the fields may not mean the same.
+        printf("Not decoding entries written with layout version %u, expected %u\n",
+               snapshot->layoutVersion(), BPF_TETHER_LAYOUT_VERSION);
+        return 0;
+    }
+    printIpv4Rules(*snapshot, "tether_upstream4_map");
+    printIpv4Rules(*snapshot, "tether_downstream4_map");
+    printStats(*snapshot);
+    return 0;
+}
+
+}  // namespace android
+
+int main(int argc, char** argv) {
+    return android::run(argc, argv);
+}
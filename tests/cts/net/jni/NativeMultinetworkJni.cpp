@@ -31,12 +31,16 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include <android/log.h>
 #include <android/multinetwork.h>
 #include <nativehelper/JNIHelp.h>
 
+#include "UdpProbeEngine.h"
+
 #define LOGD(fmt, ...) \
         __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, fmt, ##__VA_ARGS__)
 
@@ -413,103 +417,52 @@ JNIEXPORT jint Java_android_net_cts_MultinetworkApiTest_runDatagramCheck(
         return -errno;
     }
 
-    // Rely upon getaddrinfo sorting the best destination to the front.
-    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (fd < 0) {
-        LOGD("socket(%d, %d, %d) failed, errno=%d",
-              res->ai_family, res->ai_socktype, res->ai_protocol, errno);
-        freeaddrinfo(res);
-        return -errno;
+    // Probe all the addresses at once, but rely upon getaddrinfo sorting the best destination to
+    // the front for the result.
+    std::vector<sockaddr_storage> endpoints;
+    for (const struct addrinfo* ai = res; ai != NULL; ai = ai->ai_next) {
+        sockaddr_storage addr = {};
+        memcpy(&addr, ai->ai_addr, std::min<size_t>(ai->ai_addrlen, sizeof(addr)));
+        endpoints.push_back(addr);
     }
+    freeaddrinfo(res);
 
-    rval = android_setsocknetwork(handle, fd);
-    LOGD("android_setprocnetwork(%llu, %d) returned rval=%d errno=%d",
-          handle, fd, rval, errno);
-    if (rval != 0) {
-        close(fd);
-        freeaddrinfo(res);
-        return -errno;
-    }
-
-    char addrstr[kSockaddrStrLen+1];
-    sockaddr_ntop(res->ai_addr, res->ai_addrlen, addrstr, sizeof(addrstr));
-    LOGD("Attempting connect() to %s ...", addrstr);
-
-    rval = connect(fd, res->ai_addr, res->ai_addrlen);
+    android::net::UdpProbeEngine engine([handle](int fd) {
+        int rval = android_setsocknetwork(handle, fd);
+        const int saved_errno = errno;
+        LOGD("android_setsocknetwork(%llu, %d) returned rval=%d errno=%d",
+              handle, fd, rval, saved_errno);
+        return rval == 0 ? 0 : -saved_errno;
+    });
+    // Only the preferred address decides the result, so stop as soon as it answers. The other
+    // addresses are logged with whatever they answered by then.
+    android::net::ProbeOptions options;
+    options.stopOnFirstResponse = true;
+    std::vector<android::net::ProbeResult> results;
+    rval = engine.run(endpoints, options, &results);
     if (rval != 0) {
-        close(fd);
-        freeaddrinfo(res);
-        return -errno;
+        LOGD("Probing %zu addresses of %s failed: %d", endpoints.size(), kHostname, rval);
+        return rval;
     }
-    freeaddrinfo(res);
 
-    struct sockaddr_storage src_addr;
-    socklen_t src_addrlen = sizeof(src_addr);
-    if (getsockname(fd, (struct sockaddr *)&src_addr, &src_addrlen) != 0) {
-        close(fd);
-        return -errno;
+    for (size_t i = 0; i < endpoints.size(); i++) {
+        const android::net::ProbeResult& r = results[i];
+        char addrstr[kSockaddrStrLen+1];
+        sockaddr_ntop((const struct sockaddr *)&endpoints[i], sizeof(endpoints[i]), addrstr,
+                      sizeof(addrstr));
+        LOGD("QUIC UDP %s: sent=%d rcvd=%d loss=%.0f%% rtt min/median/max=%" PRId64 "/%" PRId64
+             "/%" PRId64 "us jitter=%" PRId64 "us error=%d",
+             addrstr, r.sent, r.received, r.loss() * 100, r.minRttUs, r.medianRttUs, r.maxRttUs,
+             r.jitterUs, r.error);
     }
-    sockaddr_ntop((const struct sockaddr *)&src_addr, sizeof(src_addr), addrstr, sizeof(addrstr));
-    LOGD("... from %s", addrstr);
-
-    // Don't let reads or writes block indefinitely.
-    const struct timeval timeo = { 2, 0 };  // 2 seconds
-    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeo, sizeof(timeo));
-    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeo, sizeof(timeo));
-
-    // For reference see:
-    //     https://datatracker.ietf.org/doc/html/draft-ietf-quic-invariants
-    uint8_t quic_packet[1200] = {
-        0xc0,                    // long header
-        0xaa, 0xda, 0xca, 0xca,  // reserved-space version number
-        0x08,                    // destination connection ID length
-        0, 0, 0, 0, 0, 0, 0, 0,  // 64bit connection ID
-        0x00,                    // source connection ID length
-    };
-
-    arc4random_buf(quic_packet + 6, 8);  // random connection ID
-
-    uint8_t response[1500];
-    ssize_t sent, rcvd;
-    static const int MAX_RETRIES = 5;
-    int i, errnum = 0;
-
-    for (i = 0; i < MAX_RETRIES; i++) {
-        sent = send(fd, quic_packet, sizeof(quic_packet), 0);
-        if (sent < (ssize_t)sizeof(quic_packet)) {
-            errnum = errno;
-            LOGD("send(QUIC packet) returned sent=%zd, errno=%d", sent, errnum);
-            close(fd);
-            return -errnum;
-        }
 
-        rcvd = recv(fd, response, sizeof(response), 0);
-        if (rcvd > 0) {
-            break;
-        } else {
-            errnum = errno;
-            LOGD("[%d/%d] recv(QUIC response) returned rcvd=%zd, errno=%d",
-                  i + 1, MAX_RETRIES, rcvd, errnum);
-        }
-    }
-    if (rcvd < 15) {
-        LOGD("QUIC UDP %s: sent=%zd but rcvd=%zd, errno=%d", kPort, sent, rcvd, errnum);
-        if (rcvd <= 0) {
-            LOGD("Does this network block UDP port %s?", kPort);
-        }
-        close(fd);
-        return -EPROTO;
-    }
+    // TODO: Replace this quick 'n' dirty test with proper QUIC-capable code.
 
-    int conn_id_cmp = memcmp(quic_packet + 6, response + 7, 8);
-    if (conn_id_cmp != 0) {
-        LOGD("sent and received connection IDs do not match");
-        close(fd);
+    const android::net::ProbeResult& best = results[0];
+    if (best.error != 0) return best.error;
+    if (best.received == 0) {
+        LOGD("Does this network block UDP port %s?", kPort);
         return -EPROTO;
     }
-
-    // TODO: Replace this quick 'n' dirty test with proper QUIC-capable code.
-
-    close(fd);
     return 0;
 }
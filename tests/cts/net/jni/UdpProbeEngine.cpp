@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "UdpProbeEngine.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+namespace android {
+namespace net {
+
+namespace {
+
+// For reference see:
+//     https://datatracker.ietf.org/doc/html/draft-ietf-quic-invariants
+constexpr uint8_t QUIC_LONG_HEADER = 0xc0;
+constexpr uint8_t QUIC_RESERVED_VERSION[] = {0xaa, 0xda, 0xca, 0xca};
+constexpr size_t CONN_ID_LEN = 8;
+// Where the connection ID is in a probe, and in the version negotiation packet that answers it.
+constexpr size_t PROBE_CONN_ID_OFFSET = 6;
+constexpr size_t VERSION_NEGOTIATION_CONN_ID_OFFSET = 7;
+constexpr size_t MIN_PROBE_SIZE = PROBE_CONN_ID_OFFSET + CONN_ID_LEN + 1;
+
+constexpr int RECV_BATCH = 32;
+constexpr size_t MAX_RESPONSE_SIZE = 1500;
+
+int64_t toUs(const timespec& ts) {
+    return static_cast<int64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The clock of SO_TIMESTAMPNS.
+int64_t realtimeUs() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return toUs(ts);
+}
+
+// The connection ID is the token of the run, the index of the endpoint and the number of the
+// probe.
+void writeConnId(uint8_t* out, uint32_t token, uint16_t endpoint, uint16_t seq) {
+    const uint8_t id[CONN_ID_LEN] = {
+            static_cast<uint8_t>(token >> 24),    static_cast<uint8_t>(token >> 16),
+            static_cast<uint8_t>(token >> 8),     static_cast<uint8_t>(token),
+            static_cast<uint8_t>(endpoint >> 8), static_cast<uint8_t>(endpoint),
+            static_cast<uint8_t>(seq >> 8),      static_cast<uint8_t>(seq),
+    };
+    memcpy(out, id, sizeof(id));
+}
+
+void buildProbe(std::vector<uint8_t>* probe, uint32_t token, uint16_t endpoint, uint16_t seq) {
+    std::fill(probe->begin(), probe->end(), 0);
+    uint8_t* p = probe->data();
+    p[0] = QUIC_LONG_HEADER;
+    memcpy(p + 1, QUIC_RESERVED_VERSION, sizeof(QUIC_RESERVED_VERSION));
+    p[5] = CONN_ID_LEN;  // Destination connection ID length.
+    writeConnId(p + PROBE_CONN_ID_OFFSET, token, endpoint, seq);
+    // The source connection ID is empty.
+}
+
+// Finds the connection ID of the probe a response answers. Returns false if it is neither a
+// version negotiation packet nor an echo of a probe.
+bool parseResponse(const uint8_t* buf, size_t len, uint32_t* token, uint16_t* endpoint,
+                   uint16_t* seq) {
+    static constexpr uint8_t VERSION_NEGOTIATION[] = {0, 0, 0, 0};
+    size_t offset;
+    if (len >= VERSION_NEGOTIATION_CONN_ID_OFFSET + CONN_ID_LEN && (buf[0] & 0x80) &&
+        !memcmp(buf + 1, VERSION_NEGOTIATION, sizeof(VERSION_NEGOTIATION)) && buf[5] == 0 &&
+        buf[6] == CONN_ID_LEN) {
+        offset = VERSION_NEGOTIATION_CONN_ID_OFFSET;
+    } else if (len >= MIN_PROBE_SIZE && buf[0] == QUIC_LONG_HEADER &&
+               !memcmp(buf + 1, QUIC_RESERVED_VERSION, sizeof(QUIC_RESERVED_VERSION)) &&
+               buf[5] == CONN_ID_LEN) {
+        offset = PROBE_CONN_ID_OFFSET;
+    } else {
+        return false;
+    }
+    const uint8_t* id = buf + offset;
+    *token = (id[0] << 24) | (id[1] << 16) | (id[2] << 8) | id[3];
+    *endpoint = (id[4] << 8) | id[5];
+    *seq = (id[6] << 8) | id[7];
+    return true;
+}
+
+socklen_t addrLen(const sockaddr_storage& addr) {
+    return (addr.ss_family == AF_INET6) ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+}
+
+void summarize(const std::vector<int64_t>& txUs, const std::vector<int64_t>& rxUs,
+               ProbeResult* result) {
+    result->rttsUs.clear();
+    for (size_t seq = 0; seq < rxUs.size(); seq++) {
+        if (rxUs[seq] < 0) continue;
+        result->rttsUs.push_back(std::max<int64_t>(rxUs[seq] - txUs[seq], 0));
+    }
+    result->received = result->rttsUs.size();
+    if (result->rttsUs.empty()) return;
+
+    int64_t jitterSum = 0;
+    for (size_t i = 1; i < result->rttsUs.size(); i++) {
+        jitterSum += std::abs(result->rttsUs[i] - result->rttsUs[i - 1]);
+    }
+    if (result->rttsUs.size() > 1) result->jitterUs = jitterSum / (result->rttsUs.size() - 1);
+
+    std::vector<int64_t> sorted = result->rttsUs;
+    std::sort(sorted.begin(), sorted.end());
+    result->minRttUs = sorted.front();
+    result->medianRttUs = sorted[sorted.size() / 2];
+    result->maxRttUs = sorted.back();
+}
+
+}  // namespace
+
+int UdpProbeEngine::run(const std::vector<sockaddr_storage>& endpoints,
+                        const ProbeOptions& options, std::vector<ProbeResult>* results) {
+    const size_t count = endpoints.size();
+    if (count == 0 || count > UINT16_MAX || options.probesPerEndpoint <= 0 ||
+        options.probesPerEndpoint > UINT16_MAX || options.probeSize < MIN_PROBE_SIZE) {
+        return -EINVAL;
+    }
+    results->assign(count, ProbeResult());
+
+    // One socket per address family, shared by all the endpoints of that family.
+    struct Family {
+        int fd = -1;
+        std::vector<size_t> endpoints;
+    };
+    Family families[2];
+    auto familyOf = [](const sockaddr_storage& addr) { return addr.ss_family == AF_INET6; };
+    int err = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (endpoints[i].ss_family != AF_INET && endpoints[i].ss_family != AF_INET6) {
+            (*results)[i].error = -EAFNOSUPPORT;
+            continue;
+        }
+        families[familyOf(endpoints[i])].endpoints.push_back(i);
+    }
+    std::vector<pollfd> pollFds;
+    for (Family& family : families) {
+        if (family.endpoints.empty()) continue;
+        const int domain = endpoints[family.endpoints[0]].ss_family;
+        family.fd = socket(domain, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+        int familyErr = (family.fd == -1) ? -errno : mSetup(family.fd);
+        if (!familyErr) {
+            static constexpr int on = 1;
+            // Without kernel timestamps, responses are timestamped when they are read.
+            setsockopt(family.fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+            pollFds.push_back({.fd = family.fd, .events = POLLIN, .revents = 0});
+            continue;
+        }
+        for (size_t i : family.endpoints) (*results)[i].error = familyErr;
+        family.endpoints.clear();
+        err = familyErr;
+    }
+    if (pollFds.empty()) {
+        for (Family& family : families) {
+            if (family.fd != -1) close(family.fd);
+        }
+        return err ? err : -EAFNOSUPPORT;
+    }
+
+    std::random_device random;
+    const uint32_t token = random();
+    const size_t probes = options.probesPerEndpoint;
+    std::vector<std::vector<int64_t>> txUs(count, std::vector<int64_t>(probes, -1));
+    std::vector<std::vector<int64_t>> rxUs(count, std::vector<int64_t>(probes, -1));
+    std::vector<std::vector<uint8_t>> probeBufs(count, std::vector<uint8_t>(options.probeSize));
+    size_t pendingResponses = 0;
+    bool firstEndpointAnswered = false;
+
+    // Sends probe seq to every endpoint of a family, with as few sendmmsg() calls as possible.
+    std::vector<mmsghdr> sendMsgs(count);
+    std::vector<iovec> sendIovs(count);
+    auto sendRound = [&](Family& family, uint16_t seq) {
+        size_t n = 0;
+        for (size_t i : family.endpoints) {
+            if ((*results)[i].error) continue;
+            buildProbe(&probeBufs[i], token, i, seq);
+            sendIovs[n] = {.iov_base = probeBufs[i].data(), .iov_len = probeBufs[i].size()};
+            sendMsgs[n] = {};
+            sendMsgs[n].msg_hdr.msg_name = const_cast<sockaddr_storage*>(&endpoints[i]);
+            sendMsgs[n].msg_hdr.msg_namelen = addrLen(endpoints[i]);
+            sendMsgs[n].msg_hdr.msg_iov = &sendIovs[n];
+            sendMsgs[n].msg_hdr.msg_iovlen = 1;
+            n++;
+        }
+        const int64_t now = realtimeUs();
+        size_t done = 0;
+        while (done < n) {
+            const int ret = sendmmsg(family.fd, &sendMsgs[done], n - done, 0);
+            if (ret <= 0) {
+                // A full buffer loses the probe. Other errors stop probing its endpoint.
+                const size_t i = static_cast<sockaddr_storage*>(sendMsgs[done].msg_hdr.msg_name) -
+                                 endpoints.data();
+                if (errno != EAGAIN && errno != ENOBUFS) (*results)[i].error = -errno;
+                done++;
+                continue;
+            }
+            for (int k = 0; k < ret; k++) {
+                const size_t i = static_cast<sockaddr_storage*>(
+                                         sendMsgs[done + k].msg_hdr.msg_name) -
+                                 endpoints.data();
+                txUs[i][seq] = now;
+                (*results)[i].sent++;
+                pendingResponses++;
+            }
+            done += ret;
+        }
+    };
+
+    // Reads all the responses that are queued on a socket.
+    std::vector<uint8_t> recvBufs(RECV_BATCH * MAX_RESPONSE_SIZE);
+    mmsghdr recvMsgs[RECV_BATCH];
+    iovec recvIovs[RECV_BATCH];
+    alignas(cmsghdr) uint8_t controls[RECV_BATCH][CMSG_SPACE(sizeof(timespec))];
+    auto receive = [&](int fd) {
+        while (true) {
+            for (int k = 0; k < RECV_BATCH; k++) {
+                recvIovs[k] = {.iov_base = &recvBufs[k * MAX_RESPONSE_SIZE],
+                               .iov_len = MAX_RESPONSE_SIZE};
+                recvMsgs[k] = {};
+                recvMsgs[k].msg_hdr.msg_iov = &recvIovs[k];
+                recvMsgs[k].msg_hdr.msg_iovlen = 1;
+                recvMsgs[k].msg_hdr.msg_control = controls[k];
+                recvMsgs[k].msg_hdr.msg_controllen = sizeof(controls[k]);
+            }
+            const int n = recvmmsg(fd, recvMsgs, RECV_BATCH, MSG_DONTWAIT, nullptr);
+            if (n <= 0) return;
+            const int64_t readUs = realtimeUs();
+            for (int k = 0; k < n; k++) {
+                uint32_t rxToken;
+                uint16_t i, seq;
+                if (!parseResponse(&recvBufs[k * MAX_RESPONSE_SIZE], recvMsgs[k].msg_len,
+                                   &rxToken, &i, &seq) ||
+                    rxToken != token || i >= count || seq >= probes || txUs[i][seq] < 0 ||
+                    rxUs[i][seq] >= 0) {
+                    continue;
+                }
+                rxUs[i][seq] = readUs;
+                for (cmsghdr* cmsg = CMSG_FIRSTHDR(&recvMsgs[k].msg_hdr); cmsg != nullptr;
+                     cmsg = CMSG_NXTHDR(&recvMsgs[k].msg_hdr, cmsg)) {
+                    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                        timespec ts;
+                        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                        rxUs[i][seq] = toUs(ts);
+                    }
+                }
+                pendingResponses--;
+                if (i == 0) firstEndpointAnswered = true;
+            }
+            if (n < RECV_BATCH) return;
+        }
+    };
+
+    using std::chrono::milliseconds;
+    using std::chrono::steady_clock;
+    auto nextRound = steady_clock::now();
+    steady_clock::time_point deadline;
+    size_t round = 0;
+    int ret = 0;
+    while (!(options.stopOnFirstResponse && firstEndpointAnswered)) {
+        auto now = steady_clock::now();
+        if (round < probes && now >= nextRound) {
+            for (Family& family : families) {
+                if (family.fd != -1) sendRound(family, round);
+            }
+            round++;
+            nextRound += milliseconds(options.intervalMs);
+            if (round == probes) deadline = now + milliseconds(options.timeoutMs);
+        }
+        if (round == probes && (now >= deadline || pendingResponses == 0)) break;
+
+        const auto wakeUp = (round < probes) ? nextRound : deadline;
+        const int waitMs = std::max<int64_t>(
+                std::chrono::ceil<milliseconds>(wakeUp - steady_clock::now()).count(), 0);
+        if (poll(pollFds.data(), pollFds.size(), waitMs) == -1 && errno != EINTR) {
+            ret = -errno;
+            break;
+        }
+        for (pollfd& pfd : pollFds) {
+            if (pfd.revents & POLLIN) receive(pfd.fd);
+        }
+    }
+
+    for (Family& family : families) {
+        if (family.fd != -1) close(family.fd);
+    }
+    for (size_t i = 0; i < count; i++) summarize(txUs[i], rxUs[i], &(*results)[i]);
+    return ret;
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <functional>
+#include <utility>
+#include <vector>
+
+namespace android {
+namespace net {
+
+struct ProbeOptions {
+    // Probes sent to each endpoint.
+    int probesPerEndpoint = 5;
+    // Time between two probes to the same endpoint.
+    int intervalMs = 100;
+    // Time to wait for responses after the last probe is sent.
+    int timeoutMs = 2000;
+    // The size of each probe. At least 1200 bytes, so that QUIC servers answer.
+    size_t probeSize = 1200;
+    // Stop as soon as the first endpoint, e.g. the preferred address of a host, answers a probe,
+    // instead of sending all the probes and waiting for all the responses. This takes one round
+    // trip instead of at least (probesPerEndpoint - 1) * intervalMs, but the statistics of all
+    // the endpoints are then based on fewer probes, and the probes still in flight count as lost.
+    bool stopOnFirstResponse = false;
+};
+
+struct ProbeResult {
+    int sent = 0;
+    int received = 0;
+    // Round trip times of the probes that were answered, in the order the probes were sent.
+    std::vector<int64_t> rttsUs;
+    int64_t minRttUs = 0;
+    int64_t medianRttUs = 0;
+    int64_t maxRttUs = 0;
+    // The mean absolute difference between the RTTs of consecutive answered probes (RFC 3393).
+    int64_t jitterUs = 0;
+    // 0, or the negative errno of the first send that failed.
+    int error = 0;
+
+    double loss() const { return sent ? 1.0 - static_cast<double>(received) / sent : 0; }
+};
+
+// Measures UDP reachability of several endpoints at once, e.g. all the addresses of a host on one
+// network.
+//
+// Probes are QUIC long header packets with a reserved version, which QUIC servers answer with a
+// version negotiation packet that carries the connection ID of the probe (see
+// draft-ietf-quic-invariants). UDP echo servers that send the probe back are also supported. The
+// connection ID identifies the run, the endpoint and the probe, so stray and duplicate responses
+// are ignored.
+//
+// One probe per endpoint is sent with each sendmmsg() call, one socket per address family, and
+// responses are read with recvmmsg(). RTTs use the kernel receive timestamp of each response.
+class UdpProbeEngine {
+  public:
+    // Called on each socket before it is used, e.g. to bind it to a network. Returns 0, or a
+    // negative errno.
+    using SocketSetup = std::function<int(int fd)>;
+
+    explicit UdpProbeEngine(SocketSetup setup) : mSetup(std::move(setup)) {}
+
+    // Probes the endpoints and fills one result per endpoint. Returns 0, or a negative errno if
+    // the probes could not be sent at all.
+    int run(const std::vector<sockaddr_storage>& endpoints, const ProbeOptions& options,
+            std::vector<ProbeResult>* results);
+
+  private:
+    SocketSetup mSetup;
+};
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,192 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "UdpProbeEngine.h"
+
+using android::net::ProbeOptions;
+using android::net::ProbeResult;
+using android::net::UdpProbeEngine;
+
+namespace {
+
+// A UDP server on the loopback interface that stands in for the endpoints of a network. It
+// sends every probe back, or answers it with a QUIC version negotiation packet, and can drop
+// some of them.
+class LocalUdpResponder {
+  public:
+    enum Mode { ECHO, VERSION_NEGOTIATION };
+
+    // Drops one probe out of dropEvery, if not 0.
+    LocalUdpResponder(int family, Mode mode, int dropEvery)
+        : mMode(mode), mDropEvery(dropEvery) {
+        mFd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        mStopFd = eventfd(0, EFD_CLOEXEC);
+        mAddr.ss_family = family;
+        if (family == AF_INET) {
+            reinterpret_cast<sockaddr_in*>(&mAddr)->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        } else {
+            reinterpret_cast<sockaddr_in6*>(&mAddr)->sin6_addr = in6addr_loopback;
+        }
+        socklen_t len = sizeof(mAddr);
+        EXPECT_EQ(0, bind(mFd, reinterpret_cast<sockaddr*>(&mAddr), sizeof(mAddr)));
+        EXPECT_EQ(0, getsockname(mFd, reinterpret_cast<sockaddr*>(&mAddr), &len));
+        mThread = std::thread(&LocalUdpResponder::serve, this);
+    }
+
+    ~LocalUdpResponder() {
+        const uint64_t one = 1;
+        EXPECT_EQ((ssize_t)sizeof(one), write(mStopFd, &one, sizeof(one)));
+        mThread.join();
+        close(mFd);
+        close(mStopFd);
+    }
+
+    const sockaddr_storage& address() const { return mAddr; }
+
+  private:
+    void serve() {
+        pollfd fds[] = {{.fd = mStopFd, .events = POLLIN, .revents = 0},
+                        {.fd = mFd, .events = POLLIN, .revents = 0}};
+        uint8_t buf[1500];
+        int received = 0;
+        while (poll(fds, 2, -1) > 0 && !fds[0].revents) {
+            sockaddr_storage peer;
+            socklen_t peerLen = sizeof(peer);
+            const ssize_t len = recvfrom(mFd, buf, sizeof(buf), 0,
+                                         reinterpret_cast<sockaddr*>(&peer), &peerLen);
+            if (len < 14) continue;
+            if (mDropEvery && ++received % mDropEvery == 0) continue;
+            if (mMode == ECHO) {
+                sendto(mFd, buf, len, 0, reinterpret_cast<sockaddr*>(&peer), peerLen);
+                continue;
+            }
+            // Version 0, no destination connection ID, the connection ID of the probe as the
+            // source connection ID, and one supported version.
+            uint8_t response[] = {0x80, 0, 0, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+            memcpy(response + 7, buf + 6, 8);
+            sendto(mFd, response, sizeof(response), 0, reinterpret_cast<sockaddr*>(&peer),
+                   peerLen);
+        }
+    }
+
+    const Mode mMode;
+    const int mDropEvery;
+    int mFd;
+    int mStopFd;
+    sockaddr_storage mAddr = {};
+    std::thread mThread;
+};
+
+ProbeOptions fastOptions() {
+    ProbeOptions options;
+    options.probesPerEndpoint = 10;
+    options.intervalMs = 1;
+    options.timeoutMs = 500;
+    return options;
+}
+
+int noSetup(int) {
+    return 0;
+}
+
+TEST(UdpProbeEngineTest, ProbesSeveralEndpointsAtOnce) {
+    LocalUdpResponder v4(AF_INET, LocalUdpResponder::ECHO, 0);
+    LocalUdpResponder v6(AF_INET6, LocalUdpResponder::VERSION_NEGOTIATION, 0);
+    LocalUdpResponder v4b(AF_INET, LocalUdpResponder::VERSION_NEGOTIATION, 0);
+
+    UdpProbeEngine engine(noSetup);
+    std::vector<ProbeResult> results;
+    ASSERT_EQ(0, engine.run({v4.address(), v6.address(), v4b.address()}, fastOptions(),
+                            &results));
+    ASSERT_EQ(3U, results.size());
+    for (const ProbeResult& result : results) {
+        EXPECT_EQ(0, result.error);
+        EXPECT_EQ(10, result.sent);
+        EXPECT_EQ(10, result.received);
+        EXPECT_EQ(10U, result.rttsUs.size());
+        EXPECT_EQ(0.0, result.loss());
+        EXPECT_LE(result.minRttUs, result.medianRttUs);
+        EXPECT_LE(result.medianRttUs, result.maxRttUs);
+        EXPECT_LT(result.maxRttUs, 500000);
+        EXPECT_LE(result.jitterUs, result.maxRttUs - result.minRttUs);
+    }
+}
+
+TEST(UdpProbeEngineTest, ReportsLoss) {
+    LocalUdpResponder lossy(AF_INET, LocalUdpResponder::ECHO, 2);
+    LocalUdpResponder silent(AF_INET, LocalUdpResponder::ECHO, 1);
+
+    UdpProbeEngine engine(noSetup);
+    std::vector<ProbeResult> results;
+    ASSERT_EQ(0, engine.run({lossy.address(), silent.address()}, fastOptions(), &results));
+    EXPECT_EQ(10, results[0].sent);
+    EXPECT_EQ(5, results[0].received);
+    EXPECT_EQ(0.5, results[0].loss());
+    EXPECT_EQ(10, results[1].sent);
+    EXPECT_EQ(0, results[1].received);
+    EXPECT_EQ(1.0, results[1].loss());
+    EXPECT_EQ(0, results[1].maxRttUs);
+}
+
+TEST(UdpProbeEngineTest, StopsOnFirstResponse) {
+    LocalUdpResponder best(AF_INET6, LocalUdpResponder::VERSION_NEGOTIATION, 0);
+    LocalUdpResponder other(AF_INET, LocalUdpResponder::ECHO, 0);
+
+    ProbeOptions options;
+    options.probesPerEndpoint = 10;
+    options.intervalMs = 100;
+    options.timeoutMs = 2000;
+    options.stopOnFirstResponse = true;
+    UdpProbeEngine engine(noSetup);
+    std::vector<ProbeResult> results;
+    const auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(0, engine.run({best.address(), other.address()}, options, &results));
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    // Without stopping, sending the probes alone takes 900ms.
+    EXPECT_LT(elapsed, std::chrono::milliseconds(options.intervalMs));
+    EXPECT_EQ(1, results[0].sent);
+    EXPECT_EQ(1, results[0].received);
+    EXPECT_EQ(1, results[1].sent);
+}
+
+TEST(UdpProbeEngineTest, SocketSetupFailure) {
+    LocalUdpResponder v4(AF_INET, LocalUdpResponder::ECHO, 0);
+
+    UdpProbeEngine engine([](int) { return -EPERM; });
+    std::vector<ProbeResult> results;
+    EXPECT_EQ(-EPERM, engine.run({v4.address()}, fastOptions(), &results));
+    EXPECT_EQ(-EPERM, results[0].error);
+    EXPECT_EQ(0, results[0].sent);
+
+    EXPECT_EQ(-EINVAL, engine.run({}, fastOptions(), &results));
+}
+
+}  // namespace
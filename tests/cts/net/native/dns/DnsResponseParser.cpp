@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsResponseParser.h"
+
+#include <arpa/nameser.h>
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+
+namespace android {
+namespace net {
+
+namespace {
+
+// TYPE, CLASS, TTL and RDLENGTH.
+constexpr size_t RR_FIXED_SIZE = 10;
+// TYPE and CLASS.
+constexpr size_t QUESTION_FIXED_SIZE = 4;
+
+}  // namespace
+
+int DnsResponseParser::init(const uint8_t* msg, size_t len) {
+    mMsg = msg;
+    mLen = len;
+    mAnswersOffset = mOffset = 0;
+    mAnswersLeft = 0;
+    if (len < NS_HEADER_SIZE || len > NS_MAXMSG) return -EBADMSG;
+
+    size_t offset = NS_HEADER_SIZE;
+    for (uint16_t i = 0; i < read16(4); i++) {
+        const int end = skipName(offset);
+        if (end < 0 || end + QUESTION_FIXED_SIZE > len) return -EBADMSG;
+        offset = end + QUESTION_FIXED_SIZE;
+    }
+    mAnswersOffset = offset;
+    rewind();
+    return 0;
+}
+
+int DnsResponseParser::nextAnswer(Record* record) {
+    if (mAnswersLeft == 0) return 0;
+    const int end = skipName(mOffset);
+    if (end < 0 || end + RR_FIXED_SIZE > mLen) {
+        mAnswersLeft = 0;
+        return -EBADMSG;
+    }
+    record->nameOffset = mOffset;
+    record->type = read16(end);
+    record->cls = read16(end + 2);
+    record->ttl = (static_cast<uint32_t>(read16(end + 4)) << 16) | read16(end + 6);
+    record->rdlength = read16(end + 8);
+    record->rdataOffset = end + RR_FIXED_SIZE;
+    if (record->rdataOffset + record->rdlength > mLen) {
+        mAnswersLeft = 0;
+        return -EBADMSG;
+    }
+    mOffset = record->rdataOffset + record->rdlength;
+    mAnswersLeft--;
+    return 1;
+}
+
+bool DnsResponseParser::getAddress(const Record& record, in_addr* addr) const {
+    if (record.type != ns_t_a || record.rdlength != sizeof(*addr)) return false;
+    memcpy(addr, mMsg + record.rdataOffset, sizeof(*addr));
+    return true;
+}
+
+bool DnsResponseParser::getAddress(const Record& record, in6_addr* addr) const {
+    if (record.type != ns_t_aaaa || record.rdlength != sizeof(*addr)) return false;
+    memcpy(addr, mMsg + record.rdataOffset, sizeof(*addr));
+    return true;
+}
+
+int DnsResponseParser::cnameTarget(const Record& record) const {
+    if (record.type != ns_t_cname) return -EBADMSG;
+    const int end = skipName(record.rdataOffset);
+    if (end < 0 || static_cast<size_t>(end) != record.rdataOffset + record.rdlength) {
+        return -EBADMSG;
+    }
+    return record.rdataOffset;
+}
+
+int DnsResponseParser::nameEquals(size_t offset1, size_t offset2) const {
+    NameCursor c1 = {.offset = offset1, .lowest = offset1, .nameLen = 0};
+    NameCursor c2 = {.offset = offset2, .lowest = offset2, .nameLen = 0};
+    while (true) {
+        const int len1 = readLabel(&c1);
+        const int len2 = readLabel(&c2);
+        if (len1 < 0 || len2 < 0) return -EBADMSG;
+        if (len1 != len2) return 0;
+        if (len1 == 0) return 1;
+        for (int i = 1; i <= len1; i++) {
+            if (tolower(mMsg[c1.offset + i]) != tolower(mMsg[c2.offset + i])) return 0;
+        }
+        c1.offset += 1 + len1;
+        c2.offset += 1 + len2;
+    }
+}
+
+int DnsResponseParser::expandName(size_t offset, char* out, size_t len) const {
+    NameCursor c = {.offset = offset, .lowest = offset, .nameLen = 0};
+    size_t written = 0;
+    while (true) {
+        const int labelLen = readLabel(&c);
+        if (labelLen < 0) return labelLen;
+        if (labelLen == 0) break;
+        const size_t needed = labelLen + (written > 0 ? 1 : 0);
+        if (written + needed + 1 > len) return -ENOSPC;
+        if (written > 0) out[written++] = '.';
+        memcpy(out + written, mMsg + c.offset + 1, labelLen);
+        written += labelLen;
+        c.offset += 1 + labelLen;
+    }
+    if (len == 0) return -ENOSPC;
+    out[written] = '\0';
+    return written;
+}
+
+int DnsResponseParser::canonicalName() {
+    if (read16(4) == 0) return -EBADMSG;
+    int name = questionNameOffset();
+    // Each step follows one CNAME record, so a longer chain has a loop.
+    for (int steps = 0; steps <= answerCount(); steps++) {
+        rewind();
+        Record record;
+        int ret;
+        bool followed = false;
+        while ((ret = nextAnswer(&record)) > 0) {
+            if (record.type != ns_t_cname) continue;
+            ret = nameEquals(record.nameOffset, name);
+            if (ret < 0) break;
+            if (ret == 0) continue;
+            ret = cnameTarget(record);
+            if (ret < 0) break;
+            name = ret;
+            followed = true;
+            break;
+        }
+        if (ret < 0) {
+            rewind();
+            return -EBADMSG;
+        }
+        if (!followed) {
+            rewind();
+            return name;
+        }
+    }
+    rewind();
+    return -EBADMSG;
+}
+
+int DnsResponseParser::skipName(size_t offset) const {
+    size_t nameLen = 0;
+    while (offset < mLen) {
+        const uint8_t len = mMsg[offset];
+        if ((len & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+            return (offset + 2 <= mLen) ? offset + 2 : -EBADMSG;
+        }
+        // The other label types are obsolete.
+        if (len & NS_CMPRSFLGS) return -EBADMSG;
+        nameLen += len + 1;
+        if (nameLen > NS_MAXCDNAME) return -EBADMSG;
+        offset += len + 1;
+        if (len == 0) return offset;
+    }
+    return -EBADMSG;
+}
+
+int DnsResponseParser::readLabel(NameCursor* cursor) const {
+    while (cursor->offset < mLen) {
+        const uint8_t len = mMsg[cursor->offset];
+        if ((len & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+            if (cursor->offset + 1 >= mLen) return -EBADMSG;
+            const size_t target = ((len & ~NS_CMPRSFLGS) << 8) | mMsg[cursor->offset + 1];
+            if (target >= cursor->lowest) return -EBADMSG;
+            cursor->offset = cursor->lowest = target;
+            continue;
+        }
+        if (len & NS_CMPRSFLGS) return -EBADMSG;
+        cursor->nameLen += len + 1;
+        if (cursor->nameLen > NS_MAXCDNAME || cursor->offset + 1 + len > mLen) return -EBADMSG;
+        return len;
+    }
+    return -EBADMSG;
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace android {
+namespace net {
+
+// Parses a DNS response in place, e.g. the buffer filled by android_res_nresult(), without
+// allocating or formatting anything.
+//
+// Names are referred to by their offset in the message. Following compression pointers is
+// bounded: a pointer must point before every part of the name read so far, and a name is at
+// most NS_MAXCDNAME long, so reading a name takes time linear in the size of the message.
+//
+// All methods that parse return 0 or a positive value on success, and -EBADMSG if the message is
+// malformed.
+class DnsResponseParser {
+  public:
+    struct Record {
+        size_t nameOffset;
+        uint16_t type;
+        uint16_t cls;
+        uint32_t ttl;
+        size_t rdataOffset;
+        uint16_t rdlength;
+    };
+
+    // Checks the header and skips the question. The message must outlive the parser.
+    int init(const uint8_t* msg, size_t len);
+
+    uint16_t id() const { return read16(0); }
+    int rcode() const { return mMsg[3] & 0x0f; }
+    bool truncated() const { return mMsg[2] & 0x02; }
+    uint16_t answerCount() const { return read16(6); }
+    // The name of the first question, if any.
+    size_t questionNameOffset() const { return NS_HEADER_SIZE; }
+
+    // Reads the next record of the answer section. Returns 1, 0 at the end, or -EBADMSG.
+    int nextAnswer(Record* record);
+    // Starts again from the first answer.
+    void rewind() {
+        mOffset = mAnswersOffset;
+        mAnswersLeft = answerCount();
+    }
+
+    // Copies the address of an A or AAAA record. Returns false if it is not one.
+    bool getAddress(const Record& record, in_addr* addr) const;
+    bool getAddress(const Record& record, in6_addr* addr) const;
+    // The offset of the target of a CNAME record, or -EBADMSG.
+    int cnameTarget(const Record& record) const;
+
+    // Compares two names case-insensitively. Returns 1 if equal, 0 if not, or -EBADMSG.
+    int nameEquals(size_t offset1, size_t offset2) const;
+    // Writes a name in dotted form, without the trailing dot, and returns its length, or
+    // -EBADMSG, or -ENOSPC if it does not fit in len - 1 characters.
+    int expandName(size_t offset, char* out, size_t len) const;
+
+    // Follows the CNAME chain of the question name through the answer section, and returns the
+    // offset of the name its addresses are for, or -EBADMSG. The chain is at most as long as the
+    // answer section.
+    int canonicalName();
+
+  private:
+    static constexpr size_t NS_HEADER_SIZE = 12;
+
+    struct NameCursor {
+        size_t offset;
+        // Pointers must point before this.
+        size_t lowest;
+        size_t nameLen;
+    };
+
+    uint16_t read16(size_t offset) const { return (mMsg[offset] << 8) | mMsg[offset + 1]; }
+    // Returns the offset just after the name at offset in the message, or -EBADMSG.
+    int skipName(size_t offset) const;
+    // Follows compression pointers to the next label of a name, and returns its length, 0 at the
+    // end of the name, or -EBADMSG. The label starts at cursor->offset + 1.
+    int readLabel(NameCursor* cursor) const;
+
+    const uint8_t* mMsg = nullptr;
+    size_t mLen = 0;
+    size_t mAnswersOffset = 0;
+    size_t mOffset = 0;
+    uint16_t mAnswersLeft = 0;
+};
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <errno.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DnsResponseParser.h"
+
+using android::net::DnsResponseParser;
+
+namespace {
+
+// www.example.com. AAAA, answered with
+//   www.example.com.  CNAME cdn.example.net.
+//   cdn.example.net.  CNAME edge.cdn.example.net.
+//   edge.cdn.example.net. AAAA 2001:db8::1
+//   edge.cdn.example.net. AAAA 2001:db8::2
+// using compression pointers.
+const std::vector<uint8_t> kResponse = {
+        // Header: ID, QR RD RA, QDCOUNT 1, ANCOUNT 4.
+        0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x04, 0x00, 0x00, 0x00, 0x00,
+        // 12: Question. www.example.com AAAA IN.
+        0x03, 'w', 'w', 'w', 0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x03, 'c', 'o', 'm', 0x00,
+        0x00, 0x1c, 0x00, 0x01,
+        // 33: www.example.com CNAME, TTL 60.
+        0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x11,
+        // 45: cdn.example.net
+        0x03, 'c', 'd', 'n', 0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 0x03, 'n', 'e', 't', 0x00,
+        // 62: cdn.example.net CNAME, TTL 300.
+        0xc0, 0x2d, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x07,
+        // 74: edge + pointer to cdn.example.net
+        0x04, 'e', 'd', 'g', 'e', 0xc0, 0x2d,
+        // 81: edge.cdn.example.net AAAA, TTL 20.
+        0xc0, 0x4a, 0x00, 0x1c, 0x00, 0x01, 0x00, 0x00, 0x00, 0x14, 0x00, 0x10,
+        0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x01,
+        // edge.cdn.example.net AAAA, TTL 20.
+        0xc0, 0x4a, 0x00, 0x1c, 0x00, 0x01, 0x00, 0x00, 0x00, 0x14, 0x00, 0x10,
+        0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x02,
+};
+
+std::string expand(const DnsResponseParser& parser, int offset) {
+    char name[NS_MAXDNAME];
+    const int len = parser.expandName(offset, name, sizeof(name));
+    return (len < 0) ? std::to_string(len) : std::string(name, len);
+}
+
+TEST(DnsResponseParserTest, ParsesAnswersInPlace) {
+    DnsResponseParser parser;
+    ASSERT_EQ(0, parser.init(kResponse.data(), kResponse.size()));
+    EXPECT_EQ(0x1234, parser.id());
+    EXPECT_EQ(ns_r_noerror, parser.rcode());
+    EXPECT_FALSE(parser.truncated());
+    EXPECT_EQ(4, parser.answerCount());
+
+    DnsResponseParser::Record record;
+    ASSERT_EQ(1, parser.nextAnswer(&record));
+    EXPECT_EQ(ns_t_cname, record.type);
+    EXPECT_EQ(60U, record.ttl);
+    EXPECT_EQ("www.example.com", expand(parser, record.nameOffset));
+    EXPECT_EQ("cdn.example.net", expand(parser, parser.cnameTarget(record)));
+
+    ASSERT_EQ(1, parser.nextAnswer(&record));
+    EXPECT_EQ(300U, record.ttl);
+    EXPECT_EQ("edge.cdn.example.net", expand(parser, parser.cnameTarget(record)));
+
+    std::vector<std::string> addresses;
+    while (parser.nextAnswer(&record) > 0) {
+        in6_addr addr;
+        ASSERT_TRUE(parser.getAddress(record, &addr));
+        in_addr addr4;
+        EXPECT_FALSE(parser.getAddress(record, &addr4));
+        char buf[INET6_ADDRSTRLEN];
+        addresses.push_back(inet_ntop(AF_INET6, &addr, buf, sizeof(buf)));
+    }
+    EXPECT_EQ((std::vector<std::string>{"2001:db8::1", "2001:db8::2"}), addresses);
+    EXPECT_EQ(0, parser.nextAnswer(&record));
+}
+
+TEST(DnsResponseParserTest, FollowsCnameChain) {
+    DnsResponseParser parser;
+    ASSERT_EQ(0, parser.init(kResponse.data(), kResponse.size()));
+    const int name = parser.canonicalName();
+    EXPECT_EQ("edge.cdn.example.net", expand(parser, name));
+
+    // Iteration starts again from the first answer.
+    DnsResponseParser::Record record;
+    ASSERT_EQ(1, parser.nextAnswer(&record));
+    EXPECT_EQ(ns_t_cname, record.type);
+
+    int addresses = 0;
+    while (parser.nextAnswer(&record) > 0) {
+        if (record.type == ns_t_aaaa && parser.nameEquals(record.nameOffset, name) == 1) {
+            addresses++;
+        }
+    }
+    EXPECT_EQ(2, addresses);
+}
+
+TEST(DnsResponseParserTest, ExpandNameChecksSpace) {
+    DnsResponseParser parser;
+    ASSERT_EQ(0, parser.init(kResponse.data(), kResponse.size()));
+    char name[16];
+    EXPECT_EQ(15, parser.expandName(12, name, sizeof(name)));
+    EXPECT_EQ(-ENOSPC, parser.expandName(12, name, 15));
+}
+
+TEST(DnsResponseParserTest, RejectsMalformedMessages) {
+    DnsResponseParser parser;
+    EXPECT_EQ(-EBADMSG, parser.init(kResponse.data(), 11));
+    // Truncated in the question.
+    EXPECT_EQ(-EBADMSG, parser.init(kResponse.data(), 30));
+
+    // Truncated in the rdata of the last answer.
+    ASSERT_EQ(0, parser.init(kResponse.data(), kResponse.size() - 1));
+    DnsResponseParser::Record record;
+    int ret;
+    while ((ret = parser.nextAnswer(&record)) > 0) {}
+    EXPECT_EQ(-EBADMSG, ret);
+
+    // The first CNAME target points to itself.
+    std::vector<uint8_t> loop = kResponse;
+    loop[45] = 0xc0;
+    loop[46] = 45;
+    ASSERT_EQ(0, parser.init(loop.data(), loop.size()));
+    ASSERT_EQ(1, parser.nextAnswer(&record));
+    EXPECT_EQ(-EBADMSG, parser.cnameTarget(record));
+    EXPECT_EQ(-EBADMSG, parser.canonicalName());
+
+    // The owner of the last answer points forward.
+    std::vector<uint8_t> forward = kResponse;
+    forward[forward.size() - 27] = forward.size() - 10;
+    ASSERT_EQ(0, parser.init(forward.data(), forward.size()));
+    for (int i = 0; i < 4; i++) ASSERT_EQ(1, parser.nextAnswer(&record));
+    char name[NS_MAXDNAME];
+    EXPECT_EQ(-EBADMSG, parser.expandName(record.nameOffset, name, sizeof(name)));
+}
+
+TEST(DnsResponseParserTest, RejectsCnameLoops) {
+    // a.test CNAME b.test, b.test CNAME a.test.
+    const std::vector<uint8_t> msg = {
+            0x00, 0x01, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+            // 12: a.test A IN
+            0x01, 'a', 0x04, 't', 'e', 's', 't', 0x00, 0x00, 0x01, 0x00, 0x01,
+            // 24: a.test CNAME b.test
+            0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04,
+            0x01, 'b', 0xc0, 0x0e,
+            // 40: b.test CNAME a.test
+            0xc0, 0x24, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x02,
+            0xc0, 0x0c,
+    };
+    DnsResponseParser parser;
+    ASSERT_EQ(0, parser.init(msg.data(), msg.size()));
+    EXPECT_EQ(-EBADMSG, parser.canonicalName());
+}
+
+}  // namespace
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsResultCollector.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#ifdef __ANDROID__
+#include <android/multinetwork.h>
+#endif
+
+namespace android {
+namespace net {
+
+namespace {
+
+// The largest answer android_res_nresult() can return.
+constexpr size_t MAXPACKET = 8 * 1024;
+constexpr int MAX_EVENTS = 64;
+
+}  // namespace
+
+#ifdef __ANDROID__
+DnsResultCollector::DnsResultCollector()
+    : DnsResultCollector(Backend{
+              .result =
+                      [](int fd, uint64_t, int* rcode, uint8_t* answer, size_t anslen) {
+                          return android_res_nresult(fd, rcode, answer, anslen);
+                      },
+              .cancel = [](int fd, uint64_t) { android_res_cancel(fd); },
+      }) {}
+#endif
+
+DnsResultCollector::~DnsResultCollector() {
+    while (!mQueries.empty()) cancel(mQueries.begin()->first);
+    if (mEpollFd != -1) close(mEpollFd);
+}
+
+int DnsResultCollector::init() {
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFd == -1) return -errno;
+    mAnswer.resize(MAXPACKET);
+    return 0;
+}
+
+int DnsResultCollector::add(int fd, uint64_t cookie, std::chrono::milliseconds timeout) {
+    const uint32_t generation = mNextGeneration++;
+    epoll_event event = {.events = EPOLLIN,
+                         .data = {.u64 = (static_cast<uint64_t>(generation) << 32) |
+                                         static_cast<uint32_t>(fd)}};
+    if (mEpollFd == -1 || epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        const int err = (mEpollFd == -1) ? EBADF : errno;
+        mBackend.cancel(fd, cookie);
+        return -err;
+    }
+    const Deadline deadline = std::chrono::steady_clock::now() + timeout;
+    mQueries[fd] = {.cookie = cookie, .deadline = deadline, .generation = generation};
+    mDeadlines.emplace(deadline, fd);
+    return 0;
+}
+
+bool DnsResultCollector::cancel(int fd) {
+    if (mQueries.find(fd) == mQueries.end()) return false;
+    const uint64_t cookie = remove(fd);
+    mBackend.cancel(fd, cookie);
+    return true;
+}
+
+uint64_t DnsResultCollector::remove(int fd) {
+    const auto it = mQueries.find(fd);
+    const Query query = it->second;
+    // Must happen before the backend closes fd, so that a query that later gets the same fd
+    // does not inherit its registration.
+    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, fd, nullptr);
+    mDeadlines.erase({query.deadline, fd});
+    mQueries.erase(it);
+    return query.cookie;
+}
+
+int DnsResultCollector::collect(int timeoutMs,
+                                const std::function<void(const Result&)>& onResult) {
+    if (mEpollFd == -1) return -EBADF;
+    if (mQueries.empty() && timeoutMs < 0) return 0;
+
+    if (!mDeadlines.empty()) {
+        const auto untilDeadline = mDeadlines.begin()->first - std::chrono::steady_clock::now();
+        // Round up, so that a query is not expired just before its deadline.
+        const int deadlineMs = std::max<int64_t>(
+                std::chrono::ceil<std::chrono::milliseconds>(untilDeadline).count(), 0);
+        timeoutMs = (timeoutMs < 0) ? deadlineMs : std::min(timeoutMs, deadlineMs);
+    }
+
+    epoll_event events[MAX_EVENTS];
+    const int n = epoll_wait(mEpollFd, events, MAX_EVENTS, timeoutMs);
+    if (n == -1) return (errno == EINTR) ? 0 : -errno;
+
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        const int fd = static_cast<uint32_t>(events[i].data.u64);
+        const uint32_t generation = events[i].data.u64 >> 32;
+        // Skip queries cancelled by onResult while handling an earlier event, including when a
+        // new query got the same fd since.
+        const auto it = mQueries.find(fd);
+        if (it == mQueries.end() || it->second.generation != generation) continue;
+        Result result = {.cookie = remove(fd), .len = 0, .rcode = -1, .answer = mAnswer.data()};
+        result.len = mBackend.result(fd, result.cookie, &result.rcode, mAnswer.data(),
+                                     mAnswer.size());
+        onResult(result);
+        count++;
+    }
+    return count + expire(onResult);
+}
+
+int DnsResultCollector::expire(const std::function<void(const Result&)>& onResult) {
+    const Deadline now = std::chrono::steady_clock::now();
+    int count = 0;
+    while (!mDeadlines.empty() && mDeadlines.begin()->first <= now) {
+        const int fd = mDeadlines.begin()->second;
+        const uint64_t cookie = remove(fd);
+        mBackend.cancel(fd, cookie);
+        onResult({.cookie = cookie, .len = -ETIMEDOUT, .rcode = -1, .answer = nullptr});
+        count++;
+    }
+    return count;
+}
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace android {
+namespace net {
+
+// Waits for the answers to many asynchronous DNS queries on one thread.
+//
+// The fds returned by android_res_nquery() or android_res_nsend() are added to one epoll set,
+// each with a deadline, and their answers are delivered in the order they arrive. Queries that
+// miss their deadline are cancelled with android_res_cancel().
+//
+// This class is not thread-safe. It owns the fds that are added to it: each one is eventually
+// closed by the result or cancel function of the backend, and must not be used by the caller.
+class DnsResultCollector {
+  public:
+    struct Backend {
+        // Reads the answer of a ready query and closes fd, like android_res_nresult(). Returns
+        // the length of the answer, or a negative errno.
+        std::function<int(int fd, uint64_t cookie, int* rcode, uint8_t* answer, size_t anslen)>
+                result;
+        // Abandons a query and closes fd, like android_res_cancel().
+        std::function<void(int fd, uint64_t cookie)> cancel;
+    };
+
+    struct Result {
+        // The cookie passed to add().
+        uint64_t cookie;
+        // The length of the answer, or a negative errno. -ETIMEDOUT if the deadline was missed.
+        int len;
+        int rcode;
+        // Only valid during the callback.
+        const uint8_t* answer;
+    };
+
+#ifdef __ANDROID__
+    // Uses android_res_nresult() and android_res_cancel().
+    DnsResultCollector();
+#endif
+    explicit DnsResultCollector(Backend backend) : mBackend(std::move(backend)) {}
+    // Cancels the pending queries.
+    ~DnsResultCollector();
+
+    DnsResultCollector(const DnsResultCollector&) = delete;
+    DnsResultCollector& operator=(const DnsResultCollector&) = delete;
+
+    // Returns 0, or a negative errno.
+    int init();
+
+    // Starts waiting for the answer of a query. The cookie identifies the query in its result.
+    // Returns 0, or a negative errno, in which case fd is cancelled.
+    int add(int fd, uint64_t cookie, std::chrono::milliseconds timeout);
+
+    // Cancels a pending query. Returns false if there is no such query.
+    bool cancel(int fd);
+
+    // Waits up to timeoutMs (-1 for the next deadline) for answers, and calls onResult for each
+    // query that completed or missed its deadline. Returns the number of results, or a negative
+    // errno.
+    int collect(int timeoutMs, const std::function<void(const Result&)>& onResult);
+
+    size_t pending() const { return mQueries.size(); }
+
+  private:
+    using Deadline = std::chrono::steady_clock::time_point;
+    struct Query {
+        uint64_t cookie;
+        Deadline deadline;
+        // Tells the query apart from earlier ones that had the same fd.
+        uint32_t generation;
+    };
+
+    // Removes a query from the epoll set and from the pending queries, and returns its cookie.
+    uint64_t remove(int fd);
+    int expire(const std::function<void(const Result&)>& onResult);
+
+    Backend mBackend;
+    int mEpollFd = -1;
+    std::unordered_map<int, Query> mQueries;
+    // Pending queries by deadline, to find the next one without a scan.
+    std::set<std::pair<Deadline, int>> mDeadlines;
+    std::vector<uint8_t> mAnswer;
+    uint32_t mNextGeneration = 0;
+};
+
+}  // namespace net
+}  // namespace android
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <set>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DnsResultCollector.h"
+
+using android::net::DnsResultCollector;
+using std::chrono::milliseconds;
+
+namespace {
+
+// Queries are socket pairs: the collector waits on one end, and the test answers a query by
+// writing its rcode to the other end.
+class DnsResultCollectorTest : public ::testing::Test {
+  protected:
+    DnsResultCollectorTest()
+        : mCollector({
+                  .result =
+                          [](int fd, uint64_t, int* rcode, uint8_t* answer, size_t anslen) {
+                              const int len = read(fd, answer, anslen);
+                              close(fd);
+                              if (len < 1) return -EBADMSG;
+                              *rcode = answer[0];
+                              return len;
+                          },
+                  .cancel =
+                          [this](int fd, uint64_t cookie) {
+                              mCancelled.insert(cookie);
+                              close(fd);
+                          },
+          }) {}
+
+    void SetUp() override { ASSERT_EQ(0, mCollector.init()); }
+
+    void TearDown() override {
+        for (int fd : mPeers) close(fd);
+    }
+
+    // Returns the fd the collector waits on.
+    int addQuery(uint64_t cookie, milliseconds timeout) {
+        int fds[2];
+        EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds));
+        mPeers.push_back(fds[1]);
+        EXPECT_EQ(0, mCollector.add(fds[0], cookie, timeout));
+        return fds[0];
+    }
+
+    void answer(uint64_t cookie, uint8_t rcode) {
+        EXPECT_EQ(1, write(mPeers[cookie], &rcode, 1));
+    }
+
+    std::vector<DnsResultCollector::Result> collect(int timeoutMs) {
+        std::vector<DnsResultCollector::Result> results;
+        EXPECT_LE(0, mCollector.collect(timeoutMs, [&](const DnsResultCollector::Result& r) {
+            results.push_back(r);
+        }));
+        return results;
+    }
+
+    std::set<uint64_t> mCancelled;
+    std::vector<int> mPeers;
+    DnsResultCollector mCollector;
+};
+
+TEST_F(DnsResultCollectorTest, DeliversAnswersAsTheyArrive) {
+    for (uint64_t i = 0; i < 3; i++) addQuery(i, milliseconds(10000));
+
+    answer(2, 3);
+    auto results = collect(1000);
+    ASSERT_EQ(1U, results.size());
+    EXPECT_EQ(2U, results[0].cookie);
+    EXPECT_EQ(1, results[0].len);
+    EXPECT_EQ(3, results[0].rcode);
+    EXPECT_EQ(2U, mCollector.pending());
+
+    answer(0, 0);
+    answer(1, 0);
+    results = collect(1000);
+    EXPECT_EQ(2U, results.size());
+    EXPECT_EQ(0U, mCollector.pending());
+    EXPECT_TRUE(mCancelled.empty());
+}
+
+TEST_F(DnsResultCollectorTest, ExpiresQueriesAtTheirDeadline) {
+    addQuery(0, milliseconds(20));
+    addQuery(1, milliseconds(10000));
+
+    // A negative timeout waits until the next deadline.
+    const auto results = collect(-1);
+    ASSERT_EQ(1U, results.size());
+    EXPECT_EQ(0U, results[0].cookie);
+    EXPECT_EQ(-ETIMEDOUT, results[0].len);
+    EXPECT_EQ(std::set<uint64_t>{0}, mCancelled);
+    EXPECT_EQ(1U, mCollector.pending());
+}
+
+TEST_F(DnsResultCollectorTest, Cancel) {
+    const int fd = addQuery(0, milliseconds(10000));
+    addQuery(1, milliseconds(10000));
+
+    EXPECT_TRUE(mCollector.cancel(fd));
+    EXPECT_FALSE(mCollector.cancel(fd));
+    EXPECT_EQ(std::set<uint64_t>{0}, mCancelled);
+
+    answer(1, 0);
+    const auto results = collect(1000);
+    ASSERT_EQ(1U, results.size());
+    EXPECT_EQ(1U, results[0].cookie);
+    EXPECT_EQ(0U, mCollector.pending());
+}
+
+}  // namespace
@@ -0,0 +1,298 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "LocalDnsResponder.h"
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace android {
+namespace net {
+
+namespace {
+
+constexpr size_t kMaxUdpMessage = 512;
+constexpr size_t kMaxTcpMessage = 65535;
+constexpr uint32_t kTtl = 300;
+
+uint16_t readU16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+void appendU16(std::vector<uint8_t>* out, uint16_t value) {
+    out->push_back(value >> 8);
+    out->push_back(value & 0xff);
+}
+
+void appendU32(std::vector<uint8_t>* out, uint32_t value) {
+    appendU16(out, value >> 16);
+    appendU16(out, value & 0xffff);
+}
+
+bool endsWith(const std::string& s, const std::string& suffix) {
+    return s.size() >= suffix.size() &&
+           s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+}  // namespace
+
+int LocalDnsResponder::start() {
+    mStopFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (mStopFd == -1) return -errno;
+
+    // The ephemeral UDP port may already be used by TCP, e.g. by connections to a previous
+    // responder that are in TIME_WAIT. SO_REUSEADDR only helps with the latter, so retry.
+    int err = EADDRINUSE;
+    for (int attempt = 0; attempt < 10 && err == EADDRINUSE; attempt++) {
+        if (mUdpFd != -1) close(mUdpFd);
+        if (mTcpFd != -1) close(mTcpFd);
+        mUdpFd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        mTcpFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (mUdpFd == -1 || mTcpFd == -1) return -errno;
+
+        static constexpr int on = 1;
+        mAddress = {};
+        mAddress.sin_family = AF_INET;
+        mAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(mAddress);
+        err = 0;
+        if (setsockopt(mTcpFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+            bind(mUdpFd, reinterpret_cast<sockaddr*>(&mAddress), sizeof(mAddress)) ||
+            getsockname(mUdpFd, reinterpret_cast<sockaddr*>(&mAddress), &len) ||
+            bind(mTcpFd, reinterpret_cast<sockaddr*>(&mAddress), sizeof(mAddress)) ||
+            listen(mTcpFd, SOMAXCONN)) {
+            err = errno;
+        }
+    }
+    if (err) return -err;
+
+    mThread = std::thread(&LocalDnsResponder::serve, this);
+    return 0;
+}
+
+void LocalDnsResponder::stop() {
+    if (mThread.joinable()) {
+        const uint64_t one = 1;
+        write(mStopFd, &one, sizeof(one));
+        mThread.join();
+    }
+    for (const auto& [fd, unused] : mTcpConnections) close(fd);
+    mTcpConnections.clear();
+    mPending.clear();
+    for (int* fd : {&mUdpFd, &mTcpFd, &mStopFd}) {
+        if (*fd != -1) close(*fd);
+        *fd = -1;
+    }
+}
+
+void LocalDnsResponder::serve() {
+    std::vector<pollfd> fds;
+    while (true) {
+        fds.clear();
+        fds.push_back({.fd = mStopFd, .events = POLLIN, .revents = 0});
+        fds.push_back({.fd = mUdpFd, .events = POLLIN, .revents = 0});
+        fds.push_back({.fd = mTcpFd, .events = POLLIN, .revents = 0});
+        for (const auto& [fd, unused] : mTcpConnections) {
+            fds.push_back({.fd = fd, .events = POLLIN, .revents = 0});
+        }
+
+        int timeoutMs = -1;
+        if (!mPending.empty()) {
+            const auto wait = mPending.front().due - std::chrono::steady_clock::now();
+            // Round up, so that responses are never sent early.
+            const auto waitMs = std::chrono::ceil<std::chrono::milliseconds>(wait).count();
+            timeoutMs = std::max<int64_t>(waitMs, 0);
+        }
+        if (poll(fds.data(), fds.size(), timeoutMs) == -1 && errno != EINTR) return;
+
+        if (fds[0].revents) return;
+        if (fds[1].revents & POLLIN) onUdpReadable();
+        if (fds[2].revents & POLLIN) onTcpAccept();
+        for (size_t i = 3; i < fds.size(); i++) {
+            if (!fds[i].revents || onTcpReadable(fds[i].fd)) continue;
+            const int fd = fds[i].fd;
+            mPending.erase(std::remove_if(mPending.begin(), mPending.end(),
+                                          [fd](const PendingResponse& r) { return r.fd == fd; }),
+                           mPending.end());
+            mTcpConnections.erase(fd);
+            close(fd);
+        }
+        sendDue();
+    }
+}
+
+void LocalDnsResponder::onUdpReadable() {
+    uint8_t buf[kMaxUdpMessage];
+    while (true) {
+        sockaddr_in peer;
+        socklen_t peerLen = sizeof(peer);
+        const ssize_t len = recvfrom(mUdpFd, buf, sizeof(buf), 0,
+                                     reinterpret_cast<sockaddr*>(&peer), &peerLen);
+        if (len < 0) return;
+        mUdpQueries++;
+        std::vector<uint8_t> response = makeResponse(buf, len, true /* udp */);
+        if (!response.empty()) queue(mUdpFd, peer, std::move(response));
+    }
+}
+
+void LocalDnsResponder::onTcpAccept() {
+    while (true) {
+        const int fd = accept4(mTcpFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+        mTcpConnections[fd];
+    }
+}
+
+bool LocalDnsResponder::onTcpReadable(int fd) {
+    std::vector<uint8_t>& received = mTcpConnections[fd];
+    uint8_t buf[4096];
+    while (true) {
+        const ssize_t len = read(fd, buf, sizeof(buf));
+        if (len == 0) return false;
+        if (len < 0) {
+            if (errno != EAGAIN) return false;
+            break;
+        }
+        received.insert(received.end(), buf, buf + len);
+    }
+
+    // Queries are preceded by their length. See RFC 1035 4.2.2.
+    size_t offset = 0;
+    while (received.size() - offset >= 2) {
+        const size_t len = readU16(&received[offset]);
+        if (received.size() - offset - 2 < len) break;
+        mTcpQueries++;
+        std::vector<uint8_t> response =
+                makeResponse(&received[offset + 2], len, false /* udp */);
+        if (!response.empty()) {
+            std::vector<uint8_t> framed;
+            appendU16(&framed, response.size());
+            framed.insert(framed.end(), response.begin(), response.end());
+            queue(fd, {}, std::move(framed));
+        }
+        offset += 2 + len;
+    }
+    received.erase(received.begin(), received.begin() + offset);
+    return true;
+}
+
+void LocalDnsResponder::queue(int fd, const sockaddr_in& peer, std::vector<uint8_t> message) {
+    mPending.push_back({
+            .due = std::chrono::steady_clock::now() + mOptions.latency,
+            .fd = fd,
+            .peer = peer,
+            .message = std::move(message),
+    });
+}
+
+void LocalDnsResponder::sendDue() {
+    const auto now = std::chrono::steady_clock::now();
+    while (!mPending.empty() && mPending.front().due <= now) {
+        const PendingResponse& r = mPending.front();
+        if (r.fd == mUdpFd) {
+            sendto(r.fd, r.message.data(), r.message.size(), 0,
+                   reinterpret_cast<const sockaddr*>(&r.peer), sizeof(r.peer));
+        } else {
+            // Responses are small, so they fit in the socket buffer of a connection that reads
+            // them. Others are dropped.
+            send(r.fd, r.message.data(), r.message.size(), MSG_NOSIGNAL);
+        }
+        mPending.pop_front();
+    }
+}
+
+// Returns an empty response for queries that should not be answered.
+std::vector<uint8_t> LocalDnsResponder::makeResponse(const uint8_t* query, size_t len,
+                                                     bool udp) const {
+    if (len < NS_HFIXEDSZ || len > kMaxTcpMessage) return {};
+    const uint8_t flags1 = query[2];
+    if (flags1 & 0x80) return {};  // Not a query.
+
+    // The question, which must be the only one.
+    uint16_t rcode = ns_r_noerror;
+    std::string name;
+    size_t offset = NS_HFIXEDSZ;
+    while (true) {
+        if (offset >= len) return {};
+        const uint8_t labelLen = query[offset++];
+        if (labelLen == 0) break;
+        // Queries have no compression pointers.
+        if (labelLen > NS_MAXLABEL || offset + labelLen > len) return {};
+        if (!name.empty()) name += '.';
+        name.append(reinterpret_cast<const char*>(&query[offset]), labelLen);
+        offset += labelLen;
+    }
+    if (readU16(&query[4]) != 1 || offset + 2 * NS_INT16SZ > len) {
+        rcode = ns_r_formerr;
+        offset = NS_HFIXEDSZ;
+    }
+    const size_t questionEnd = (rcode == ns_r_noerror) ? offset + 2 * NS_INT16SZ : NS_HFIXEDSZ;
+    const uint16_t type = (rcode == ns_r_noerror) ? readU16(&query[offset]) : 0;
+
+    if (rcode == ns_r_noerror && endsWith("." + name, mOptions.nxdomainSuffix)) {
+        rcode = ns_r_nxdomain;
+    }
+    const bool truncated = udp && mOptions.truncateUdp;
+
+    std::vector<uint8_t> answer;
+    uint16_t ancount = 0;
+    if (rcode == ns_r_noerror && !truncated && (type == ns_t_a || type == ns_t_aaaa)) {
+        appendU16(&answer, 0xc000 | NS_HFIXEDSZ);  // Pointer to the name of the question.
+        appendU16(&answer, type);
+        appendU16(&answer, ns_c_in);
+        appendU32(&answer, kTtl);
+        if (type == ns_t_a) {
+            in_addr addr;
+            inet_pton(AF_INET, "192.0.2.1", &addr);
+            appendU16(&answer, sizeof(addr));
+            answer.insert(answer.end(), reinterpret_cast<uint8_t*>(&addr),
+                          reinterpret_cast<uint8_t*>(&addr) + sizeof(addr));
+        } else {
+            in6_addr addr;
+            inet_pton(AF_INET6, "2001:db8::1", &addr);
+            appendU16(&answer, sizeof(addr));
+            answer.insert(answer.end(), reinterpret_cast<uint8_t*>(&addr),
+                          reinterpret_cast<uint8_t*>(&addr) + sizeof(addr));
+        }
+        ancount = 1;
+    }
+
+    std::vector<uint8_t> response;
+    response.reserve(questionEnd + answer.size());
+    response.insert(response.end(), query, query + 2);  // ID
+    // QR, the opcode and RD of the query, and TC.
+    response.push_back(0x80 | (flags1 & 0x79) | (truncated ? 0x02 : 0));
+    response.push_back(0x80 | rcode);  // RA
+    appendU16(&response, questionEnd > NS_HFIXEDSZ ? 1 : 0);
+    appendU16(&response, ancount);
+    appendU16(&response, 0);  // NSCOUNT
+    appendU16(&response, 0);  // ARCOUNT
+    response.insert(response.end(), query + NS_HFIXEDSZ, query + questionEnd);
+    response.insert(response.end(), answer.begin(), answer.end());
+    return response;
+}
+
+}  // namespace net
+}  // namespace android
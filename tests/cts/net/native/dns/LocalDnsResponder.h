@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace android {
+namespace net {
+
+// A DNS server on the loopback interface that answers every query locally, so that DNS clients
+// can be tested and benchmarked without network access.
+//
+// A and AAAA queries are answered with 192.0.2.1 and 2001:db8::1 (RFC 5737 and RFC 3849
+// documentation addresses), other types with an empty answer. Queries for names under
+// nxdomainSuffix get NXDOMAIN. The server listens on the same port for UDP and TCP.
+class LocalDnsResponder {
+  public:
+    struct Options {
+        // Delay before each response is sent.
+        std::chrono::microseconds latency{0};
+        // Answer UDP queries with the TC bit set and no records, so that clients retry over TCP.
+        bool truncateUdp = false;
+        std::string nxdomainSuffix = ".nx.test";
+    };
+
+    explicit LocalDnsResponder(const Options& options) : mOptions(options) {}
+    ~LocalDnsResponder() { stop(); }
+
+    // Starts serving on 127.0.0.1 on an ephemeral port. Returns 0, or a negative errno.
+    int start();
+    void stop();
+
+    const sockaddr_in& address() const { return mAddress; }
+    uint64_t udpQueries() const { return mUdpQueries; }
+    uint64_t tcpQueries() const { return mTcpQueries; }
+
+  private:
+    struct PendingResponse {
+        std::chrono::steady_clock::time_point due;
+        int fd;  // The UDP socket, or a TCP connection.
+        sockaddr_in peer;
+        std::vector<uint8_t> message;
+    };
+
+    void serve();
+    void onUdpReadable();
+    void onTcpAccept();
+    // Returns false if the connection was closed.
+    bool onTcpReadable(int fd);
+    void queue(int fd, const sockaddr_in& peer, std::vector<uint8_t> message);
+    void sendDue();
+    std::vector<uint8_t> makeResponse(const uint8_t* query, size_t len, bool udp) const;
+
+    const Options mOptions;
+    sockaddr_in mAddress = {};
+    int mUdpFd = -1;
+    int mTcpFd = -1;
+    int mStopFd = -1;
+    std::thread mThread;
+    std::atomic<uint64_t> mUdpQueries{0};
+    std::atomic<uint64_t> mTcpQueries{0};
+    // The following are only used on mThread.
+    // TCP connections and the bytes they received that do not make a whole query yet.
+    std::map<int, std::vector<uint8_t>> mTcpConnections;
+    // Sorted by due time, since the latency is the same for all responses.
+    std::deque<PendingResponse> mPending;
+};
+
+}  // namespace net
+}  // namespace android
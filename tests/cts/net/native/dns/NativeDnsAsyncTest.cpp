@@ -29,6 +29,8 @@
 #include <android/multinetwork.h>
 #include <gtest/gtest.h>
 
+#include "DnsResultCollector.h"
+
 namespace {
 constexpr int MAXPACKET = 8 * 1024;
 constexpr int PTON_MAX = 16;
@@ -202,6 +204,33 @@ TEST (NativeDnsAsyncTest, Async_Cancel) {
     // otherwise it will hit fdsan double-close fd.
 }
 
+TEST (NativeDnsAsyncTest, Async_Collect) {
+    android::net::DnsResultCollector collector;
+    ASSERT_EQ(0, collector.init());
+
+    const char* names[] = {"www.google.com", "www.youtube.com", "www.googleapis.com",
+                           "play.googleapis.com"};
+    const int types[] = {ns_t_a, ns_t_aaaa};
+    uint64_t cookie = 0;
+    for (const char* name : names) {
+        for (int type : types) {
+            int fd = android_res_nquery(NETWORK_UNSPECIFIED, name, ns_c_in, type, 0);
+            ASSERT_GE(fd, 0);
+            EXPECT_EQ(0, collector.add(fd, cookie++, std::chrono::milliseconds(TIMEOUT_MS)));
+        }
+    }
+
+    std::vector<bool> answered(cookie);
+    while (collector.pending() > 0) {
+        ASSERT_LE(0, collector.collect(-1, [&](const android::net::DnsResultCollector::Result& r) {
+            EXPECT_GE(r.len, 0);
+            EXPECT_EQ(ns_r_noerror, r.rcode);
+            answered[r.cookie] = true;
+        }));
+    }
+    EXPECT_EQ(std::vector<bool>(cookie, true), answered);
+}
+
 TEST (NativeDnsAsyncTest, Async_Query_MALFORMED) {
     // Empty string to create BLOB and query, we will get empty result and rcode = 0
     // on DNSTLS.
@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of asynchronous DNS queries against LocalDnsResponder, so that the results do not
+// depend on the network.
+//
+// android_res_nsend() always goes through the resolver of the network and cannot be pointed at
+// a local server, so the queries are made by localResNsend() and localResNresult() below, which
+// follow the same contract: the send call returns an fd to poll, and the result call reads the
+// answer and closes the fd. Answers are collected by DnsResultCollector. This measures the cost
+// of the asynchronous flow and of the server at increasing concurrency, with configurable
+// latency, NXDOMAIN and truncation.
+//
+// The BM_Parse* benchmarks compare DnsResponseParser with ns_parserr() on the same answers.
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <errno.h>
+#include <resolv.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "DnsResponseParser.h"
+#include "DnsResultCollector.h"
+#include "LocalDnsResponder.h"
+
+using android::net::DnsResponseParser;
+using android::net::DnsResultCollector;
+using android::net::LocalDnsResponder;
+using std::chrono::steady_clock;
+
+namespace {
+
+constexpr std::chrono::milliseconds TIMEOUT(10000);
+
+enum Mode : int64_t { MODE_NOERROR, MODE_NXDOMAIN, MODE_TRUNCATED };
+
+// Sends a query to the server over UDP. Returns a socket to poll for the answer, or a negative
+// errno.
+int localResNsend(const sockaddr_in& server, const uint8_t* msg, size_t msglen) {
+    const int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -errno;
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&server), sizeof(server)) ||
+        send(fd, msg, msglen, 0) != static_cast<ssize_t>(msglen)) {
+        const int err = errno;
+        close(fd);
+        return -err;
+    }
+    return fd;
+}
+
+// Retries a query over TCP, as resolvers do when the UDP answer is truncated. This blocks, so
+// with truncation the answers that are ready are read one TCP round trip after another.
+int tcpQuery(const sockaddr_in& server, const uint8_t* msg, size_t msglen, uint8_t* answer,
+             size_t anslen) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return -errno;
+    std::vector<uint8_t> framed = {static_cast<uint8_t>(msglen >> 8),
+                                   static_cast<uint8_t>(msglen & 0xff)};
+    framed.insert(framed.end(), msg, msg + msglen);
+
+    int ret = 0;
+    uint8_t lenBuf[2];
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&server), sizeof(server)) ||
+        send(fd, framed.data(), framed.size(), MSG_NOSIGNAL) !=
+                static_cast<ssize_t>(framed.size()) ||
+        recv(fd, lenBuf, sizeof(lenBuf), MSG_WAITALL) != sizeof(lenBuf)) {
+        ret = -(errno ? errno : EBADMSG);
+    } else {
+        const size_t len = (lenBuf[0] << 8) | lenBuf[1];
+        if (len > anslen) {
+            ret = -EMSGSIZE;
+        } else if (recv(fd, answer, len, MSG_WAITALL) != static_cast<ssize_t>(len)) {
+            ret = -EBADMSG;
+        } else {
+            ret = len;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+// Reads the answer to a query sent by localResNsend() and closes fd. Returns the length of the
+// answer, or a negative errno.
+int localResNresult(int fd, const sockaddr_in& server, const uint8_t* msg, size_t msglen,
+                    int* rcode, uint8_t* answer, size_t anslen) {
+    int len = recv(fd, answer, anslen, 0);
+    if (len < 0) len = -errno;
+    close(fd);
+    if (len >= 0 && len < NS_HFIXEDSZ) len = -EBADMSG;
+    if (len > 0 && (answer[2] & 0x02)) len = tcpQuery(server, msg, msglen, answer, anslen);
+    if (len < 0) return len;
+    *rcode = answer[3] & 0x0f;
+    return len;
+}
+
+// Builds a recursive query for one name, without relying on res_mkquery(), which is not part of
+// the public API of bionic.
+std::vector<uint8_t> makeQuery(uint16_t id, const std::string& name, uint16_t type) {
+    std::vector<uint8_t> query = {
+            static_cast<uint8_t>(id >> 8), static_cast<uint8_t>(id & 0xff),
+            0x01, 0x00,  // RD
+            0x00, 0x01,  // QDCOUNT
+            0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    };
+    size_t start = 0;
+    while (start < name.size()) {
+        const size_t end = std::min(name.find('.', start), name.size());
+        query.push_back(end - start);
+        query.insert(query.end(), name.begin() + start, name.begin() + end);
+        start = end + 1;
+    }
+    query.push_back(0);
+    query.insert(query.end(), {static_cast<uint8_t>(type >> 8), static_cast<uint8_t>(type & 0xff),
+                               0x00, ns_c_in});
+    return query;
+}
+
+uint64_t percentile(std::vector<uint64_t>* samples, int percent) {
+    if (samples->empty()) return 0;
+    const size_t n = (samples->size() - 1) * percent / 100;
+    std::nth_element(samples->begin(), samples->begin() + n, samples->end());
+    return (*samples)[n];
+}
+
+// Args: the number of queries in flight, the latency of the server in microseconds, and Mode.
+// Each iteration sends as many queries as can be in flight and waits for all their answers.
+void BM_Query(benchmark::State& state) {
+    const size_t concurrency = state.range(0);
+    const Mode mode = static_cast<Mode>(state.range(2));
+    LocalDnsResponder::Options options;
+    options.latency = std::chrono::microseconds(state.range(1));
+    options.truncateUdp = (mode == MODE_TRUNCATED);
+    LocalDnsResponder responder(options);
+    if (int err = responder.start()) {
+        state.SkipWithError(strerror(-err));
+        return;
+    }
+    const int expectedRcode = (mode == MODE_NXDOMAIN) ? ns_r_nxdomain : ns_r_noerror;
+
+    // Each query has its own name, as different apps would.
+    std::vector<std::vector<uint8_t>> queries(concurrency);
+    for (size_t i = 0; i < concurrency; i++) {
+        const std::string name =
+                "host" + std::to_string(i) + ((mode == MODE_NXDOMAIN) ? ".nx.test" : ".test");
+        queries[i] = makeQuery(i, name, ns_t_aaaa);
+    }
+
+    DnsResultCollector collector({
+            .result =
+                    [&](int fd, uint64_t cookie, int* rcode, uint8_t* answer, size_t anslen) {
+                        return localResNresult(fd, responder.address(), queries[cookie].data(),
+                                               queries[cookie].size(), rcode, answer, anslen);
+                    },
+            .cancel = [](int fd, uint64_t) { close(fd); },
+    });
+    if (int err = collector.init()) {
+        state.SkipWithError(strerror(-err));
+        return;
+    }
+
+    std::vector<steady_clock::time_point> sent(concurrency);
+    std::vector<uint64_t> latencies;
+    bool ok = true;
+    const auto onResult = [&](const DnsResultCollector::Result& result) {
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                    steady_clock::now() - sent[result.cookie])
+                                    .count());
+        ok = ok && result.len >= 0 && result.rcode == expectedRcode;
+    };
+    for (auto _ : state) {
+        for (size_t i = 0; i < concurrency; i++) {
+            sent[i] = steady_clock::now();
+            const int fd = localResNsend(responder.address(), queries[i].data(), queries[i].size());
+            const int err = (fd < 0) ? fd : collector.add(fd, i, TIMEOUT);
+            if (err) {
+                state.SkipWithError(strerror(-err));
+                return;
+            }
+        }
+        while (collector.pending() > 0) {
+            const int ret = collector.collect(-1, onResult);
+            if (ret < 0) {
+                state.SkipWithError(strerror(-ret));
+                return;
+            }
+        }
+        if (!ok) {
+            state.SkipWithError("Unexpected answer");
+            return;
+        }
+    }
+
+    state.SetItemsProcessed(state.iterations() * concurrency);
+    state.counters["p50_us"] = percentile(&latencies, 50) / 1000.0;
+    state.counters["p99_us"] = percentile(&latencies, 99) / 1000.0;
+    state.counters["tcp_queries"] = responder.tcpQueries();
+}
+
+void QueryArgs(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"concurrency", "latency_us", "mode"});
+    for (int64_t mode : {MODE_NOERROR, MODE_NXDOMAIN, MODE_TRUNCATED}) {
+        for (int64_t latencyUs : {0, 1000}) {
+            for (int64_t concurrency : {1, 8, 32, 128}) {
+                b->Args({concurrency, latencyUs, mode});
+            }
+        }
+    }
+}
+
+BENCHMARK(BM_Query)->Apply(QueryArgs)->UseRealTime();
+
+// A response to an AAAA query for host.test, with a CNAME to cdn.test and then AAAA records.
+std::vector<uint8_t> makeResponse(size_t addresses) {
+    std::vector<uint8_t> response = makeQuery(1, "host.test", ns_t_aaaa);
+    response[2] |= 0x80;  // QR
+    response[7] = 1 + addresses;
+    // host.test CNAME cdn.test, with the name of the question compressed.
+    response.insert(response.end(), {0xc0, NS_HFIXEDSZ, 0x00, ns_t_cname, 0x00, ns_c_in,
+                                     0x00, 0x00, 0x01, 0x2c, 0x00, 0x06});
+    const uint8_t cdnOffset = response.size();
+    response.insert(response.end(), {0x03, 'c', 'd', 'n', 0xc0, NS_HFIXEDSZ + 5});
+    for (size_t i = 0; i < addresses; i++) {
+        response.insert(response.end(), {0xc0, cdnOffset, 0x00, ns_t_aaaa, 0x00, ns_c_in,
+                                         0x00, 0x00, 0x01, 0x2c, 0x00, 0x10,
+                                         0x20, 0x01, 0x0d, 0xb8, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                         0, static_cast<uint8_t>(i)});
+    }
+    return response;
+}
+
+// The way NativeDnsAsyncTest reads answers: ns_parserr() for each record, then inet_ntop().
+void BM_ParseNsParserrNtop(benchmark::State& state) {
+    const std::vector<uint8_t> response = makeResponse(state.range(0));
+    for (auto _ : state) {
+        ns_msg handle;
+        if (ns_initparse(response.data(), response.size(), &handle) < 0) {
+            state.SkipWithError("ns_initparse failed");
+            return;
+        }
+        std::vector<std::string> answers;
+        for (int i = 0; i < ns_msg_count(handle, ns_s_an); i++) {
+            ns_rr rr;
+            if (ns_parserr(&handle, ns_s_an, i, &rr) < 0 || ns_rr_type(rr) != ns_t_aaaa) continue;
+            char buffer[INET6_ADDRSTRLEN];
+            if (inet_ntop(AF_INET6, ns_rr_rdata(rr), buffer, sizeof(buffer))) {
+                answers.push_back(buffer);
+            }
+        }
+        benchmark::DoNotOptimize(answers.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// The same without formatting: ns_parserr() expands the owner name of every record.
+void BM_ParseNsParserr(benchmark::State& state) {
+    const std::vector<uint8_t> response = makeResponse(state.range(0));
+    for (auto _ : state) {
+        ns_msg handle;
+        if (ns_initparse(response.data(), response.size(), &handle) < 0) {
+            state.SkipWithError("ns_initparse failed");
+            return;
+        }
+        for (int i = 0; i < ns_msg_count(handle, ns_s_an); i++) {
+            ns_rr rr;
+            if (ns_parserr(&handle, ns_s_an, i, &rr) < 0 || ns_rr_type(rr) != ns_t_aaaa) continue;
+            in6_addr addr;
+            memcpy(&addr, ns_rr_rdata(rr), sizeof(addr));
+            benchmark::DoNotOptimize(addr);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_ParseInPlace(benchmark::State& state) {
+    const std::vector<uint8_t> response = makeResponse(state.range(0));
+    for (auto _ : state) {
+        DnsResponseParser parser;
+        if (parser.init(response.data(), response.size())) {
+            state.SkipWithError("init failed");
+            return;
+        }
+        DnsResponseParser::Record record;
+        while (parser.nextAnswer(&record) > 0) {
+            in6_addr addr;
+            if (parser.getAddress(record, &addr)) benchmark::DoNotOptimize(addr);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// Also follows the CNAME chain and checks that each address is for its end.
+void BM_ParseInPlaceCanonical(benchmark::State& state) {
+    const std::vector<uint8_t> response = makeResponse(state.range(0));
+    for (auto _ : state) {
+        DnsResponseParser parser;
+        int name;
+        if (parser.init(response.data(), response.size()) || (name = parser.canonicalName()) < 0) {
+            state.SkipWithError("Parsing failed");
+            return;
+        }
+        DnsResponseParser::Record record;
+        while (parser.nextAnswer(&record) > 0) {
+            in6_addr addr;
+            if (parser.getAddress(record, &addr) &&
+                parser.nameEquals(record.nameOffset, name) == 1) {
+                benchmark::DoNotOptimize(addr);
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+BENCHMARK(BM_ParseNsParserrNtop)->Arg(1)->Arg(8)->Arg(32);
+BENCHMARK(BM_ParseNsParserr)->Arg(1)->Arg(8)->Arg(32);
+BENCHMARK(BM_ParseInPlace)->Arg(1)->Arg(8)->Arg(32);
+BENCHMARK(BM_ParseInPlaceCanonical)->Arg(1)->Arg(8)->Arg(32);
+
+}  // namespace
+
+BENCHMARK_MAIN();
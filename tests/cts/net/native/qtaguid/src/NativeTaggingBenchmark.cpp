@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2021 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks of socket tagging with many sockets and threads.
+//
+// Each benchmark runs against both tagging paths: the legacy xt_qtaguid module, through
+// /proc/net/xt_qtaguid/ctrl, and the BPF-based one, through the qtaguid functions of libcutils
+// which ask netd to update its BPF maps. A path the device does not support is skipped.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <cutils/qtaguid.h>
+#include <qtaguid/qtaguid.h>
+
+namespace {
+
+enum Backend : int64_t { BACKEND_XT_QTAGUID, BACKEND_BPF };
+
+// Sockets each thread tags.
+constexpr int SOCKETS_PER_THREAD = 512;
+// Latency is measured for one operation out of this many, so that reading the clock does not
+// dominate.
+constexpr int SAMPLE_EVERY = 8;
+
+bool hasXtQtaguid() {
+    return access("/proc/net/xt_qtaguid/ctrl", R_OK | W_OK) == 0;
+}
+
+int tagSocket(Backend backend, int fd, int tag, uid_t uid) {
+    return (backend == BACKEND_XT_QTAGUID) ? legacy_tagSocket(fd, tag, uid)
+                                           : qtaguid_tagSocket(fd, tag, uid);
+}
+
+int untagSocket(Backend backend, int fd) {
+    return (backend == BACKEND_XT_QTAGUID) ? legacy_untagSocket(fd) : qtaguid_untagSocket(fd);
+}
+
+// Returns false, and skips the benchmark, if the backend is not supported.
+bool checkBackend(benchmark::State& state, Backend backend) {
+    if (backend == BACKEND_XT_QTAGUID && !hasXtQtaguid()) {
+        state.SkipWithError("xt_qtaguid is not supported by this kernel");
+        return false;
+    }
+    if (backend == BACKEND_BPF && hasXtQtaguid()) {
+        // libcutils uses xt_qtaguid if the kernel has it.
+        state.SkipWithError("The BPF tagging path is not used on this kernel");
+        return false;
+    }
+    return true;
+}
+
+// The kernel memory used by slab allocations, such as the per-socket state of xt_qtaguid.
+int64_t slabKb() {
+    FILE* fp = fopen("/proc/meminfo", "re");
+    if (!fp) return -1;
+    char line[128];
+    int64_t kb = -1;
+    while (fgets(line, sizeof(line), fp)) {
+        long long value;
+        if (sscanf(line, "Slab: %lld kB", &value) == 1) {
+            kb = value;
+            break;
+        }
+    }
+    fclose(fp);
+    return kb;
+}
+
+std::vector<int> openSockets(int count) {
+    std::vector<int> fds;
+    for (int i = 0; i < count; i++) {
+        const int fd = socket((i % 2) ? AF_INET6 : AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) break;
+        fds.push_back(fd);
+    }
+    return fds;
+}
+
+void closeSockets(const std::vector<int>& fds) {
+    for (int fd : fds) close(fd);
+}
+
+class LatencySampler {
+  public:
+    void add(std::chrono::steady_clock::duration d) {
+        mSamples.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+    }
+
+    // Adds the percentiles of the calling thread. They are averaged over the threads.
+    void report(benchmark::State& state) {
+        if (mSamples.empty()) return;
+        std::sort(mSamples.begin(), mSamples.end());
+        for (int p : {50, 99}) {
+            const double ns = mSamples[(mSamples.size() - 1) * p / 100];
+            state.counters["p" + std::to_string(p) + "_ns"] =
+                    benchmark::Counter(ns, benchmark::Counter::kAvgThreads);
+        }
+    }
+
+  private:
+    std::vector<int64_t> mSamples;
+};
+
+// Runs op on the sockets of the thread in turn, and measures its latency.
+template <typename Op>
+void runOnSockets(benchmark::State& state, const std::vector<int>& fds, Op op) {
+    LatencySampler sampler;
+    size_t i = 0;
+    for (auto _ : state) {
+        const int fd = fds[i % fds.size()];
+        int ret;
+        if (i % SAMPLE_EVERY == 0) {
+            const auto start = std::chrono::steady_clock::now();
+            ret = op(fd, i);
+            sampler.add(std::chrono::steady_clock::now() - start);
+        } else {
+            ret = op(fd, i);
+        }
+        if (ret) {
+            state.SkipWithError(strerror(-ret));
+            break;
+        }
+        i++;
+    }
+    sampler.report(state);
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Tags an untagged socket, then untags it.
+void BM_TagUntag(benchmark::State& state) {
+    const Backend backend = static_cast<Backend>(state.range(0));
+    if (!checkBackend(state, backend)) return;
+    const std::vector<int> fds = openSockets(SOCKETS_PER_THREAD);
+    const uid_t uid = getuid();
+    runOnSockets(state, fds, [&](int fd, size_t i) {
+        const int ret = tagSocket(backend, fd, 0x1000 + i, uid);
+        return ret ? ret : untagSocket(backend, fd);
+    });
+    closeSockets(fds);
+}
+
+// Changes the tag of sockets that are already tagged.
+void BM_Retag(benchmark::State& state) {
+    const Backend backend = static_cast<Backend>(state.range(0));
+    if (!checkBackend(state, backend)) return;
+    const std::vector<int> fds = openSockets(SOCKETS_PER_THREAD);
+    const uid_t uid = getuid();
+    for (int fd : fds) tagSocket(backend, fd, 0x1000, uid);
+    runOnSockets(state, fds, [&](int fd, size_t i) {
+        return tagSocket(backend, fd, 0x2000 + (i % 2), uid);
+    });
+    for (int fd : fds) untagSocket(backend, fd);
+    closeSockets(fds);
+}
+
+// What an app pays to tag a new connection: creating the socket, tagging it and closing it,
+// without untagging. Compare with BM_SocketOnly.
+void BM_TagNewSocket(benchmark::State& state) {
+    const Backend backend = static_cast<Backend>(state.range(0));
+    if (!checkBackend(state, backend)) return;
+    const uid_t uid = getuid();
+    LatencySampler sampler;
+    int i = 0;
+    for (auto _ : state) {
+        const auto start = std::chrono::steady_clock::now();
+        const int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const int ret = (fd == -1) ? -errno : tagSocket(backend, fd, 0x1000 + i++, uid);
+        if (fd != -1) close(fd);
+        sampler.add(std::chrono::steady_clock::now() - start);
+        if (ret) {
+            state.SkipWithError(strerror(-ret));
+            break;
+        }
+    }
+    sampler.report(state);
+    state.SetItemsProcessed(state.iterations());
+}
+
+void BM_SocketOnly(benchmark::State& state) {
+    LatencySampler sampler;
+    for (auto _ : state) {
+        const auto start = std::chrono::steady_clock::now();
+        const int fd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            state.SkipWithError(strerror(errno));
+            break;
+        }
+        close(fd);
+        sampler.add(std::chrono::steady_clock::now() - start);
+    }
+    sampler.report(state);
+    state.SetItemsProcessed(state.iterations());
+}
+
+// Tags many sockets at once and reports the growth of kernel slab memory per tagged socket.
+// The BPF maps are preallocated, so the BPF path is expected to use no memory per socket.
+void BM_TagMemory(benchmark::State& state) {
+    const Backend backend = static_cast<Backend>(state.range(0));
+    const int count = state.range(1);
+    if (!checkBackend(state, backend)) return;
+    const uid_t uid = getuid();
+    for (auto _ : state) {
+        const std::vector<int> fds = openSockets(count);
+        if (fds.size() != static_cast<size_t>(count)) {
+            closeSockets(fds);
+            state.SkipWithError("Cannot open enough sockets");
+            return;
+        }
+        const int64_t before = slabKb();
+        for (size_t i = 0; i < fds.size(); i++) tagSocket(backend, fds[i], 0x1000 + i, uid);
+        const int64_t after = slabKb();
+        state.PauseTiming();
+        for (int fd : fds) untagSocket(backend, fd);
+        closeSockets(fds);
+        state.ResumeTiming();
+        if (before < 0 || after < 0) {
+            state.SkipWithError("Cannot read /proc/meminfo");
+            return;
+        }
+        state.counters["slab_bytes_per_socket"] =
+                static_cast<double>(std::max<int64_t>(after - before, 0)) * 1024 / count;
+    }
+    state.SetItemsProcessed(state.iterations() * count);
+}
+
+void Backends(benchmark::internal::Benchmark* b) {
+    b->ArgNames({"backend"});
+    b->Arg(BACKEND_XT_QTAGUID)->Arg(BACKEND_BPF);
+}
+
+BENCHMARK(BM_TagUntag)->Apply(Backends)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_Retag)->Apply(Backends)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_TagNewSocket)->Apply(Backends)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_SocketOnly)->ThreadRange(1, 8)->UseRealTime();
+BENCHMARK(BM_TagMemory)
+        ->ArgNames({"backend", "sockets"})
+        ->Args({BACKEND_XT_QTAGUID, 4096})
+        ->Args({BACKEND_BPF, 4096})
+        ->Iterations(3);
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    // 8 threads with SOCKETS_PER_THREAD sockets each, or BM_TagMemory, need more fds than the
+    // default soft limit.
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    benchmark::Initialize(&argc, argv);
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}